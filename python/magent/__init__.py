@@ -1,8 +1,10 @@
 from . import model
 from . import utility
 from . import gridworld
+from . import env_pool
 
 # some alias
 GridWorld = gridworld.GridWorld
+EnvPool = env_pool.EnvPool
 ProcessingModel = model.ProcessingModel
 round = utility.rec_round
@@ -10,6 +10,7 @@ import numpy as np
 
 from .c_lib import _LIB, as_float_c_array, as_int32_c_array
 from .environment import Environment
+from .gridworld import VIEW_DTYPES
 
 
 class DiscreteSnake(Environment):
@@ -30,7 +31,9 @@ class DiscreteSnake(Environment):
             'view_width': int, 'view_height': int,
             'max_dead_penalty': float, 'corpse_value': float,
             'embedding_size': int, 'total_resource': int,
+            'frame_skip': int,
             'render_dir': str,
+            'obs_dtype': str,
         }
 
         # config general setting
@@ -60,6 +63,9 @@ class DiscreteSnake(Environment):
         _LIB.env_get_info(self.game, 0, b"action_space",
                           buf.ctypes.data_as(ctypes.POINTER(ctypes.c_int32)))
         self.action_space = buf[0]
+        _LIB.env_get_info(self.game, 0, b"view_dtype",
+                          buf.ctypes.data_as(ctypes.POINTER(ctypes.c_int32)))
+        self.view_dtype = VIEW_DTYPES[buf[0]]
 
     def reset(self):
         _LIB.env_reset(self.game)
@@ -107,7 +113,7 @@ class DiscreteSnake(Environment):
         feature_space = self.feature_space
 
         n = self.get_num(handle)
-        view_buf = self._get_obs_buf(self.OBS_VIEW_INDEX, [n] + view_space, np.float32)
+        view_buf = self._get_obs_buf(self.OBS_VIEW_INDEX, [n] + view_space, self.view_dtype)
         feature_buf = self._get_obs_buf(self.OBS_FEATURE_INDEX, (n, feature_space), np.float32)
 
         bufs = (ctypes.POINTER(ctypes.c_float) * 2)()
@@ -117,6 +123,20 @@ class DiscreteSnake(Environment):
 
         return view_buf, feature_buf
 
+    def get_observation_subset(self, handle, indices):
+        """ get observation of the agents of indices only, (views[i], features[i]) is of agent indices[i] """
+        indices = np.ascontiguousarray(indices, dtype=np.int32)
+        n = len(indices)
+        view_buf = np.empty([n] + self.view_space, dtype=self.view_dtype)
+        feature_buf = np.empty((n, self.feature_space), dtype=np.float32)
+
+        bufs = (ctypes.POINTER(ctypes.c_float) * 2)()
+        bufs[0] = as_float_c_array(view_buf)
+        bufs[1] = as_float_c_array(feature_buf)
+        _LIB.env_get_observation_subset(self.game, handle, indices.ctypes.data_as(ctypes.POINTER(ctypes.c_int32)),
+                                        ctypes.c_int(n), bufs)
+        return view_buf, feature_buf
+
     def set_action(self, handle, actions):
         assert isinstance(actions, np.ndarray)
         assert actions.dtype == np.int32
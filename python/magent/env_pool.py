@@ -0,0 +1,110 @@
+"""a pool of environments stepped together by the C++ engine"""
+from __future__ import absolute_import
+
+import ctypes
+
+import numpy as np
+
+from .c_lib import _LIB, as_float_c_array, as_int32_c_array
+
+
+class EnvPool:
+    """ serve a batch of environments with one call for every operation
+    all the environments must be built from the same config, so they share
+    group handles, view space, feature space and action space
+    """
+    def __init__(self, envs, n_threads=0):
+        """
+        Parameters
+        ----------
+        envs: list of GridWorld
+            the environments in the pool, the pool does not own them
+        n_threads: int
+            the number of worker threads, 0 for the number of cores
+        """
+        self.envs = envs
+        games = (ctypes.c_void_p * len(envs))(*[env.game.value for env in envs])
+        pool = ctypes.c_void_p()
+        _LIB.env_pool_new(ctypes.byref(pool), games, len(envs), n_threads)
+        self.pool = pool
+
+    def reset(self):
+        """reset all the environments"""
+        _LIB.env_pool_reset_all(self.pool)
+
+    def get_num(self, handle):
+        """ get the number of agents of a group in every environment
+
+        Returns
+        -------
+        nums: numpy array (int32)
+            the shape is (n_env,)
+        """
+        buf = np.empty((len(self.envs),), dtype=np.int32)
+        _LIB.env_pool_get_num_all(self.pool, handle, as_int32_c_array(buf))
+        return buf
+
+    def get_observation(self, handle):
+        """ get observation of a group in all environments
+
+        Returns
+        -------
+        obs : tuple (views, features)
+            the concatenation of the observations of every environment,
+            split them by the values of get_num
+        """
+        env = self.envs[0]
+        n = int(np.sum(self.get_num(handle)))
+        view_buf = np.empty((n,) + env.get_view_space(handle), dtype=env.view_dtype[handle.value])
+        feature_buf = np.empty((n,) + env.get_feature_space(handle), dtype=np.float32)
+
+        bufs = (ctypes.POINTER(ctypes.c_float) * 2)()
+        bufs[0] = as_float_c_array(view_buf)
+        bufs[1] = as_float_c_array(feature_buf)
+        _LIB.env_pool_get_observation_all(self.pool, handle, bufs)
+
+        return view_buf, feature_buf
+
+    def set_action(self, handle, actions):
+        """ set actions of a group in all environments
+
+        Parameters
+        ----------
+        actions: numpy array
+            the concatenation of actions of every environment, the dtype must be int32
+        """
+        assert isinstance(actions, np.ndarray)
+        assert actions.dtype == np.int32
+        _LIB.env_pool_set_action_all(self.pool, handle, as_int32_c_array(actions))
+
+    def step(self):
+        """ step all the environments
+
+        Returns
+        -------
+        done: numpy array (bool)
+            whether the game is done in every environment
+        """
+        done = np.empty((len(self.envs),), dtype=np.int32)
+        _LIB.env_pool_step_all(self.pool, as_int32_c_array(done))
+        return done.astype(np.bool)
+
+    def get_reward(self, handle):
+        """ get rewards of a group in all environments
+
+        Returns
+        -------
+        rewards: numpy array (float32)
+            the concatenation of rewards of every environment
+        """
+        n = int(np.sum(self.get_num(handle)))
+        buf = np.empty((n,), dtype=np.float32)
+        _LIB.env_pool_get_reward_all(self.pool, handle, as_float_c_array(buf))
+        return buf
+
+    def clear_dead(self):
+        """ clear dead agents in all the environments """
+        _LIB.env_pool_clear_dead_all(self.pool)
+
+    def __del__(self):
+        _LIB.env_pool_delete(self.pool)
@@ -10,6 +10,9 @@ import numpy as np
 from .c_lib import _LIB, as_float_c_array, as_int32_c_array
 from .environment import Environment
 
+# element types of views, indexed by the "view_dtype" info of a group
+VIEW_DTYPES = {0: np.float32, 1: np.float16, 2: np.uint8}
+
 
 class GridWorld(Environment):
     # constant
@@ -47,8 +50,21 @@ class GridWorld(Environment):
             'map_width': int, 'map_height': int,
             'food_mode': bool, 'turn_mode': bool, 'minimap_mode': bool,
             'revive_mode': bool, 'goal_mode': bool,
+            'incremental_view_mode': bool,
+            'deterministic_mode': bool,
+            'tiled_map_mode': bool,
             'embedding_size': int,
+            'tile_size': int,
+            'frame_skip': int,
+            'event_mask': int,
+            'memory_limit': int,
+            'num_threads': int,
             'render_dir': str,
+            'render_format': str,
+            'replay_file': str,
+            'obs_dtype': str,
+            'pooled_radii': str,
+            'distributed': str,
         }
 
         for key in config.config_dict:
@@ -87,6 +103,7 @@ class GridWorld(Environment):
 
         # serialize event expression, send to C++ engine
         self._serialize_event_exp(config)
+        self.rule_num = len(config.reward_rules)
 
         # init group handles
         self.group_handles = []
@@ -97,11 +114,16 @@ class GridWorld(Environment):
 
         # init observation buffer (for acceleration)
         self._init_obs_buf()
+        self.registered_bufs = {}
+        self.reward_nums = {}
+        self.sparse_capacity = {}
+        self.state_capacity = 0  # buffer size for save_state, the last state with some room
 
         # init view space, feature space, action space
         self.view_space = {}
         self.feature_space = {}
         self.action_space = {}
+        self.view_dtype = {}
         buf = np.empty((3,), dtype=np.int32)
         for handle in self.group_handles:
             _LIB.env_get_info(self.game, handle, b"view_space",
@@ -113,6 +135,9 @@ class GridWorld(Environment):
             _LIB.env_get_info(self.game, handle, b"action_space",
                                   buf.ctypes.data_as(ctypes.POINTER(ctypes.c_int32)))
             self.action_space[handle.value] = (buf[0],)
+            _LIB.env_get_info(self.game, handle, b"view_dtype",
+                              buf.ctypes.data_as(ctypes.POINTER(ctypes.c_int32)))
+            self.view_dtype[handle.value] = VIEW_DTYPES[buf[0]]
 
     def reset(self):
         """reset environment"""
@@ -237,7 +262,12 @@ class GridWorld(Environment):
         no = handle.value
 
         n = self.get_num(handle)
-        view_buf = self._get_obs_buf(no, self.OBS_INDEX_VIEW, (n,) + view_space, np.float32)
+        if no in self.registered_bufs:
+            view_buf, feature_buf, _ = self.registered_bufs[no]
+            _LIB.env_get_observation(self.game, handle, None)
+            return view_buf[:n], feature_buf[:n]
+
+        view_buf = self._get_obs_buf(no, self.OBS_INDEX_VIEW, (n,) + view_space, self.view_dtype[no])
         feature_buf = self._get_obs_buf(no, self.OBS_INDEX_HP, (n,) + feature_space, np.float32)
 
         bufs = (ctypes.POINTER(ctypes.c_float) * 2)()
@@ -247,6 +277,122 @@ class GridWorld(Environment):
 
         return view_buf, feature_buf
 
+    def get_observation_subset(self, handle, indices):
+        """ get observation of some agents of a group, the others are not extracted
+
+        Parameters
+        ----------
+        handle : group handle
+        indices : array of int
+            indices of the agents in the group (as in get_agent_id)
+
+        Returns
+        -------
+        obs : tuple (views, features)
+            (views[i], features[i]) is the observation of agent indices[i]
+        """
+        no = handle.value
+        indices = np.ascontiguousarray(indices, dtype=np.int32)
+        n = len(indices)
+        view_buf = np.empty((n,) + self.view_space[no], dtype=self.view_dtype[no])
+        feature_buf = np.empty((n,) + self.feature_space[no], dtype=np.float32)
+
+        bufs = (ctypes.POINTER(ctypes.c_float) * 2)()
+        bufs[0] = as_float_c_array(view_buf)
+        bufs[1] = as_float_c_array(feature_buf)
+        _LIB.env_get_observation_subset(self.game, handle, indices.ctypes.data_as(ctypes.POINTER(ctypes.c_int32)),
+                                        ctypes.c_int(n), bufs)
+        return view_buf, feature_buf
+
+    def get_observation_sparse(self, handle):
+        """ get observation of a whole group, views are returned as the list of their nonzero entries
+
+        Parameters
+        ----------
+        handle : group handle
+
+        Returns
+        -------
+        obs : tuple (offsets, coords, values, features)
+            offsets is a numpy array, whose shape is n + 1
+            coords is a numpy array, whose shape is nnz * 3, every row is (view_y, view_x, channel)
+            values is a numpy array, whose shape is nnz
+            features is a numpy array, whose shape is n * feature_size
+            for agent i, its view entries are coords[offsets[i]:offsets[i+1]], values[offsets[i]:offsets[i+1]]
+        """
+        no = handle.value
+        n = self.get_num(handle)
+        offsets = np.empty((n + 1,), dtype=np.int32)
+        features = np.empty((n,) + self.feature_space[no], dtype=np.float32)
+        capacity = self.sparse_capacity.get(no, 4 * n)
+        nnz = ctypes.c_int32()
+        while True:
+            coords = np.empty((capacity, 3), dtype=np.int32)
+            values = np.empty((capacity,), dtype=np.float32)
+            _LIB.gridworld_get_observation_sparse(self.game, handle, as_int32_c_array(offsets),
+                                                  as_int32_c_array(coords), as_float_c_array(values),
+                                                  capacity, as_float_c_array(features), ctypes.byref(nnz))
+            if nnz.value <= capacity:
+                break
+            capacity = 2 * nnz.value
+        self.sparse_capacity[no] = capacity
+        return offsets, coords[:nnz.value], values[:nnz.value], features
+
+    def get_observation_device(self, handle, view_ptr, feature_ptr):
+        """ write observation of a whole group into buffers on the cuda device, the library
+        should be built with -DUSE_CUDA=ON. views are always float32
+
+        Parameters
+        ----------
+        handle : group handle
+        view_ptr : int
+            device address of a float32 buffer, whose shape is (n,) + view_space,
+            e.g. tensor.data_ptr() of a torch cuda tensor
+        feature_ptr : int
+            device address of a float32 buffer, whose shape is (n,) + feature_space
+        """
+        _LIB.gridworld_get_observation_device(self.game, handle,
+                                              ctypes.cast(ctypes.c_void_p(view_ptr), ctypes.POINTER(ctypes.c_float)),
+                                              ctypes.cast(ctypes.c_void_p(feature_ptr), ctypes.POINTER(ctypes.c_float)))
+
+    def register_buffers(self, handle, capacity, path=None):
+        """ register persistent output buffers of a group, then get_observation and get_reward
+        return slices of them without copy.
+
+        Parameters
+        ----------
+        handle: group handle
+        capacity: int
+            max number of agents in this group
+        path: str, optional
+            if given, the buffers are backed by a file mapped from path (e.g. under /dev/shm),
+            so another process can map the same file to read observations
+
+        Returns
+        -------
+        bufs: tuple (views, features, rewards)
+            numpy arrays with capacity as their first dimension
+        """
+        view_space = self.view_space[handle.value]
+        feature_space = self.feature_space[handle.value]
+        shapes = [(capacity,) + view_space, (capacity,) + feature_space, (capacity,)]
+        dtypes = [self.view_dtype[handle.value], np.float32, np.float32]
+
+        if path is None:
+            bufs = [np.zeros(shape, dtype=dtype) for shape, dtype in zip(shapes, dtypes)]
+        else:
+            sizes = [int(np.prod(shape)) * np.dtype(dtype).itemsize for shape, dtype in zip(shapes, dtypes)]
+            with open(path, "wb") as fout:
+                fout.truncate(sum(sizes))
+            offsets = np.cumsum([0] + sizes[:-1])
+            bufs = [np.memmap(path, dtype=dtype, mode="r+", shape=shape, offset=int(offset))
+                    for shape, dtype, offset in zip(shapes, dtypes, offsets)]
+
+        for name, buf in zip([b"view", b"feature", b"reward"], bufs):
+            _LIB.env_register_buffer(self.game, handle, name, buf.ctypes.data_as(ctypes.c_void_p), capacity)
+        self.registered_bufs[handle.value] = tuple(bufs)
+        return tuple(bufs)
+
     def set_action(self, handle, actions):
         """ set actions for whole group
 
@@ -270,8 +416,96 @@ class GridWorld(Environment):
         """
         done = ctypes.c_int32()
         _LIB.env_step(self.game, ctypes.byref(done))
+        self.reward_nums = {}
+        return bool(done)
+
+    def step_async(self, clear_dead=True):
+        """ start a step on a background thread of the engine and return at once,
+        so that the policy of another environment can run meanwhile.
+        rewards and observations are written into the registered buffers (see register_buffers),
+        call wait() before calling any other method of this environment
+
+        Parameters
+        ----------
+        clear_dead: bool
+            whether to clear dead agents after the step, then the registered observations
+            are refreshed for the next step as well
+        """
+        # rewards are for the agents before clear_dead
+        self.reward_nums = {no: self.get_num(no) for no in self.registered_bufs}
+        _LIB.env_step_async(self.game, ctypes.c_int32(clear_dead))
+
+    def wait(self):
+        """ wait for the step started by step_async
+
+        Returns
+        -------
+        done: bool
+            whether the game is done
+        """
+        done = ctypes.c_int32()
+        _LIB.env_wait(self.game, ctypes.byref(done))
         return bool(done)
 
+    def step_full(self, actions):
+        """ set actions, step, get rewards, clear dead and get observations of all groups in one call
+
+        Parameters
+        ----------
+        actions: dict
+            group handle value -> numpy array (int32) of actions, groups not in it keep their actions
+            (e.g. the groups controlled by a policy or a model)
+
+        Returns
+        -------
+        done: bool
+            whether the game is done
+        outputs: dict
+            group handle value -> (obs, rewards, alives, ids).
+            rewards and alives are of the agents in this step, obs and ids are of the agents after clear dead
+        """
+        n_group = len(self.group_handles)
+        action_ptrs = (ctypes.POINTER(ctypes.c_int32) * n_group)()
+        obs_ptrs = (ctypes.POINTER(ctypes.POINTER(ctypes.c_float)) * n_group)()
+        reward_ptrs = (ctypes.POINTER(ctypes.c_float) * n_group)()
+        alive_ptrs = (ctypes.POINTER(ctypes.c_bool) * n_group)()
+        id_ptrs = (ctypes.POINTER(ctypes.c_int32) * n_group)()
+        nums = np.empty((n_group,), dtype=np.int32)
+
+        bufs = {}
+        for handle in self.group_handles:
+            no = handle.value
+            if no in actions:
+                assert actions[no].dtype == np.int32
+                action_ptrs[no] = as_int32_c_array(actions[no])
+            n = self.get_num(handle)
+            alive = np.empty((n,), dtype=np.bool)
+            ids = np.empty((n,), dtype=np.int32)
+            alive_ptrs[no] = alive.ctypes.data_as(ctypes.POINTER(ctypes.c_bool))
+            id_ptrs[no] = as_int32_c_array(ids)
+            if no in self.registered_bufs:
+                # rewards and observations are written into the registered buffers
+                view, feature, reward = self.registered_bufs[no]
+            else:
+                view = np.empty((n,) + self.view_space[no], dtype=self.view_dtype[no])
+                feature = np.empty((n,) + self.feature_space[no], dtype=np.float32)
+                reward = np.empty((n,), dtype=np.float32)
+                obs_ptrs[no] = (ctypes.POINTER(ctypes.c_float) * 2)(as_float_c_array(view),
+                                                                    as_float_c_array(feature))
+                reward_ptrs[no] = as_float_c_array(reward)
+            bufs[no] = (n, view, feature, reward, alive, ids)
+
+        done = ctypes.c_int32()
+        _LIB.env_step_full(self.game, action_ptrs, obs_ptrs, reward_ptrs, alive_ptrs, id_ptrs,
+                           as_int32_c_array(nums), ctypes.byref(done))
+        self.reward_nums = {}
+
+        outputs = {}
+        for no, (n, view, feature, reward, alive, ids) in bufs.items():
+            m = nums[no]
+            outputs[no] = ((view[:m], feature[:m]), reward[:n], alive, ids[:m])
+        return bool(done), outputs
+
     def get_reward(self, handle):
         """ get reward for a whole group
 
@@ -280,7 +514,15 @@ class GridWorld(Environment):
         rewards: numpy array (float32)
             reward for all the agents in the group
         """
+        if handle.value in self.registered_bufs:
+            # rewards are written into the registered buffer by step
+            n = self.reward_nums.get(handle.value)
+            if n is None:
+                n = self.get_num(handle)
+            return self.registered_bufs[handle.value][2][:n]
+
         n = self.get_num(handle)
+
         buf = np.empty((n,), dtype=np.float32)
         _LIB.env_get_reward(self.game, handle,
                             buf.ctypes.data_as(ctypes.POINTER(ctypes.c_float)))
@@ -303,6 +545,13 @@ class GridWorld(Environment):
         _LIB.env_get_info(self.game, handle, b'num', ctypes.byref(num))
         return num.value
 
+    def get_global_num(self, handle):
+        """ get the number of agents in a group over all the ranks of a distributed game,
+        every rank should call it"""
+        num = ctypes.c_int32()
+        _LIB.env_get_info(self.game, handle, b'global_num', ctypes.byref(num))
+        return num.value
+
     def get_action_space(self, handle):
         """get action space
 
@@ -419,10 +668,141 @@ class GridWorld(Environment):
                           buf.ctypes.data_as(ctypes.POINTER(ctypes.c_float)))
         return buf
 
+    def get_profile(self):
+        """ get the time spent in every phase of the engine since the last call
+
+        Returns
+        -------
+        profile : dict
+            phase name -> (total time in ms, calls, processed items)
+        """
+        names = ["attack", "starve", "turn_parallel", "turn_boundary", "move_parallel",
+                 "move_boundary", "calc_reward", "get_observation", "clear_dead", "render", "policy"]
+        buf = np.empty((1 + len(names) * 3,), dtype=np.float32)
+        _LIB.env_get_info(self.game, -1, b"profile",
+                          buf.ctypes.data_as(ctypes.POINTER(ctypes.c_float)))
+        n_phase = int(buf[0])
+        ret = buf[1:].reshape((n_phase, 3))
+        return {names[i]: (float(ret[i, 0]), int(ret[i, 1]), int(ret[i, 2])) for i in range(n_phase)}
+
+    def get_memory(self):
+        """ get the heap memory held by the engine
+
+        Returns
+        -------
+        memory : dict
+            category name -> bytes, in the order of MemoryCategory in GridWorld.h.
+            "map" includes the buffers of get_observation_device on the device
+        """
+        names = ["map", "agent", "group_buffer", "range", "reward", "render", "step_buffer"]
+        buf = np.empty((1 + len(names),), dtype=np.float32)
+        _LIB.env_get_info(self.game, -1, b"memory",
+                          buf.ctypes.data_as(ctypes.POINTER(ctypes.c_float)))
+        return {names[i]: int(buf[i + 1]) for i in range(int(buf[0]))}
+
+    def get_rule_profile(self):
+        """ get the time spent in every reward rule since the last call, the rules are evaluated
+        in parallel, so the sum can be larger than the time of "calc_reward" in get_profile
+
+        Returns
+        -------
+        profile : list
+            (total time in ms, evaluated steps, evaluated permutations) for every rule, in the order of
+            Config.add_reward_rule
+        """
+        buf = np.empty((1 + self.rule_num * 3,), dtype=np.float32)
+        _LIB.env_get_info(self.game, -1, b"rule_profile",
+                          buf.ctypes.data_as(ctypes.POINTER(ctypes.c_float)))
+        n_rule = int(buf[0])
+        ret = buf[1:].reshape((n_rule, 3))
+        return [(float(ret[i, 0]), int(ret[i, 1]), int(ret[i, 2])) for i in range(n_rule)]
+
+    # kinds of the event stream, in the order of StepEventKind in GridWorld.h
+    EVENT_KINDS = ["attack", "kill", "eat", "starve", "blocked"]
+    EVENT_DTYPE = np.dtype([("kind", np.int32), ("frame", np.int32), ("src", np.int32), ("dst", np.int32),
+                            ("x", np.int32), ("y", np.int32), ("value", np.float32)])
+
+    def set_event_kinds(self, kinds):
+        """ enable the kinds of the event stream, the others are not collected
+
+        Parameters
+        ----------
+        kinds: list of str
+            names in GridWorld.EVENT_KINDS, [] to disable the stream
+        """
+        mask = 0
+        for kind in kinds:
+            mask |= 1 << self.EVENT_KINDS.index(kind)
+        _LIB.env_config_game(self.game, b"event_mask", ctypes.byref(ctypes.c_int(mask)))
+
+    def get_events(self):
+        """ get the events of the last step
+
+        Returns
+        -------
+        events : numpy structured array of GridWorld.EVENT_DTYPE
+            kind (index in EVENT_KINDS), frame, src and dst (agent ids, -1 for none),
+            x and y (target cell), value (damage or food eaten)
+        """
+        n = ctypes.c_int32()
+        _LIB.env_get_info(self.game, -1, b"event_num", ctypes.byref(n))
+        buf = np.empty((n.value,), dtype=self.EVENT_DTYPE)
+        if n.value > 0:
+            _LIB.env_get_info(self.game, -1, b"events", buf.ctypes.data_as(ctypes.POINTER(ctypes.c_int32)))
+        return buf
+
     def set_seed(self, seed):
         """ set random seed of the engine"""
         _LIB.env_config_game(self.game, b"seed", ctypes.byref(ctypes.c_int(seed)))
 
+    # ====== STATE ======
+    def save_state(self):
+        """ save the state of map, agents, groups and the random engine, call it between steps
+
+        Returns
+        -------
+        state : numpy array of uint8
+        """
+        # a call saves the whole state, so the buffer is sized from the last state and only a larger
+        # state is saved a second time
+        capacity = self.state_capacity
+        buf = np.empty((capacity,), dtype=np.uint8)
+        size = ctypes.c_longlong(capacity)
+        _LIB.env_save_state(self.game, buf.ctypes.data_as(ctypes.c_char_p), ctypes.byref(size))
+        if size.value > capacity:
+            buf = np.empty((size.value,), dtype=np.uint8)
+            _LIB.env_save_state(self.game, buf.ctypes.data_as(ctypes.c_char_p), ctypes.byref(size))
+        self.state_capacity = size.value + size.value // 16
+        return buf[:size.value]
+
+    def load_state(self, state):
+        """ restore a state saved by an environment with the same configuration, after reset
+
+        Parameters
+        ----------
+        state : numpy array of uint8, returned by save_state
+        """
+        state = np.ascontiguousarray(state, dtype=np.uint8)
+        _LIB.env_load_state(self.game, state.ctypes.data_as(ctypes.c_char_p), ctypes.c_longlong(state.size))
+
+    def clone(self):
+        """ fork the environment, the clone has the same configuration and state but does not render
+
+        Returns
+        -------
+        env : GridWorld
+        """
+        ret = GridWorld.__new__(GridWorld)
+        ret.__dict__.update(self.__dict__)
+        game = ctypes.c_void_p()
+        _LIB.env_clone_game(self.game, ctypes.byref(game))
+        ret.game = game
+        ret._init_obs_buf()
+        ret.registered_bufs = {}
+        ret.reward_nums = {}
+        ret.sparse_capacity = {}
+        return ret
+
     # ====== RENDER ======
     def set_render_dir(self, name):
         """ set directory to save render file"""
@@ -434,6 +814,30 @@ class GridWorld(Environment):
         """ render a step """
         _LIB.env_render(self.game)
 
+    def set_replay_file(self, name):
+        """ record a replay log (snapshots and actions) to the file, much smaller than rendering every step.
+        call it before reset, None to stop recording
+        """
+        _LIB.env_config_game(self.game, b"replay_file", (name or "").encode("ascii"))
+
+    def replay(self, name, render=True):
+        """ re-simulate a replay log, the environment should be reset and configured as the recorded one
+
+        Parameters
+        ----------
+        name: str
+            the file given to set_replay_file
+        render: bool
+            render every step into the render directory
+
+        Returns
+        -------
+        n_step : int
+        """
+        n = ctypes.c_int32()
+        _LIB.gridworld_replay(self.game, name.encode("ascii"), ctypes.c_int(int(render)), ctypes.byref(n))
+        return n.value
+
     def _get_groups_info(self):
         """ private method, for interactive application"""
         n = len(self.group_handles)
@@ -489,6 +893,50 @@ class GridWorld(Environment):
         else:
             raise NotImplementedError
 
+    def set_policy(self, handle, name, **kwargs):
+        """ bind a built-in scripted policy to a group, the engine infers its actions in step,
+        so do not call set_action for this group
+
+        Parameters
+        ----------
+        handle: group handle
+        name: str or None
+            "runaway" (away_group, move_back), "rush" (target_group, threshold) or "gather" (target_group),
+            None to unbind
+        kwargs: parameters of the policy, group handles are accepted
+
+        Examples
+        --------
+        >>> env.set_policy(deer_handle, "runaway", away_group=tiger_handle)
+        """
+        if name is None:
+            _LIB.gridworld_set_policy(self.game, handle, None, 0, None, None)
+            return
+        length = len(kwargs)
+        keys = (ctypes.c_char_p * length)(*[key.encode("ascii") for key in kwargs.keys()])
+        values = (ctypes.c_float * length)(*[float(v.value if isinstance(v, ctypes.c_int32) else v)
+                                             for v in kwargs.values()])
+        _LIB.gridworld_set_policy(self.game, handle, name.encode("ascii"), length, keys, values)
+
+    def set_model(self, handle, path, backend="onnx"):
+        """ bind a model to a group, the engine runs it on the observation of the group in step,
+        so do not call set_action for this group
+
+        Parameters
+        ----------
+        handle: group handle
+        path: str or None
+            path of the model file, None to unbind.
+            an onnx model takes the view (and the feature if it has two inputs),
+            and outputs the logits (n, n_action) or the actions (n,)
+        backend: str
+            "onnx", needs magent to be built with USE_ONNXRUNTIME
+        """
+        if path is None:
+            _LIB.gridworld_set_model(self.game, handle, None, None)
+            return
+        _LIB.gridworld_set_model(self.game, handle, backend.encode("ascii"), path.encode("ascii"))
+
     # ====== PRIVATE ======
     def _serialize_event_exp(self, config):
         """serialize event expression and sent them to game engine"""
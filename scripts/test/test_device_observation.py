@@ -0,0 +1,82 @@
+"""check get_observation_device against get_observation, the library should be built with -DUSE_CUDA=ON"""
+
+import argparse
+
+import numpy as np
+import torch
+
+import magent
+
+
+def load_config(map_size, pooled_radii):
+    gw = magent.gridworld
+    cfg = gw.Config()
+
+    # agents turn, so the views of all the directions are extracted
+    cfg.set({"map_width": map_size, "map_height": map_size, "turn_mode": True, "minimap_mode": True,
+             "embedding_size": 10, "pooled_radii": pooled_radii.encode("ascii")})
+
+    big = cfg.register_agent_type(
+        "big",
+        {
+            'width': 2, 'length': 3, 'hp': 10, 'speed': 1,
+            'view_range': gw.SectorRange(7, 120), 'attack_range': gw.SectorRange(2, 120),
+            'damage': 2, 'step_recover': 0.1,
+        })
+
+    small = cfg.register_agent_type(
+        "small",
+        {
+            'width': 1, 'length': 1, 'hp': 5, 'speed': 2,
+            'view_range': gw.CircleRange(5), 'attack_range': gw.CircleRange(1.5),
+            'damage': 1, 'step_recover': 0.1,
+        })
+
+    g0 = cfg.add_group(big)
+    g1 = cfg.add_group(small)
+
+    a = gw.AgentSymbol(g0, index='any')
+    b = gw.AgentSymbol(g1, index='any')
+    cfg.add_reward_rule(gw.Event(a, 'attack', b), receiver=[a, b], value=[1, -1])
+    return cfg
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--map_size", type=int, default=100)
+    parser.add_argument("--n_agent", type=int, default=500)
+    parser.add_argument("--n_step", type=int, default=50)
+    parser.add_argument("--pooled_radii", type=str, default="2,6")
+    args = parser.parse_args()
+
+    env = magent.GridWorld(load_config(args.map_size, args.pooled_radii))
+    env.set_seed(0)
+    env.reset()
+    env.add_walls(method="random", n=args.map_size * args.map_size // 50)
+    handles = env.get_handles()
+    env.add_agents(handles[0], method="random", n=args.n_agent // 5)
+    env.add_agents(handles[1], method="random", n=args.n_agent)
+
+    bad = 0
+    for step in range(args.n_step):
+        for handle in handles:
+            n = env.get_num(handle)
+            if n == 0:
+                continue
+            view, feature = env.get_observation(handle)
+            device_view = torch.zeros((n,) + env.get_view_space(handle), dtype=torch.float32, device="cuda")
+            device_feature = torch.zeros((n,) + env.get_feature_space(handle), dtype=torch.float32, device="cuda")
+            env.get_observation_device(handle, device_view.data_ptr(), device_feature.data_ptr())
+
+            view_diff = np.abs(device_view.cpu().numpy() - view).max()
+            feature_diff = np.abs(device_feature.cpu().numpy() - feature).max()
+            if view_diff > 1e-6 or feature_diff > 1e-5:
+                bad += 1
+                print("step %d group %d : view diff %g, feature diff %g" % (step, handle.value, view_diff, feature_diff))
+
+            n_action = env.get_action_space(handle)[0]
+            env.set_action(handle, np.random.randint(n_action, size=n, dtype=np.int32))
+        env.step()
+        env.clear_dead()
+
+    print("bad", bad)
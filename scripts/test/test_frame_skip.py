@@ -0,0 +1,55 @@
+"""check the rewards of frame_skip : an agent scoring in frame 0 and killed in frame 1 keeps its frame 0 reward"""
+
+import numpy as np
+
+import magent
+
+
+def load_config():
+    gw = magent.gridworld
+    cfg = gw.Config()
+
+    cfg.set({"map_width": 12, "map_height": 12, "frame_skip": 2})
+
+    attrs = {
+        'width': 1, 'length': 1, 'hp': 3, 'speed': 1,
+        'view_range': gw.CircleRange(2), 'attack_range': gw.CircleRange(1),
+        'damage': 2, 'step_reward': -0.01, 'kill_reward': 5, 'dead_penalty': -1, 'attack_penalty': -0.1,
+    }
+    small = cfg.register_agent_type("small", attrs)
+    weak = cfg.register_agent_type("weak", dict(attrs, hp=1))
+
+    cfg.add_group(small)
+    cfg.add_group(small)
+    cfg.add_group(weak)
+    return cfg
+
+
+if __name__ == "__main__":
+    env = magent.GridWorld(load_config())
+    env.reset()
+    a, c, b = env.get_handles()
+
+    # everyone attacks east : a kills b in frame 0, c hits a in both frames and kills it in frame 1.
+    # the second agent of b keeps its group alive, so the step does not end after frame 0
+    env.add_agents(a, method="custom", pos=[(5, 5)])
+    env.add_agents(c, method="custom", pos=[(4, 5)])
+    env.add_agents(b, method="custom", pos=[(6, 5), (1, 1)])
+
+    attack_base, view2attack = env.get_view2attack(a)
+    cy, cx = view2attack.shape[0] // 2, view2attack.shape[1] // 2
+    east = attack_base + view2attack[cy, cx + 1]
+    for handle in [a, c, b]:
+        env.set_action(handle, np.full((env.get_num(handle),), east, dtype=np.int32))
+    env.step()
+
+    # frame 0 : step reward + kill reward + attack penalty, frame 1 : dead penalty
+    bad = 0
+    for handle, name, expected in [(a, "a", -0.01 + 5 - 0.1 - 1), (c, "c", 2 * (-0.01 - 0.1) + 5)]:
+        reward = env.get_reward(handle)[0]
+        print("%s reward %.3f expected %.3f alive %s" % (name, reward, expected, env.get_alive(handle)[0]))
+        if abs(reward - expected) > 1e-4:
+            bad += 1
+    if env.get_alive(a)[0] or env.get_alive(b)[0]:
+        bad += 1
+    print("bad", bad)
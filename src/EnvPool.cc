@@ -0,0 +1,90 @@
+/**
+ * \file EnvPool.cc
+ * \brief A pool of environments stepped together on a thread pool
+ */
+
+#include "EnvPool.h"
+#include "utility/ObsDtype.h"
+
+namespace magent {
+namespace environment {
+
+EnvPool::EnvPool(EnvHandle *envs, int n, int n_threads) : envs(envs, envs + n), pool(n_threads) {
+}
+
+int EnvPool::calc_offsets(GroupHandle group, std::vector<int> &offsets) {
+    int sum = 0;
+    offsets.resize(envs.size());
+    for (int i = 0; i < envs.size(); i++) {
+        int num;
+        envs[i]->get_info(group, "num", &num);
+        offsets[i] = sum;
+        sum += num;
+    }
+    return sum;
+}
+
+void EnvPool::reset_all() {
+    pool.parallel_for((int)envs.size(), [this] (int i) {
+        envs[i]->reset();
+    });
+}
+
+void EnvPool::get_observation_all(GroupHandle group, float **linear_buffers) {
+    std::vector<int> offsets;
+    calc_offsets(group, offsets);
+
+    // all environments in a pool share the same observation space
+    int view_space[3], feature_size, view_dtype;
+    envs[0]->get_info(group, "view_space", view_space);
+    envs[0]->get_info(group, "feature_space", &feature_size);
+    envs[0]->get_info(group, "view_dtype", &view_dtype);
+    const size_t view_bytes = (size_t)view_space[0] * view_space[1] * view_space[2]
+                              * utility::obs_dtype_size((utility::ObsDtype)view_dtype);
+
+    pool.parallel_for((int)envs.size(), [&] (int i) {
+        float *buffers[2] = {
+            (float *)((char *)linear_buffers[0] + offsets[i] * view_bytes),
+            linear_buffers[1] + (size_t)offsets[i] * feature_size,
+        };
+        envs[i]->get_observation(group, buffers);
+    });
+}
+
+void EnvPool::set_action_all(GroupHandle group, const int *actions) {
+    std::vector<int> offsets;
+    calc_offsets(group, offsets);
+
+    pool.parallel_for((int)envs.size(), [&] (int i) {
+        envs[i]->set_action(group, actions + offsets[i]);
+    });
+}
+
+void EnvPool::step_all(int *done) {
+    pool.parallel_for((int)envs.size(), [&] (int i) {
+        envs[i]->step(done + i);
+    });
+}
+
+void EnvPool::get_reward_all(GroupHandle group, float *buffer) {
+    std::vector<int> offsets;
+    calc_offsets(group, offsets);
+
+    pool.parallel_for((int)envs.size(), [&] (int i) {
+        envs[i]->get_reward(group, buffer + offsets[i]);
+    });
+}
+
+void EnvPool::clear_dead_all() {
+    pool.parallel_for((int)envs.size(), [this] (int i) {
+        envs[i]->clear_dead();
+    });
+}
+
+void EnvPool::get_num_all(GroupHandle group, int *buffer) {
+    for (int i = 0; i < envs.size(); i++)
+        envs[i]->get_info(group, "num", buffer + i);
+}
+
+} // namespace environment
+} // namespace magent
@@ -0,0 +1,52 @@
+/**
+ * \file EnvPool.h
+ * \brief A pool of environments stepped together on a thread pool
+ */
+
+#ifndef MAGNET_ENVPOOL_H
+#define MAGNET_ENVPOOL_H
+
+#include <vector>
+
+#include "Environment.h"
+#include "utility/ThreadPool.h"
+
+namespace magent {
+namespace environment {
+
+/**
+ * EnvPool serves a batch of environments with one call.
+ * Buffers are the concatenation of the buffers of every environment for a group,
+ * in the order of environments. Use get_num_all to get the number of agents in each environment.
+ * The pool does not own the environments, they should be deleted by env_delete_game.
+ */
+class EnvPool {
+public:
+    EnvPool(EnvHandle *envs, int n, int n_threads);
+
+    // run step
+    void reset_all();
+    void get_observation_all(GroupHandle group, float **linear_buffers);
+    void set_action_all(GroupHandle group, const int *actions);
+    void step_all(int *done);
+    void get_reward_all(GroupHandle group, float *buffer);
+    void clear_dead_all();
+
+    // info getter
+    void get_num_all(GroupHandle group, int *buffer);
+    int get_env_num() const { return (int)envs.size(); }
+
+private:
+    // fill offsets of every environment in the batch buffer, counted in agents
+    int calc_offsets(GroupHandle group, std::vector<int> &offsets);
+
+    std::vector<EnvHandle> envs;
+    ::magent::utility::ThreadPool pool;
+};
+
+typedef EnvPool* EnvPoolHandle;
+
+} // namespace environment
+} // namespace magent
+
+#endif //MAGNET_ENVPOOL_H
@@ -6,11 +6,41 @@
 #ifndef MAGNET_ENVIRONMENT_H
 #define MAGNET_ENVIRONMENT_H
 
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#include <future>
+
 namespace magent {
 namespace environment {
 
 typedef int GroupHandle;
 
+// output buffers of a group registered once by the caller (see Environment::register_buffer).
+// the engine writes rewards into them in step, and observations in clear_dead
+struct RegisteredBuffers {
+    float *view = nullptr, *feature = nullptr, *reward = nullptr;
+    int view_capacity = 0, feature_capacity = 0, reward_capacity = 0;  // in number of agents
+    bool obs_fresh = false;  // view and feature hold the observation of current agents
+
+    // return false for an unknown name
+    bool set(const char *name, void *buffer, int capacity) {
+        if (strcmp(name, "view") == 0) {
+            view = (float *)buffer; view_capacity = capacity;
+        } else if (strcmp(name, "feature") == 0) {
+            feature = (float *)buffer; feature_capacity = capacity;
+        } else if (strcmp(name, "reward") == 0) {
+            reward = (float *)buffer; reward_capacity = capacity;
+        } else {
+            return false;
+        }
+        obs_fresh = false;
+        return true;
+    }
+
+    bool has_obs() const { return view != nullptr && feature != nullptr; }
+};
+
 class Environment {
 public:
     Environment() = default;
@@ -25,12 +55,67 @@ public:
     virtual void set_action(GroupHandle group, const int *actions) = 0;
     virtual void step(int *done) = 0;
     virtual void get_reward(GroupHandle group, float *buffer) = 0;
+    virtual void clear_dead() = 0;
+
+    // register a persistent output buffer ("view", "feature" or "reward") for group, nullptr to unregister.
+    // then get_observation and get_reward accept nullptr and use the registered buffers
+    virtual void register_buffer(GroupHandle group, const char *name, void *buffer, int capacity) = 0;
 
     // info getter
     virtual void get_info(GroupHandle group, const char *name, void *buffer) = 0;
 
     // render
     virtual void render() = 0;
+
+    // snapshot of the full game state (map, agents, groups and the random engine), taken between steps.
+    // a state can only be loaded into an environment with the same configuration, after reset
+    virtual void save_state(std::vector<char> &blob) {
+        throw std::logic_error("save_state is not supported by this environment");
+    }
+    virtual void load_state(const char *blob, size_t size) {
+        throw std::logic_error("load_state is not supported by this environment");
+    }
+    // observations of the agents indices[0..n) of group, written to rows 0..n) of the buffers.
+    // nothing is done for the other agents
+    virtual void get_observation_subset(GroupHandle group, const int *indices, int n, float **linear_buffers) {
+        throw std::logic_error("get_observation_subset is not supported by this environment");
+    }
+    // a new environment with the same configuration and state
+    virtual Environment *clone() {
+        throw std::logic_error("clone is not supported by this environment");
+    }
+
+    // set_action, step, get_reward, clear_dead and get_observation of all the groups in one call.
+    // every argument is an array indexed by group, a null array or a null entry skips that output (or action).
+    // rewards and alive are of the agents in this step, ids, nums and obs are of the agents after clear_dead
+    virtual void step_full(const int **actions, float ***obs, float **rewards, bool **alive, int **ids,
+                           int *nums, int *done) {
+        throw std::logic_error("step_full is not supported by this environment");
+    }
+
+    // run step (and clear_dead if needed) on a background thread, rewards and observations go to the
+    // registered buffers. no other function of the environment can be called before wait_step
+    void step_async(bool clear) {
+        if (pending_step.valid())
+            throw std::logic_error("the previous asynchronous step is not waited");
+        pending_step = std::async(std::launch::async, [this, clear]() {
+            int done;
+            step(&done);
+            if (clear)
+                clear_dead();
+            return done;
+        });
+    }
+    // wait for the asynchronous step, exceptions thrown in the step are rethrown here
+    void wait_step(int *done) {
+        if (!pending_step.valid())
+            throw std::logic_error("no asynchronous step to wait");
+        *done = pending_step.get();
+    }
+    bool step_pending() const { return pending_step.valid(); }
+
+private:
+    std::future<int> pending_step;
 };
 
 typedef Environment* EnvHandle;
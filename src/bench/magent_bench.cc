@@ -0,0 +1,417 @@
+/**
+ * \file magent_bench.cc
+ * \brief micro and macro benchmarks of the engine, on google benchmark
+ *
+ * Micro benchmarks time one phase of the engine (view extraction, move, attack, reward, clear dead)
+ * on a battle game of 10k agents. The state is restored by env_load_state before every iteration,
+ * so every iteration starts from the same map. Phases inside step are timed by the profiler of the engine.
+ *
+ * Macro benchmarks replay the builtin configs (battle, pursuit, gather, double_attack) with
+ * random actions on fixed seeds. Each iteration is a full step loop like the python wrapper:
+ * set_action, step, get_reward, clear_dead and get_observation for every group.
+ * They report steps/sec, agent_steps/sec and the time of every phase in ms per step.
+ *
+ * Flags benchmarks run the macro loop of battle under every combination of turn_mode, food_mode,
+ * minimap_mode and incremental_view_mode, to compare the specialized kernels of the engine.
+ *
+ * Usage:
+ *     magent_bench --benchmark_format=json
+ *     magent_bench --benchmark_filter=Macro/battle --benchmark_out=bench.json --benchmark_out_format=json
+ */
+
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "../runtime_api.h"
+
+namespace {
+
+// the same order as ProfilePhase in GridWorld.h
+const char *phase_names[] = {
+    "attack", "starve", "turn_parallel", "turn_boundary", "move_parallel",
+    "move_boundary", "calc_reward", "get_observation", "clear_dead", "render", "policy",
+};
+const int N_PHASE = sizeof(phase_names) / sizeof(phase_names[0]), MAX_PHASE = 64;
+
+// bits of the mode flags of a game
+enum {
+    FLAG_TURN = 1, FLAG_FOOD = 2, FLAG_MINIMAP = 4, FLAG_INCREMENTAL = 8, FLAG_DEFAULT = -1,
+};
+enum {
+    PHASE_ATTACK = 0, PHASE_MOVE_PARALLEL = 4, PHASE_MOVE_BOUNDARY = 5, PHASE_CALC_REWARD = 6,
+};
+
+struct AgentTypeSpec {
+    const char *name;
+    std::vector<const char *> keys;
+    std::vector<float> values;
+};
+
+// a game built from a builtin config, groups are added in order and filled with n agents at random
+struct Scenario {
+    std::vector<AgentTypeSpec> types;
+    std::vector<int> group_types;      // type index of every group
+    std::vector<double> group_density;  // agents per cell of every group
+    double wall_density;
+    bool minimap_mode;
+    int embedding_size;
+    void (*add_rules)(EnvHandle game);
+};
+
+const AgentTypeSpec battle_small = {"small",
+    {"width", "length", "hp", "speed", "view_radius", "view_angle", "attack_radius", "attack_angle",
+     "damage", "step_recover", "step_reward", "kill_reward", "dead_penalty", "attack_penalty"},
+    {1, 1, 10, 2, 6, 360, 1.5, 360, 2, 0.1, -0.005, 5, -0.1, -0.1}};
+
+// agent a, b of the groups g0, g1 with index any
+void define_pair(EnvHandle game, int g0, int g1) {
+    gridworld_define_agent_symbol(game, 0, g0, -1);
+    gridworld_define_agent_symbol(game, 1, g1, -1);
+}
+
+const int OP_AND = 0, OP_ATTACK = 7;
+
+void battle_rules(EnvHandle game) {
+    define_pair(game, 0, 1);
+    int e0[] = {0, 1}, e1[] = {1, 0};
+    gridworld_define_event_node(game, 0, OP_ATTACK, e0, 2);
+    gridworld_define_event_node(game, 1, OP_ATTACK, e1, 2);
+    int r0[] = {0}, r1[] = {1};
+    float v[] = {0.2};
+    gridworld_add_reward_rule(game, 0, r0, v, 1, false, false);
+    gridworld_add_reward_rule(game, 1, r1, v, 1, false, false);
+}
+
+void pursuit_rules(EnvHandle game) {
+    define_pair(game, 0, 1);
+    int e[] = {0, 1};
+    gridworld_define_event_node(game, 0, OP_ATTACK, e, 2);
+    int r[] = {0, 1};
+    float v[] = {1, -1};
+    gridworld_add_reward_rule(game, 0, r, v, 2, false, false);
+}
+
+void gather_rules(EnvHandle game) {
+    define_pair(game, 1, 0);
+    int e[] = {0, 1};
+    gridworld_define_event_node(game, 0, OP_ATTACK, e, 2);
+    int r[] = {0};
+    float v[] = {0.5};
+    gridworld_add_reward_rule(game, 0, r, v, 1, false, false);
+}
+
+void double_attack_rules(EnvHandle game) {
+    gridworld_define_agent_symbol(game, 0, 1, -1);  // tiger a
+    gridworld_define_agent_symbol(game, 1, 1, -1);  // tiger b
+    gridworld_define_agent_symbol(game, 2, 0, -1);  // deer
+    int e1[] = {0, 2}, e2[] = {1, 2}, both[] = {1, 2};
+    gridworld_define_event_node(game, 0, OP_AND, both, 2);
+    gridworld_define_event_node(game, 1, OP_ATTACK, e1, 2);
+    gridworld_define_event_node(game, 2, OP_ATTACK, e2, 2);
+    int r[] = {0, 1};
+    float v[] = {1, 1};
+    gridworld_add_reward_rule(game, 0, r, v, 2, false, false);
+}
+
+Scenario get_scenario(const std::string &name) {
+    if (name == "battle") {
+        return {{battle_small}, {0, 0}, {0.04, 0.04}, 0.0, true, 10, battle_rules};
+    } else if (name == "pursuit") {
+        return {{{"predator",
+                  {"width", "length", "hp", "speed", "view_radius", "view_angle",
+                   "attack_radius", "attack_angle", "attack_penalty"},
+                  {2, 2, 1, 1, 5, 360, 2, 360, -0.2}},
+                 {"prey",
+                  {"width", "length", "hp", "speed", "view_radius", "view_angle", "attack_radius", "attack_angle"},
+                  {1, 1, 1, 1.5, 4, 360, 0, 360}}},
+                {0, 1}, {0.0125, 0.025}, 0.03, false, 0, pursuit_rules};
+    } else if (name == "gather") {
+        return {{{"agent",
+                  {"width", "length", "hp", "speed", "view_radius", "view_angle", "attack_radius", "attack_angle",
+                   "damage", "step_recover", "step_reward", "dead_penalty", "attack_penalty", "attack_in_group"},
+                  {1, 1, 3, 3, 7, 360, 1, 360, 6, 0, -0.01, -1, -0.1, 1}},
+                 {"food",
+                  {"width", "length", "hp", "speed", "view_radius", "view_angle",
+                   "attack_radius", "attack_angle", "kill_reward"},
+                  {1, 1, 25, 0, 1, 360, 0, 360, 5}}},
+                {1, 0}, {0.04, 0.02}, 0.0, true, 0, gather_rules};
+    } else if (name == "double_attack") {
+        return {{{"deer",
+                  {"width", "length", "hp", "speed", "view_radius", "view_angle",
+                   "attack_radius", "attack_angle", "step_recover", "kill_supply"},
+                  {1, 1, 5, 1, 1, 360, 0, 360, 0.2, 8}},
+                 {"tiger",
+                  {"width", "length", "hp", "speed", "view_radius", "view_angle", "attack_radius", "attack_angle",
+                   "damage", "step_recover"},
+                  {1, 1, 10, 1, 4, 360, 1, 360, 1, -0.2}}},
+                {0, 1}, {0.05, 0.01}, 0.04, false, 10, double_attack_rules};
+    }
+    return {};
+}
+
+struct Game {
+    EnvHandle handle = nullptr;
+    int n_group = 0;
+    std::vector<std::vector<float>> views, features, rewards;
+    std::vector<std::vector<int>> actions;
+    std::vector<int> attack_base, action_space;
+    std::vector<char> state;  // snapshot right after the agents are added
+    std::mt19937 rng;
+
+    ~Game() {
+        if (handle != nullptr)
+            env_delete_game(handle);
+    }
+
+    // a map large enough for n_agent agents in the densities of the scenario.
+    // flags replace the minimap_mode of the scenario and turn on the other modes, unless FLAG_DEFAULT
+    void init(const std::string &name, int n_agent, int seed, int flags = FLAG_DEFAULT) {
+        Scenario sc = get_scenario(name);
+        double density = 0;
+        for (double d : sc.group_density)
+            density += d;
+        int map_size = (int)std::ceil(std::sqrt(n_agent / density));
+
+        env_new_game(&handle, "GridWorld");
+        env_config_game(handle, "map_width", &map_size);
+        env_config_game(handle, "map_height", &map_size);
+        env_config_game(handle, "minimap_mode", &sc.minimap_mode);
+        env_config_game(handle, "embedding_size", &sc.embedding_size);
+        if (flags != FLAG_DEFAULT) {
+            bool turn = (flags & FLAG_TURN) != 0, food = (flags & FLAG_FOOD) != 0;
+            bool minimap = (flags & FLAG_MINIMAP) != 0, incremental = (flags & FLAG_INCREMENTAL) != 0;
+            env_config_game(handle, "turn_mode", &turn);
+            env_config_game(handle, "food_mode", &food);
+            env_config_game(handle, "minimap_mode", &minimap);
+            env_config_game(handle, "incremental_view_mode", &incremental);
+        }
+        for (AgentTypeSpec &type : sc.types)
+            gridworld_register_agent_type(handle, type.name, (int)type.keys.size(), type.keys.data(),
+                                          type.values.data());
+        sc.add_rules(handle);
+
+        n_group = (int)sc.group_types.size();
+        for (int type : sc.group_types) {
+            GroupHandle group;
+            gridworld_new_group(handle, sc.types[type].name, &group);
+        }
+        env_config_game(handle, "seed", &seed);
+        env_reset(handle);
+
+        int n_wall = (int)(map_size * map_size * sc.wall_density);
+        if (n_wall > 0)
+            gridworld_add_agents(handle, -1, n_wall, "random", nullptr, nullptr, nullptr);
+        for (int i = 0; i < n_group; i++) {
+            int n = (int)(n_agent * sc.group_density[i] / density);
+            gridworld_add_agents(handle, i, n, "random", nullptr, nullptr, nullptr);
+        }
+
+        views.resize(n_group); features.resize(n_group); rewards.resize(n_group); actions.resize(n_group);
+        attack_base.resize(n_group); action_space.resize(n_group);
+        for (int i = 0; i < n_group; i++) {
+            int view_space[3], feature_space, n = get_num(i);
+            env_get_info(handle, i, "view_space", view_space);
+            env_get_info(handle, i, "feature_space", &feature_space);
+            env_get_info(handle, i, "attack_base", &attack_base[i]);
+            env_get_info(handle, i, "action_space", &action_space[i]);
+            views[i].resize((size_t)n * view_space[0] * view_space[1] * view_space[2] + 1);
+            features[i].resize((size_t)n * feature_space + 1);
+            rewards[i].resize((size_t)n + 1);
+            actions[i].resize((size_t)n + 1);
+        }
+
+        long long size = 0;
+        env_save_state(handle, nullptr, &size);
+        state.resize((size_t)size);
+        env_save_state(handle, state.data(), &size);
+        rng.seed((unsigned)seed);
+        read_profile();  // drop the records of the setup
+    }
+
+    void restore() {
+        env_load_state(handle, state.data(), (long long)state.size());
+    }
+
+    int get_num(GroupHandle group) {
+        int n;
+        env_get_info(handle, group, "num", &n);
+        return n;
+    }
+
+    // kind : 0 for random actions, 1 for moves only, 2 for attacks only
+    void set_random_actions(int kind = 0) {
+        for (int i = 0; i < n_group; i++) {
+            int n = get_num(i), lo = 0, hi = action_space[i];
+            if (kind == 1)
+                hi = attack_base[i];
+            else if (kind == 2 && attack_base[i] < action_space[i])
+                lo = attack_base[i];
+            std::uniform_int_distribution<int> dist(lo, hi - 1);
+            for (int j = 0; j < n; j++)
+                actions[i][j] = dist(rng);
+            env_set_action(handle, i, actions[i].data());
+        }
+    }
+
+    void get_observation(GroupHandle group) {
+        float *buffers[2] = {views[group].data(), features[group].data()};
+        env_get_observation(handle, group, buffers);
+    }
+
+    // (time in ms, calls, items) of every phase, the profiler is reset
+    std::vector<float> read_profile() {
+        std::vector<float> profile(1 + MAX_PHASE * 3);
+        env_get_info(handle, -1, "profile", profile.data());
+        return profile;
+    }
+};
+
+double phase_seconds(const std::vector<float> &profile, int phase) {
+    return profile[1 + phase * 3] / 1000.0;
+}
+
+/******** micro benchmarks ********/
+const int MICRO_AGENTS = 10000;
+
+void BM_ExtractView(benchmark::State &state) {
+    Game game;
+    game.init("battle", MICRO_AGENTS, 0);
+    long long n_agent = 0;
+    for (auto _ : state) {
+        game.get_observation(0);
+        n_agent += game.get_num(0);
+    }
+    state.SetItemsProcessed(n_agent);
+}
+
+// time the phases of step in [begin, end] with a fixed kind of actions
+void run_step_phase(benchmark::State &state, int kind, int begin, int end) {
+    Game game;
+    game.init("battle", MICRO_AGENTS, 0);
+    long long n_agent = 0;
+    for (auto _ : state) {
+        game.restore();
+        game.set_random_actions(kind);
+        game.read_profile();
+        int done;
+        env_step(game.handle, &done);
+        std::vector<float> profile = game.read_profile();
+        double seconds = 0;
+        for (int phase = begin; phase <= end; phase++)
+            seconds += phase_seconds(profile, phase);
+        state.SetIterationTime(seconds);
+        n_agent += game.get_num(0) + game.get_num(1);
+    }
+    state.SetItemsProcessed(n_agent);
+}
+
+void BM_DoMove(benchmark::State &state) {
+    run_step_phase(state, 1, PHASE_MOVE_PARALLEL, PHASE_MOVE_BOUNDARY);
+}
+
+void BM_GetAttackObj(benchmark::State &state) {
+    run_step_phase(state, 2, PHASE_ATTACK, PHASE_ATTACK);
+}
+
+void BM_CalcReward(benchmark::State &state) {
+    run_step_phase(state, 0, PHASE_CALC_REWARD, PHASE_CALC_REWARD);
+}
+
+// clear the agents killed by a few steps of attacks
+void BM_ClearDead(benchmark::State &state) {
+    Game game;
+    game.init("battle", MICRO_AGENTS, 0);
+    long long n_dead = 0;
+    for (auto _ : state) {
+        state.PauseTiming();
+        game.restore();
+        int done, before = game.get_num(0) + game.get_num(1);
+        for (int i = 0; i < 5; i++) {
+            game.set_random_actions(2);
+            env_step(game.handle, &done);
+        }
+        state.ResumeTiming();
+        gridworld_clear_dead(game.handle);
+        n_dead += before - game.get_num(0) - game.get_num(1);
+    }
+    state.SetItemsProcessed(n_dead);
+}
+
+BENCHMARK(BM_ExtractView)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_DoMove)->UseManualTime()->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_GetAttackObj)->UseManualTime()->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_CalcReward)->UseManualTime()->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_ClearDead)->Unit(benchmark::kMillisecond);
+
+/******** macro benchmarks ********/
+const int MACRO_STEPS = 10;  // steps per iteration, from the initial state
+
+// MACRO_STEPS steps of the python loop per iteration, on a game ready to restore
+void run_macro(benchmark::State &state, Game &game) {
+    long long n_step = 0, n_agent_step = 0;
+    std::vector<double> phase_time(N_PHASE, 0.0);
+    for (auto _ : state) {
+        state.PauseTiming();
+        game.restore();
+        game.read_profile();
+        state.ResumeTiming();
+        for (int t = 0; t < MACRO_STEPS; t++) {
+            game.set_random_actions();
+            int done;
+            env_step(game.handle, &done);
+            for (int i = 0; i < game.n_group; i++) {
+                int n = game.get_num(i);
+                env_get_reward(game.handle, i, game.rewards[i].data());
+                n_agent_step += n;
+            }
+            gridworld_clear_dead(game.handle);
+            for (int i = 0; i < game.n_group; i++)
+                game.get_observation(i);
+            n_step++;
+        }
+        state.PauseTiming();
+        std::vector<float> profile = game.read_profile();
+        for (int i = 0; i < phase_time.size(); i++)
+            phase_time[i] += profile[1 + i * 3];
+        state.ResumeTiming();
+    }
+    state.counters["steps/sec"] = benchmark::Counter(n_step, benchmark::Counter::kIsRate);
+    state.counters["agent_steps/sec"] = benchmark::Counter(n_agent_step, benchmark::Counter::kIsRate);
+    for (int i = 0; i < phase_time.size(); i++) {
+        if (phase_time[i] > 0)
+            state.counters[std::string("ms/step:") + phase_names[i]] = phase_time[i] / n_step;
+    }
+}
+
+void BM_Macro(benchmark::State &state, const char *name) {
+    Game game;
+    game.init(name, (int)state.range(0), 0);
+    run_macro(state, game);
+}
+
+// battle of 10k agents, the argument is a combination of FLAG_*
+void BM_Flags(benchmark::State &state) {
+    Game game;
+    game.init("battle", MICRO_AGENTS, 0, (int)state.range(0));
+    run_macro(state, game);
+}
+
+BENCHMARK_CAPTURE(BM_Macro, battle, "battle")
+        ->Arg(1000)->Arg(10000)->Arg(100000)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Macro, pursuit, "pursuit")
+        ->Arg(1000)->Arg(10000)->Arg(100000)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Macro, gather, "gather")
+        ->Arg(1000)->Arg(10000)->Arg(100000)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Macro, double_attack, "double_attack")
+        ->Arg(1000)->Arg(10000)->Arg(100000)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_Flags)->DenseRange(0, FLAG_TURN | FLAG_FOOD | FLAG_MINIMAP | FLAG_INCREMENTAL)
+        ->Unit(benchmark::kMillisecond);
+
+} // namespace
+
+BENCHMARK_MAIN();
@@ -0,0 +1,115 @@
+/**
+ * \file BodyStore.h
+ * \brief bodies of all the snakes, as ring buffers carved from one pooled arena
+ */
+
+#ifndef MAGNET_DISCRETE_SNAKE_BODYSTORE_H
+#define MAGNET_DISCRETE_SNAKE_BODYSTORE_H
+
+#include <vector>
+#include "snake_def.h"
+
+namespace magent {
+namespace discrete_snake {
+
+// a body in the arena, segment i (0 for the head) is at offset + ((head + i) & mask)
+struct BodyRing {
+    int offset = -1;
+    int mask = 0;    // capacity - 1, capacity is a power of two
+    int head = 0;
+    int length = 0;
+};
+
+/**
+ * All the segments live in one vector, every body owns a block of power-of-two capacity.
+ * push_head and pop_tail are O(1) and never allocate, as long as reserve_head is called
+ * (serially) before a parallel push_head. A full ring moves to a block twice as large,
+ * freed blocks are reused by later bodies of the same size class.
+ */
+class BodyStore {
+public:
+    // an empty ring of at least n cells
+    void assign(BodyRing &ring, int n) {
+        release(ring);
+        int capacity = 1, size_class = 0;
+        while (capacity < n) {
+            capacity <<= 1;
+            size_class++;
+        }
+        ring.offset = alloc_block(size_class);
+        ring.mask = capacity - 1;
+        ring.head = ring.length = 0;
+    }
+
+    void release(BodyRing &ring) {
+        if (ring.offset < 0)
+            return;
+        free_blocks[class_of(ring)].push_back(ring.offset);
+        ring.offset = -1;
+        ring.mask = ring.head = ring.length = 0;
+    }
+
+    // make room for one more segment
+    void reserve_head(BodyRing &ring) {
+        if (ring.length <= ring.mask)
+            return;
+        BodyRing larger;
+        assign(larger, (ring.mask + 1) * 2);
+        for (int i = 0; i < ring.length; i++)
+            arena[larger.offset + i] = at(ring, i);
+        larger.length = ring.length;
+        release(ring);
+        ring = larger;
+    }
+
+    void push_head(BodyRing &ring, Position pos) {
+        ring.head = (ring.head - 1) & ring.mask;
+        arena[ring.offset + ring.head] = pos;
+        ring.length++;
+    }
+
+    Position pop_tail(BodyRing &ring) {
+        ring.length--;
+        return at(ring, ring.length);
+    }
+
+    const Position &at(const BodyRing &ring, int i) const {
+        return arena[ring.offset + ((ring.head + i) & ring.mask)];
+    }
+
+    // drop all the bodies
+    void reset() {
+        arena.clear();
+        free_blocks.clear();
+    }
+
+private:
+    static int class_of(const BodyRing &ring) {
+        int size_class = 0;
+        while ((1 << size_class) <= ring.mask)
+            size_class++;
+        return size_class;
+    }
+
+    int alloc_block(int size_class) {
+        if (free_blocks.size() <= size_class)
+            free_blocks.resize((size_t)size_class + 1);
+        std::vector<int> &blocks = free_blocks[size_class];
+        if (!blocks.empty()) {
+            int offset = blocks.back();
+            blocks.pop_back();
+            return offset;
+        }
+        int offset = (int)arena.size();
+        arena.resize(arena.size() + ((size_t)1 << size_class));
+        return offset;
+    }
+
+    std::vector<Position> arena;
+    std::vector<std::vector<int>> free_blocks;  // offsets of free blocks of every size class
+};
+
+} // namespace discrete_snake
+} // namespace magent
+
+#endif //MAGNET_DISCRETE_SNAKE_BODYSTORE_H
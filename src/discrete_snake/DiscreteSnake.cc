@@ -8,6 +8,8 @@
 #include <unordered_set>
 #include <unordered_map>
 #include <iostream>
+#include <algorithm>
+#include <omp.h>
 #include "DiscreteSnake.h"
 
 
@@ -22,20 +24,20 @@ DiscreteSnake::DiscreteSnake() {
     max_dead_penalty = -10;
     corpse_value = 1;
     initial_length = 3;
-    head_mask = nullptr;
+    frame_skip = 1;
+    head_claim = nullptr;
+    obs_dtype = utility::OBS_FLOAT32;
 
     first_render = true;
 }
 
 DiscreteSnake::~DiscreteSnake() {
-    if (head_mask != nullptr)
-        delete head_mask;
+    if (head_claim != nullptr)
+        delete [] head_claim;
 
-    for (auto agent : agents)
-        delete agent;
-
-    for (auto food : foods)
-        delete food;
+    for (auto agent : agents)   // bodies are released to body_store
+        agent_pool.free(agent);
+    // foods are freed with the pool
 }
 
 void DiscreteSnake::reset() {
@@ -43,12 +45,24 @@ void DiscreteSnake::reset() {
     render_generator.next_file();
 
     map.reset(width, height);
-    head_mask = new int [width * height];
+    if (head_claim != nullptr)
+        delete [] head_claim;
+    head_claim = new std::atomic<int> [width * height];
+    for (int i = 0; i < width * height; i++)
+        head_claim[i].store(0, std::memory_order_relaxed);
 
     //free agents
     for (int i = 0; i < agents.size(); i++) {
-        delete agents[i];
+        agent_pool.free(agents[i]);
     }
+    agents.clear();
+    agent_pool.reset();
+    body_store.reset();
+
+    // foods are trivially destructible, recycle them at once
+    foods.clear();
+    food_pool.reset();
+    registered.obs_fresh = false;
 }
 
 void DiscreteSnake::set_config(const char *key, void *p_value) {
@@ -74,9 +88,16 @@ void DiscreteSnake::set_config(const char *key, void *p_value) {
         initial_length = ivalue;
     else if (strequ(key, "total_resource"))
         total_resource = ivalue;
+    else if (strequ(key, "frame_skip")) {  // a step repeats the actions for frame_skip frames
+        if (ivalue < 1)
+            LOG(FATAL) << "invalid frame_skip in DiscreteSnake::set_config : " << ivalue;
+        frame_skip = ivalue;
+    }
 
     else if (strequ(key, "embedding_size"))
         embedding_size = ivalue;
+    else if (strequ(key, "obs_dtype"))  // "float32", "float16" or "uint8", element type of views
+        obs_dtype = utility::parse_obs_dtype(strvalue);
     else if (strequ(key, "render_dir"))
         render_generator.set_render("save_dir", strvalue);
 
@@ -88,13 +109,15 @@ void DiscreteSnake::set_config(const char *key, void *p_value) {
 }
 
 void DiscreteSnake::add_object(int obj_id, int n, const char *method, const int *linear_buffer) {
+    registered.obs_fresh = false;
+
     if (obj_id == -1) {  // wall
 
     } else if (obj_id == -2) { // food
         std::vector<Position> pos;
         if (strequ(method, "random")) { // snake
             for (int i = 0; i < n; i++) {
-                Food *food = new Food(1, 1, corpse_value);
+                Food *food = food_pool.alloc(1, 1, corpse_value);
 
                 map.get_random_blank(pos, 1);
                 foods.insert(food);
@@ -107,7 +130,7 @@ void DiscreteSnake::add_object(int obj_id, int n, const char *method, const int
         if (strequ(method, "random")) { // snake
             std::vector<Position> pos;
             for (int i = 0; i < n; i++) {
-                Agent *agent = new Agent(id_counter);
+                Agent *agent = agent_pool.alloc(id_counter, &body_store);
                 Direction dir = (Direction) (random() % (int) DIR_NUM);
 
                 map.get_random_blank(pos, initial_length);
@@ -125,6 +148,34 @@ void DiscreteSnake::add_object(int obj_id, int n, const char *method, const int
 }
 
 void DiscreteSnake::get_observation(GroupHandle group, float **linear_buffer) {
+    float *registered_buffers[2];
+    if (linear_buffer == nullptr) {  // use registered buffers
+        if (!registered.has_obs())
+            LOG(FATAL) << "no registered observation buffer in DiscreteSnake::get_observation";
+        if (registered.obs_fresh)
+            return;
+        if (agents.size() > registered.view_capacity || agents.size() > registered.feature_capacity)
+            LOG(FATAL) << "registered observation buffer is too small in DiscreteSnake::get_observation : "
+                       << agents.size() << " agents";
+        registered_buffers[0] = registered.view;
+        registered_buffers[1] = registered.feature;
+        linear_buffer = registered_buffers;
+        registered.obs_fresh = true;
+    }
+    extract_observation(nullptr, (int)agents.size(), linear_buffer);
+}
+
+void DiscreteSnake::get_observation_subset(GroupHandle group, const int *indices, int n, float **linear_buffer) {
+    if (linear_buffer == nullptr)
+        LOG(FATAL) << "the registered buffers are not used by DiscreteSnake::get_observation_subset";
+    for (int i = 0; i < n; i++) {
+        if (indices[i] < 0 || indices[i] >= agents.size())
+            LOG(FATAL) << "invalid agent index in DiscreteSnake::get_observation_subset : " << indices[i];
+    }
+    extract_observation(indices, n, linear_buffer);
+}
+
+void DiscreteSnake::extract_observation(const int *indices, int n, float **linear_buffer) {
     int n_channel = CHANNEL_NUM; // wall food self other id
     int n_action = (int)ACT_NUM;
     int feature_size = embedding_size + n_action + 1; // embedding + last_action + length
@@ -135,20 +186,37 @@ void DiscreteSnake::get_observation(GroupHandle group, float **linear_buffer) {
     view_buffer = (decltype(view_buffer))linear_buffer[0];
     feature_buffer = (decltype(feature_buffer))linear_buffer[1];
 
-    size_t agent_size = agents.size();
+    size_t agent_size = (size_t)n;
+    const size_t view_size = (size_t)view_height * view_width * n_channel;
 
-    memset(view_buffer, 0, sizeof(float) * agent_size * view_height * view_width * n_channel);
-    memset(feature_buffer, 0, sizeof(float) * agent_size * feature_size);
+    // other dtypes are extracted into a float scratch of every thread, then converted into the buffer
+    const bool convert = obs_dtype != utility::OBS_FLOAT32;
+    char *converted_buffer = (char *)linear_buffer[0];
+    const size_t converted_size = view_size * utility::obs_dtype_size(obs_dtype);
 
-    #pragma omp parallel for
-    for (int i = 0; i < agent_size; i++) {
-        Agent *agent = agents[i];
+    if (!convert)
+        memset(view_buffer, 0, sizeof(float) * agent_size * view_size);
 
-        map.extract_view(agent, (float *)view_buffer[i],
-                         view_height, view_width, n_channel, id_counter);
-        agent->get_embedding(feature_buffer[i], embedding_size);
-        feature_buffer[i][embedding_size + agent->get_action()] = 1;
-        feature_buffer[i][embedding_size + n_action] = agent->get_length();
+    // before the parallel loop, since an agent can be listed more than once in indices
+    for (int i = 0; i < agent_size; i++)
+        agents[indices == nullptr ? i : indices[i]]->update_feature(embedding_size);
+
+    #pragma omp parallel
+    {
+        std::vector<float> scratch(convert ? view_size : 0);
+        #pragma omp for
+        for (int i = 0; i < agent_size; i++) {
+            Agent *agent = agents[indices == nullptr ? i : indices[i]];
+
+            float *view = convert ? scratch.data() : (float *)view_buffer[i];
+            if (convert)
+                memset(view, 0, sizeof(float) * view_size);
+            map.extract_view(agent, view, view_height, view_width, n_channel, id_counter);
+            if (convert)
+                utility::convert_obs(view, converted_buffer + i * converted_size, view_size, obs_dtype);
+
+            memcpy(feature_buffer[i], agent->get_feature(), sizeof(float) * feature_size);
+        }
     }
 }
 
@@ -162,9 +230,30 @@ void DiscreteSnake::set_action(GroupHandle group, const int *actions) {
 }
 
 void DiscreteSnake::step(int *done) {
-    #pragma omp declare reduction (merge : std::vector<Agent*> : omp_out.insert(omp_out.end(), omp_in.begin(), omp_in.end()))
-    #pragma omp declare reduction (merge : std::vector<Food*>  : omp_out.insert(omp_out.end(), omp_in.begin(), omp_in.end()))
-    #pragma omp declare reduction (merge : std::set<PositionInteger> : omp_out.insert(omp_in.begin(), omp_in.end()))
+    map.drop_free_cells();
+
+    // the later frames repeat the actions of the snakes still alive, rewards add up until clear_dead
+    step_frame(agents);
+    std::vector<Agent*> alive;
+    for (int frame = 1; frame < frame_skip; frame++) {
+        alive.clear();
+        for (Agent *agent : agents) {
+            if (!agent->is_dead())
+                alive.push_back(agent);
+        }
+        step_frame(alive);
+    }
+
+    // write rewards into registered buffer, registered observations are outdated now
+    registered.obs_fresh = false;
+    if (registered.reward != nullptr)
+        get_reward(0, nullptr);
+
+    *done = 0;
+}
+
+void DiscreteSnake::step_frame(const std::vector<Agent*> &movers) {
+    #pragma omp declare reduction (merge : std::vector<Position> : omp_out.insert(omp_out.end(), omp_in.begin(), omp_in.end()))
 
     const Action dir2inverse[] = {
         ACT_LEFT, ACT_UP, ACT_RIGHT, ACT_DOWN,
@@ -178,10 +267,12 @@ void DiscreteSnake::step(int *done) {
 
     // update body
     LOG(TRACE) << "update body.  ";
-    size_t agent_size = agents.size();
+    size_t agent_size = movers.size();
+    for (int i = 0; i < agent_size; i++)  // the arena can grow only here
+        movers[i]->reserve_head();
     #pragma omp parallel for
     for (int i = 0; i < agent_size; i++) {
-        Agent *agent = agents[i];
+        Agent *agent = movers[i];
 
         Action act = agent->get_action();
         Direction dir = agent->get_dir();
@@ -202,80 +293,119 @@ void DiscreteSnake::step(int *done) {
             map.move_tail(agent);
     }
 
-    memset(head_mask, 0, sizeof(int) * width * height);
-    for (int i = 0; i < agent_size; i++)
-        head_mask[map.pos2int(agents[i]->get_head())]++;
-
     // check head (food or wall or other)
     LOG(TRACE) << "check head.  ";
     std::vector<Food*>  eat_list;
     std::vector<Agent*> dead_list;
-    std::set<PositionInteger> double_head_list;
+    std::vector<PositionInteger> double_head_list;
 
     int added_length = 0;
-    #pragma omp parallel for reduction(merge: dead_list) reduction(merge: eat_list) reduction(merge: double_head_list) reduction(+: added_length)
-    for (int i = 0; i < agent_size; i++) {
-        Agent *agent = agents[i];
-        Food *eaten = nullptr;
+    #pragma omp parallel reduction(+: added_length)
+    {
+        #pragma omp single
+        head_check_buffers.resize((size_t)omp_get_num_threads());
+        HeadCheckBuffer &local = head_check_buffers[omp_get_thread_num()];
+        local.dead_list.clear();
+        local.eat_list.clear();
+        local.double_head_list.clear();
+
+        // claim the cells of new heads, the agent that turns a claim into HEAD_COLLIDED records the cell
+        #pragma omp for schedule(static)
+        for (int i = 0; i < agent_size; i++) {
+            std::atomic<int> &claim = head_claim[map.pos2int(movers[i]->get_head())];
+            int expected = 0;
+            if (!claim.compare_exchange_strong(expected, i + 1, std::memory_order_relaxed)) {
+                // claimed by another head, or already collided
+                while (expected != HEAD_COLLIDED
+                       && !claim.compare_exchange_weak(expected, HEAD_COLLIDED, std::memory_order_relaxed)) {
+                }
+                if (expected != HEAD_COLLIDED)
+                    local.double_head_list.push_back(map.pos2int(movers[i]->get_head()));
+            }
+        }
 
-        float reward = 0;
-        bool dead = false;
+        // the implicit barrier above publishes all the claims
+        #pragma omp for schedule(static)
+        for (int i = 0; i < agent_size; i++) {
+            Agent *agent = movers[i];
+            Food *eaten = nullptr;
 
-        PositionInteger head_int = map.pos2int(agent->get_head());
-        if (head_mask[head_int] > 1) {
-            dead = true;
-            double_head_list.insert(head_int);
-        } else {
-            map.move_head(agent, head_int, reward, dead, eaten);
-        }
+            float reward = 0;
+            bool dead = false;
 
-        if (dead) {
-            dead_list.push_back(agent);
-            agent->set_dead();
-            //agent->add_reward(-std::min(-max_dead_penalty, (Reward)(agent->get_length() - initial_length)));
-            agent->add_reward(-max_dead_penalty);
-        } else {
-            if (eaten != nullptr) {
-                eat_list.push_back(eaten);
-                agent->add_reward(reward);
+            PositionInteger head_int = map.pos2int(agent->get_head());
+            if (head_claim[head_int].load(std::memory_order_relaxed) == HEAD_COLLIDED) {
+                dead = true;
+            } else {
+                map.move_head(agent, head_int, reward, dead, eaten);
+            }
+
+            if (dead) {
+                local.dead_list.push_back(agent);
+                agent->set_dead();
+                //agent->add_reward(-std::min(-max_dead_penalty, (Reward)(agent->get_length() - initial_length)));
+                agent->add_reward(-max_dead_penalty);
+            } else {
+                if (eaten != nullptr) {
+                    local.eat_list.push_back(eaten);
+                    agent->add_reward(reward);
+                }
+                // calc total length for resource balancing
+                added_length += agent->get_length() - initial_length;
             }
-            // calc total length for resource balancing
-            added_length += agent->get_length() - initial_length;
         }
+
+        // release the claims for the next step
+        #pragma omp for schedule(static)
+        for (int i = 0; i < agent_size; i++)
+            head_claim[map.pos2int(movers[i]->get_head())].store(0, std::memory_order_relaxed);
+    }
+    for (HeadCheckBuffer &local : head_check_buffers) {
+        dead_list.insert(dead_list.end(), local.dead_list.begin(), local.dead_list.end());
+        eat_list.insert(eat_list.end(), local.eat_list.begin(), local.eat_list.end());
+        double_head_list.insert(double_head_list.end(), local.double_head_list.begin(), local.double_head_list.end());
     }
+    // foods are refilled at double heads in the order of position
+    std::sort(double_head_list.begin(), double_head_list.end());
 
     // delete eaten foods
     LOG(TRACE) << "delete eaten food.  ";
     #pragma omp parallel for
     for (int i = 0; i < eat_list.size(); i++) {
         map.remove_food(eat_list[i]);
-        delete eat_list[i];
     }
     for (int i = 0; i < eat_list.size(); i++) {
         foods.erase(eat_list[i]);
+        food_pool.free(eat_list[i]);
     }
 
     // make dead agents as food
     LOG(TRACE) << "make food.  ";
-    std::vector<Food*> new_foods;
-    #pragma omp parallel for reduction(merge: new_foods)
+    std::vector<Position> food_pos;
+    #pragma omp parallel for reduction(merge: food_pos)
     for (int i = 0; i < dead_list.size(); i++) {
         int add = (int)dead_list[i]->get_length() - initial_length;
-        map.make_food(dead_list[i], corpse_value, new_foods, add);
+        map.make_food(dead_list[i], food_pos, add);
+    }
+    for (auto pos : food_pos) {
+        Food *food = food_pool.alloc(1, 1, corpse_value);
+        map.add_food(food, pos.x, pos.y);
+        foods.insert(food);
     }
-    foods.insert(new_foods.begin(), new_foods.end());
 
     // double head, balance total resource
     int add = total_resource - added_length - (int)foods.size();
     if (add > 0) {
         for (auto pos_int : double_head_list) {
-            Food *food = new Food(1, 1, corpse_value);
+            Food *food = food_pool.alloc(1, 1, corpse_value);
             Position pos = map.int2pos(pos_int);
 
             if (map.add_food(food, pos.x, pos.y)) {
                 foods.insert(food);
                 if (--add == 0)
                     break;
+            } else {
+                food_pool.free(food);
             }
         }
     }
@@ -301,12 +431,18 @@ void DiscreteSnake::step(int *done) {
         printf("%d %d\n", foods.size(), map.get_food_num());
         exit(0);
     }*/
-
-    *done = 0;
 }
 
 void DiscreteSnake::get_reward(GroupHandle group, float *buffer) {
     size_t agent_size = agents.size();
+    if (buffer == nullptr) {  // use registered buffer
+        if (registered.reward == nullptr)
+            LOG(FATAL) << "no registered reward buffer in DiscreteSnake::get_reward";
+        if (agent_size > registered.reward_capacity)
+            LOG(FATAL) << "registered reward buffer is too small in DiscreteSnake::get_reward : "
+                       << agent_size << " agents";
+        buffer = registered.reward;
+    }
     #pragma omp parallel for
     for (int i = 0; i < agent_size; i++) {
         buffer[i] = agents[i]->get_reward();
@@ -319,7 +455,7 @@ void DiscreteSnake::clear_dead() {
     for (int j = 0; j < agent_size; j++) {
         Agent *agent = agents[j];
         if (agent->is_dead()) {
-            delete agent;
+            agent_pool.free(agent);
         } else {
             agent->init_reward();
             agents[pt++] = agent;
@@ -327,6 +463,17 @@ void DiscreteSnake::clear_dead() {
         }
     }
     agents.resize(pt);
+
+    // refresh registered observations for the next step
+    if (registered.has_obs())
+        get_observation(0, nullptr);
+}
+
+void DiscreteSnake::register_buffer(GroupHandle group, const char *name, void *buffer, int capacity) {
+    if (group != 0)
+        LOG(FATAL) << "invalid group handle in DiscreteSnake::register_buffer : " << group;
+    if (!registered.set(name, buffer, capacity))
+        LOG(FATAL) << "invalid buffer name in DiscreteSnake::register_buffer : " << name;
 }
 
 /**
@@ -367,8 +514,8 @@ void DiscreteSnake::get_info(GroupHandle group, const char *name, void *void_buf
         size_t agent_size = agents.size();
         #pragma omp parallel for
         for (int i = 0; i < agent_size; i++) {
-            int_buffer[2 * i] = agents[i]->get_body().front().x;
-            int_buffer[2 * i + 1] = agents[i]->get_body().front().y;
+            int_buffer[2 * i] = agents[i]->get_head().x;
+            int_buffer[2 * i + 1] = agents[i]->get_head().y;
         }
     } else if (strequ(name, "action_space")) {
         int_buffer[0] = (int)ACT_NUM;
@@ -376,6 +523,8 @@ void DiscreteSnake::get_info(GroupHandle group, const char *name, void *void_buf
         int_buffer[0] = view_height;
         int_buffer[1] = view_width;
         int_buffer[2] = CHANNEL_NUM;
+    } else if (strequ(name, "view_dtype")) {  // int, 0 for float32, 1 for float16, 2 for uint8
+        int_buffer[0] = (int)obs_dtype;
     } else if (strequ(name, "feature_space")) {
         int n_action = (int)ACT_NUM;
         int_buffer[0] = embedding_size + n_action + 1; // embedding + last_action + length
@@ -6,12 +6,15 @@
 #ifndef MAGNET_DISCRETE_SNACK_H
 #define MAGNET_DISCRETE_SNACK_H
 
+#include <atomic>
 #include <cstring>
-#include <deque>
 #include <set>
 #include "snake_def.h"
+#include "BodyStore.h"
 #include "Map.h"
 #include "RenderGenerator.h"
+#include "../utility/ObjectPool.h"
+#include "../utility/ObsDtype.h"
 
 namespace magent {
 namespace discrete_snake {
@@ -27,9 +30,12 @@ public:
     // run step
     void reset() override;
     void get_observation(GroupHandle group, float **buffer) override;
+    void get_observation_subset(GroupHandle group, const int *indices, int n, float **buffer) override;
     void set_action(GroupHandle group, const int *actions) override;
     void step(int *done) override;
     void get_reward(GroupHandle group, float *buffer) override;
+    void clear_dead() override;
+    void register_buffer(GroupHandle group, const char *name, void *buffer, int capacity) override;
 
     // info getter
     void get_info(GroupHandle group, const char *name, void *void_buffer) override;
@@ -38,15 +44,32 @@ public:
     void render() override;
     void render_next_file();
 
-    void clear_dead();
-
     void add_object(int obj_id, int n, const char *method, const int *linear_buffer);
 
 private:
+    // observations of agents[indices[i]] (agents[i] if indices = nullptr) into row i, for i < n
+    void extract_observation(const int *indices, int n, float **buffer);
+    // one frame of step for the moving snakes
+    void step_frame(const std::vector<Agent*> &movers);
+
     Map map;
     std::vector<Agent*> agents;
     std::set<Food*> foods;
-    int *head_mask;
+    BodyStore body_store;  // agents release their bodies here, so it outlives agent_pool
+    utility::ObjectPool<Agent> agent_pool;
+    utility::ObjectPool<Food> food_pool;
+    // claim of every cell by the new heads, agent index + 1, or HEAD_COLLIDED if two heads meet.
+    // only the cells of the heads are cleared after a step
+    std::atomic<int> *head_claim;
+    static const int HEAD_COLLIDED = -1;
+    // thread-local outputs of the head check, concatenated in thread order (= agent order)
+    struct HeadCheckBuffer {
+        std::vector<Agent*> dead_list;
+        std::vector<Food*> eat_list;
+        std::vector<PositionInteger> double_head_list;
+    };
+    std::vector<HeadCheckBuffer> head_check_buffers;
+    RegisteredBuffers registered;  // only one group
 
     int id_counter;
     bool first_render;
@@ -58,6 +81,8 @@ private:
     int embedding_size;
     int initial_length;
     int total_resource;
+    int frame_skip;
+    utility::ObsDtype obs_dtype;
 
     /* render */
     RenderGenerator render_generator;
@@ -92,15 +117,21 @@ private:
 
 class Agent {
 public:
-    explicit Agent(int &id_counter): group(0), dead(false), in_event_calc(false), dir(DIR_NUM), last_action(ACT_NUM),
-                                     next_reward(0), total_reward(0) {
+    Agent(int &id_counter, BodyStore *bodies): group(0), dead(false), in_event_calc(false), dir(DIR_NUM),
+                                               last_action(ACT_NUM), next_reward(0), total_reward(0), bodies(bodies) {
         id = group;
         id = id_counter++;
     }
 
+    ~Agent() {
+        bodies->release(body);
+    }
+
+    // pos[0] is the head
     void init_body(std::vector<Position> &pos) {
-        body.clear();
-        body.insert(body.begin(), pos.begin(), pos.end());
+        bodies->assign(body, (int)pos.size() + 1);
+        for (int i = (int)pos.size() - 1; i >= 0; i--)
+            bodies->push_head(body, pos[i]);
         total_reward = 0;
     }
 
@@ -118,33 +149,48 @@ public:
     Reward get_reward() const { return next_reward; }
     Reward get_total_reward() const { return total_reward; }
 
-    Position get_head() const { return body.front(); }
-    void push_head(Position head) { body.push_front(head); }
-    Position pop_tail() {
-        Position ret =  body.back();
-        body.pop_back();
-        return ret;
-    }
+    Position get_head() const { return bodies->at(body, 0); }
+    // reserve_head must be called (serially) before a parallel push_head
+    void reserve_head() { bodies->reserve_head(body); }
+    void push_head(Position head) { bodies->push_head(body, head); }
+    Position pop_tail() { return bodies->pop_tail(body); }
 
     int get_id() const { return id; }
-    void get_embedding(float *buf, int size) {
-        if (embedding.empty()) {
+    // feature : embedding, one-hot last action, length. the row is kept between observations,
+    // only the entries of a changed action or length are rewritten by update_feature, which must be called serially
+    const float *get_feature() const { return feature.data(); }
+    void update_feature(int embedding_size) {
+        const size_t size = (size_t)embedding_size + ACT_NUM + 1;
+        if (feature.size() != size) {
+            feature.assign(size, 0);
             int t = id;
-            for (int i = 0; i < size; i++, t >>= 1) {
-                embedding.push_back((float)(t & 1));
-            }
+            for (int i = 0; i < embedding_size; i++, t >>= 1)
+                feature[i] = (float)(t & 1);
+            feature_action = ACT_NUM;
+            feature_length = 0;
+        }
+        if (feature_action != last_action) {
+            feature[embedding_size + feature_action] = 0;
+            feature[embedding_size + last_action] = 1;
+            feature_action = last_action;
+            feature_length = 0;  // the one-hot of ACT_NUM is the length
+        }
+        if (feature_length != body.length) {
+            feature[embedding_size + ACT_NUM] = (float)body.length;
+            feature_length = body.length;
         }
-        memcpy(buf, &embedding[0], sizeof(float) * size);
     }
 
-    std::deque<Position> &get_body() { return body; }
-    size_t get_length() const { return body.size(); }
+    // segment i of the body, 0 for the head
+    const Position &get_body(int i) const { return bodies->at(body, i); }
+    size_t get_length() const { return (size_t)body.length; }
 
     void set_dead() { dead = true; }
     bool is_dead() { return dead; }
 
 private:
-    std::deque<Position> body;
+    BodyStore *bodies;
+    BodyRing body;
     Direction dir;
 
     Reward next_reward;
@@ -154,7 +200,9 @@ private:
     bool in_event_calc;
 
     int id;
-    std::vector<float> embedding;
+    std::vector<float> feature;
+    Action feature_action;  // the last action and the length written in feature
+    int feature_length;
     GroupHandle group;
 };
 
@@ -13,11 +13,13 @@
 namespace magent {
 namespace discrete_snake {
 
-Map::Map() : slots(nullptr) {
+Map::Map() : slots(nullptr), plane_words(0), planes(nullptr), id_plane(nullptr), free_valid(false) {
 }
 
 Map::~Map() {
     delete [] slots;
+    delete [] planes;
+    delete [] id_plane;
 }
 
 void Map::reset(int width, int height) {
@@ -31,6 +33,13 @@ void Map::reset(int width, int height) {
 
     map_width = width;
     map_height = height;
+    free_valid = false;
+
+    delete [] planes;
+    delete [] id_plane;
+    plane_words = (width + 63) / 64 + 1;
+    planes = new unsigned long long[(size_t)OCC_PLANE_NUM * height * plane_words]();
+    id_plane = new int[(size_t)width * height]();
 
     // init border
     for (int i = 0; i < map_width; i++) {
@@ -47,7 +56,8 @@ int Map::add_wall(Position pos) {
     PositionInteger pos_int = pos2int(pos);
     if (slots[pos_int].occ_type != OCC_NONE)
         return 1;
-    slots[pos_int].occ_type = OCC_WALL;
+    set_occ(pos_int, OCC_WALL);
+    update_free(pos_int);
     return 0;
 }
 
@@ -63,109 +73,138 @@ int Map::get_food_num() {
 }
 
 bool Map::get_random_blank(std::vector<Position> &pos, int n) {
-    int tries = 0;
-
     pos.resize(n);
-    while(tries < map_width * map_height) {
-        int last_dir = 100;
-        PositionInteger pos_int;
-
+    for (int tries = 0; tries < REJECT_TRIES; tries++) {
         int x = (int)random() % map_width;
         int y = (int)random() % map_height;
+        if (grow_body(pos, n, x, y))
+            return true;
+    }
 
-        int i;
-        for (i = 0; i < n; i++) {
-            pos_int = pos2int(x, y);
-            if (slots[pos_int].occ_type != OCC_NONE)
-                break;
+    // crowded map, the head is a free cell
+    prepare_free_cells();
+    for (int tries = 0; tries < map_width * map_height && !free_cells.empty(); tries++) {
+        Position head = int2pos(free_cells[(size_t)random() % free_cells.size()]);
+        if (grow_body(pos, n, head.x, head.y))
+            return true;
+    }
+    return false;
+}
 
-            pos[i] = Position{x, y};
-
-            int start = (int)random() % 100;
-            for (int j = 0; j < 4; j++) { // 4 direction
-                int new_x = x, new_y = y;
-                int dir = (start + j) % 4;
-                if (abs(dir - last_dir) == 2)
-                    continue;
-                switch (dir) {
-                    case 0: new_x -= 1; break;
-                    case 1: new_y -= 1; break;
-                    case 2: new_x += 1; break;
-                    case 3: new_y += 1; break;
-                    default:
-                        LOG(FATAL) << "invalid dir in Map::get_random_blank";
-                }
-                if (slots[pos_int].occ_type == OCC_NONE) {
-                    x = new_x; y = new_y;
-                    last_dir = dir;
-                    break;
-                }
+// a random walk of n blank cells from (x, y)
+bool Map::grow_body(std::vector<Position> &pos, int n, int x, int y) {
+    int last_dir = 100;
+    PositionInteger pos_int;
+
+    for (int i = 0; i < n; i++) {
+        pos_int = pos2int(x, y);
+        if (slots[pos_int].occ_type != OCC_NONE)
+            return false;
+
+        pos[i] = Position{x, y};
+
+        int start = (int)random() % 100;
+        for (int j = 0; j < 4; j++) { // 4 direction
+            int new_x = x, new_y = y;
+            int dir = (start + j) % 4;
+            if (abs(dir - last_dir) == 2)
+                continue;
+            switch (dir) {
+                case 0: new_x -= 1; break;
+                case 1: new_y -= 1; break;
+                case 2: new_x += 1; break;
+                case 3: new_y += 1; break;
+                default:
+                    LOG(FATAL) << "invalid dir in Map::get_random_blank";
+            }
+            if (slots[pos_int].occ_type == OCC_NONE) {
+                x = new_x; y = new_y;
+                last_dir = dir;
+                break;
             }
         }
-        if (i == n) {
-            return true;
+    }
+    return true;
+}
+
+void Map::prepare_free_cells() {
+    if (free_valid)
+        return;
+    free_cells.clear();
+    free_at.assign((size_t)map_width * map_height, -1);
+    for (int i = 0; i < map_width * map_height; i++) {
+        if (slots[i].occ_type == OCC_NONE) {
+            free_at[i] = (int)free_cells.size();
+            free_cells.push_back(i);
         }
-        tries++;
     }
-    return false;
+    free_valid = true;
 }
 
 void Map::add_agent(Agent *agent) {
-    for (auto pos : agent->get_body()) {
-        PositionInteger pos_int = pos2int(pos);
-        slots[pos_int].occ_type = OCC_AGENT;
+    for (int i = 0; i < agent->get_length(); i++) {
+        PositionInteger pos_int = pos2int(agent->get_body(i));
+        set_occ(pos_int, OCC_AGENT, agent->get_id());
         slots[pos_int].occupier = agent;
         slots[pos_int].occ_ct = 1;
+        update_free(pos_int);
     }
 }
 
+// read n (1 <= n <= 64) bits starting from bit `offset` of a row of words
+static inline unsigned long long get_bits(const unsigned long long *row, int offset, int n) {
+    int word = offset >> 6, shift = offset & 63;
+    unsigned long long bits = row[word] >> shift;
+    if (shift != 0)
+        bits |= row[word + 1] << (64 - shift);
+    return n == 64 ? bits : bits & ((1ULL << n) - 1);
+}
+
+// scan the view window row by row in the bitplanes, 64 cells at a time, only occupied cells are written
 void Map::extract_view(const Agent* agent, float *linear_buffer, int height, int width, int channel,
-                       int id_counter) {
+                       int id_counter) const {
     Position pos = agent->get_head();
+    const int self_id = agent->get_id() + 1;
 
     float (*buffer)[width][channel] = (decltype(buffer)) linear_buffer;
 
-    int x_start = pos.x - width / 2;
-    int y_start = pos.y - height / 2;
-    int x_end = x_start + width - 1;
-    int y_end = y_start + height - 1;
-
-    x_start = std::max(0, std::min(map_width-1, x_start));
-    x_end   = std::max(0, std::min(map_width-1, x_end));
-    y_start = std::max(0, std::min(map_height-1, y_start));
-    y_end   = std::max(0, std::min(map_height-1, y_end));
-
-    int view_x_start = 0 + x_start - (pos.x - width/2);
-    int view_y_start = 0 + y_start - (pos.y - height/2);
-
-    int view_x = view_x_start;
-    for (int x = x_start; x <= x_end; x++) {
-        int view_y = view_y_start;
-        for (int y =  y_start; y <= y_end; y++) {
-            PositionInteger pos_int = pos2int(x, y);
-            Agent *occupier;
-            switch (slots[pos_int].occ_type) {
-                case OCC_NONE:
-                    break;
-                case OCC_WALL:
-                    buffer[view_y][view_x][CHANNEL_WALL] = 1;
-                    break;
-                case OCC_FOOD:
-                    buffer[view_y][view_x][CHANNEL_FOOD] = 1;
-                    break;
-                case OCC_AGENT:
-                    occupier = (Agent*)slots[pos_int].occupier;
-                    if (occupier == agent) {
-                        buffer[view_y][view_x][CHANNEL_SELF] = 1;
-                    } else {
-                        buffer[view_y][view_x][CHANNEL_OTHER] = 1;
+    int view_x0 = pos.x - width / 2;
+    int view_y0 = pos.y - height / 2;
+
+    int x_start = std::max(0, view_x0);
+    int x_end   = std::min(map_width - 1, view_x0 + width - 1);
+    int y_start = std::max(0, view_y0);
+    int y_end   = std::min(map_height - 1, view_y0 + height - 1);
+
+    for (int y = y_start; y <= y_end; y++) {
+        float (*view_row)[channel] = buffer[y - view_y0];
+        const int *id_row = id_plane + (size_t)y * map_width;
+        for (int p = 0; p < OCC_PLANE_NUM; p++) {
+            const OccType type = (OccType)(p + 1);
+            const unsigned long long *plane_row = planes + ((size_t)p * map_height + y) * plane_words;
+            for (int x = x_start; x <= x_end; x += 64) {
+                int n = std::min(64, x_end - x + 1);
+                unsigned long long hit = get_bits(plane_row, x, n);
+                while (hit) {
+                    int cell_x = x + __builtin_ctzll(hit);
+                    hit &= hit - 1;
+
+                    float *cell = view_row[cell_x - view_x0];
+                    switch (type) {
+                        case OCC_WALL:
+                            cell[CHANNEL_WALL] = 1;
+                            break;
+                        case OCC_FOOD:
+                            cell[CHANNEL_FOOD] = 1;
+                            break;
+                        default:
+                            cell[id_row[cell_x] == self_id ? CHANNEL_SELF : CHANNEL_OTHER] = 1;
+                            cell[CHANNEL_ID] = (float) id_row[cell_x] / id_counter;
+                            break;
                     }
-                    buffer[view_y][view_x][CHANNEL_ID] = (float) (occupier->get_id() + 1) / id_counter;
-                    break;
+                }
             }
-            view_y++;
         }
-        view_x++;
     }
 }
 
@@ -176,7 +215,8 @@ void Map::move_tail(Agent *agent) {
     int remain = --slots[tail_int].occ_ct;
 
     if (remain == 0) {
-        slots[tail_int].occ_type = OCC_NONE;
+        set_occ(tail_int, OCC_NONE);
+        update_free(tail_int);
     }
 }
 
@@ -186,9 +226,10 @@ void Map::move_head(Agent *agent, PositionInteger head_int, Reward &reward, bool
 
     switch (slots[head_int].occ_type) {
         case OCC_NONE:
-            slots[head_int].occ_type = OCC_AGENT;
+            set_occ(head_int, OCC_AGENT, agent->get_id());
             slots[head_int].occupier = agent;
             slots[head_int].occ_ct = 1;
+            update_free(head_int);
             reward = 0;
             dead = false;
             break;
@@ -211,33 +252,26 @@ void Map::move_head(Agent *agent, PositionInteger head_int, Reward &reward, bool
 
             reward = food->get_value();
 
-            slots[head_int].occ_type = OCC_AGENT;
+            set_occ(head_int, OCC_AGENT, agent->get_id());
             slots[head_int].occupier = agent;
             slots[head_int].occ_ct = 1;
             break;
     }
 }
 
-void Map::make_food(Agent *agent, Reward value, std::vector<Food*> &foods, int add) {
-    bool skip_head = true;
+// clear the body of a dead agent, and return at most `add` positions of the body to be filled by food
+void Map::make_food(Agent *agent, std::vector<Position> &food_pos, int add) {
     int ct = 0;
-    for (Position pos : agent->get_body()) {
-        if (skip_head) {
-            skip_head = false;
-        } else {
-            PositionInteger pos_int = pos2int(pos);
-
-            if (slots[pos_int].occ_type == OCC_AGENT) {
-                if (ct < add) {
-                    Food *food = new Food(1, 1, value);
-                    slots[pos_int].occ_type = OCC_FOOD;
-                    slots[pos_int].occupier = food;
-                    food->set_xy(pos.x, pos.y);
-                    foods.push_back(food);
-                    ct++;
-                } else {
-                    slots[pos_int].occ_type = OCC_NONE;
-                }
+    for (int i = 1; i < agent->get_length(); i++) {  // skip head
+        Position pos = agent->get_body(i);
+        PositionInteger pos_int = pos2int(pos);
+
+        if (slots[pos_int].occ_type == OCC_AGENT) {
+            set_occ(pos_int, OCC_NONE);
+            update_free(pos_int);
+            if (ct < add) {
+                food_pos.push_back(pos);
+                ct++;
             }
         }
     }
@@ -261,8 +295,9 @@ bool Map::add_food(Food *food, int x, int y) {
     for (int i = 0; i < width; i++)
         for (int j = 0; j < height; j++) {
             pos_int = pos2int(x + i, y + j);
-            slots[pos_int].occ_type = OCC_FOOD;
+            set_occ(pos_int, OCC_FOOD);
             slots[pos_int].occupier = food;
+            update_free(pos_int);
         }
     return true;
 }
@@ -276,8 +311,9 @@ void Map::remove_food(Food *food) {
         for (int j = 0; j < height; j++) {
             PositionInteger pos_int = pos2int(x + i, y + j);
             if (slots[pos_int].occ_type == OCC_FOOD) {
-                slots[pos_int].occ_type = OCC_NONE;
+                set_occ(pos_int, OCC_NONE);
                 slots[pos_int].occupier = nullptr;
+                update_free(pos_int);
             }
         }
 }
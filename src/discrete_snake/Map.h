@@ -34,16 +34,21 @@ public:
 
     void get_wall(std::vector<Position> &walls) const;
 
+    // a random blank body of n cells. the head is drawn by rejection sampling first, so placements on a sparse map
+    // do not change, then from the free cell index
     bool get_random_blank(std::vector<Position> &pos, int n);
+    // the parallel phases of a step do not maintain the free cell index, drop it before them
+    void drop_free_cells() { free_valid = false; }
+    // the view should be zeroed before
     void extract_view(const Agent* agent, float *linear_buffer, int height, int width, int channel,
-                      int id_counter);
+                      int id_counter) const;
 
     void move_tail(Agent *agent);
     void move_head(Agent *agent, PositionInteger head_int, Reward &reward, bool &dead, Food *&eaten);
 
     bool add_food(Food *food, int x, int y);
     void remove_food(Food *food);
-    void make_food(Agent *agent, Reward value, std::vector<Food *> &foods, int add);
+    void make_food(Agent *agent, std::vector<Position> &food_pos, int add);
     int get_food_num();
 
     /**
@@ -71,6 +76,62 @@ private:
     Slot *slots;
 
     int map_width, map_height;
+
+    // layered copy of the occupation of slots for extract_view : one bitplane for each of OCC_WALL, OCC_FOOD
+    // and OCC_AGENT, row-major, plane_words 64-bit words per row (one more for unaligned reads).
+    // bits are updated atomically, the parallel moves of a step change cells sharing a word.
+    // id_plane holds the id + 1 of the occupier of every agent cell, row-major
+    static const int OCC_PLANE_NUM = 3;
+    int plane_words;
+    unsigned long long *planes;
+    int *id_plane;
+
+    // every change of occ_type goes here to keep the bitplanes, id is the id of the agent for OCC_AGENT
+    void set_occ(PositionInteger pos_int, OccType type, int id = -1) {
+        OccType old = slots[pos_int].occ_type;
+        slots[pos_int].occ_type = type;
+
+        Position p = int2pos(pos_int);
+        if (type == OCC_AGENT)
+            id_plane[(size_t)p.y * map_width + p.x] = id + 1;
+        if (old == type)
+            return;
+        size_t word = (size_t)p.y * plane_words + (p.x >> 6);
+        unsigned long long bit = 1ULL << (p.x & 63);
+        if (old != OCC_NONE)
+            __atomic_fetch_and(&planes[(size_t)(old - 1) * map_height * plane_words + word], ~bit, __ATOMIC_RELAXED);
+        if (type != OCC_NONE)
+            __atomic_fetch_or(&planes[(size_t)(type - 1) * map_height * plane_words + word], bit, __ATOMIC_RELAXED);
+    }
+
+    // free cell index : the OCC_NONE cells in any order, and the index of every cell in it, -1 if not blank.
+    // it is built by the first placement that needs it, then kept up to date by the serial changes (swap-remove)
+    // until it is dropped
+    static const int REJECT_TRIES = 16;
+    std::vector<PositionInteger> free_cells;
+    std::vector<int> free_at;
+    bool free_valid;
+
+    void update_free(PositionInteger pos_int) {
+        if (!free_valid)
+            return;
+        int index = free_at[pos_int];
+        if (slots[pos_int].occ_type == OCC_NONE) {
+            if (index < 0) {
+                free_at[pos_int] = (int)free_cells.size();
+                free_cells.push_back(pos_int);
+            }
+        } else if (index >= 0) {
+            PositionInteger last = free_cells.back();
+            free_cells[index] = last;
+            free_at[last] = index;
+            free_cells.pop_back();
+            free_at[pos_int] = -1;
+        }
+    }
+
+    void prepare_free_cells();
+    bool grow_body(std::vector<Position> &pos, int n, int x, int y);
 };
 
 } // namespace discrete_snake
@@ -155,7 +155,7 @@ void RenderGenerator::render_a_frame(const std::vector<Agent *> &agents, const s
     for (int i = 0; i < agents.size(); i++) {
         if (agents[i]->is_dead())
             continue;
-        num_snake += agents[i]->get_body().size();
+        num_snake += agents[i]->get_length();
     }
     
     int num_food = foods.size();
@@ -187,11 +187,10 @@ void RenderGenerator::render_a_frame(const std::vector<Agent *> &agents, const s
     for (auto agent : agents) {
         if (agent->is_dead())
             continue;
-        auto &body = agent->get_body();
-        int tmp = body.size();
-        for (auto pos_iter = body.rbegin(); pos_iter != body.rend(); pos_iter++ ) {
-            int color = --tmp == 0 ? 0 : 2;
-            fout << id_ct++ << " " <<  hp << " " << dir << " " << pos_iter->x << " " << pos_iter->y
+        for (int i = (int)agent->get_length() - 1; i >= 0; i--) {  // from tail to head
+            const Position &pos = agent->get_body(i);
+            int color = i == 0 ? 0 : 2;
+            fout << id_ct++ << " " <<  hp << " " << dir << " " << pos.x << " " << pos.y
                  << " " << color << std::endl;
         }
     }
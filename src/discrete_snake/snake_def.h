@@ -15,6 +15,7 @@ namespace discrete_snake {
 
 using ::magent::environment::Environment;
 using ::magent::environment::GroupHandle;
+using ::magent::environment::RegisteredBuffers;
 using ::magent::utility::strequ;
 
 struct Position {
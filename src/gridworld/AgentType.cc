@@ -3,6 +3,8 @@
  * \brief implementation of AgentType (mainly initialization)
  */
 
+#include <algorithm>
+#include <cstdlib>
 #include "AgentType.h"
 
 namespace magent {
@@ -120,6 +122,82 @@ AgentType::AgentType(int n, std::string name, const char **keys, float *values,
         action_space.push_back(i);
     }
     // action space layout : move turn attack ...
+
+    init_dir_tables();
+}
+
+void AgentType::init_dir_tables() {
+    int view_left_top_x, view_left_top_y, view_right_bottom_x, view_right_bottom_y;
+    view_range->get_range_rela_offset(view_left_top_x, view_left_top_y, view_right_bottom_x, view_right_bottom_y);
+
+    for (int d = 0; d < DIR_NUM; d++) {
+        Direction dir = (Direction)d;
+        DirTable &table = dir_tables[d];
+
+        // the real position is the cell at the front left of the agent, see save_to_real in Map.cc
+        int real_dx = 0, real_dy = 0;
+        switch (dir) {
+            case SOUTH: real_dx = width - 1;  real_dy = length - 1; break;
+            case WEST:  real_dx = 0;          real_dy = width - 1;  break;
+            case EAST:  real_dx = length - 1; real_dy = 0;          break;
+            default: break;
+        }
+
+        int dx, dy;
+        rela_to_map(dir, view_x_offset, view_y_offset, dx, dy);
+        table.eye_dx = real_dx + dx;
+        table.eye_dy = real_dy + dy;
+
+        int x1, y1, x2, y2;
+        rela_to_map(dir, view_left_top_x, view_left_top_y, x1, y1);
+        rela_to_map(dir, view_right_bottom_x, view_right_bottom_y, x2, y2);
+        table.view_x0 = table.eye_dx + std::min(x1, x2);
+        table.view_x1 = table.eye_dx + std::max(x1, x2);
+        table.view_y0 = table.eye_dy + std::min(y1, y2);
+        table.view_y1 = table.eye_dy + std::max(y1, y2);
+
+        int n_attack = attack_range->get_count();
+        table.attack_dx.resize(n_attack);
+        table.attack_dy.resize(n_attack);
+        for (int i = 0; i < n_attack; i++) {
+            int rela_x, rela_y;
+            attack_range->num2delta(i, rela_x, rela_y);
+            rela_to_map(dir, att_x_offset + rela_x, att_y_offset + rela_y, dx, dy);
+            table.attack_dx[i] = real_dx + dx;
+            table.attack_dy[i] = real_dy + dy;
+        }
+
+        int n_move = move_range->get_count();
+        table.move_dx.resize(n_move);
+        table.move_dy.resize(n_move);
+        for (int i = 0; i < n_move; i++) {
+            int rela_x, rela_y;
+            move_range->num2delta(i, rela_x, rela_y);
+            rela_to_map(dir, rela_x, rela_y, table.move_dx[i], table.move_dy[i]);
+        }
+    }
+}
+
+size_t AgentType::get_memory() const {
+    size_t bytes = 0;
+    const Range *ranges[] = {view_range, attack_range, move_range};
+    for (const Range *range : ranges) {
+        if (range != nullptr)
+            bytes += sizeof(Range) + range->get_memory();
+    }
+    for (int i = 0; i < DIR_NUM; i++) {
+        const DirTable &table = dir_tables[i];
+        bytes += utility::vector_bytes(table.attack_dx) + utility::vector_bytes(table.attack_dy)
+                 + utility::vector_bytes(table.move_dx) + utility::vector_bytes(table.move_dy);
+    }
+    return bytes + utility::vector_bytes(action_space);
+}
+
+int get_action_reach(const AgentType &type) {
+    int move = std::max(type.move_range->get_width(), type.move_range->get_height());
+    int body = std::max(type.width, type.length);
+    int turn = std::max(std::abs(type.turn_x_offset), std::abs(type.turn_y_offset));
+    return move + 2 * body + turn;
 }
 
 } // namespace magent
@@ -14,6 +14,15 @@
 namespace magent {
 namespace gridworld {
 
+// the view box and attacked cells of an agent facing a direction,
+// as offsets to its saved position (the top-left cell it occupies) in map
+struct DirTable {
+    int eye_dx, eye_dy;
+    int view_x0, view_y0, view_x1, view_y1;  // bounding box of the view, before clipped by the map
+    std::vector<int> attack_dx, attack_dy;   // attacked cell of every attack action
+    std::vector<int> move_dx, move_dy;       // displacement of every move action
+};
+
 class AgentType {
 public:
     AgentType(int n, std::string name, const char **keys, float *values, bool turn_mode);
@@ -46,8 +55,19 @@ public:
 
     int move_base, turn_base, attack_base;
     std::vector<int> action_space;
+
+    DirTable dir_tables[DIR_NUM];
+
+    // heap memory of the ranges and the direction tables
+    size_t get_memory() const;
+
+private:
+    void init_dir_tables();
 };
 
+// the farthest cell (in both axes) that a move or turn of this type can touch, relative to agent's position
+int get_action_reach(const AgentType &type);
+
 
 } // namespace magent
 } // namespace gridworld
@@ -0,0 +1,40 @@
+/**
+ * \file DeviceObserver.cc
+ * \brief DeviceObserver of a build without cuda, the cuda one is in DeviceObserver.cu
+ */
+
+#include "DeviceObserver.h"
+#include "../utility/utility.h"
+
+#ifndef MAGENT_USE_CUDA
+
+namespace magent {
+namespace gridworld {
+
+struct DeviceObserver::DeviceState {
+};
+
+DeviceObserver::DeviceObserver() : width(-1), height(-1), n_plane(0), plane_words(0) {
+    LOG(FATAL) << "device observations need cuda, configure with -DUSE_CUDA=ON";
+}
+
+DeviceObserver::~DeviceObserver() = default;
+
+size_t DeviceObserver::get_memory() const {
+    return 0;
+}
+
+void DeviceObserver::resize_map(int width, int height, int n_plane, int plane_words) {
+}
+
+void DeviceObserver::upload_rows(const std::vector<int> &rows, const unsigned long long *planes,
+                                 const float *hp_plane, const unsigned char *plane_used) {
+}
+
+void DeviceObserver::observe(const DeviceObserveJob &job) {
+}
+
+} // namespace gridworld
+} // namespace magent
+
+#endif
@@ -0,0 +1,319 @@
+/**
+ * \file DeviceObserver.cu
+ * \brief cuda kernels of DeviceObserver, built with USE_CUDA
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+
+#include <cuda_runtime.h>
+
+#include "DeviceObserver.h"
+#include "../utility/utility.h"
+
+namespace magent {
+namespace gridworld {
+
+#define CUDA_CHECK(call) do {                                                      \
+        cudaError_t err = (call);                                                  \
+        if (err != cudaSuccess)                                                    \
+            LOG(FATAL) << "cuda error in DeviceObserver : " << cudaGetErrorString(err); \
+    } while (0)
+
+// a buffer on the device or in pinned host memory, grown on demand, the content is not kept
+template <typename T, bool HOST>
+class CudaArray {
+public:
+    CudaArray() : data(nullptr), capacity(0) {}
+    ~CudaArray() { release(); }
+
+    T *reserve(size_t n) {
+        if (n > capacity) {
+            release();
+            capacity = std::max(n, capacity * 2);
+            if (HOST)
+                CUDA_CHECK(cudaHostAlloc((void **)&data, capacity * sizeof(T), cudaHostAllocDefault));
+            else
+                CUDA_CHECK(cudaMalloc((void **)&data, capacity * sizeof(T)));
+        }
+        return data;
+    }
+    T *get() const { return data; }
+    size_t bytes() const { return capacity * sizeof(T); }
+
+private:
+    void release() {
+        if (data != nullptr)
+            HOST ? cudaFreeHost(data) : cudaFree(data);
+        data = nullptr;
+        capacity = 0;
+    }
+
+    T *data;
+    size_t capacity;
+};
+
+struct DeviceObserver::DeviceState {
+    CudaArray<unsigned long long, false> planes;
+    CudaArray<float, false> hp_plane;
+    CudaArray<unsigned char, false> plane_used;
+
+    // changed rows : row indexes, then for every row its n_plane * plane_words words and width hp values
+    CudaArray<int, true> stage_rows;
+    CudaArray<unsigned long long, true> stage_words;
+    CudaArray<float, true> stage_hp;
+    CudaArray<int, false> rows;
+    CudaArray<unsigned long long, false> words;
+    CudaArray<float, false> hp;
+
+    CudaArray<DeviceAgent, true> stage_agents;
+    CudaArray<DeviceAgent, false> agents;
+    CudaArray<int, false> channel_trans, minimap_channels;
+    CudaArray<float, false> minimap;
+    std::map<const void *, unsigned long long *> masks;  // of every range key
+    size_t mask_bytes = 0;
+
+    size_t get_memory() const {
+        return planes.bytes() + hp_plane.bytes() + plane_used.bytes() + stage_rows.bytes() + stage_words.bytes()
+               + stage_hp.bytes() + rows.bytes() + words.bytes() + hp.bytes() + stage_agents.bytes()
+               + agents.bytes() + channel_trans.bytes() + minimap_channels.bytes() + minimap.bytes() + mask_bytes;
+    }
+
+    ~DeviceState() {
+        for (auto &item : masks)
+            cudaFree(item.second);
+    }
+};
+
+DeviceObserver::DeviceObserver() : width(-1), height(-1), n_plane(0), plane_words(0), state(new DeviceState) {
+    int n_device = 0;
+    CUDA_CHECK(cudaGetDeviceCount(&n_device));
+    if (n_device == 0)
+        LOG(FATAL) << "no cuda device for the device observations";
+}
+
+DeviceObserver::~DeviceObserver() = default;
+
+size_t DeviceObserver::get_memory() const {
+    return state->get_memory();
+}
+
+void DeviceObserver::resize_map(int width, int height, int n_plane, int plane_words) {
+    this->width = width;
+    this->height = height;
+    this->n_plane = n_plane;
+    this->plane_words = plane_words;
+    state->planes.reserve((size_t)n_plane * height * plane_words);
+    state->hp_plane.reserve((size_t)width * height);
+    state->plane_used.reserve((size_t)std::max(n_plane, 1));
+}
+
+// block r copies the staged row r to its place
+__global__ void scatter_rows_kernel(const int *rows, const unsigned long long *words, const float *hp,
+                                    unsigned long long *planes, float *hp_plane,
+                                    int width, int height, int n_plane, int plane_words) {
+    const int r = blockIdx.x, y = rows[r];
+    const int n_word = n_plane * plane_words;
+    const unsigned long long *row_words = words + (size_t)r * n_word;
+    for (int k = threadIdx.x; k < n_word; k += blockDim.x) {
+        int c = k / plane_words, word = k % plane_words;
+        planes[((size_t)c * height + y) * plane_words + word] = row_words[k];
+    }
+    const float *row_hp = hp + (size_t)r * width;
+    for (int x = threadIdx.x; x < width; x += blockDim.x)
+        hp_plane[(size_t)y * width + x] = row_hp[x];
+}
+
+void DeviceObserver::upload_rows(const std::vector<int> &rows, const unsigned long long *planes,
+                                 const float *hp_plane, const unsigned char *plane_used) {
+    DeviceState &s = *state;
+    CUDA_CHECK(cudaMemcpy(s.plane_used.get(), plane_used, (size_t)n_plane, cudaMemcpyHostToDevice));
+
+    const int n_row = (int)rows.size();
+    if (n_row == 0)
+        return;
+    const size_t n_word = (size_t)n_plane * plane_words;
+
+    int *stage_rows = s.stage_rows.reserve((size_t)n_row);
+    unsigned long long *stage_words = s.stage_words.reserve(n_word * n_row);
+    float *stage_hp = s.stage_hp.reserve((size_t)width * n_row);
+    for (int r = 0; r < n_row; r++) {
+        const int y = rows[r];
+        stage_rows[r] = y;
+        for (int c = 0; c < n_plane; c++)
+            memcpy(stage_words + r * n_word + (size_t)c * plane_words,
+                   planes + ((size_t)c * height + y) * plane_words, sizeof(unsigned long long) * plane_words);
+        memcpy(stage_hp + (size_t)r * width, hp_plane + (size_t)y * width, sizeof(float) * width);
+    }
+
+    CUDA_CHECK(cudaMemcpyAsync(s.rows.reserve((size_t)n_row), stage_rows, sizeof(int) * n_row,
+                               cudaMemcpyHostToDevice));
+    CUDA_CHECK(cudaMemcpyAsync(s.words.reserve(n_word * n_row), stage_words,
+                               sizeof(unsigned long long) * n_word * n_row, cudaMemcpyHostToDevice));
+    CUDA_CHECK(cudaMemcpyAsync(s.hp.reserve((size_t)width * n_row), stage_hp, sizeof(float) * width * n_row,
+                               cudaMemcpyHostToDevice));
+    scatter_rows_kernel<<<n_row, 128>>>(s.rows.get(), s.words.get(), s.hp.get(), s.planes.get(),
+                                        s.hp_plane.get(), width, height, n_plane, plane_words);
+    CUDA_CHECK(cudaGetLastError());
+}
+
+struct ViewParams {
+    DeviceViewDir dirs[DEVICE_DIR_NUM];
+    int width, height, n_plane, plane_words;
+    int view_height, view_width, n_channel;
+    int view_left_top_x, view_left_top_y;
+    int row_begin;
+};
+
+// block i extracts the view of agent i, a thread for every cell in the bounding box of the view and the mask.
+// same as Map::extract_view_kernel, the views should be zeroed before
+__global__ void view_kernel(ViewParams p, const DeviceAgent *agents, const unsigned long long *masks,
+                            const unsigned long long *planes, const float *hp_plane,
+                            const unsigned char *plane_used, const int *channel_trans, float *views) {
+    const int i = blockIdx.x;
+    const DeviceAgent agent = agents[i];
+    const DeviceViewDir &d = p.dirs[agent.dir];
+
+    const int agent_y = agent.y - p.row_begin;  // row in the device planes
+    const int eye_x = agent.x + d.eye_dx, eye_y = agent_y + d.eye_dy;
+    const int start_x = max(max(agent.x + d.view_x0, 0), eye_x + d.mask_x0);
+    const int end_x   = min(min(agent.x + d.view_x1, p.width - 1), eye_x + d.mask_x0 + d.mask_cols - 1);
+    const int start_y = max(max(agent_y + d.view_y0, 0), eye_y + d.mask_y0);
+    const int end_y   = min(min(agent_y + d.view_y1, p.height - 1), eye_y + d.mask_y0 + d.mask_rows - 1);
+    const int box_w = end_x - start_x + 1, box_h = end_y - start_y + 1;
+    if (box_w <= 0 || box_h <= 0)
+        return;
+
+    float *view = views + (size_t)i * p.view_height * p.view_width * p.n_channel;
+    for (int k = threadIdx.x; k < box_w * box_h; k += blockDim.x) {
+        const int x = start_x + k % box_w, y = start_y + k / box_w;
+        const int mask_x = x - eye_x - d.mask_x0;
+        const unsigned long long *mask_row = masks + d.mask_offset + (size_t)(y - eye_y - d.mask_y0) * d.mask_n_word;
+        if (((mask_row[mask_x >> 6] >> (mask_x & 63)) & 1) == 0)
+            continue;
+
+        const int dx = x - eye_x, dy = y - eye_y;
+        const int view_x = d.rot[0] * dx + d.rot[1] * dy - p.view_left_top_x;
+        const int view_y = d.rot[2] * dx + d.rot[3] * dy - p.view_left_top_y;
+        float *cell = view + ((size_t)view_y * p.view_width + view_x) * p.n_channel;
+        const float hp = hp_plane[(size_t)y * p.width + x];
+        const unsigned long long bit = 1ULL << (x & 63);
+        for (int c = 0; c < p.n_plane; c++) {
+            if (!plane_used[c] || (planes[((size_t)c * p.height + y) * p.plane_words + (x >> 6)] & bit) == 0)
+                continue;
+            cell[channel_trans[c]] = 1;
+            if (hp != 0)  // is agent
+                cell[channel_trans[c] + 1] = hp;
+        }
+    }
+}
+
+// block (i, g) copies the minimap of group g into the view of agent i, same as GridWorld::copy_minimap
+__global__ void minimap_kernel(const DeviceAgent *agents, const float *minimap, const int *minimap_channels,
+                               int n_group, int view_height, int view_width, int n_channel,
+                               int scale_h, int scale_w, float *views) {
+    const int i = blockIdx.x, g = blockIdx.y;
+    const DeviceAgent agent = agents[i];
+    const int self_x = agent.x / scale_w, self_y = agent.y / scale_h;
+    const int channel = minimap_channels[g];
+
+    float *view = views + (size_t)i * view_height * view_width * n_channel;
+    for (int k = threadIdx.x; k < view_height * view_width; k += blockDim.x) {
+        const int y = k / view_width, x = k % view_width;
+        float value = minimap[(size_t)k * n_group + g];
+        if (y == self_y && x == self_x)
+            value += 1;
+        view[(size_t)k * n_channel + channel] = value;
+    }
+}
+
+// a thread for every agent, same as GridWorld::fill_feature_kernel without the pooled features.
+// the features should be zeroed before
+__global__ void feature_kernel(const DeviceAgent *agents, int n, int feature_size, int embedding_size,
+                               int n_action, bool position, int width, int height, float *features) {
+    const int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= n)
+        return;
+    const DeviceAgent agent = agents[i];
+    float *feature = features + (size_t)i * feature_size;
+
+    int t = agent.id;
+    for (int b = 0; b < embedding_size; b++, t >>= 1)
+        feature[b] = (float)(t & 1);
+    feature[embedding_size + agent.action] = 1;
+    feature[embedding_size + n_action] = agent.last_reward;
+    if (position) {
+        feature[embedding_size + n_action + 1] = (float)agent.x / width;
+        feature[embedding_size + n_action + 2] = (float)agent.y / height;
+    }
+}
+
+void DeviceObserver::observe(const DeviceObserveJob &job) {
+    DeviceState &s = *state;
+    const int n = job.n;
+    const size_t view_size = (size_t)job.view_height * job.view_width * job.n_channel;
+    if (n == 0)
+        return;
+
+    auto iter = s.masks.find(job.range_key);
+    if (iter == s.masks.end()) {
+        unsigned long long *masks;
+        const size_t mask_bytes = sizeof(unsigned long long) * std::max(job.n_mask_word, (size_t)1);
+        CUDA_CHECK(cudaMalloc((void **)&masks, mask_bytes));
+        s.mask_bytes += mask_bytes;
+        CUDA_CHECK(cudaMemcpy(masks, job.masks, sizeof(unsigned long long) * job.n_mask_word,
+                              cudaMemcpyHostToDevice));
+        iter = s.masks.insert(std::make_pair(job.range_key, masks)).first;
+    }
+
+    DeviceAgent *stage_agents = s.stage_agents.reserve((size_t)n);
+    memcpy(stage_agents, job.agents, sizeof(DeviceAgent) * n);
+    CUDA_CHECK(cudaMemcpyAsync(s.agents.reserve((size_t)n), stage_agents, sizeof(DeviceAgent) * n,
+                               cudaMemcpyHostToDevice));
+    CUDA_CHECK(cudaMemcpy(s.channel_trans.reserve((size_t)std::max(n_plane, 1)), job.channel_trans,
+                          sizeof(int) * n_plane, cudaMemcpyHostToDevice));
+
+    CUDA_CHECK(cudaMemsetAsync(job.device_views, 0, sizeof(float) * view_size * n));
+    CUDA_CHECK(cudaMemsetAsync(job.device_features, 0, sizeof(float) * job.feature_size * n));
+
+    ViewParams params;
+    memcpy(params.dirs, job.dirs, sizeof(params.dirs));
+    params.width = width; params.height = height;
+    params.n_plane = n_plane; params.plane_words = plane_words;
+    params.view_height = job.view_height; params.view_width = job.view_width; params.n_channel = job.n_channel;
+    params.view_left_top_x = job.view_left_top_x; params.view_left_top_y = job.view_left_top_y;
+    params.row_begin = job.row_begin;
+    view_kernel<<<n, 128>>>(params, s.agents.get(), iter->second, s.planes.get(), s.hp_plane.get(),
+                            s.plane_used.get(), s.channel_trans.get(), job.device_views);
+    CUDA_CHECK(cudaGetLastError());
+
+    if (job.minimap != nullptr) {
+        const size_t minimap_size = (size_t)job.view_height * job.view_width * job.n_group;
+        CUDA_CHECK(cudaMemcpy(s.minimap.reserve(minimap_size), job.minimap, sizeof(float) * minimap_size,
+                              cudaMemcpyHostToDevice));
+        CUDA_CHECK(cudaMemcpy(s.minimap_channels.reserve((size_t)job.n_group), job.minimap_channels,
+                              sizeof(int) * job.n_group, cudaMemcpyHostToDevice));
+        minimap_kernel<<<dim3(n, job.n_group), 128>>>(s.agents.get(), s.minimap.get(), s.minimap_channels.get(),
+                                                     job.n_group, job.view_height, job.view_width, job.n_channel,
+                                                     job.scale_h, job.scale_w, job.device_views);
+        CUDA_CHECK(cudaGetLastError());
+    }
+
+    feature_kernel<<<(n + 127) / 128, 128>>>(s.agents.get(), n, job.feature_size, job.embedding_size,
+                                             job.n_action, job.minimap != nullptr, job.map_width,
+                                             job.map_height, job.device_features);
+    CUDA_CHECK(cudaGetLastError());
+
+    if (job.pooled != nullptr) {
+        const int pooled_size = job.feature_size - job.pooled_offset;
+        CUDA_CHECK(cudaMemcpy2DAsync(job.device_features + job.pooled_offset, sizeof(float) * job.feature_size,
+                                     job.pooled, sizeof(float) * pooled_size, sizeof(float) * pooled_size, n,
+                                     cudaMemcpyHostToDevice));
+    }
+
+    CUDA_CHECK(cudaStreamSynchronize(0));
+}
+
+} // namespace gridworld
+} // namespace magent
@@ -0,0 +1,109 @@
+/**
+ * \file DeviceObserver.h
+ * \brief observations extracted on a cuda device into device buffers (needs USE_CUDA in cmake)
+ */
+
+#ifndef MAGNET_GRIDWORLD_DEVICEOBSERVER_H
+#define MAGNET_GRIDWORLD_DEVICEOBSERVER_H
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+namespace magent {
+namespace gridworld {
+
+// an agent as read by the kernels
+struct DeviceAgent {
+    int x, y;  // position, the top-left cell
+    int dir;   // index in DeviceObserveJob::dirs
+    int id;
+    int action;
+    float last_reward;
+};
+
+// the view of a direction of an agent type, offsets are relative to the position of the agent.
+// a map offset (dx, dy) to the eye is (rot[0] * dx + rot[1] * dy, rot[2] * dx + rot[3] * dy) in view
+struct DeviceViewDir {
+    int eye_dx, eye_dy;
+    int view_x0, view_y0, view_x1, view_y1;  // bounding box of the view
+    int mask_x0, mask_y0, mask_rows, mask_cols, mask_n_word;  // the rotated range, as RangeMask
+    int mask_offset;                          // first word of the mask in the uploaded masks
+    int rot[4];
+};
+
+static const int DEVICE_DIR_NUM = 4;
+
+// the observation of a group, in the layout of get_observation. pointers are on the host except the outputs
+struct DeviceObserveJob {
+    const DeviceAgent *agents;
+    int n;
+
+    // view
+    const void *range_key;  // masks are uploaded once for every key (the agent type)
+    const unsigned long long *masks;  // words of the masks of all the directions
+    size_t n_mask_word;
+    DeviceViewDir dirs[DEVICE_DIR_NUM];
+    int view_height, view_width, n_channel;
+    int view_left_top_x, view_left_top_y;
+    const int *channel_trans;  // channel in view of every plane of the map
+
+    // minimap (view_height, view_width, n_group), nullptr if not minimap_mode
+    const float *minimap;
+    int n_group;
+    const int *minimap_channels;  // channel in view of every group
+    int scale_h, scale_w;
+
+    // feature : embedding, one-hot last action, last reward, position (if minimap), pooled (computed on host)
+    int feature_size, embedding_size, n_action;
+    int map_width, map_height;
+    int row_begin;        // first row of the map in the device planes, the rows around the strip in distributed mode
+    const float *pooled;  // (n, feature_size - pooled_offset), nullptr for none
+    int pooled_offset;
+
+    float *device_views;     // (n, view_height, view_width, n_channel)
+    float *device_features;  // (n, feature_size)
+};
+
+/**
+ * A device copy of the bitplanes and the hp plane of a Map, updated with the rows changed since the last
+ * sync. The views, minimap channels and features of a group are written by kernels into buffers on the device,
+ * so they do not cross the bus, only the changed rows and the agent records do.
+ * All calls are serial, and the outputs are ready when observe returns.
+ * Without USE_CUDA the library still builds, and creating an observer raises an error
+ */
+class DeviceObserver {
+public:
+    DeviceObserver();
+    ~DeviceObserver();
+
+    DeviceObserver(const DeviceObserver &) = delete;
+    DeviceObserver &operator=(const DeviceObserver &) = delete;
+
+    // the layout of the planes of the map, all the rows are uploaded at the next sync if it changes
+    bool same_layout(int width, int height, int n_plane, int plane_words) const {
+        return width == this->width && height == this->height
+               && n_plane == this->n_plane && plane_words == this->plane_words;
+    }
+    void resize_map(int width, int height, int n_plane, int plane_words);
+
+    // upload rows of the host planes (n_plane, height, plane_words), hp plane (height, width) and plane_used
+    void upload_rows(const std::vector<int> &rows, const unsigned long long *planes, const float *hp_plane,
+                     const unsigned char *plane_used);
+
+    void observe(const DeviceObserveJob &job);
+
+    // bytes of the device buffers and the pinned staging buffers of the host
+    size_t get_memory() const;
+
+private:
+    struct DeviceState;  // buffers of the device and the pinned staging buffers of the host
+
+    int width, height, n_plane, plane_words;
+    std::unique_ptr<DeviceState> state;
+};
+
+} // namespace gridworld
+} // namespace magent
+
+#endif //MAGNET_GRIDWORLD_DEVICEOBSERVER_H
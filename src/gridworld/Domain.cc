@@ -0,0 +1,445 @@
+/**
+ * \file Domain.cc
+ * \brief distributed mode of GridWorld : halo exchange, border chain and migration (see Domain.h)
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <unordered_map>
+
+#include "Domain.h"
+
+namespace magent {
+namespace gridworld {
+
+// rows of the map covered by an agent at its direction
+static int body_height(const Agent *agent) {
+    Direction dir = agent->get_dir();
+    const AgentType &type = agent->get_type();
+    return dir == NORTH || dir == SOUTH ? type.length : type.width;
+}
+
+void GridWorld::init_domain() {
+    Domain &d = *domain;
+    d.y_begin = (int)((long long)config.height * d.rank / d.size);
+    d.y_end   = (int)((long long)config.height * (d.rank + 1) / d.size);
+
+    // a ghost must be mirrored if it can be seen, pooled, attacked or touched by a move from the other side
+    int view = 0, attack = 0, reach = 0, body = 0;
+    for (int radius : config.pooled_radii)
+        view = std::max(view, radius);
+    for (Group &group : groups) {
+        const AgentType &type = group.get_type();
+        for (int dir = 0; dir < DIR_NUM; dir++) {
+            const DirTable &table = type.dir_tables[dir];
+            view = std::max(view, std::max(-table.view_y0, table.view_y1));
+            for (int dy : table.attack_dy)
+                attack = std::max(attack, std::abs(dy));
+        }
+        reach = std::max(reach, get_action_reach(type));
+        body = std::max(body, std::max(type.width, type.length));
+    }
+    d.zone = 2 * reach;
+    d.halo = std::max(std::max(view, attack), d.zone + reach) + body;
+    if (d.size > 1 && config.height / d.size < d.halo)
+        LOG(FATAL) << "the map is too small for " << d.size << " ranks, strips should have "
+                   << d.halo << " rows at least";
+    // a ghost covers body rows past the halo at most, and a blank area never touches the last stored row
+    d.row_begin = std::max(d.y_begin - d.halo - body, 0);
+    d.row_end   = std::min(d.y_end + d.halo + body, config.height);
+
+    for (int side = 0; side < 2; side++) {
+        d.ghosts[side].clear();
+        d.ghost_hps[side].assign(groups.size(), std::vector<float>());
+        for (Group &group : groups)
+            d.ghosts[side].push_back(Group(group.get_type()));
+    }
+    d.render_groups.clear();
+    d.dirty = true;
+}
+
+// the halos in both directions, after the agents of this rank are added or moved
+void GridWorld::sync_domain() {
+    for (int side = 0; side < 2; side++)
+        send_halo(side);
+    for (int side = 0; side < 2; side++)
+        recv_halo(side);
+    domain->dirty = false;
+}
+
+void GridWorld::release_ghosts(int side) {
+    for (int i = 0; i < groups.size(); i++) {
+        Group &ghosts = domain->ghosts[side][i];
+        for (Agent *agent : ghosts.get_agents())
+            map.remove_agent(agent);
+        ghosts.clear();
+        domain->ghost_hps[side][i].clear();
+    }
+}
+
+// the agents which the neighbour on side needs : those within its halo or already in its rows
+void GridWorld::send_halo(int side) {
+    Domain &d = *domain;
+    if (!d.has_neighbour(side))
+        return;
+
+    std::vector<DomainAgent> records;
+    for (GroupHandle i = 0; i < groups.size(); i++) {
+        for (const Agent *agent : groups[i].get_agents()) {
+            if (agent->is_dead() || agent->is_ghost())
+                continue;
+            Position pos = agent->get_pos();
+            if (side == 0 ? pos.y < d.y_begin + d.halo : pos.y + body_height(agent) > d.y_end - d.halo)
+                records.push_back(DomainAgent{agent->get_id(), i, pos, agent->get_dir(), agent->get_hp()});
+        }
+    }
+
+    std::vector<FoodCell> foods;
+    if (config.food_mode) {
+        if (side == 0)
+            map.get_foods(d.y_begin, d.y_begin + d.halo, foods);
+        else
+            map.get_foods(d.y_end - d.halo, d.y_end, foods);
+    }
+
+    std::vector<char> message;
+    utility::StateWriter writer(message);
+    writer.write_vector(records);
+    writer.write_vector(foods);
+    d.transport->send(d.neighbour(side), Domain::TAG_HALO, message);
+}
+
+// replace the ghosts and the foods of side by those sent by the neighbour
+void GridWorld::recv_halo(int side) {
+    Domain &d = *domain;
+    if (!d.has_neighbour(side))
+        return;
+
+    std::vector<char> message;
+    d.transport->recv(d.neighbour(side), Domain::TAG_HALO, message);
+    utility::StateReader reader(message.data(), message.size());
+    std::vector<DomainAgent> records;
+    std::vector<FoodCell> foods;
+    reader.read_vector(records);
+    reader.read_vector(foods);
+
+    if (side == 0)
+        map.clear_foods(d.y_begin - d.halo, d.y_begin);
+    else
+        map.clear_foods(d.y_end, d.y_end + d.halo);
+    release_ghosts(side);
+    for (const DomainAgent &record : records) {
+        if (record.group < 0 || record.group >= groups.size())
+            LOG(FATAL) << "invalid group of a ghost : " << record.group;
+        Group &ghosts = d.ghosts[side][record.group];
+        Agent *agent = ghosts.new_agent(record.id, record.group);
+        agent->set_ghost(true);
+        agent->set_pos(record.pos);
+        agent->set_dir(record.dir);
+        agent->set_hp(record.hp);
+        // a cell is only held by two agents if they were added on top of each other across a border
+        if (map.add_agent(agent, group2channel(record.group)) != 0)
+            ghosts.pop_agent();
+        else
+            d.ghost_hps[side][record.group].push_back(record.hp);
+    }
+    for (const FoodCell &food : foods)
+        map.add_food(food.pos, food.amount);
+}
+
+// send the damage dealt to ghosts and the food eaten in the rows of the neighbours in this attack phase
+// to their owners, apply those from the neighbours. called before the attack buffer is cleared
+void GridWorld::forward_ghost_damage() {
+    Domain &d = *domain;
+
+    // the last cell hit of every ghost, in the order the attacks were applied
+    std::unordered_map<const void *, Position> hit_cells;
+    std::vector<FoodCell> bites[2];
+    for (int i : attack_order) {
+        const AttackTarget &target = attack_targets[i];
+        const Agent *agent = attack_buffer[i].agent;
+        EventOp op = agent->get_last_op();
+        if ((op == OP_ATTACK || op == OP_KILL) && agent->get_op_obj() == target.obj) {
+            if (((const Agent *)target.obj)->is_ghost())
+                hit_cells[target.obj] = Position{target.x, target.y};
+        } else if (target.hp_supply > 0 && !d.owns(Position{target.x, target.y})) {
+            bites[target.y < d.y_begin ? 0 : 1].push_back(FoodCell{Position{target.x, target.y},
+                                                                    target.hp_supply});
+        }
+    }
+
+    for (int side = 0; side < 2; side++) {
+        if (!d.has_neighbour(side))
+            continue;
+        std::vector<DomainDamage> records;
+        for (GroupHandle i = 0; i < groups.size(); i++) {
+            std::vector<Agent*> &ghosts = d.ghosts[side][i].get_agents();
+            std::vector<float> &hps = d.ghost_hps[side][i];
+            for (int j = 0; j < ghosts.size(); j++) {
+                float damage = hps[j] - ghosts[j]->get_hp();
+                if (damage > 0) {
+                    auto iter = hit_cells.find(ghosts[j]);
+                    Position cell = iter == hit_cells.end() ? ghosts[j]->get_pos() : iter->second;
+                    records.push_back(DomainDamage{ghosts[j]->get_id(), i, damage, cell});
+                    hps[j] = ghosts[j]->get_hp();
+                }
+            }
+        }
+        std::vector<char> message;
+        utility::StateWriter writer(message);
+        writer.write_vector(records);
+        writer.write_vector(bites[side]);
+        d.transport->send(d.neighbour(side), Domain::TAG_DAMAGE, message);
+    }
+
+    std::vector<std::unordered_map<int, Agent*>> by_id(groups.size());
+    for (int side = 0; side < 2; side++) {
+        if (!d.has_neighbour(side))
+            continue;
+        std::vector<char> message;
+        d.transport->recv(d.neighbour(side), Domain::TAG_DAMAGE, message);
+        utility::StateReader reader(message.data(), message.size());
+        std::vector<DomainDamage> records;
+        std::vector<FoodCell> bites;
+        reader.read_vector(records);
+        reader.read_vector(bites);
+
+        for (const DomainDamage &record : records) {
+            if (record.group < 0 || record.group >= groups.size())
+                LOG(FATAL) << "invalid group of a damage : " << record.group;
+            std::unordered_map<int, Agent*> &index = by_id[record.group];
+            if (index.empty()) {
+                for (Agent *agent : groups[record.group].get_agents())
+                    index[agent->get_id()] = agent;
+            }
+            auto iter = index.find(record.id);
+            if (iter == index.end() || iter->second->is_dead())
+                continue;
+
+            Agent *agent = iter->second;
+            agent->be_attack(record.damage);
+            if (agent->is_dead()) {
+                map.remove_agent(agent);
+                groups[record.group].inc_dead_ct();
+                if (config.food_mode)
+                    map.add_food(record.cell, agent->get_type().food_supply);
+            } else {
+                map.update_hp(agent);
+            }
+        }
+        for (const FoodCell &bite : bites)
+            map.eat_food(bite.pos, bite.amount);
+    }
+}
+
+// take the turns and moves of the agents near a border out of the buffers, for run_border_chain
+void GridWorld::split_border_actions() {
+    Domain &d = *domain;
+    auto split_moves = [&d](std::vector<MoveAction> &buf) {
+        auto end = std::stable_partition(buf.begin(), buf.end(), [&d](const MoveAction &action) {
+            return !d.near_border(action.agent->get_pos());
+        });
+        d.border_moves.insert(d.border_moves.end(), end, buf.end());
+        buf.erase(end, buf.end());
+    };
+    auto split_turns = [&d](std::vector<TurnAction> &buf) {
+        auto end = std::stable_partition(buf.begin(), buf.end(), [&d](const TurnAction &action) {
+            return !d.near_border(action.agent->get_pos());
+        });
+        d.border_turns.insert(d.border_turns.end(), end, buf.end());
+        buf.erase(end, buf.end());
+    };
+
+    for (std::vector<MoveAction> &buf : move_buffers)
+        split_moves(buf);
+    split_moves(move_buffer_bound);
+    for (std::vector<TurnAction> &buf : turn_buffers)
+        split_turns(buf);
+    split_turns(turn_buffer_bound);
+}
+
+// the border actions of the ranks in order from the top. a rank acts after its upper neighbour has sent
+// the new positions there, while its lower neighbour waits, so it sees the final or the initial border
+// of both neighbours and the interior moves (at least zone rows away) never meet the border ones
+void GridWorld::run_border_chain() {
+    Domain &d = *domain;
+    recv_halo(0);
+    do_turns(d.border_turns);
+    begin_events(1);
+    (this->*move_kernel_fn)(d.border_moves, event_buffers[0]);
+    flush_events();
+    send_halo(1);
+    send_halo(0);
+    recv_halo(1);
+}
+
+// agents out of the rows of this rank are written for their new owner, removed from the map
+// and marked as ghosts, so compact_groups drops them
+void GridWorld::emigrate(std::vector<char> *messages) {
+    Domain &d = *domain;
+    std::vector<Agent*> leaving[2];
+    for (Group &group : groups) {
+        for (Agent *agent : group.get_agents()) {
+            if (agent->is_dead() || d.owns(agent->get_pos()))
+                continue;
+            leaving[agent->get_pos().y < d.y_begin ? 0 : 1].push_back(agent);
+        }
+    }
+
+    for (int side = 0; side < 2; side++) {
+        messages[side].clear();
+        utility::StateWriter writer(messages[side]);
+        writer.write<uint64_t>(leaving[side].size());
+        for (Agent *agent : leaving[side]) {
+            if (!d.has_neighbour(side))
+                LOG(FATAL) << "an agent left the map at (" << agent->get_pos().x << ", " << agent->get_pos().y << ")";
+            writer.write(DomainAgent{agent->get_id(), agent->get_group(), agent->get_pos(),
+                                     agent->get_dir(), agent->get_hp()});
+            writer.write(agent->get_reward());
+            writer.write(agent->get_action());
+            agent->save_state(writer);
+
+            map.remove_agent(agent);
+            agent->set_ghost(true);
+        }
+    }
+}
+
+// append the agents sent by the neighbours to their groups, then mirror the new halos
+void GridWorld::immigrate(std::vector<char> *messages) {
+    Domain &d = *domain;
+    for (int side = 0; side < 2; side++) {
+        if (d.has_neighbour(side))
+            d.transport->send(d.neighbour(side), Domain::TAG_MIGRATE, messages[side]);
+    }
+
+    // the cells of the new agents are held by their ghosts
+    release_ghosts(0);
+    release_ghosts(1);
+
+    for (int side = 0; side < 2; side++) {
+        if (!d.has_neighbour(side))
+            continue;
+        std::vector<char> message;
+        d.transport->recv(d.neighbour(side), Domain::TAG_MIGRATE, message);
+        utility::StateReader reader(message.data(), message.size());
+
+        uint64_t n = reader.read<uint64_t>();
+        for (uint64_t i = 0; i < n; i++) {
+            DomainAgent record = reader.read<DomainAgent>();
+            Reward reward = reader.read<Reward>();
+            Action action = reader.read<Action>();
+            if (record.group < 0 || record.group >= groups.size())
+                LOG(FATAL) << "invalid group of a migrated agent : " << record.group;
+
+            Group &g = groups[record.group];
+            Agent *agent = g.new_agent(record.id, record.group);
+            agent->load_state(reader);
+            agent->set_pos(record.pos);
+            agent->set_dir(record.dir);
+            agent->set_hp(record.hp);
+            agent->set_action(action);
+            g.get_store().rewards[agent->get_index()] = reward;
+            agent->init_reward();
+
+            if (map.add_agent(agent, group2channel(record.group)) != 0) {
+                LOG(WARNING) << "the cell of a migrated agent (" << record.pos.x << ", " << record.pos.y
+                             << ") is occupied, the agent is dropped";
+                g.pop_agent();
+            } else {
+                g.get_stats().add(agent->get_pos(), agent->get_action());
+            }
+        }
+    }
+
+    sync_domain();
+}
+
+// sum values over all the ranks, every rank gets the result
+void GridWorld::reduce_sum(std::vector<double> &values) {
+    Domain &d = *domain;
+    std::vector<char> message;
+    if (d.rank == 0) {
+        std::vector<double> part;
+        for (int r = 1; r < d.size; r++) {
+            d.transport->recv(r, Domain::TAG_REDUCE, message);
+            utility::StateReader reader(message.data(), message.size());
+            reader.read_vector(part);
+            if (part.size() != values.size())
+                LOG(FATAL) << "ranks disagree on the size of a reduction";
+            for (size_t i = 0; i < values.size(); i++)
+                values[i] += part[i];
+        }
+        message.clear();
+        utility::StateWriter writer(message);
+        writer.write_vector(values);
+        for (int r = 1; r < d.size; r++)
+            d.transport->send(r, Domain::TAG_REDUCE, message);
+    } else {
+        utility::StateWriter writer(message);
+        writer.write_vector(values);
+        d.transport->send(0, Domain::TAG_REDUCE, message);
+        d.transport->recv(0, Domain::TAG_REDUCE, message);
+        utility::StateReader reader(message.data(), message.size());
+        reader.read_vector(values);
+    }
+}
+
+// gather the agents and attack events of all ranks, rank 0 renders the whole map
+void GridWorld::render_distributed() {
+    Domain &d = *domain;
+    std::vector<DomainAgent> records;
+    for (GroupHandle i = 0; i < groups.size(); i++) {
+        for (const Agent *agent : groups[i].get_agents()) {
+            if (!agent->is_dead())
+                records.push_back(DomainAgent{agent->get_id(), i, agent->get_pos(), agent->get_dir(),
+                                              agent->get_hp()});
+        }
+    }
+    std::vector<RenderAttackEvent> events;
+    events.swap(d.attack_events);
+
+    std::vector<char> message;
+    if (d.rank != 0) {
+        utility::StateWriter writer(message);
+        writer.write_vector(records);
+        writer.write_vector(events);
+        d.transport->send(0, Domain::TAG_RENDER, message);
+        first_render = false;
+        return;
+    }
+
+    std::vector<DomainAgent> part;
+    std::vector<RenderAttackEvent> part_events;
+    for (int r = 1; r < d.size; r++) {
+        d.transport->recv(r, Domain::TAG_RENDER, message);
+        utility::StateReader reader(message.data(), message.size());
+        reader.read_vector(part);
+        reader.read_vector(part_events);
+        records.insert(records.end(), part.begin(), part.end());
+        events.insert(events.end(), part_events.begin(), part_events.end());
+    }
+
+    if (d.render_groups.empty()) {
+        for (Group &group : groups)
+            d.render_groups.push_back(Group(group.get_type()));
+    }
+    for (Group &group : d.render_groups)
+        group.clear();
+    for (const DomainAgent &record : records) {
+        Agent *agent = d.render_groups[record.group].new_agent(record.id, record.group);
+        agent->set_pos(record.pos);
+        agent->set_dir(record.dir);
+        agent->set_hp(record.hp);
+    }
+
+    if (first_render) {
+        first_render = false;
+        render_generator.gen_config(d.render_groups, config.width, config.height);
+    }
+    render_generator.set_attack_event(events);
+    render_generator.render_a_frame(d.render_groups, map);
+}
+
+} // namespace gridworld
+} // namespace magent
@@ -0,0 +1,88 @@
+/**
+ * \file Domain.h
+ * \brief domain decomposition of a GridWorld over the ranks of a transport
+ */
+
+#ifndef MAGNET_GRIDWORLD_DOMAIN_H
+#define MAGNET_GRIDWORLD_DOMAIN_H
+
+#include <memory>
+#include <vector>
+
+#include "../utility/Transport.h"
+#include "GridWorld.h"
+
+namespace magent {
+namespace gridworld {
+
+// an agent mirrored or migrated to another rank
+struct DomainAgent {
+    int id;
+    GroupHandle group;
+    Position pos;
+    Direction dir;
+    float hp;
+};
+
+// damage dealt to a ghost, applied by the owner of the agent. cell is the last cell of it hit,
+// where the corpse food is left if the damage kills the agent
+struct DomainDamage {
+    int id;
+    GroupHandle group;
+    float damage;
+    Position cell;
+};
+
+/**
+ * The map is split into strips of rows, one per rank. A rank owns the agents whose position
+ * (top-left cell) is in its rows [y_begin, y_end), the agents of the neighbour strips within halo rows
+ * are mirrored on its map as ghosts. Ghosts are seen by views and attacks and block moves, but do not act.
+ *
+ * Coordinates are global on every rank, and walls are added on every rank. The map of a rank only stores
+ * the rows [row_begin, row_end) around its strip, so its memory scales with the strip and the halo,
+ * except a bitmap of the walls of the whole map.
+ * Damage on ghosts is sent to their owners after the attack phase, with the food eaten in the rows of the owner.
+ * Foods within halo rows of a border are mirrored with the ghosts.
+ * Agents within zone rows of a border turn and move in a chain from the top rank to the bottom one,
+ * each rank after its upper neighbour has sent its new border, so no two moves on a border conflict.
+ * Agents that moved out of the strip migrate to their new owner in clear_dead
+ */
+struct Domain {
+    std::shared_ptr<utility::Transport> transport;
+    int rank, size;
+    int y_begin, y_end;  // rows owned by this rank
+    int halo;            // rows mirrored from each neighbour
+    int row_begin, row_end;  // rows stored in the map of this rank
+    int zone;            // agents closer to a border move in the border chain
+    bool dirty;          // ghosts are outdated, after reset and add_agents
+
+    // ghosts of the upper (0) and lower (1) neighbour, a group for every group of the game,
+    // and their hp when they were mirrored
+    std::vector<Group> ghosts[2];
+    std::vector<std::vector<float>> ghost_hps[2];
+
+    std::vector<TurnAction> border_turns;
+    std::vector<MoveAction> border_moves;
+
+    // gathered on rank 0 by render
+    std::vector<Group> render_groups;
+    std::vector<RenderAttackEvent> attack_events;
+
+    enum Tag { TAG_HALO = 1, TAG_DAMAGE, TAG_MIGRATE, TAG_REDUCE, TAG_RENDER };
+
+    explicit Domain(std::shared_ptr<utility::Transport> transport)
+            : transport(transport), rank(transport->get_rank()), size(transport->get_size()),
+              y_begin(0), y_end(0), halo(0), row_begin(0), row_end(0), zone(0), dirty(true) {}
+
+    bool owns(Position pos) const { return pos.y >= y_begin && pos.y < y_end; }
+    bool has_neighbour(int side) const { return side == 0 ? rank > 0 : rank < size - 1; }
+    int neighbour(int side) const { return side == 0 ? rank - 1 : rank + 1; }
+    bool near_border(Position pos) const {
+        return (rank > 0 && pos.y < y_begin + zone) || (rank < size - 1 && pos.y >= y_end - zone);
+    }
+};
+
+} // namespace gridworld
+} // namespace magent
+
+#endif //MAGNET_GRIDWORLD_DOMAIN_H
@@ -5,42 +5,41 @@
 
 #include <iostream>
 #include <cstring>
+#include <climits>
 #include <algorithm>
 #include <fstream>
+#include <sstream>
 #include <cassert>
+#include <future>
+#include <atomic>
+#include <mutex>
 
 #include "GridWorld.h"
+#include "Domain.h"
+#include "Replay.h"
 
 namespace magent {
 namespace gridworld {
 
-GridWorld::GridWorld() {
+GridWorld::GridWorld() : profiler(PROF_PHASE_NUM), rule_profiler(0) {
     first_render = true;
-
-    food_mode = false;
-    turn_mode = false;
-    minimap_mode = false;
-    goal_mode = false;
     large_map_mode = false;
-    mean_mode = false;
 
     reward_des_initialized = false;
-    embedding_size = 0;
+    event_frame = 0;
+    executor = utility::ThreadPool::shared(0);
+    tile_cols = tile_rows = cur_tile_size = 0;
     random_engine.seed(0);
+    random_seed = 0;
+    step_counter = call_counter = 0;
 
     counter_x = counter_y = nullptr;
+    select_kernels();
 }
 
 GridWorld::~GridWorld() {
     for (int i = 0; i < groups.size(); i++) {
-        std::vector<Agent*> &agents = groups[i].get_agents();
-
-        // free agents
-        size_t agent_size = agents.size();
-        #pragma omp parallel for
-        for (int j = 0; j < agent_size; j++) {
-            delete agents[j];
-        }
+        // agents are freed with the pool of their group
 
         // free ranges
         AgentType &type = groups[i].get_type();
@@ -62,52 +61,53 @@ GridWorld::~GridWorld() {
         delete [] counter_x;
     if (counter_y != nullptr)
         delete [] counter_y;
-
-    if (large_map_mode) {
-        delete [] move_buffers;
-        delete [] turn_buffers;
-    }
 }
 
 void GridWorld::reset() {
     id_counter = 0;
 
-    if (width * height > 99 * 99) {
-        large_map_mode = true;
-        if (width * height > 1000 * 1000) {
-            NUM_SEP_BUFFER = 16;
-        } else {
-            NUM_SEP_BUFFER = 8;
-        }
-        move_buffers = new std::vector<MoveAction>[NUM_SEP_BUFFER];
-        turn_buffers = new std::vector<TurnAction>[NUM_SEP_BUFFER];
-    } else
-        NUM_SEP_BUFFER = 1;
-
-    // reset map
-    map.reset(width, height, food_mode);
+    large_map_mode = config.width * config.height > 99 * 99;
+    for (int i = 0; i < 4; i++)
+        color_tiles[i].clear();
+    if (large_map_mode) {
+        cur_tile_size = config.tile_size > 0 ? config.tile_size : DEFAULT_TILE_SIZE;
+        tile_cols = (config.width + cur_tile_size - 1) / cur_tile_size;
+        tile_rows = (config.height + cur_tile_size - 1) / cur_tile_size;
+        for (int i = 0; i < tile_rows; i++)
+            for (int j = 0; j < tile_cols; j++)
+                color_tiles[(i % 2) * 2 + j % 2].push_back(i * tile_cols + j);
+    } else {
+        cur_tile_size = tile_cols = tile_rows = 0;
+    }
+    move_buffers.assign((size_t)tile_cols * tile_rows, std::vector<MoveAction>());
+    turn_buffers.assign((size_t)tile_cols * tile_rows, std::vector<TurnAction>());
+
+    // reset map, a rank of distributed mode stores its rows and the rows around them
+    if (domain != nullptr)
+        init_domain();
+    map.set_dirty_track(config.incremental_view_mode);
+    map.set_tiled(config.tiled_map_mode);
+    map.set_pooling(config.pooled_radii.empty() ? 0 : (int)groups.size());
+    if (domain != nullptr)
+        map.set_stored_rows(domain->row_begin, domain->row_end);
+    else
+        map.set_stored_rows(0, -1);
+    map.reset(config.width, config.height, config.food_mode, group2channel((GroupHandle)groups.size()));
 
     if (counter_x != nullptr)
         delete [] counter_x;
     if (counter_y != nullptr)
         delete [] counter_y;
-    counter_x = new int [width];
-    counter_y = new int [height];
+    counter_x = new int [config.width];
+    counter_y = new int [config.height];
 
     render_generator.next_file();
     stat_recorder.reset();
+    events.clear();
 
     for (int i = 0;i < groups.size(); i++) {
-        std::vector<Agent*> &agents = groups[i].get_agents();
-
-        // free agents
-        size_t agent_size = agents.size();
-        #pragma omp parallel for
-        for (int j = 0; j < agent_size; j++) {
-            delete agents[j];
-        }
-
-        groups[i].clear();
+        groups[i].clear();  // recycle agents
+        groups[i].get_registered().obs_fresh = false;
         groups[i].get_type().n_channel = group2channel((GroupHandle)groups.size());
     }
 
@@ -115,6 +115,9 @@ void GridWorld::reset() {
         init_reward_description();
         reward_des_initialized = true;
     }
+    select_kernels();
+    mark_replay_dirty();
+    check_memory_limit("reset");
 }
 
 void GridWorld::set_config(const char *key, void *p_value) {
@@ -124,28 +127,76 @@ void GridWorld::set_config(const char *key, void *p_value) {
     const char *strvalue = (const char *)p_value;
 
     if (strequ(key, "map_width"))
-        width = ivalue;
+        config.width = ivalue;
     else if (strequ(key, "map_height"))
-        height = ivalue;
+        config.height = ivalue;
 
     else if (strequ(key, "food_mode"))      // dead agent will leave food in the map
-        food_mode = bvalue;
+        config.food_mode = bvalue;
     else if (strequ(key, "turn_mode"))      // has two more actions -- turn left and turn right
-        turn_mode = bvalue;
+        config.turn_mode = bvalue;
     else if (strequ(key, "minimap_mode"))   // add minimap into observation
-        minimap_mode = bvalue;
+        config.minimap_mode = bvalue;
     else if (strequ(key, "goal_mode"))      // deprecated every agents has a specific goal
-        goal_mode = bvalue;
+        config.goal_mode = bvalue;
     else if (strequ(key, "embedding_size")) // embedding size in the observation.feature
-        embedding_size = ivalue;
+        config.embedding_size = ivalue;
+    else if (strequ(key, "incremental_view_mode")) // only re-extract views that overlap changed cells
+        config.incremental_view_mode = bvalue;
+    else if (strequ(key, "deterministic_mode"))    // counter-based random streams, independent of thread number
+        config.deterministic_mode = bvalue;
+    else if (strequ(key, "tiled_map_mode"))        // store the map in 16x16 tiles, for the locality of wide maps
+        config.tiled_map_mode = bvalue;
+    else if (strequ(key, "tile_size"))      // tile size for parallel moves in large map, 0 for auto
+        config.tile_size = ivalue;
+    else if (strequ(key, "frame_skip")) {   // a step repeats the actions for frame_skip frames (or until done),
+        if (ivalue < 1)                     // rewards add up over the frames
+            LOG(FATAL) << "invalid frame_skip in GridWorld::set_config : " << ivalue;
+        config.frame_skip = ivalue;
+    }
+    else if (strequ(key, "event_mask"))     // kinds of the event stream, bit (1 << kind) for StepEventKind kind
+        config.event_mask = ivalue;
+    else if (strequ(key, "memory_limit"))   // in MiB, reset, add_agents and render raise an error if the memory
+        config.memory_limit = ivalue;       // of the game (see get_info(-1, "memory")) is over it. 0 for none
+
+    else if (strequ(key, "num_threads"))    // threads of the parallel loops (caller included), 0 for OMP_NUM_THREADS.
+        executor = utility::ThreadPool::shared(ivalue);  // games with the same value share one pool
+    else if (strequ(key, "distributed"))    // transport ("local:<name>:<rank>:<size>" or "mpi") of the ranks
+        domain.reset(strvalue[0] == '\0'   // which split the map, "" for a single process. takes effect at reset
+                     ? nullptr : new Domain(utility::new_transport(strvalue)));
+
+    else if (strequ(key, "obs_dtype"))      // "float32", "float16" or "uint8", element type of views
+        config.obs_dtype = utility::parse_obs_dtype(strvalue);
+    else if (strequ(key, "pooled_radii")) { // comma separated radii, density and hp of every group around agents
+        config.pooled_radii.clear();        // are appended to the features, "" for none
+        for (const char *p = strvalue; *p != '\0'; ) {
+            char *end;
+            long radius = strtol(p, &end, 10);
+            if (end == p || radius < 0 || (*end != ',' && *end != '\0'))
+                LOG(FATAL) << "invalid pooled radii : " << strvalue;
+            config.pooled_radii.push_back((int)radius);
+            p = *end == ',' ? end + 1 : end;
+        }
+    }
 
     else if (strequ(key, "render_dir"))     // the directory of saved videos
         render_generator.set_render("save_dir", strvalue);
-    else if (strequ(key, "seed"))           // random seed
+    else if (strequ(key, "render_format"))  // "text", "binary" (delta encoded), "binary_lz4" or "live" (shared memory ring)
+        render_generator.set_render("format", strvalue);
+    else if (strequ(key, "replay_file"))    // record a replay log (snapshots and actions) to the file, "" to stop.
+        recorder.reset(strvalue[0] == '\0'  // it is lz4 compressed if lz4 is built in
+                       ? nullptr : new ReplayRecorder(strvalue, utility::render_compress_available()));
+    else if (strequ(key, "seed")) {         // random seed
         random_engine.seed((unsigned long)ivalue);
+        random_seed = (uint64_t)(unsigned int)ivalue;
+        step_counter = call_counter = 0;
+        mark_replay_dirty();
+    }
 
     else
         LOG(FATAL) << "invalid argument in GridWorld::set_config : " << key;
+
+    select_kernels();
 }
 
 void GridWorld::register_agent_type(const char *name, int n, const char **keys, float *values) {
@@ -154,7 +205,7 @@ void GridWorld::register_agent_type(const char *name, int n, const char **keys,
     if (agent_types.find(str) != agent_types.end())
         LOG(FATAL) << "duplicated name of agent type in GridWorld::register_agent_type : " << str;
 
-    agent_types.insert(std::make_pair(str, AgentType(n, str, keys, values, turn_mode)));
+    agent_types.insert(std::make_pair(str, AgentType(n, str, keys, values, config.turn_mode)));
 }
 
 void GridWorld::new_group(const char* agent_name, GroupHandle *group) {
@@ -171,20 +222,27 @@ void GridWorld::new_group(const char* agent_name, GroupHandle *group) {
 void add_or_error(int ret, int x, int y, int &id_counter, Group &g, Agent *agent) {
     if (ret != 0) {
         LOG(WARNING) << "invalid position in add_agents (" << x << ", " << y << "), already occupied, ignored.\n";
+        g.pop_agent();
     } else {
+        g.get_stats().add(agent->get_pos(), agent->get_action());
         id_counter++;
-        g.add_agent(agent);
     }
 };
 
 void GridWorld::add_agents(GroupHandle group, int n, const char *method,
                            const int *pos_x, const int *pos_y, const int *pos_dir) {
     int ret;
+    mark_replay_dirty();
 
-    if (group == -1) {  // group == -1 for wall
+    // in distributed mode a rank only adds the agents in its rows, walls are added on every rank
+    if (config.deterministic_mode && strequ(method, "random") && (group == -1 || domain == nullptr)) {
+        if (group < -1 || group >= (int)groups.size())
+            LOG(FATAL) << "invalid group handle in GridWorld::add_agents : " << group;
+        add_random_deterministic(group, n);
+    } else if (group == -1) {  // group == -1 for wall
         if (strequ(method, "random")) {
             for (int i = 0; i < n; i++) {
-                Position pos = map.get_random_blank(random_engine);
+                Position pos = map.get_random_wall_cell(random_engine);
                 ret = map.add_wall(pos);
                 if  (ret != 0) {
                     LOG(WARNING) << "invalid position in add_wall (" << pos_x[i] << ", " << pos_y[i] << "), "
@@ -225,16 +283,34 @@ void GridWorld::add_agents(GroupHandle group, int n, const char *method,
         AgentType &agent_type = g.get_type();
 
         if (strequ(method, "random")) {
+            if (domain != nullptr)  // the share of the rows of this rank
+                n = (int)((long long)n * domain->y_end / config.height - (long long)n * domain->y_begin / config.height);
             for (int i = 0; i < n; i++) {
-                Agent *agent = new Agent(agent_type, id_counter, group);
-                Direction dir = turn_mode ? (Direction)(random_engine() % DIR_NUM) : NORTH;
+                // once the map is crowded, the rest of the multi-cell agents are placed at once
+                if (!config.turn_mode && domain == nullptr && width * length > 1 && map.is_crowded()) {
+                    std::vector<Position> poses;
+                    if (map.get_random_blank_areas(random_engine, executor, width, length, n - i, poses) < n - i)
+                        LOG(FATAL) << "cannot find a blank position in a filled map";
+                    for (Position pos : poses) {
+                        Agent *agent = g.new_agent(next_agent_id(), group);
+                        agent->set_dir(NORTH);
+                        agent->set_pos(pos);
+                        ret = map.add_agent(agent, base_channel_id);
+                        add_or_error(ret, pos.x, pos.y, id_counter, g, agent);
+                    }
+                    break;
+                }
+
+                Agent *agent = g.new_agent(next_agent_id(), group);
+                Direction dir = config.turn_mode ? (Direction)(random_engine() % DIR_NUM) : NORTH;
+                int m_width = width, m_height = length;
+                if (dir == WEST || dir == EAST)
+                    std::swap(m_width, m_height);
                 Position pos;
 
-                if (dir == NORTH || dir == SOUTH) {
-                    pos = map.get_random_blank(random_engine, width, length);
-                } else {
-                    pos = map.get_random_blank(random_engine, length, width);
-                }
+                do {
+                    pos = map.get_random_blank(random_engine, m_width, m_height);
+                } while (domain != nullptr && (pos.y < domain->y_begin || pos.y + m_height > domain->y_end));
 
                 agent->set_dir(dir);
                 agent->set_pos(pos);
@@ -244,13 +320,15 @@ void GridWorld::add_agents(GroupHandle group, int n, const char *method,
             }
         } else if (strequ(method, "custom")) {
             for (int i = 0; i < n; i++) {
-                Agent *agent = new Agent(agent_type, id_counter, group);
+                if (domain != nullptr && !domain->owns(Position{pos_x[i], pos_y[i]}))
+                    continue;
+                Agent *agent = g.new_agent(next_agent_id(), group);
 
                 if (pos_dir[i] >= DIR_NUM) {
                     LOG(FATAL) << "invalid direction in GridWorld::add_agent";
                 }
 
-                agent->set_dir(turn_mode ? (Direction) pos_dir[i] : NORTH);
+                agent->set_dir(config.turn_mode ? (Direction) pos_dir[i] : NORTH);
                 agent->set_pos((Position) {pos_x[i], pos_y[i]});
 
                 ret = map.add_agent(agent, base_channel_id);
@@ -260,7 +338,7 @@ void GridWorld::add_agents(GroupHandle group, int n, const char *method,
             // parameter int xs[4] = {x, y, width, height}
             int x_start = pos_x[0],         y_start = pos_x[1];
             int x_end = x_start + pos_x[2], y_end = y_start + pos_x[3];
-            Direction dir = turn_mode ? (Direction)pos_x[4] : NORTH;
+            Direction dir = config.turn_mode ? (Direction)pos_x[4] : NORTH;
             int m_width, m_height;
 
             if (dir == NORTH || dir == SOUTH) {
@@ -275,7 +353,9 @@ void GridWorld::add_agents(GroupHandle group, int n, const char *method,
 
             for (int x = x_start; x < x_end; x += m_width)
                 for (int y = y_start; y < y_end; y += m_height) {
-                    Agent *agent = new Agent(agent_type, id_counter, group);
+                    if (domain != nullptr && !domain->owns(Position{x, y}))
+                        continue;
+                    Agent *agent = g.new_agent(next_agent_id(), group);
 
                     agent->set_pos(Position{x, y});
                     agent->set_dir(dir);
@@ -287,12 +367,88 @@ void GridWorld::add_agents(GroupHandle group, int n, const char *method,
             LOG(FATAL) << "unsupported method in GridWorld::add_agents : " << method;
         }
     }
+
+    // the map is changed, registered observations are outdated
+    for (int i = 0; i < groups.size(); i++)
+        groups[i].get_registered().obs_fresh = false;
+    if (domain != nullptr)
+        domain->dirty = true;
+    check_memory_limit("add_agents");
+}
+
+// ids are unique over the ranks in distributed mode
+int GridWorld::next_agent_id() const {
+    return domain == nullptr ? id_counter : id_counter * domain->size + domain->rank;
 }
 
 void GridWorld::get_observation(GroupHandle group, float **linear_buffers) {
+    extract_observation(group, linear_buffers, config.obs_dtype);
+}
+
+void GridWorld::get_observation_subset(GroupHandle group, const int *indices, int n, float **linear_buffers) {
+    if (group < 0 || group >= groups.size())
+        LOG(FATAL) << "invalid group handle in GridWorld::get_observation_subset : " << group;
+    if (linear_buffers == nullptr)
+        LOG(FATAL) << "the registered buffers are not used by GridWorld::get_observation_subset";
+    const int agent_size = groups[group].get_num();
+    for (int i = 0; i < n; i++) {
+        if (indices[i] < 0 || indices[i] >= agent_size)
+            LOG(FATAL) << "invalid agent index in GridWorld::get_observation_subset : " << indices[i];
+    }
+    if (config.incremental_view_mode) {  // two rows of the same agent would update its cached view at once
+        std::vector<char> seen((size_t)agent_size, 0);
+        for (int i = 0; i < n; i++) {
+            if (seen[indices[i]]++)
+                LOG(FATAL) << "duplicated agent index in GridWorld::get_observation_subset : " << indices[i];
+        }
+    }
+    extract_observation(group, linear_buffers, config.obs_dtype, indices, n);
+}
+
+// arguments of observe_kernel, prepared by extract_observation
+struct GridWorld::ObserveJob {
+    std::vector<Agent*> *agents;
+    const int *indices;  // rows of the agents in the view cache, nullptr if they are the rows of the group
+    float *views, *features;
+    size_t view_size;
+    int feature_size, n_action;
+    const int *channel_trans;
+    const std::vector<int> *channel_trans_vector;
+    const float *minimap;
+    int view_height, view_width, n_channel;
+    ViewCache *view_cache;
+    int epoch;
+    char *converted;
+    size_t converted_size;
+    utility::ObsDtype dtype;
+};
+
+// views are written in dtype, features are always float.
+// a subset of agents is extracted into the first n_index rows, the other agents are skipped
+void GridWorld::extract_observation(GroupHandle group, float **linear_buffers, utility::ObsDtype dtype,
+                                    const int *indices, int n_index) {
+    if (domain != nullptr && domain->dirty)  // every rank asks for the same observations
+        sync_domain();
+    auto prof_start = profiler.now();
     Group &g = groups[group];
     AgentType &type = g.get_type();
 
+    float *registered_buffers[2];
+    if (linear_buffers == nullptr) {  // use registered buffers
+        RegisteredBuffers &reg = g.get_registered();
+        if (!reg.has_obs())
+            LOG(FATAL) << "no registered observation buffer in GridWorld::get_observation for group " << group;
+        if (reg.obs_fresh)
+            return;
+        if (g.get_num() > reg.view_capacity || g.get_num() > reg.feature_capacity)
+            LOG(FATAL) << "registered observation buffer is too small in GridWorld::get_observation : "
+                       << g.get_num() << " agents";
+        registered_buffers[0] = reg.view;
+        registered_buffers[1] = reg.feature;
+        linear_buffers = registered_buffers;
+        reg.obs_fresh = true;
+    }
+
     const int n_channel   = g.get_type().n_channel;
     const int view_width  = g.get_type().view_range->get_width();
     const int view_height = g.get_type().view_range->get_height();
@@ -301,21 +457,32 @@ void GridWorld::get_observation(GroupHandle group, float **linear_buffers) {
     const int feature_size = get_feature_size(group);
 
     std::vector<Agent*> &agents = g.get_agents();
-    size_t agent_size = agents.size();
+    std::vector<Agent*> subset;
+    if (indices != nullptr) {
+        subset.resize((size_t)n_index);
+        for (int i = 0; i < n_index; i++)
+            subset[i] = agents[indices[i]];
+    }
+    size_t agent_size = indices == nullptr ? agents.size() : subset.size();
 
     // transform buffers
     NDPointer<float, 4> view_buffer(linear_buffers[0], {{-1, view_height, view_width, n_channel}});
     NDPointer<float, 2> feature_buffer(linear_buffers[1], {{-1, feature_size}});
 
-    memset(view_buffer.data, 0, sizeof(float) * agent_size * view_height * view_width * n_channel);
-    memset(feature_buffer.data, 0, sizeof(float) * agent_size * feature_size);
+    const size_t view_size = (size_t)view_height * view_width * n_channel;
+    ViewCache &view_cache = g.get_view_cache();
 
-    // gather view info from AgentType
-    const Range *range = type.view_range;
-    int view_x_offset = type.view_x_offset, view_y_offset = type.view_y_offset;
-    int view_left_top_x, view_left_top_y, view_right_bottom_x, view_right_bottom_y;
-    range->get_range_rela_offset(view_left_top_x, view_left_top_y,
-                                 view_right_bottom_x, view_right_bottom_y);
+    // other dtypes are extracted into a float scratch of every thread, then converted into the buffer
+    const bool convert = dtype != utility::OBS_FLOAT32;
+    char *converted_buffer = (char *)linear_buffers[0];
+    const size_t converted_size = view_size * utility::obs_dtype_size(dtype);
+
+    if (config.incremental_view_mode) { // every row is copied from the cache, no need to clear
+        view_cache.resize(agents.size(), view_size);
+    } else if (!convert) {
+        memset(view_buffer.data, 0, sizeof(float) * agent_size * view_size);
+    }
+    memset(feature_buffer.data, 0, sizeof(float) * agent_size * feature_size);
 
     // to make channel layout in observation symmetric to every group
     std::vector<int> channel_trans = make_channel_trans(group,
@@ -325,25 +492,318 @@ void GridWorld::get_observation(GroupHandle group, float **linear_buffers) {
 
     // build minimap
     NDPointer<float, 3> minimap(nullptr, {{view_height, view_width, n_group}});
-    int scale_h = (height + view_height - 1) / view_height;
-    int scale_w = (width + view_width - 1) / view_width;
+    if (config.minimap_mode) {
+        std::vector<float> &minimap_buffer = g.get_minimap_buffer();
+        minimap_buffer.resize((size_t)view_height * view_width * n_group);
+        minimap.data = minimap_buffer.data();
+        build_minimap(type, view_height, view_width, minimap.data);
+    }
 
-    if (minimap_mode) {
-        minimap.data = new float [view_height * view_width * n_group];
-        memset(minimap.data, 0, sizeof(float) * view_height * view_width * n_group);
+    map.prepare_pooling();
 
-        std::vector<int> group_sizes;
-        for (int i = 0; i < n_group; i++)
-            group_sizes.push_back(groups[i].get_size() > 0 ? (int)groups[i].get_size() : 1);
+    // fill local view for every agents. the changes after this epoch make the cached views dirty
+    int epoch = config.incremental_view_mode ? map.next_dirty_epoch() : 0;
+    ObserveJob job = {indices == nullptr ? &agents : &subset, indices, view_buffer.data, feature_buffer.data,
+                      view_size, feature_size, n_action,
+                      &channel_trans[0], &channel_trans, minimap.data, view_height, view_width, n_channel,
+                      &view_cache, epoch, converted_buffer, converted_size, dtype};
+    (this->*observe_kernels[convert ? 1 : 0])(job);
+
+    profiler.record(PROF_GET_OBSERVATION, prof_start, agent_size);
+}
+
+template <bool MINIMAP, bool INCREMENTAL, bool CONVERT, bool POOLED>
+void GridWorld::observe_kernel(ObserveJob &job) {
+    std::vector<Agent*> &agents = *job.agents;
+    ViewCache &view_cache = *job.view_cache;
+    const size_t view_size = job.view_size;
+
+    utility::parallel_range(executor, (int)agents.size(), GRAIN_VIEW, [&](int begin, int end) {
+        std::vector<float> scratch(CONVERT ? view_size : 0);
+        for (int i = begin; i < end; i++) {
+            Agent *agent = agents[i];
+            float *view = CONVERT ? scratch.data() : job.views + i * view_size;
+            // get spatial view
+            if (INCREMENTAL) {
+                const int row = job.indices == nullptr ? i : job.indices[i];
+                float *cached = view_cache.get_view(row);
+                if (!view_cache.is_valid(row, agent) ||
+                    map.is_view_dirty(agent, view_cache.get_epoch(row))) {
+                    memset(cached, 0, sizeof(float) * view_size);
+                    map.extract_view(agent, cached, job.channel_trans);
+                }
+                view_cache.set_valid(row, agent, job.epoch);
+                memcpy(view, cached, sizeof(float) * view_size);
+            } else {
+                if (CONVERT)
+                    memset(view, 0, sizeof(float) * view_size);
+                map.extract_view(agent, view, job.channel_trans);
+            }
+
+            if (MINIMAP)
+                copy_minimap(agent, *job.channel_trans_vector, job.minimap, job.view_height, job.view_width,
+                             job.n_channel, view);
+            if (CONVERT)
+                utility::convert_obs(view, job.converted + i * job.converted_size, view_size, job.dtype);
+
+            // get non-spatial feature
+            fill_feature_kernel<MINIMAP, POOLED>(agent, job.n_action, job.features + (size_t)i * job.feature_size);
+        }
+    });
+}
+
+// sparse observation of a group : the nonzero view entries of agent i are entries [offsets[i], offsets[i + 1]),
+// coords holds (view_y, view_x, channel) of every entry. only the first capacity entries are written,
+// the number of entries is returned, so the caller can grow its buffers and retry. features are dense
+int GridWorld::get_observation_sparse(GroupHandle group, int *offsets, int *coords, float *values, int capacity,
+                                      float *features) {
+    auto prof_start = profiler.now();
+    Group &g = groups[group];
+    AgentType &type = g.get_type();
+
+    const int view_width  = type.view_range->get_width();
+    const int view_height = type.view_range->get_height();
+    const int n_group = (int)groups.size();
+    const int n_action = (int)type.action_space.size();
+    const int feature_size = get_feature_size(group);
+
+    std::vector<Agent*> &agents = g.get_agents();
+    const int agent_size = (int)agents.size();
+    memset(features, 0, sizeof(float) * agent_size * feature_size);
 
-        // by agents
-        #pragma omp parallel for
+    std::vector<int> channel_trans = make_channel_trans(group, group2channel(0), type.n_channel, n_group);
+
+    std::vector<float> &minimap = g.get_minimap_buffer();
+    if (config.minimap_mode) {
+        minimap.resize((size_t)view_height * view_width * n_group);
+        build_minimap(type, view_height, view_width, minimap.data());
+    }
+
+    map.prepare_pooling();
+
+    // every chunk collects the entries of its agents, then they are
+    // copied to their place once the offsets are known
+    const int n_chunk = (agent_size + GRAIN_VIEW - 1) / GRAIN_VIEW;
+    std::vector<std::vector<SparseViewEntry>> chunk_entries((size_t)n_chunk);
+    offsets[0] = 0;
+    utility::parallel_range(executor, agent_size, GRAIN_VIEW, [&](int begin, int end) {
+        std::vector<SparseViewEntry> &entries = chunk_entries[begin / GRAIN_VIEW];
+        for (int i = begin; i < end; i++) {
+            Agent *agent = agents[i];
+            size_t start = entries.size();
+            map.extract_view_sparse(agent, entries, &channel_trans[0]);
+            if (config.minimap_mode)
+                copy_minimap_sparse(agent, channel_trans, minimap.data(), view_height, view_width, entries);
+            offsets[i + 1] = (int)(entries.size() - start);
+
+            fill_feature(agent, n_action, features + (size_t)i * feature_size);
+        }
+    });
+
+    for (int i = 0; i < agent_size; i++)
+        offsets[i + 1] += offsets[i];
+
+    utility::parallel_range(executor, n_chunk, 1, [&](int begin, int end) {
+        for (int c = begin; c < end; c++) {
+            const std::vector<SparseViewEntry> &entries = chunk_entries[c];
+            int start = offsets[c * GRAIN_VIEW];
+            int n = std::min((int)entries.size(), capacity - start);
+            for (int k = 0; k < n; k++) {
+                const SparseViewEntry &entry = entries[k];
+                coords[3 * (start + k) + 0] = entry.view_y;
+                coords[3 * (start + k) + 1] = entry.view_x;
+                coords[3 * (start + k) + 2] = entry.channel;
+                values[start + k] = entry.value;
+            }
+        }
+    });
+
+    profiler.record(PROF_GET_OBSERVATION, prof_start, agent_size);
+    return offsets[agent_size];
+}
+
+// observation of a group written by a DeviceObserver into buffers on the cuda device, in the layout of
+// get_observation. only the rows of the map changed since the last call are uploaded. views are always float32
+// and are extracted from scratch, whatever obs_dtype and incremental_view_mode.
+// the minimap and the pooled features are computed here and copied
+void GridWorld::get_observation_device(GroupHandle group, float *device_views, float *device_features) {
+    if (group < 0 || group >= (GroupHandle)groups.size())
+        LOG(FATAL) << "invalid group handle in GridWorld::get_observation_device : " << group;
+    if (domain != nullptr && domain->dirty)
+        sync_domain();
+    auto prof_start = profiler.now();
+    if (device_observer == nullptr) {
+        device_observer.reset(new DeviceObserver());
+        map.set_row_track(true);
+    }
+
+    Group &g = groups[group];
+    AgentType &type = g.get_type();
+    const Range *range = type.view_range;
+    const int view_width  = range->get_width();
+    const int view_height = range->get_height();
+    const int n_group = (int)groups.size();
+    const int n_action = (int)type.action_space.size();
+    const int feature_size = get_feature_size(group);
+
+    std::vector<Agent*> &agents = g.get_agents();
+    const int agent_size = (int)agents.size();
+    std::vector<DeviceAgent> device_agents((size_t)agent_size);
+    utility::parallel_range(executor, agent_size, GRAIN_VIEW, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            Agent *agent = agents[i];
+            device_agents[i] = DeviceAgent{agent->get_pos().x, agent->get_pos().y, (int)agent->get_dir(),
+                                           agent->get_id(), agent->get_action(), agent->get_last_reward()};
+        }
+    });
+
+    // the directions and the rotated masks of the view range of the type
+    static_assert(DIR_NUM == DEVICE_DIR_NUM, "DeviceObserveJob should have a view of every direction");
+    static const int rotations[DIR_NUM][4] = {
+        {0, 1, -1, 0},  // EAST,  same as map_to_view in Map.cc
+        {-1, 0, 0, -1}, // SOUTH
+        {0, -1, 1, 0},  // WEST
+        {1, 0, 0, 1},   // NORTH
+    };
+    DeviceObserveJob job;
+    std::vector<unsigned long long> masks;
+    for (int d = 0; d < DIR_NUM; d++) {
+        const DirTable &table = type.dir_tables[d];
+        const RangeMask &mask = range->get_dir_mask((Direction)d);
+        DeviceViewDir &dir = job.dirs[d];
+        dir.eye_dx = table.eye_dx; dir.eye_dy = table.eye_dy;
+        dir.view_x0 = table.view_x0; dir.view_y0 = table.view_y0;
+        dir.view_x1 = table.view_x1; dir.view_y1 = table.view_y1;
+        dir.mask_x0 = mask.x0; dir.mask_y0 = mask.y0;
+        dir.mask_rows = mask.rows; dir.mask_cols = mask.cols; dir.mask_n_word = mask.n_word;
+        dir.mask_offset = (int)masks.size();
+        memcpy(dir.rot, rotations[d], sizeof(dir.rot));
+        masks.insert(masks.end(), mask.bits.begin(), mask.bits.end());
+    }
+    int view_right_bottom_x, view_right_bottom_y;
+    range->get_range_rela_offset(job.view_left_top_x, job.view_left_top_y, view_right_bottom_x, view_right_bottom_y);
+
+    std::vector<int> channel_trans = make_channel_trans(group, group2channel(0), type.n_channel, n_group);
+
+    std::vector<float> &minimap = g.get_minimap_buffer();
+    std::vector<int> minimap_channels;
+    if (config.minimap_mode) {
+        minimap.resize((size_t)view_height * view_width * n_group);
+        build_minimap(type, view_height, view_width, minimap.data());
+        for (int j = 0; j < n_group; j++)
+            minimap_channels.push_back(channel_trans[group2channel(j)] + 2);
+    }
+
+    const int pooled_offset = config.embedding_size + n_action + 1 + (config.goal_mode ? 2 : 0) + (config.minimap_mode ? 2 : 0);
+    std::vector<float> pooled;
+    if (!config.pooled_radii.empty()) {
+        const int pooled_size = feature_size - pooled_offset;
+        map.prepare_pooling();
+        pooled.assign((size_t)agent_size * pooled_size, 0.0f);
+        utility::parallel_range(executor, agent_size, GRAIN_VIEW, [&](int begin, int end) {
+            for (int i = begin; i < end; i++)
+                map.get_pooled(agents[i], config.pooled_radii, pooled.data() + (size_t)i * pooled_size);
+        });
+    }
+
+    job.agents = device_agents.data();
+    job.n = agent_size;
+    job.range_key = range;
+    job.masks = masks.data();
+    job.n_mask_word = masks.size();
+    job.view_height = view_height; job.view_width = view_width; job.n_channel = type.n_channel;
+    job.channel_trans = channel_trans.data();
+    job.minimap = config.minimap_mode ? minimap.data() : nullptr;
+    job.n_group = n_group;
+    job.minimap_channels = minimap_channels.data();
+    job.scale_h = (config.height + view_height - 1) / view_height;
+    job.scale_w = (config.width + view_width - 1) / view_width;
+    job.feature_size = feature_size; job.embedding_size = config.embedding_size; job.n_action = n_action;
+    job.map_width = config.width; job.map_height = config.height;
+    job.row_begin = map.get_row_begin();
+    job.pooled = pooled.empty() ? nullptr : pooled.data();
+    job.pooled_offset = pooled_offset;
+    job.device_views = device_views;
+    job.device_features = device_features;
+
+    map.sync_device(*device_observer);
+    device_observer->observe(job);
+    profiler.record(PROF_GET_OBSERVATION, prof_start, agent_size);
+}
+
+// non-spatial feature : embedding, one-hot last action, last reward, absolute position in minimap_mode
+// and the pooled features. map.prepare_pooling should be called before
+void GridWorld::fill_feature(Agent *agent, int n_action, float *feature) {
+    if (config.minimap_mode)
+        config.pooled_radii.empty() ? fill_feature_kernel<true, false>(agent, n_action, feature)
+                                    : fill_feature_kernel<true, true>(agent, n_action, feature);
+    else
+        config.pooled_radii.empty() ? fill_feature_kernel<false, false>(agent, n_action, feature)
+                                    : fill_feature_kernel<false, true>(agent, n_action, feature);
+}
+
+template <bool MINIMAP, bool POOLED>
+void GridWorld::fill_feature_kernel(Agent *agent, int n_action, float *feature) {
+    agent->get_embedding(feature, config.embedding_size);
+    // last action
+    feature[config.embedding_size + agent->get_action()] = 1;
+    // last reward
+    feature[config.embedding_size + n_action] = agent->get_last_reward();
+    if (MINIMAP) { // absolute coordination
+        Position pos = agent->get_pos();
+        feature[config.embedding_size + n_action + 1] = (float) pos.x / config.width;
+        feature[config.embedding_size + n_action + 2] = (float) pos.y / config.height;
+    }
+    if (POOLED) {
+        int offset = config.embedding_size + n_action + 1 + (config.goal_mode ? 2 : 0) + (MINIMAP ? 2 : 0);
+        map.get_pooled(agent, config.pooled_radii, feature + offset);
+    }
+}
+
+template <bool MINIMAP, bool INCREMENTAL, bool POOLED>
+void GridWorld::select_observe_kernels() {
+    observe_kernels[0] = &GridWorld::observe_kernel<MINIMAP, INCREMENTAL, false, POOLED>;
+    observe_kernels[1] = &GridWorld::observe_kernel<MINIMAP, INCREMENTAL, true, POOLED>;
+}
+
+void GridWorld::select_kernels() {
+    const bool pooled = !config.pooled_radii.empty();
+    if (config.minimap_mode) {
+        if (config.incremental_view_mode)
+            pooled ? select_observe_kernels<true, true, true>() : select_observe_kernels<true, true, false>();
+        else
+            pooled ? select_observe_kernels<true, false, true>() : select_observe_kernels<true, false, false>();
+    } else {
+        if (config.incremental_view_mode)
+            pooled ? select_observe_kernels<false, true, true>() : select_observe_kernels<false, true, false>();
+        else
+            pooled ? select_observe_kernels<false, false, true>() : select_observe_kernels<false, false, false>();
+    }
+
+    bool absorb = false;
+    for (const auto &item : agent_types)
+        absorb = absorb || item.second.can_absorb;
+    if (config.turn_mode)
+        move_kernel_fn = absorb ? &GridWorld::move_kernel<true, true> : &GridWorld::move_kernel<true, false>;
+    else
+        move_kernel_fn = absorb ? &GridWorld::move_kernel<false, true> : &GridWorld::move_kernel<false, false>;
+}
+
+// minimap (view_height, view_width, n_group) : the ratio of the agents of every group in every cell
+// from the histograms of the group statistics, O(groups * cells)
+void GridWorld::build_minimap(const AgentType &type, int view_height, int view_width, float *minimap_data) {
+    const int n_group = (int)groups.size();
+    NDPointer<float, 3> minimap(minimap_data, {{view_height, view_width, n_group}});
+    int scale_h = (config.height + view_height - 1) / view_height;
+    int scale_w = (config.width + view_width - 1) / view_width;
+
+    if (type.can_absorb) { // absorbed goals are ignored, they are not in the statistics
+        memset(minimap.data, 0, sizeof(float) * view_height * view_width * n_group);
         for (int i = 0; i < n_group; i++) {
             std::vector<Agent*> &agents_ = groups[i].get_agents();
-            AgentType type_ = agents[0]->get_type();
             size_t total_ct = 0;
             for (int j = 0; j < agents_.size(); j++) {
-                if (type_.can_absorb && agents_[j]->is_absorbed()) // ignore absorbed goal
+                if (agents_[j]->is_absorbed())
                     continue;
                 Position pos = agents_[j]->get_pos();
                 int x = pos.x / scale_w, y = pos.y / scale_h;
@@ -357,320 +817,881 @@ void GridWorld::get_observation(GroupHandle group, float **linear_buffers) {
                 }
             }
         }
+        return;
     }
 
-    // fill local view for every agents
-    #pragma omp parallel for
-    for (int i = 0; i < agent_size; i++) {
-        Agent *agent = agents[i];
-        // get spatial view
-        map.extract_view(agent, view_buffer.data + i*view_height*view_width*n_channel, &channel_trans[0], range,
-                         n_channel, view_width, view_height, view_x_offset, view_y_offset,
-                         view_left_top_x, view_left_top_y, view_right_bottom_x, view_right_bottom_y);
-
-        if (minimap_mode) {
-            int self_x = agent->get_pos().x / scale_w;
-            int self_y = agent->get_pos().y / scale_h;
-            for (int j = 0; j < n_group; j++) {
-                int minimap_channel = channel_trans[group2channel(j)] + 2;
-                // copy minimap to channel
-                for (int k = 0; k < view_height; k++) {
-                    for (int l = 0; l < view_width; l++) {
-                        view_buffer.at(i, k, l, minimap_channel)= minimap.at(k, l, j);
-                    }
-                }
-                view_buffer.at(i, self_y, self_x, minimap_channel) += 1;
+    for (int i = 0; i < n_group; i++) {
+        GroupStats &stats = groups[i].get_stats();
+        const int *counts = stats.get_grid(view_height, view_width, scale_h, scale_w, groups[i].get_agents());
+        const float total_ct = (float)stats.get_num();
+        for (int j = 0; j < view_height; j++) {
+            for (int k = 0; k < view_width; k++) {
+                minimap.at(j, k, i) = counts[j * view_width + k] / total_ct;
             }
         }
+    }
+}
 
-        // get non-spatial feature
-        agent->get_embedding(feature_buffer.data + i*feature_size, embedding_size);
-        Position pos = agent->get_pos();
-        // last action
-        feature_buffer.at(i, embedding_size + agent->get_action()) = 1;
-        // last reward
-        feature_buffer.at(i, embedding_size + n_action) = agent->get_last_reward();
-        if (minimap_mode) { // absolute coordination
-            feature_buffer.at(i, embedding_size + n_action + 1) = (float) pos.x / width;
-            feature_buffer.at(i, embedding_size + n_action + 2) = (float) pos.y / height;
+// copy minimap into the minimap channels of a view, the cell of agent is marked by adding 1
+void GridWorld::copy_minimap(const Agent *agent, const std::vector<int> &channel_trans, const float *minimap_data,
+                             int view_height, int view_width, int n_channel, float *view) {
+    const int n_group = (int)groups.size();
+    NDPointer<const float, 3> minimap(minimap_data, {{view_height, view_width, n_group}});
+    NDPointer<float, 3> view_buffer(view, {{view_height, view_width, n_channel}});
+    int scale_h = (config.height + view_height - 1) / view_height;
+    int scale_w = (config.width + view_width - 1) / view_width;
+
+    int self_x = agent->get_pos().x / scale_w;
+    int self_y = agent->get_pos().y / scale_h;
+    for (int j = 0; j < n_group; j++) {
+        int minimap_channel = channel_trans[group2channel(j)] + 2;
+        // copy minimap to channel
+        for (int k = 0; k < view_height; k++) {
+            for (int l = 0; l < view_width; l++) {
+                view_buffer.at(k, l, minimap_channel)= minimap.at(k, l, j);
+            }
         }
+        view_buffer.at(self_y, self_x, minimap_channel) += 1;
     }
+}
 
-    if (minimap_mode)
-        delete [] minimap.data;
+// append the nonzero minimap entries of agent, same values as copy_minimap
+void GridWorld::copy_minimap_sparse(const Agent *agent, const std::vector<int> &channel_trans,
+                                    const float *minimap_data, int view_height, int view_width,
+                                    std::vector<SparseViewEntry> &entries) {
+    const int n_group = (int)groups.size();
+    NDPointer<const float, 3> minimap(minimap_data, {{view_height, view_width, n_group}});
+    int scale_h = (config.height + view_height - 1) / view_height;
+    int scale_w = (config.width + view_width - 1) / view_width;
+
+    int self_x = agent->get_pos().x / scale_w;
+    int self_y = agent->get_pos().y / scale_h;
+    for (int j = 0; j < n_group; j++) {
+        int minimap_channel = channel_trans[group2channel(j)] + 2;
+        for (int k = 0; k < view_height; k++) {
+            for (int l = 0; l < view_width; l++) {
+                float value = minimap.at(k, l, j);
+                if (k == self_y && l == self_x)
+                    value += 1;
+                if (value != 0)
+                    entries.push_back(SparseViewEntry{k, l, minimap_channel, value});
+            }
+        }
+    }
+}
+
+// (view_height, view_width) : the attack action of every cell in the view, -1 for cells out of attack range
+void GridWorld::get_view2attack(const AgentType &type, int *buffer) {
+    const Range *range = type.attack_range;
+    const Range *view_range = type.view_range;
+    const int view_width = view_range->get_width(), view_height = view_range->get_height();
+
+    NDPointer<int, 2> ret(buffer, {view_height, view_width});
+    memset(ret.data, -1, sizeof(int) * view_height * view_width);
+    int x1, y1, x2, y2;
+
+    view_range->get_range_rela_offset(x1, y1, x2, y2);
+    for (int i = 0; i < range->get_count(); i++) {
+        int dx, dy;
+        range->num2delta(i, dx, dy);
+        //dx -= type.att_x_offset; dy -= type.att_y_offset;
+
+        ret.at(dy - y1, dx - x1) = i;
+    }
 }
 
 void GridWorld::set_action(GroupHandle group, const int *actions) {
+    if (is_controlled(group))
+        LOG(FATAL) << "group " << group << " is controlled by a policy or a model in GridWorld::set_action";
+    push_actions(group, actions);
+}
+
+void GridWorld::push_actions(GroupHandle group, const int *actions) {
+    if (recorder != nullptr)
+        recorder->record_actions(*this, group, actions, groups[group].get_num());
+    queue_actions(group, actions);
+}
+
+void GridWorld::queue_actions(GroupHandle group, const int *actions) {
     std::vector<Agent*> &agents = groups[group].get_agents();
     const AgentType &type = groups[group].get_type();
+    GroupStats &stats = groups[group].get_stats();
     // action space layout : move turn attack ...
-    const int bandwidth = (width + NUM_SEP_BUFFER - 1) / NUM_SEP_BUFFER;
 
     size_t agent_size = agents.size();
 
-    if (large_map_mode) { // divide actions in group, in order to compute them in parallel
+    // two tiles of the same color are separated by a whole tile,
+    // so the actions in them never touch the same cell if 2 * reach <= tile size
+    if (large_map_mode && 2 * get_action_reach(type) <= cur_tile_size) {
+        int serial_ct = 0;
         for (int i = 0; i < agent_size; i++) {
             Agent *agent = agents[i];
             Action act = (Action) actions[i];
+            stats.set_action(agent->get_action(), act);
             agent->set_action(act);
 
-            if (act < type.turn_base) {          // move
-                int x = agent->get_pos().x;
-                int x_ = x % bandwidth;
-                if (x_ < 4 || x_ > bandwidth - 4) {
-                    move_buffer_bound.push_back(MoveAction{agent, act - type.move_base});
-                } else {
-                    int to = agent->get_pos().x / bandwidth;
-                    move_buffers[to].push_back(MoveAction{agent, act - type.move_base});
-                }
-            } else if (act < type.attack_base) { // turn
-                int x = agent->get_pos().x;
-                int x_ = x % bandwidth;
-                if (x_ < 4 || x_ > bandwidth - 4) {
-                    turn_buffer_bound.push_back(TurnAction{agent, act - type.move_base});
+            if (act < type.attack_base) {        // move or turn
+                const Position &pos = agent->get_pos();
+                int tx = pos.x / cur_tile_size, ty = pos.y / cur_tile_size;
+                if (tx < 0 || tx >= tile_cols || ty < 0 || ty >= tile_rows) {
+                    serial_ct++;
+                    if (act < type.turn_base)
+                        move_buffer_bound.push_back(MoveAction{agent, act - type.move_base});
+                    else
+                        turn_buffer_bound.push_back(TurnAction{agent, act - type.move_base});
                 } else {
-                    int to = agent->get_pos().x / bandwidth;
-                    turn_buffers[to].push_back(TurnAction{agent, act - type.move_base});
+                    int to = ty * tile_cols + tx;
+                    if (act < type.turn_base)
+                        move_buffers[to].push_back(MoveAction{agent, act - type.move_base});
+                    else
+                        turn_buffers[to].push_back(TurnAction{agent, act - type.move_base});
                 }
             } else {                             // attack
                 attack_buffer.push_back(AttackAction{agent, act - type.attack_base});
             }
         }
+        stat_recorder.serial_action += serial_ct;
     } else {
+        int serial_ct = 0;
         for (int i = 0; i < agent_size; i++) {
             Agent *agent = agents[i];
             Action act = (Action) actions[i];
+            stats.set_action(agent->get_action(), act);
             agent->set_action(act);
 
             if (act < type.turn_base) {          // move
                 move_buffer_bound.push_back(MoveAction{agent, act - type.move_base});
+                serial_ct++;
             } else if (act < type.attack_base) { // turn
                 turn_buffer_bound.push_back(TurnAction{agent, act - type.move_base});
+                serial_ct++;
             } else {                             // attack
                 attack_buffer.push_back(AttackAction{agent, act - type.attack_base});
             }
         }
+        stat_recorder.serial_action += serial_ct;
     }
 }
 
 void GridWorld::step(int *done) {
-    #pragma omp declare reduction (merge : std::vector<RenderAttackEvent> : omp_out.insert(omp_out.end(), omp_in.begin(), omp_in.end()))
-    const bool stat = false;
-
     LOG(TRACE) << "gridworld step begin.  ";
+    if (domain != nullptr && domain->dirty)
+        sync_domain();
+    for (GroupHandle i = 0; i < policies.size(); i++) {
+        if (policies[i] != nullptr)
+            infer_policy_actions(i);
+    }
+    infer_model_actions();
+    if (recorder != nullptr)
+        recorder->record_step(*this);
+    run_frames(done);
+}
+
+void GridWorld::run_frames(int *done) {
+    if (config.frame_skip > 1 && domain != nullptr)
+        LOG(FATAL) << "frame_skip is not supported in distributed mode";
+    map.drop_free_cells();
+
+    // the later frames repeat the actions of the agents, killed ones are skipped by the phases.
+    // a frame starts from the step reward, since a death overwrites the reward with the dead penalty.
+    // the rewards of the earlier frames are kept aside and added back at the end
+    events.clear();
+    bool kept = false;
+    for (int frame = 0; frame < config.frame_skip; frame++) {
+        event_frame = frame;
+        if (frame > 0) {
+            frame_rewards.resize(groups.size());
+            for (GroupHandle i = 0; i < groups.size(); i++) {
+                std::vector<Agent*> &agents = groups[i].get_agents();
+                std::vector<Reward> &earlier = frame_rewards[i];
+                if (!kept)
+                    earlier.assign(agents.size(), 0);
+                utility::parallel_range(executor, (int)agents.size(), GRAIN_AGENT, [&](int begin, int end) {
+                    for (int j = begin; j < end; j++) {
+                        if (!agents[j]->is_dead()) {
+                            earlier[j] += agents[j]->get_reward();
+                            agents[j]->next_frame();
+                        }
+                    }
+                });
+                queue_actions(i, groups[i].get_store().last_actions.data());
+            }
+            kept = true;
+        }
+        step_frame(done);
+        if (*done)
+            break;
+    }
+    if (kept) {
+        for (GroupHandle i = 0; i < groups.size(); i++) {
+            std::vector<Agent*> &agents = groups[i].get_agents();
+            const std::vector<Reward> &earlier = frame_rewards[i];
+            utility::parallel_range(executor, (int)agents.size(), GRAIN_AGENT, [&](int begin, int end) {
+                for (int j = begin; j < end; j++)
+                    agents[j]->add_reward(earlier[j]);
+            });
+        }
+    }
+
+    // write rewards into registered buffers, registered observations are outdated now
+    for (int i = 0; i < groups.size(); i++) {
+        RegisteredBuffers &reg = groups[i].get_registered();
+        reg.obs_fresh = false;
+        if (reg.reward != nullptr)
+            get_reward(i, nullptr);
+    }
+}
+
+void GridWorld::step_frame(int *done) {
+    auto prof_start = profiler.now();
     size_t attack_size = attack_buffer.size();
     size_t group_size  = groups.size();
 
     // shuffle attacks
+    utility::Philox attack_engine(random_seed, RNG_ATTACK, step_counter);
     for (int i = 0; i < attack_size; i++) {
-        int j = (int)random_engine() % (i+1);
+        unsigned int r = config.deterministic_mode ? attack_engine() : (unsigned int)random_engine();
+        int j = (int)(r % (unsigned int)(i+1));
         std::swap(attack_buffer[i], attack_buffer[j]);
     }
 
     LOG(TRACE) << "attack.  ";
-    std::vector<RenderAttackEvent> render_attack_buffer;
-    std::map<PositionInteger, int> attack_obj_counter;    // for statistic info
+    // resolve the targets in parallel, then bucket attacks by target object into shards.
+    // the attacks on one object form a run, a shard applies its runs in shuffled order, no two shards touch
+    // the same object. the result is the same as applying all the attacks serially in shuffled order :
+    // an attacker killed by an earlier attack does not attack, the hp supply of an attack is added before
+    // the later attacks on the attacker. a run waits when this depends on a run not resolved that far,
+    // the shards are swept in waves until all runs are resolved
+    const int n_shard = 4 * (executor == nullptr ? 1 : executor->get_num_threads() + 1);
+    attack_targets.resize(attack_size);
+
+    utility::parallel_range(executor, (int)attack_size, GRAIN_AGENT, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            Agent *agent = attack_buffer[i].agent;
+            AttackTarget &target = attack_targets[i];
+
+            target.reward = 0;
+            target.hp_supply = 0;
+            target.supplied = false;
+            target.dead_group = -1;
+            target.state = ATTACK_PENDING;
+            if (agent->is_dead()) {
+                target.shard = -2;
+                continue;
+            }
+            target.self = map.get_table_index(agent);
 
-    // attack
-    #pragma omp parallel for reduction(merge: render_attack_buffer)
-    for (int i = 0; i < attack_size; i++) {
-        Agent *agent = attack_buffer[i].agent;
+            // the target is checked again when the attack is applied, the slot only loses its occupier or
+            // turns into food before that, so a slot of any occupier is bucketed with it
+            target.pos = map.get_attack_slot(attack_buffer[i], target.x, target.y);
+            if (target.pos == -1) {  // attack blank block
+                target.shard = -1;
+                continue;
+            }
 
-        if (agent->is_dead())
-            continue;
+            target.obj = map.get_occupier(target.pos);
+            Agent *obj = map.get_agent(target.pos);
+            target.victim = obj == nullptr ? NO_OCCUPIER : map.get_table_index(obj);
+            unsigned long long key = (unsigned long long)(size_t)target.obj >> 4;
+            target.shard = (int)(((key * 0x9E3779B97F4A7C15ULL) >> 32) % n_shard);
+        }
+    });
 
-        int obj_x, obj_y;
-        PositionInteger obj_pos = map.get_attack_obj(attack_buffer[i], obj_x, obj_y);
-        if (!first_render)
-            render_attack_buffer.emplace_back(RenderAttackEvent{agent->get_id(), obj_x, obj_y});
+    // counting sort by shard, keep shuffled order inside a shard
+    shard_begin.assign((size_t)n_shard + 1, 0);
+    for (int i = 0; i < attack_size; i++) {
+        if (attack_targets[i].shard >= 0)
+            shard_begin[attack_targets[i].shard + 1]++;
+    }
+    for (int i = 0; i < n_shard; i++)
+        shard_begin[i + 1] += shard_begin[i];
+    attack_order.resize((size_t)shard_begin[n_shard]);
+    {
+        std::vector<int> cursor(shard_begin.begin(), shard_begin.end() - 1);
+        for (int i = 0; i < attack_size; i++) {
+            if (attack_targets[i].shard >= 0)
+                attack_order[cursor[attack_targets[i].shard]++] = i;
+        }
+    }
 
-        if (obj_pos == -1) {  // attack blank block
-            agent->add_reward(agent->get_type().attack_penalty);
-            continue;
+    utility::parallel_range(executor, n_shard, 1, [&](int begin, int end) {
+        for (int s = begin; s < end; s++) {
+            std::stable_sort(attack_order.data() + shard_begin[s], attack_order.data() + shard_begin[s + 1],
+                             [this](int a, int b) {
+                return attack_targets[a].obj < attack_targets[b].obj;
+            });
         }
+    });
+
+    // split the shards into runs
+    run_of.assign(map.get_table_size(), -1);
+    attack_of.assign(map.get_table_size(), -1);
+    attack_runs.clear();
+    shard_run_begin.resize((size_t)n_shard + 1);
+    for (int s = 0; s < n_shard; s++) {
+        shard_run_begin[s] = (int)attack_runs.size();
+        for (int p = shard_begin[s]; p < shard_begin[s + 1]; p++) {
+            const AttackTarget &target = attack_targets[attack_order[p]];
+            if (p == shard_begin[s] || target.obj != attack_targets[attack_order[p - 1]].obj) {
+                if (target.victim != NO_OCCUPIER)
+                    run_of[target.victim] = (int)attack_runs.size();
+                attack_runs.push_back(AttackRun{p, p, p, INT_MAX});
+            }
+            attack_runs.back().end = p + 1;
+        }
+    }
+    shard_run_begin[n_shard] = (int)attack_runs.size();
+    for (int i = 0; i < attack_size; i++) {
+        if (attack_targets[i].shard != -2)
+            attack_of[attack_targets[i].self] = i;
+    }
+
+    // whether the attacker of attack i is alive when attack i is applied, -1 for unknown yet
+    auto attacker_alive = [this](int i) {
+        int r = run_of[attack_targets[i].self];
+        if (r == -1)
+            return 1;
+        const AttackRun &run = attack_runs[r];
+        int cursor = __atomic_load_n(&run.cursor, __ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&run.death, __ATOMIC_RELAXED) < i)
+            return 0;
+        return cursor == run.end || attack_order[cursor] >= i ? 1 : -1;
+    };
 
-        if (stat) {
-            attack_obj_counter[obj_pos]++;
+    // apply the attacks of a run until one depends on unresolved attacks, return whether any is applied
+    auto resolve_run = [&](AttackRun &run) {
+        int start = run.cursor;
+        while (run.cursor < run.end) {
+            int i = attack_order[run.cursor];
+            AttackTarget &target = attack_targets[i];
+            Agent *agent = attack_buffer[i].agent;
+
+            int alive = attacker_alive(i);
+            if (alive == -1)
+                break;
+            int state = ATTACK_SKIP;
+            if (alive) {
+                Agent *obj = map.get_agent(target.pos);
+                if (obj != nullptr) {
+                    // the supply of its own earlier attack, none for attacking blank
+                    int own = attack_of[target.victim];
+                    if (own != -1 && own < i && attack_targets[own].shard >= 0) {
+                        AttackTarget &own_target = attack_targets[own];
+                        if (__atomic_load_n(&own_target.state, __ATOMIC_ACQUIRE) == ATTACK_PENDING)
+                            break;
+                        if (own_target.hp_supply > 0 && !own_target.supplied) {
+                            obj->add_hp(own_target.hp_supply);
+                            map.update_hp(obj);
+                            own_target.supplied = true;
+                        }
+                    }
+                }
+
+                int x, y;
+                if (map.get_attack_obj(attack_buffer[i], x, y) == -1) {
+                    state = ATTACK_MISS;
+                } else {
+                    state = ATTACK_HIT;
+                    target.reward = map.do_attack(agent, target.pos, target.dead_group, target.hp_supply);
+                    if (obj != nullptr && obj->is_dead())
+                        __atomic_store_n(&run.death, i, __ATOMIC_RELAXED);
+                }
+            }
+            __atomic_store_n(&target.state, state, __ATOMIC_RELEASE);
+            __atomic_store_n(&run.cursor, run.cursor + 1, __ATOMIC_RELEASE);
         }
+        return run.cursor != start;
+    };
+
+    // waves. the earliest unresolved attack in shuffled order can always be applied, so every wave progresses
+    pending_runs.resize(attack_runs.size());
+    for (int r = 0; r < attack_runs.size(); r++)
+        pending_runs[r] = r;
+    shard_run_end.assign(shard_run_begin.begin() + 1, shard_run_begin.end());
+    int n_pending = (int)attack_runs.size();
+    while (n_pending > 0) {
+        std::atomic<int> progress(0);
+        utility::parallel_range(executor, n_shard, 1, [&](int begin, int end) {
+            for (int s = begin; s < end; s++) {
+                int left = shard_run_begin[s];
+                for (int k = shard_run_begin[s]; k < shard_run_end[s]; k++) {
+                    AttackRun &run = attack_runs[pending_runs[k]];
+                    if (resolve_run(run))
+                        progress++;
+                    if (run.cursor < run.end)
+                        pending_runs[left++] = pending_runs[k];
+                }
+                shard_run_end[s] = left;
+            }
+        });
+        if (progress == 0)
+            LOG(FATAL) << "attack resolution does not progress";
+        n_pending = 0;
+        for (int s = 0; s < n_shard; s++)
+            n_pending += shard_run_end[s] - shard_run_begin[s];
+    }
 
-        float reward = 0.0;
-        GroupHandle dead_group = -1;
-        #pragma omp critical
-        {
-            reward = map.do_attack(agent, obj_pos, dead_group);
-            if (dead_group != -1) {
-                groups[dead_group].inc_dead_ct();
+    shard_dead_ct.assign((size_t)n_shard * group_size, 0);
+    shard_both_attack.assign((size_t)n_shard, 0);
+    const bool attack_events = want_event(EVENT_ATTACK) || want_event(EVENT_KILL) || want_event(EVENT_EAT);
+    if (attack_events)
+        begin_events((size_t)n_shard);
+
+    utility::parallel_range(executor, n_shard, 1, [&](int begin, int end) {
+        for (int s = begin; s < end; s++) {
+            int hit_ct = 0;
+            for (int p = shard_begin[s]; p < shard_begin[s + 1]; p++) {
+                int i = attack_order[p];
+                const AttackTarget &target = attack_targets[i];
+                if (p > shard_begin[s] && target.obj != attack_targets[attack_order[p - 1]].obj)
+                    hit_ct = 0;
+                if (target.state != ATTACK_HIT)
+                    continue;
+                // count an object once, at its second attacker
+                if (++hit_ct == 2)
+                    shard_both_attack[s]++;
+
+                if (target.dead_group != -1)
+                    shard_dead_ct[s * group_size + target.dead_group]++;
+
+                if (attack_events) {
+                    std::vector<StepEvent> &buf = event_buffers[s];
+                    Agent *agent = attack_buffer[i].agent;
+                    EventOp op = agent->get_last_op();
+                    if (op == OP_ATTACK || op == OP_KILL) {
+                        int obj_id = ((Agent *)agent->get_op_obj())->get_id();
+                        if (want_event(EVENT_ATTACK))
+                            buf.push_back(StepEvent{EVENT_ATTACK, event_frame, agent->get_id(), obj_id,
+                                                    target.x, target.y, agent->get_type().damage});
+                        if (op == OP_KILL && want_event(EVENT_KILL))
+                            buf.push_back(StepEvent{EVENT_KILL, event_frame, agent->get_id(), obj_id,
+                                                    target.x, target.y, 0});
+                    } else if (target.hp_supply > 0 && want_event(EVENT_EAT)) {
+                        buf.push_back(StepEvent{EVENT_EAT, event_frame, agent->get_id(), -1,
+                                                target.x, target.y, target.hp_supply});
+                    }
+                }
             }
         }
-        agent->add_reward(reward + agent->get_type().attack_penalty);
+    });
+
+    if (attack_events)
+        flush_events();
+    for (int s = 0; s < n_shard; s++) {
+        for (int j = 0; j < group_size; j++)
+            groups[j].set_dead_ct(groups[j].get_dead_ct() + shard_dead_ct[s * group_size + j]);
+        stat_recorder.both_attack += shard_both_attack[s];
     }
-    attack_buffer.clear();
-    if (!first_render)
-        render_generator.set_attack_event(render_attack_buffer);
 
-    if (stat) {
-        for (auto iter : attack_obj_counter) {
-            if (iter.second > 1) {
-                stat_recorder.both_attack++;
+    // apply rewards and the rest of hp supply to attackers. the reward of a killed attacker is its dead penalty
+    utility::parallel_range(executor, (int)attack_size, GRAIN_AGENT, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            Agent *agent = attack_buffer[i].agent;
+            AttackTarget &target = attack_targets[i];
+
+            if (target.shard == -2)
+                continue;
+            if (target.shard == -1)
+                target.state = attacker_alive(i) ? ATTACK_MISS : ATTACK_SKIP;
+            if (agent->is_dead())
+                continue;
+
+            agent->add_reward(target.reward + agent->get_type().attack_penalty);
+            if (target.hp_supply > 0 && !target.supplied) {
+                agent->add_hp(target.hp_supply);
+                map.update_hp(agent);
             }
         }
+    });
+
+    if (!first_render) {
+        std::vector<RenderAttackEvent> render_attack_buffer;
+        for (int i = 0; i < attack_size; i++) {
+            if (attack_targets[i].state == ATTACK_HIT || attack_targets[i].state == ATTACK_MISS)
+                render_attack_buffer.emplace_back(RenderAttackEvent{attack_buffer[i].agent->get_id(),
+                                                                    attack_targets[i].x, attack_targets[i].y});
+        }
+        if (domain != nullptr)
+            domain->attack_events = render_attack_buffer;
+        render_generator.set_attack_event(render_attack_buffer);
     }
+    if (domain != nullptr)
+        forward_ghost_damage();
+    attack_buffer.clear();
+    prof_start = profiler.record(PROF_ATTACK, prof_start, attack_size);
 
     // starve
     LOG(TRACE) << "starve.  ";
     for (int i = 0; i < group_size; i++) {
         Group &group = groups[i];
         std::vector<Agent*> &agents = group.get_agents();
-        int starve_ct = 0;
+        const unsigned char *deads = group.get_store().deads.data();
+        std::atomic<int> starve_ct(0);
         size_t agent_size = agents.size();
+        const bool starve_events = want_event(EVENT_STARVE);
+        if (starve_events)
+            begin_events((agent_size + GRAIN_AGENT - 1) / GRAIN_AGENT);
+
+        utility::parallel_range(executor, (int)agent_size, GRAIN_AGENT, [&](int begin, int end) {
+            int local_ct = 0;
+            for (int j = begin; j < end; j++) {
+                if (deads[j])
+                    continue;
 
-        #pragma omp parallel for reduction(+: starve_ct)
-        for (int j = 0; j < agent_size; j++) {
-            Agent *agent = agents[j];
-
-            if (agent->is_dead())
-                continue;
-
-            // alive agents
-            bool starve = agent->starve();
-            if (starve) {
-                map.remove_agent(agent);
-                starve_ct++;
+                Agent *agent = agents[j];
+
+                // alive agents
+                float old_hp = agent->get_hp();
+                bool starve = agent->starve();
+                if (starve) {
+                    map.remove_agent(agent);
+                    local_ct++;
+                    if (starve_events) {
+                        Position pos = agent->get_pos();
+                        event_buffers[begin / GRAIN_AGENT].push_back(StepEvent{EVENT_STARVE, event_frame,
+                                                               agent->get_id(), -1, pos.x, pos.y, 0});
+                    }
+                } else if (agent->get_hp() != old_hp) {
+                    map.update_hp(agent);
+                }
             }
-        }
+            starve_ct += local_ct;
+        });
+        if (starve_events)
+            flush_events();
         group.set_dead_ct(group.get_dead_ct() + starve_ct);
     }
+    prof_start = profiler.record(PROF_STARVE, prof_start);
 
-    if (turn_mode) {
-        // do turn
-        auto do_turn_for_a_buffer = [] (std::vector<TurnAction> &turn_buf, Map &map) {
-            //std::random_shuffle(turn_buf.begin(), turn_buf.end());
-            size_t turn_size = turn_buf.size();
-            for (int i = 0; i < turn_size; i++) {
-                Action act = turn_buf[i].action;
-                Agent *agent = turn_buf[i].agent;
-
-                if (agent->is_dead())
-                    continue;
-
-                int dir = act * 2 - 1;
-                map.do_turn(agent, dir);
-            }
-            turn_buf.clear();
-        };
+    if (domain != nullptr)
+        split_border_actions();
 
+    if (config.turn_mode) {
+        // do turn
         if (large_map_mode) {
             LOG(TRACE) << "turn parallel.  ";
-            #pragma omp parallel for
-            for (int i = 0; i < NUM_SEP_BUFFER; i++) {        // turn in separate areas, do them in parallel
-                do_turn_for_a_buffer(turn_buffers[i], map);
+            size_t turn_ct = 0;
+            for (int c = 0; c < 4; c++) {     // turn in tiles of the same color, do them in parallel
+                const std::vector<int> &tiles = color_tiles[c];
+                size_t n_tile = tiles.size();
+                for (int i = 0; i < n_tile; i++)
+                    turn_ct += turn_buffers[tiles[i]].size();
+                utility::parallel_range(executor, (int)n_tile, 1, [&](int begin, int end) {
+                    for (int i = begin; i < end; i++) {
+                        do_turns(turn_buffers[tiles[i]]);
+                    }
+                });
             }
+            prof_start = profiler.record(PROF_TURN_PARALLEL, prof_start, turn_ct);
         }
         LOG(TRACE) << "turn boundary.   ";
-        do_turn_for_a_buffer(turn_buffer_bound, map);
+        size_t turn_bound_ct = turn_buffer_bound.size();
+        do_turns(turn_buffer_bound);
+        prof_start = profiler.record(PROF_TURN_BOUNDARY, prof_start, turn_bound_ct);
     }
 
-    // do move
-    auto do_move_for_a_buffer = [] (std::vector<MoveAction> &move_buf, Map &map) {
-        //std::random_shuffle(move_buf.begin(), move_buf.end());
-        size_t move_size = move_buf.size();
-        for (int j = 0; j < move_size; j++) {
-            Action act = move_buf[j].action;
-            Agent *agent = move_buf[j].agent;
-
-            if (agent->is_dead() || agent->is_absorbed())
-                continue;
-
-            int dx, dy;
-            int delta[2];
-            agent->get_type().move_range->num2delta(act, dx, dy);
-            switch(agent->get_dir()) {
-                case NORTH:
-                    delta[0] = dx;  delta[1] = dy;  break;
-                case SOUTH:
-                    delta[0] = -dx; delta[1] = -dy; break;
-                case WEST:
-                    delta[0] = dy;  delta[1] = -dx; break;
-                case EAST:
-                    delta[0] = -dy; delta[1] = dx;  break;
-                default:
-                    LOG(FATAL) << "invalid direction in GridWorld::step when do move";
-            }
-
-            map.do_move(agent, delta);
-        }
-        move_buf.clear();
-    };
-
+    // do move, blocked moves are appended to the buffer of their tile, then to the one of the boundary
+    begin_events(move_buffers.size() + 1);
     if (large_map_mode) {
         LOG(TRACE) << "move parallel.  ";
-        #pragma omp parallel for
-        for (int i = 0; i < NUM_SEP_BUFFER; i++) {    // move in separate areas, do them in parallel
-            do_move_for_a_buffer(move_buffers[i], map);
+        size_t move_ct = 0;
+        for (int c = 0; c < 4; c++) {     // move in tiles of the same color, do them in parallel
+            const std::vector<int> &tiles = color_tiles[c];
+            size_t n_tile = tiles.size();
+            for (int i = 0; i < n_tile; i++)
+                move_ct += move_buffers[tiles[i]].size();
+            utility::parallel_range(executor, (int)n_tile, 1, [&](int begin, int end) {
+                for (int i = begin; i < end; i++) {
+                    (this->*move_kernel_fn)(move_buffers[tiles[i]], event_buffers[tiles[i]]);
+                }
+            });
         }
+        prof_start = profiler.record(PROF_MOVE_PARALLEL, prof_start, move_ct);
     }
     LOG(TRACE) << "move boundary.  ";
-    do_move_for_a_buffer(move_buffer_bound, map);
+    size_t move_bound_ct = move_buffer_bound.size();
+    (this->*move_kernel_fn)(move_buffer_bound, event_buffers.back());
+    flush_events();
+    if (domain != nullptr)
+        run_border_chain();
+    prof_start = profiler.record(PROF_MOVE_BOUNDARY, prof_start, move_bound_ct);
 
     LOG(TRACE) << "calc_reward.  ";
     calc_reward();
+    profiler.record(PROF_CALC_REWARD, prof_start, reward_rules.size());
 
     LOG(TRACE) << "game over check.  ";
-    int live_ct = 0;  // default game over condition: all the agents in an arbitrary group die
+    // default game over condition: all the agents in an arbitrary group die.
+    // alive agents of every group and triggered terminal rules, summed over the ranks in distributed mode
+    std::vector<double> counts(groups.size() + 1, 0.0);
+    for (int i = 0; i < groups.size(); i++)
+        counts[i] = groups[i].get_alive_num();
+    size_t rule_size = reward_rules.size();
+    for (int i = 0; i < rule_size; i++) {
+        if (reward_rules[i].trigger && reward_rules[i].is_terminal)
+            counts.back() += 1;
+    }
+    if (domain != nullptr)
+        reduce_sum(counts);
+
+    int live_ct = 0;
     for (int i = 0; i < groups.size(); i++) {
-        if (groups[i].get_alive_num() > 0)
+        if (counts[i] > 0)
             live_ct++;
     }
-    *done = (int)(live_ct < groups.size());
+    *done = (int)(live_ct < groups.size() || counts.back() > 0);
+    step_counter++;
+}
 
-    size_t rule_size = reward_rules.size();
-    for (int i = 0; i < rule_size; i++) {
-        if (reward_rules[i].trigger && reward_rules[i].is_terminal)
-            *done = (int)true;
+void GridWorld::do_turns(std::vector<TurnAction> &turn_buf) {
+    //std::random_shuffle(turn_buf.begin(), turn_buf.end());
+    size_t turn_size = turn_buf.size();
+    for (int i = 0; i < turn_size; i++) {
+        Action act = turn_buf[i].action;
+        Agent *agent = turn_buf[i].agent;
+
+        if (agent->is_dead())
+            continue;
+
+        int dir = act * 2 - 1;
+        Position old_pos = agent->get_pos();
+        map.do_turn(agent, dir);
+        groups[agent->get_group()].get_stats().move(old_pos, agent->get_pos());
     }
+    turn_buf.clear();
 }
 
 void GridWorld::clear_dead() {
+    compact_groups(nullptr, nullptr, nullptr);
+}
+
+// clear dead agents. rewards and alive of the agents before compaction and ids of the agents after it
+// are written on the way if the buffers of a group are given (for step_full)
+void GridWorld::compact_groups(float **rewards, bool **alive, int **ids) {
+    auto prof_start = profiler.now();
     size_t group_size = groups.size();
 
-    #pragma omp parallel for
+    // agents which moved to the rows of another rank are dropped like dead ones, but stay alive
+    std::vector<char> migrants[2];
+    if (domain != nullptr)
+        emigrate(migrants);
+
+    utility::parallel_range(executor, (int)group_size, 1, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            Group &group = groups[i];
+            std::vector<Agent*> &agents = group.get_agents();
+            AgentStore &store = group.get_store();
+            ViewCache &view_cache = group.get_view_cache();
+
+            float *reward_out = rewards == nullptr ? nullptr : rewards[i];
+            bool  *alive_out  = alive == nullptr ? nullptr : alive[i];
+            int   *id_out     = ids == nullptr ? nullptr : ids[i];
+            const Reward group_reward = group.get_reward();
+            group.init_reward();
+
+            // clear dead agents
+            size_t agent_size = agents.size();
+            int dead_ct = 0;
+            unsigned int pt = 0;
+            float sum_x = 0, sum_y = 0;
+
+            for (int j = 0; j < agent_size; j++) {
+                Agent *agent = agents[j];
+                if (reward_out != nullptr)
+                    reward_out[j] = store.rewards[j] + group_reward;
+                if (alive_out != nullptr)
+                    alive_out[j] = !store.deads[j];
+                if (agent->is_dead() || agent->is_ghost()) {
+                    group.get_stats().remove(store.poses[j], store.last_actions[j]);
+                    group.free_agent(agent);
+                    dead_ct++;
+                } else {
+                    if (pt != j) {
+                        store.move(j, pt);
+                        agent->set_index(pt);
+                        if (config.incremental_view_mode)
+                            view_cache.move(j, pt);
+                    }
+                    agent->init_reward();
+                    if (id_out != nullptr)
+                        id_out[pt] = store.ids[pt];
+                    agents[pt++] = agent;
+
+                    //Position pos = agent->get_pos();
+                    //sum_x += pos.x; sum_y += pos.y;
+                }
+            }
+            agents.resize(pt);
+            store.resize(pt);
+            if (config.incremental_view_mode && view_cache.get_size() > pt)
+                view_cache.truncate(pt);
+            group.set_dead_ct(0);
+        }
+    });
+    if (domain != nullptr)
+        immigrate(migrants);
+    if (recorder != nullptr)
+        recorder->record_clear();
+    profiler.record(PROF_CLEAR_DEAD, prof_start);
+
+    // refresh registered observations for the next step
     for (int i = 0; i < group_size; i++) {
-        Group &group = groups[i];
-        group.init_reward();
-        std::vector<Agent*> &agents = group.get_agents();
+        if (groups[i].get_registered().has_obs())
+            get_observation(i, nullptr);
+    }
+}
 
-        // clear dead agents
-        size_t agent_size = agents.size();
-        int dead_ct = 0;
-        unsigned int pt = 0;
-        float sum_x = 0, sum_y = 0;
+void GridWorld::step_full(const int **actions, float ***obs, float **rewards, bool **alive, int **ids,
+                          int *nums, int *done) {
+    const int n_group = (int)groups.size();
+    if (actions != nullptr) {
+        for (int i = 0; i < n_group; i++)
+            if (actions[i] != nullptr)
+                set_action(i, actions[i]);
+    }
 
-        for (int j = 0; j < agent_size; j++) {
-            Agent *agent = agents[j];
-            if (agent->is_dead()) {
-                delete agent;
-                dead_ct++;
-            } else {
-                agent->init_reward();
-                agent->set_index(pt);
-                agents[pt++] = agent;
+    step(done);
+    compact_groups(rewards, alive, ids);
+
+    for (int i = 0; i < n_group; i++) {
+        if (nums != nullptr)
+            nums[i] = groups[i].get_num();
+        if (obs != nullptr && obs[i] != nullptr)
+            get_observation(i, obs[i]);
+    }
+}
+
+// moves of a buffer in order. directions are always NORTH without turn_mode,
+// only absorbing types can leave absorbed agents
+template <bool ROTATE, bool ABSORB>
+void GridWorld::move_kernel(std::vector<MoveAction> &move_buf, std::vector<StepEvent> &events) {
+    //std::random_shuffle(move_buf.begin(), move_buf.end());
+    const bool blocked_events = want_event(EVENT_BLOCKED);
+    size_t move_size = move_buf.size();
+    for (int j = 0; j < move_size; j++) {
+        Action act = move_buf[j].action;
+        Agent *agent = move_buf[j].agent;
+
+        if (agent->is_dead() || (ABSORB && agent->is_absorbed()))
+            continue;
+
+        const DirTable &table = agent->get_type().dir_tables[ROTATE ? agent->get_dir() : NORTH];
+        const int delta[2] = {table.move_dx[act], table.move_dy[act]};
+
+        Position old_pos = agent->get_pos();
+        map.do_move(agent, delta);
+        groups[agent->get_group()].get_stats().move(old_pos, agent->get_pos());
+
+        if (blocked_events && !agent->is_dead() && (delta[0] != 0 || delta[1] != 0)
+            && agent->get_pos().x == old_pos.x && agent->get_pos().y == old_pos.y) {
+            int obj_id = agent->get_last_op() == OP_COLLIDE ? ((Agent *)agent->get_op_obj())->get_id() : -1;
+            events.push_back(StepEvent{EVENT_BLOCKED, event_frame, agent->get_id(), obj_id,
+                                       old_pos.x + delta[0], old_pos.y + delta[1], 0});
+        }
+    }
+    move_buf.clear();
+}
 
-                //Position pos = agent->get_pos();
-                //sum_x += pos.x; sum_y += pos.y;
+// empty buffers for the chunks of a parallel phase, flushed into events in order
+void GridWorld::begin_events(size_t n_buffer) {
+    event_buffers.resize(n_buffer);
+}
+
+void GridWorld::flush_events() {
+    for (std::vector<StepEvent> &buf : event_buffers) {
+        events.insert(events.end(), buf.begin(), buf.end());
+        buf.clear();
+    }
+}
+
+// every agent (or wall) of this call draws from its own stream (random_seed, RNG_ADD_AGENTS, call, i).
+// the placements are drawn in parallel on the map before the call, then committed in order,
+// a placement taken by an earlier one of the same call is redrawn from its stream.
+// so the result does not depend on the number of threads
+void GridWorld::add_random_deterministic(GroupHandle group, int n) {
+    const uint32_t call = call_counter++;
+    int width = 1, length = 1;
+    if (group >= 0) {
+        width = groups[group].get_type().width;
+        length = groups[group].get_type().length;
+    }
+    const bool random_dir = group >= 0 && config.turn_mode;
+
+    std::vector<utility::Philox> engines;
+    engines.reserve((size_t)std::max(n, 0));
+    for (int i = 0; i < n; i++)
+        engines.emplace_back(random_seed, RNG_ADD_AGENTS, call, (uint32_t)i);
+    std::vector<Direction> dirs((size_t)std::max(n, 0), NORTH);
+    std::vector<Position> poses((size_t)std::max(n, 0));
+
+    auto draw_pos = [&](int i) {
+        bool rotated = dirs[i] == WEST || dirs[i] == EAST;
+        if (group == -1)
+            poses[i] = map.get_random_wall_cell(engines[i]);
+        else
+            poses[i] = map.get_random_blank(engines[i], rotated ? length : width, rotated ? width : length);
+    };
+
+    std::atomic<bool> full(false);
+    utility::parallel_range(executor, n, GRAIN_VIEW, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            if (random_dir)
+                dirs[i] = (Direction)(engines[i]() % DIR_NUM);
+            try {
+                draw_pos(i);
+            } catch (std::exception &e) {
+                full = true;
             }
         }
-        agents.resize(pt);
-        group.set_dead_ct(0);
+    });
+    if (full)
+        LOG(FATAL) << "cannot find a blank position in a filled map";
+
+    if (group == -1) {
+        for (int i = 0; i < n; i++) {
+            while (map.add_wall(poses[i]) != 0)
+                draw_pos(i);
+        }
+    } else {
+        Group &g = groups[group];
+        int base_channel_id = group2channel(group);
+        for (int i = 0; i < n; i++) {
+            Agent *agent = g.new_agent(next_agent_id(), group);
+            agent->set_dir(dirs[i]);
+            agent->set_pos(poses[i]);
+            while (map.add_agent(agent, base_channel_id) != 0) {
+                draw_pos(i);
+                agent->set_pos(poses[i]);
+            }
+            g.get_stats().add(agent->get_pos(), agent->get_action());
+            id_counter++;
+        }
     }
 }
 
+void GridWorld::register_buffer(GroupHandle group, const char *name, void *buffer, int capacity) {
+    if (group < 0 || group >= groups.size())
+        LOG(FATAL) << "invalid group handle in GridWorld::register_buffer : " << group;
+    if (!groups[group].get_registered().set(name, buffer, capacity))
+        LOG(FATAL) << "invalid buffer name in GridWorld::register_buffer : " << name;
+}
+
 void GridWorld::set_goal(GroupHandle group, const char *method, const int *linear_buffer) {
     // deprecated
+    mark_replay_dirty();
     if (strequ(method, "random")) {
         std::vector<Agent*> &agents = groups[group].get_agents();
+        const uint32_t call = call_counter++;
         for (int i = 0; i < agents.size(); i++) {
-            int x = (int)random_engine() % width;
-            int y = (int)random_engine() % height;
+            int x, y;
+            if (config.deterministic_mode) {
+                utility::Philox engine(random_seed, RNG_GOAL, call, (uint32_t)agents[i]->get_id());
+                x = (int)(engine() % (unsigned int)config.width);
+                y = (int)(engine() % (unsigned int)config.height);
+            } else {
+                x = (int)random_engine() % config.width;
+                y = (int)random_engine() % config.height;
+            }
             agents[i]->set_goal(Position{x, y}, 0);
         }
     } else {
@@ -678,29 +1699,235 @@ void GridWorld::set_goal(GroupHandle group, const char *method, const int *linea
     }
 }
 
+void GridWorld::set_policy(GroupHandle group, std::shared_ptr<Policy> policy) {
+    if (group < 0 || group >= groups.size())
+        LOG(FATAL) << "invalid group handle in GridWorld::set_policy : " << group;
+    if (policies.size() < groups.size())
+        policies.resize(groups.size());
+    policies[group] = policy;
+}
+
+void GridWorld::infer_policy_actions(GroupHandle group) {
+    auto prof_start = profiler.now();
+    Group &g = groups[group];
+    const AgentType &type = g.get_type();
+    const Policy &policy = *policies[group];
+    const int n_group = (int)groups.size();
+
+    PolicyContext ctx;
+    ctx.group = group;
+    ctx.view_height = type.view_range->get_height();
+    ctx.view_width = type.view_range->get_width();
+    ctx.n_channel = type.n_channel;
+    ctx.wall_channel = 0;
+    ctx.food_channel = config.food_mode ? 1 : -1;
+    ctx.minimap_mode = config.minimap_mode;
+    ctx.move_base = type.move_base;
+    ctx.attack_base = type.attack_base;
+    ctx.view2attack.resize((size_t)ctx.view_height * ctx.view_width);
+    get_view2attack(type, ctx.view2attack.data());
+
+    std::vector<int> channel_trans = make_channel_trans(group, group2channel(0), type.n_channel, n_group);
+    for (int i = 0; i < n_group; i++)
+        ctx.group_channels.push_back(channel_trans[group2channel(i)]);
+    policy.check(ctx);
+
+    std::vector<float> &minimap = g.get_minimap_buffer();
+    if (config.minimap_mode) {
+        minimap.resize((size_t)ctx.view_height * ctx.view_width * n_group);
+        build_minimap(type, ctx.view_height, ctx.view_width, minimap.data());
+    }
+
+    std::vector<Agent*> &agents = g.get_agents();
+    const int agent_size = (int)agents.size();
+    const size_t view_size = (size_t)ctx.view_height * ctx.view_width * ctx.n_channel;
+    const unsigned int step_seed = config.deterministic_mode ? 0 : (unsigned int)random_engine();
+    policy_actions.resize(agents.size());
+
+    // every chunk extracts the views of its agents into its own buffer, one at a time
+    utility::parallel_range(executor, agent_size, GRAIN_VIEW, [&](int begin, int end) {
+        std::vector<float> view(view_size);
+        for (int i = begin; i < end; i++) {
+            Agent *agent = agents[i];
+            memset(view.data(), 0, sizeof(float) * view_size);
+            map.extract_view(agent, view.data(), &channel_trans[0]);
+            if (config.minimap_mode)
+                copy_minimap(agent, channel_trans, minimap.data(), ctx.view_height, ctx.view_width,
+                             ctx.n_channel, view.data());
+
+            unsigned int seed = config.deterministic_mode
+                                ? utility::Philox(random_seed, RNG_POLICY, step_counter, (uint32_t)agent->get_id())()
+                                : step_seed ^ ((unsigned int)agent->get_id() * 2654435761u);
+            policy_actions[i] = policy.infer_action(*agent, view.data(), ctx, &seed);
+        }
+    });
+
+    push_actions(group, policy_actions.data());
+    profiler.record(PROF_POLICY, prof_start, agent_size);
+}
+
+void GridWorld::set_model(GroupHandle group, std::shared_ptr<InferenceBackend> model) {
+    if (group < 0 || group >= groups.size())
+        LOG(FATAL) << "invalid group handle in GridWorld::set_model : " << group;
+    if (models.size() < groups.size())
+        models.resize(groups.size());
+    models[group] = model;
+}
+
+bool GridWorld::is_controlled(GroupHandle group) const {
+    return (group < policies.size() && policies[group] != nullptr)
+           || (group < models.size() && models[group] != nullptr);
+}
+
+void GridWorld::infer_model_actions() {
+    auto prof_start = profiler.now();
+    size_t agent_size = 0;
+    std::future<void> pending;
+    GroupHandle pending_group = -1;
+    int slot = 0;
+
+    for (GroupHandle i = 0; i < models.size(); i++) {
+        if (models[i] == nullptr)
+            continue;
+
+        Group &g = groups[i];
+        const AgentType &type = g.get_type();
+        InferenceBatch batch;
+        batch.n = g.get_num();
+        batch.view_height = type.view_range->get_height();
+        batch.view_width = type.view_range->get_width();
+        batch.n_channel = type.n_channel;
+        batch.feature_size = get_feature_size(i);
+        batch.n_action = (int)type.action_space.size();
+        agent_size += batch.n;
+
+        // the buffers of this slot were used by the group before the pending one, which has finished
+        model_views[slot].resize((size_t)batch.n * batch.view_height * batch.view_width * batch.n_channel + 1);
+        model_features[slot].resize((size_t)batch.n * batch.feature_size + 1);
+        model_actions[slot].resize((size_t)batch.n + 1);
+        float *buffers[2] = {model_views[slot].data(), model_features[slot].data()};
+        extract_observation(i, buffers, utility::OBS_FLOAT32);  // models take float views
+        batch.view = buffers[0];
+        batch.feature = buffers[1];
+
+        if (pending.valid()) {
+            pending.get();
+            push_actions(pending_group, model_actions[1 - slot].data());
+        }
+        InferenceBackend *model = models[i].get();
+        int *actions = model_actions[slot].data();
+        pending = std::async(std::launch::async, [model, batch, actions]() {
+            if (batch.n > 0)
+                model->forward(batch, actions);
+        });
+        pending_group = i;
+        slot = 1 - slot;
+    }
+
+    if (pending.valid()) {
+        pending.get();
+        push_actions(pending_group, model_actions[1 - slot].data());
+        profiler.record(PROF_POLICY, prof_start, agent_size);
+    }
+}
+
 void GridWorld::calc_reward() {
     size_t rule_size = reward_rules.size();
-    for (int i = 0; i < groups.size(); i++)
-        groups[i].set_recursive_base(0);
 
+    // collect agents that attacked, killed or collided with something for the event-driven rules
+    for (int i = 0; i < event_groups.size(); i++) {
+        std::vector<Agent*> &agents = groups[event_groups[i]].get_agents();
+        std::vector<Agent*> &event_agents = groups[event_groups[i]].get_event_agents();
+        event_agents.clear();
+        for (int j = 0; j < agents.size(); j++) {
+            if (agents[j]->get_op_obj() != nullptr)
+                event_agents.push_back(agents[j]);
+        }
+    }
+
+    // an evaluation for every rule, or for every GRAIN_AGENT candidates of the first level
+    // if it is an `any` symbol. evaluations are independent, they run in parallel
+    int n_ctx = 0;
     for (int i = 0; i < rule_size; i++) {
+        RewardRule &rule = reward_rules[i];
+        int n_candidate = 0;
+        if (!rule.input_symbols.empty() && rule.input_symbols[0]->is_any()) {
+            Group &g = groups[rule.input_symbols[0]->group];
+            n_candidate = (int)(rule.from_events[0] ? g.get_event_agents() : g.get_agents()).size();
+        }
+        int begin = 0;
+        do {
+            if (n_ctx == rule_contexts.size())
+                rule_contexts.emplace_back();
+            RuleContext &ctx = rule_contexts[n_ctx++];
+            ctx.rule  = i;
+            ctx.begin = begin;
+            ctx.end   = std::min(begin + GRAIN_AGENT, n_candidate);
+            begin = ctx.end;
+        } while (begin < n_candidate);
+    }
+
+    utility::parallel_range(executor, n_ctx, 1, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            auto start = rule_profiler.now();
+            RuleContext &ctx = rule_contexts[i];
+            RewardRule &rule = reward_rules[ctx.rule];
+            ctx.entities.assign(agent_symbols.size(), nullptr);
+            ctx.involved.clear();
+            ctx.auto_value = rule.values.empty() ? 0 : rule.values[0];
+            ctx.trigger = false;
+            ctx.rewards.clear();
+            ctx.scanned.assign(groups.size(), false);
+            ctx.n_leaf = 0;
+            calc_rule(ctx, 0);
+            ctx.time = std::chrono::duration<double>(rule_profiler.now() - start).count();
+        }
+    });
+
+    // merge in the order of the serial search
+    for (int i = 0; i < rule_size; i++)
         reward_rules[i].trigger = false;
-        std::vector<AgentSymbol*> &input_symbols = reward_rules[i].input_symbols;
-        std::vector<AgentSymbol*> &infer_obj     = reward_rules[i].infer_obj;
-        calc_rule(input_symbols, infer_obj, reward_rules[i], 0);
+    std::vector<bool> scanned(groups.size(), false);
+    for (int i = 0; i < n_ctx; i++) {
+        const RuleContext &ctx = rule_contexts[i];
+        for (const RuleContext::RewardRecord &record : ctx.rewards) {
+            if (record.agent == nullptr)
+                groups[record.group].add_reward(record.value);
+            else
+                record.agent->add_reward(record.value);
+        }
+        reward_rules[ctx.rule].trigger |= ctx.trigger;
+        for (int j = 0; j < groups.size(); j++)
+            scanned[j] = scanned[j] || ctx.scanned[j];
+        rule_profiler.add(ctx.rule, ctx.time, ctx.n_leaf, i == 0 || rule_contexts[i - 1].rule != ctx.rule);
     }
+
+    // the base the scan of a group ends with, kept in the saved state
+    for (int i = 0; i < groups.size(); i++)
+        groups[i].set_recursive_base(scanned[i] ? (int)groups[i].get_size() - 1 : 0);
 }
 
 void GridWorld::get_reward(GroupHandle group, float *buffer) {
-    std::vector<Agent*> &agents = groups[group].get_agents();
+    if (buffer == nullptr) {  // use registered buffer
+        RegisteredBuffers &reg = groups[group].get_registered();
+        if (reg.reward == nullptr)
+            LOG(FATAL) << "no registered reward buffer in GridWorld::get_reward for group " << group;
+        if (groups[group].get_num() > reg.reward_capacity)
+            LOG(FATAL) << "registered reward buffer is too small in GridWorld::get_reward : "
+                       << groups[group].get_num() << " agents";
+        buffer = reg.reward;
+    }
+
+    const Reward *rewards = groups[group].get_store().rewards.data();
 
-    size_t  agent_size = agents.size();
+    size_t  agent_size = groups[group].get_size();
     Reward  group_reward = groups[group].get_reward();
 
-    #pragma omp parallel for
-    for (int i = 0; i < agent_size; i++) {
-        buffer[i] = agents[i]->get_reward() + group_reward;
-    }
+    utility::parallel_range(executor, (int)agent_size, GRAIN_AGENT, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            buffer[i] = rewards[i] + group_reward;
+        }
+    });
 }
 
 /**
@@ -716,24 +1943,24 @@ void GridWorld::get_info(GroupHandle group, const char *name, void *void_buffer)
 
     if (strequ(name, "num")) {         // int
         int_buffer[0] = groups[group].get_num();
+    } else if (strequ(name, "global_num")) {  // int, over all the ranks in distributed mode, asked by every rank
+        std::vector<double> num(1, (double)groups[group].get_num());
+        if (domain != nullptr)
+            reduce_sum(num);
+        int_buffer[0] = (int)num[0];
     } else if (strequ(name, "id")) {   // int
-        size_t agent_size = agents.size();
-        #pragma omp parallel for
-        for (int i = 0; i < agent_size; i++) {
-            int_buffer[i] = agents[i]->get_id();
-        }
+        const AgentStore &store = groups[group].get_store();
+        memcpy(int_buffer, store.ids.data(), sizeof(int) * store.size());
     } else if (strequ(name, "pos")) {   // int
-        size_t agent_size = agents.size();
-        #pragma omp parallel for
-        for (int i = 0; i < agent_size; i++) {
-            int_buffer[2 * i] = agents[i]->get_pos().x;
-            int_buffer[2 * i + 1] = agents[i]->get_pos().y;
-        }
+        const AgentStore &store = groups[group].get_store();
+        static_assert(sizeof(Position) == 2 * sizeof(int), "Position should be two packed ints");
+        memcpy(int_buffer, store.poses.data(), sizeof(Position) * store.size());
     } else if (strequ(name, "alive")) {  // bool
-        size_t agent_size = agents.size();
-        #pragma omp parallel for
+        const AgentStore &store = groups[group].get_store();
+        const unsigned char *deads = store.deads.data();
+        size_t agent_size = store.size();
         for (int i = 0; i < agent_size; i++) {
-            bool_buffer[i] = !agents[i]->is_dead();
+            bool_buffer[i] = !deads[i];
         }
     } else if (strequ(name, "global_minimap")) {
         size_t n_group = groups.size();
@@ -744,46 +1971,30 @@ void GridWorld::get_info(GroupHandle group, const char *name, void *void_buffer)
 
         NDPointer<float, 3> minimap(float_buffer, {view_height, view_width, (int)n_group});
 
-        int scale_h = (height + view_height - 1) / view_height;
-        int scale_w = (width + view_width - 1) / view_width;
+        int scale_h = (config.height + view_height - 1) / view_height;
+        int scale_w = (config.width + view_width - 1) / view_width;
 
         for (size_t i = 0; i < n_group; i++) {
             size_t channel = (i - group + n_group) % n_group;
-            std::vector<Agent*> &agents_ = groups[i].get_agents();
-            for (size_t j = 0; j < agents_.size(); j++) {
-                Position pos = agents_[j]->get_pos();
-                int x = pos.x / scale_w, y = pos.y / scale_h;
-                minimap.at(y, x, channel)++;
-            }
-            // scale
+            GroupStats &stats = groups[i].get_stats();
+            const int *counts = stats.get_grid(view_height, view_width, scale_h, scale_w, groups[i].get_agents());
+            const float total_ct = (float)stats.get_num();
             for (size_t j = 0; j < view_height; j++) {
                 for (size_t k = 0; k < view_width; k++) {
-                    minimap.at(j, k, channel) /= agents_.size();
+                    minimap.at(j, k, channel) = counts[j * view_width + k] / total_ct;
                 }
             }
         }
     } else if (strequ(name, "mean_info")) {
         size_t agent_size = agents.size();
         int n_action = (int)groups[group].get_type().action_space.size();
-        int *action_counter = new int[n_action];
-        float sum_x, sum_y;
-        sum_x = sum_y = 0;
-        memset(action_counter, 0, sizeof(int) * n_action);
-        #pragma omp parallel for reduction(+: sum_x) reduction(+: sum_y)
-        for (int i = 0; i < agent_size; i++) {
-            Position pos = agents[i]->get_pos();
-            sum_x += pos.x;
-            sum_y += pos.y;
-            int x = agents[i]->get_action();
-            #pragma omp atomic
-            action_counter[x]++;
-        }
+        const GroupStats &stats = groups[group].get_stats();
 
         assert (agent_size != 0);
-        float_buffer[0] = sum_x / agent_size;
-        float_buffer[1] = sum_y / agent_size;
+        float_buffer[0] = (float)stats.get_sum_x() / agent_size;
+        float_buffer[1] = (float)stats.get_sum_y() / agent_size;
         for (int i = 0; i < n_action; i++)
-            float_buffer[2 + i] = (float)(1.0 * action_counter[i] / agent_size);
+            float_buffer[2 + i] = (float)(1.0 * stats.get_action_count(i) / agent_size);
     } else if (strequ(name, "walls_info")) {
         std::vector<Position> walls;
         map.get_wall(walls);
@@ -848,26 +2059,12 @@ void GridWorld::get_info(GroupHandle group, const char *name, void *void_buffer)
         int_buffer[0] = groups[group].get_type().view_range->get_height();
         int_buffer[1] = groups[group].get_type().view_range->get_width();
         int_buffer[2] = groups[group].get_type().n_channel;
+    } else if (strequ(name, "view_dtype")) {  // int, 0 for float32, 1 for float16, 2 for uint8
+        int_buffer[0] = (int)config.obs_dtype;
     } else if (strequ(name, "feature_space")) {
         int_buffer[0] = get_feature_size(group);
     } else if (strequ(name, "view2attack")) {
-        const AgentType &type = groups[group].get_type();
-        const Range *range = type.attack_range;
-        const Range *view_range = type.view_range;
-        const int view_width = view_range->get_width(), view_height = view_range->get_height();
-
-        NDPointer<int, 2> ret(int_buffer, {view_height, view_width});
-        memset(ret.data, -1, sizeof(int) * view_height * view_width);
-        int x1, y1, x2, y2;
-
-        view_range->get_range_rela_offset(x1, y1, x2, y2);
-        for (int i = 0; i < range->get_count(); i++) {
-            int dx, dy;
-            range->num2delta(i, dx, dy);
-            //dx -= type.att_x_offset; dy -= type.att_y_offset;
-
-            ret.at(dy - y1, dx - x1) = i;
-        }
+        get_view2attack(groups[group].get_type(), int_buffer);
     } else if (strequ(name, "attack_base")) {
         int_buffer[0] = groups[group].get_type().attack_base;
     }  else if (strequ(name, "groups_info")) {
@@ -886,14 +2083,116 @@ void GridWorld::get_info(GroupHandle group, const char *name, void *void_buffer)
             info.at(i, 3) = colors[i][1];
             info.at(i, 4) = colors[i][2];
         }
+    } else if (strequ(name, "event_num")) {  // int, events of the last step
+        int_buffer[0] = (int)events.size();
+    } else if (strequ(name, "events")) {     // StepEvent * event_num
+        if (!events.empty())
+            memcpy(void_buffer, events.data(), events.size() * sizeof(StepEvent));
     } else if (strequ(name, "both_attack")) {
         int_buffer[0] = stat_recorder.both_attack;
+    } else if (strequ(name, "serial_action")) {  // int, moves and turns done serially since reset
+        int_buffer[0] = stat_recorder.serial_action;
+    } else if (strequ(name, "domain")) {  // int, (rank, number of ranks, first row, end row) of this rank
+        int_buffer[0] = domain == nullptr ? 0 : domain->rank;
+        int_buffer[1] = domain == nullptr ? 1 : domain->size;
+        int_buffer[2] = domain == nullptr ? 0 : domain->y_begin;
+        int_buffer[3] = domain == nullptr ? config.height : domain->y_end;
+    } else if (strequ(name, "profile")) {  // float, (n_phase, (time in ms, calls, items) * n_phase), reset after read
+        int n_phase = profiler.get_phase_num();
+        float_buffer[0] = n_phase;
+        NDPointer<float, 2> ret(float_buffer + 1, {n_phase, 3});
+        for (int i = 0; i < n_phase; i++) {
+            ret.at(i, 0) = (float)(profiler.get_time(i) * 1000);
+            ret.at(i, 1) = (float)profiler.get_calls(i);
+            ret.at(i, 2) = (float)profiler.get_items(i);
+        }
+        profiler.reset();
+    } else if (strequ(name, "rule_profile")) {  // float, (n_rule, (time in ms, steps, permutations) * n_rule), reset after read
+        int n_rule = rule_profiler.get_phase_num();
+        float_buffer[0] = n_rule;
+        NDPointer<float, 2> ret(float_buffer + 1, {n_rule, 3});
+        for (int i = 0; i < n_rule; i++) {
+            ret.at(i, 0) = (float)(rule_profiler.get_time(i) * 1000);
+            ret.at(i, 1) = (float)rule_profiler.get_calls(i);
+            ret.at(i, 2) = (float)rule_profiler.get_items(i);
+        }
+        rule_profiler.reset();
+    } else if (strequ(name, "memory")) {  // float, (n_category, bytes * n_category), see MemoryCategory
+        std::vector<size_t> bytes;
+        count_memory(bytes);
+        float_buffer[0] = MEM_CATEGORY_NUM;
+        for (int i = 0; i < MEM_CATEGORY_NUM; i++)
+            float_buffer[i + 1] = (float)bytes[i];
     } else {
         LOG(FATAL) << "unsupported info name in GridWorld::get_info : " << name;
     }
 }
 
 // private utility
+void GridWorld::count_memory(std::vector<size_t> &bytes) {
+    bytes.assign(MEM_CATEGORY_NUM, 0);
+
+    bytes[MEM_MAP] = map.get_memory() + (size_t)std::max(config.width, 0) * sizeof(int)
+                     + (size_t)std::max(config.height, 0) * sizeof(int);  // counter_x, counter_y
+    if (device_observer != nullptr)
+        bytes[MEM_MAP] += device_observer->get_memory();
+    for (const Group &g : groups) {
+        bytes[MEM_AGENT] += g.get_agent_memory();
+        bytes[MEM_GROUP_BUFFER] += g.get_buffer_memory();
+    }
+    for (const auto &item : agent_types)
+        bytes[MEM_RANGE] += item.second.get_memory();
+    bytes[MEM_REWARD] = get_reward_memory();
+    bytes[MEM_RENDER] = render_generator.get_memory();
+
+    size_t &step = bytes[MEM_STEP_BUFFER];
+    step += utility::vector_bytes(attack_buffer) + utility::vector_bytes(attack_targets)
+            + utility::vector_bytes(attack_order) + utility::vector_bytes(shard_begin)
+            + utility::vector_bytes(shard_dead_ct) + utility::vector_bytes(shard_both_attack)
+            + utility::vector_bytes(attack_runs) + utility::vector_bytes(shard_run_begin)
+            + utility::vector_bytes(shard_run_end) + utility::vector_bytes(pending_runs)
+            + utility::vector_bytes(run_of) + utility::vector_bytes(attack_of);
+    for (const std::vector<Reward> &buffer : frame_rewards)
+        step += sizeof(buffer) + utility::vector_bytes(buffer);
+    for (const std::vector<MoveAction> &buffer : move_buffers)
+        step += sizeof(buffer) + utility::vector_bytes(buffer);
+    for (const std::vector<TurnAction> &buffer : turn_buffers)
+        step += sizeof(buffer) + utility::vector_bytes(buffer);
+    for (int i = 0; i < 4; i++)
+        step += utility::vector_bytes(color_tiles[i]);
+    step += utility::vector_bytes(move_buffer_bound) + utility::vector_bytes(turn_buffer_bound);
+    step += utility::vector_bytes(policy_actions);
+    for (int i = 0; i < 2; i++) {
+        step += utility::vector_bytes(model_views[i]) + utility::vector_bytes(model_features[i])
+                + utility::vector_bytes(model_actions[i]);
+    }
+    step += utility::vector_bytes(events);
+    for (const std::vector<StepEvent> &buffer : event_buffers)
+        step += sizeof(buffer) + utility::vector_bytes(buffer);
+}
+
+void GridWorld::check_memory_limit(const char *where) {
+    if (config.memory_limit <= 0)
+        return;
+
+    static const char *names[MEM_CATEGORY_NUM] = {
+        "map", "agent", "group_buffer", "range", "reward", "render", "step_buffer",
+    };
+    std::vector<size_t> bytes;
+    count_memory(bytes);
+    size_t total = 0;
+    for (size_t b : bytes)
+        total += b;
+    if (total <= ((size_t)config.memory_limit << 20))
+        return;
+
+    std::ostringstream os;
+    for (int i = 0; i < MEM_CATEGORY_NUM; i++)
+        os << (i == 0 ? "" : ", ") << names[i] << " " << (bytes[i] >> 20) << " MiB";
+    LOG(FATAL) << "the memory of the game is over memory_limit (" << config.memory_limit << " MiB) after "
+               << where << " : " << os.str();
+}
+
 std::vector<int> GridWorld::make_channel_trans(
         GroupHandle group,
         int base, int n_channel, int n_group) {
@@ -903,7 +2202,7 @@ std::vector<int> GridWorld::make_channel_trans(
     for (int i = 0; i < groups.size(); i++) {
         int cycle_group = (group + i) % n_group;
         trans[group2channel(cycle_group)] = base;
-        if (minimap_mode) {
+        if (config.minimap_mode) {
             base += 3;
         } else {
             base += 2;
@@ -915,9 +2214,9 @@ std::vector<int> GridWorld::make_channel_trans(
 int GridWorld::group2channel(GroupHandle group) {
     int base = 1;
     int scale = 2;
-    if (food_mode)
+    if (config.food_mode)
         base++;
-    if (minimap_mode)
+    if (config.minimap_mode)
         scale++;
 
     return base + group * scale; // wall + additional + (has, hp) + (has, hp) + ...
@@ -925,11 +2224,13 @@ int GridWorld::group2channel(GroupHandle group) {
 
 int GridWorld::get_feature_size(GroupHandle group) {
     // feature space layout : [embedding, last_action (one hot), last_reward]
-    int feature_space = embedding_size + (int)groups[group].get_type().action_space.size() + 1;
-    if (goal_mode)
+    int feature_space = config.embedding_size + (int)groups[group].get_type().action_space.size() + 1;
+    if (config.goal_mode)
         feature_space += 2;
-    if (minimap_mode)  // x, y coordinate
+    if (config.minimap_mode)  // x, y coordinate
         feature_space += 2;
+    // pooled features : (density, hp) of every group at every radius
+    feature_space += (int)(config.pooled_radii.size() * groups.size() * 2);
     return feature_space;
 }
 
@@ -937,15 +2238,205 @@ int GridWorld::get_feature_size(GroupHandle group) {
  * render
  */
 void GridWorld::render() {
+    auto prof_start = profiler.now();
     if (render_generator.get_save_dir() == "___debug___")
         map.render();
+    else if (domain != nullptr)
+        render_distributed();
     else {
         if (first_render) {
             first_render = false;
-            render_generator.gen_config(groups, width, height);
+            render_generator.gen_config(groups, config.width, config.height);
         }
         render_generator.render_a_frame(groups, map);
     }
+    profiler.record(PROF_RENDER, prof_start);
+    check_memory_limit("render");
+}
+
+/**
+ * state snapshot
+ */
+static const char STATE_MAGIC[4] = {'M', 'A', 'G', 'S'};
+static const uint32_t STATE_VERSION = 3;
+
+void Agent::save_state(utility::StateWriter &writer) const {
+    writer.write(absorbed);
+    writer.write(last_op);
+    writer.write(last_reward);
+    writer.write(goal);
+    writer.write(goal_radius);
+}
+
+void Agent::load_state(utility::StateReader &reader) {
+    absorbed = reader.read<bool>();
+    last_op = reader.read<EventOp>();
+    last_reward = reader.read<Reward>();
+    goal = reader.read<Position>();
+    goal_radius = reader.read<int>();
+    op_obj = nullptr;
+}
+
+void Group::save_state(utility::StateWriter &writer) const {
+    writer.write<uint64_t>(agents.size());
+    writer.write(dead_ct);
+    writer.write(next_reward);
+    writer.write(center_x);
+    writer.write(center_y);
+    writer.write(recursive_base);
+
+    for (const Agent *agent : agents)
+        agent->save_state(writer);
+    writer.write_vector(store->ids);
+    writer.write_vector(store->poses);
+    writer.write_vector(store->dirs);
+    writer.write_vector(store->hps);
+    writer.write_vector(store->deads);
+    writer.write_vector(store->rewards);
+    writer.write_vector(store->last_actions);
+}
+
+void Group::load_state(utility::StateReader &reader, GroupHandle handle) {
+    clear();
+    registered.obs_fresh = false;
+
+    uint64_t n = reader.read<uint64_t>();
+    dead_ct = reader.read<int>();
+    next_reward = reader.read<Reward>();
+    center_x = reader.read<float>();
+    center_y = reader.read<float>();
+    recursive_base = reader.read<int>();
+
+    // the rows initialized by the constructor of Agent are overwritten by the saved store
+    agents.reserve(n);
+    for (uint64_t i = 0; i < n; i++)
+        new_agent(0, handle)->load_state(reader);
+    reader.read_vector(store->ids);
+    reader.read_vector(store->poses);
+    reader.read_vector(store->dirs);
+    reader.read_vector(store->hps);
+    reader.read_vector(store->deads);
+    reader.read_vector(store->rewards);
+    reader.read_vector(store->last_actions);
+    if (store->ids.size() != n || store->poses.size() != n || store->dirs.size() != n || store->hps.size() != n
+        || store->deads.size() != n || store->rewards.size() != n || store->last_actions.size() != n)
+        LOG(FATAL) << "broken group in the state";
+
+    for (size_t i = 0; i < n; i++)
+        stats.add(store->poses[i], store->last_actions[i]);
+}
+
+void GridWorld::save_state(std::vector<char> &blob) {
+    if (domain != nullptr)  // ghosts of the neighbours are in the map
+        LOG(FATAL) << "save_state is not supported in distributed mode";
+    utility::StateWriter writer(blob);
+
+    writer.write_array(STATE_MAGIC, sizeof(STATE_MAGIC));
+    writer.write(STATE_VERSION);
+    writer.write<int32_t>(config.width);
+    writer.write<int32_t>(config.height);
+    writer.write<uint64_t>(groups.size());
+    for (int i = 0; i < groups.size(); i++)
+        writer.write_string(groups[i].get_type().name);
+
+    writer.write(id_counter);
+    writer.write(stat_recorder);
+    std::ostringstream engine_state;
+    engine_state << random_engine;
+    writer.write_string(engine_state.str());
+    writer.write(random_seed);
+    writer.write(step_counter);
+    writer.write(call_counter);
+
+    for (int i = 0; i < groups.size(); i++)
+        groups[i].save_state(writer);
+    map.save_state(writer);
+}
+
+void GridWorld::load_state(const char *blob, size_t size) {
+    if (domain != nullptr)
+        LOG(FATAL) << "load_state is not supported in distributed mode";
+    utility::StateReader reader(blob, size);
+
+    char magic[4];
+    reader.read_array(magic, sizeof(magic));
+    if (memcmp(magic, STATE_MAGIC, sizeof(magic)) != 0 || reader.read<uint32_t>() != STATE_VERSION)
+        LOG(FATAL) << "invalid state in GridWorld::load_state";
+    if (counter_x == nullptr)
+        LOG(FATAL) << "reset the environment before GridWorld::load_state";
+    int state_width = reader.read<int32_t>(), state_height = reader.read<int32_t>();
+    if (state_width != config.width || state_height != config.height || reader.read<uint64_t>() != groups.size())
+        LOG(FATAL) << "the state is saved by an environment with another configuration";
+    for (int i = 0; i < groups.size(); i++) {
+        if (reader.read_string() != groups[i].get_type().name)
+            LOG(FATAL) << "the state is saved by an environment with another configuration";
+    }
+
+    id_counter = reader.read<int>();
+    stat_recorder = reader.read<StatRecorder>();
+    std::istringstream engine_state(reader.read_string());
+    engine_state >> random_engine;
+    random_seed = reader.read<uint64_t>();
+    step_counter = reader.read<uint32_t>();
+    call_counter = reader.read<uint32_t>();
+
+    for (int i = 0; i < groups.size(); i++)
+        groups[i].load_state(reader, (GroupHandle)i);
+    map.load_state(reader, groups);
+    if (!reader.at_end())
+        LOG(FATAL) << "broken state in GridWorld::load_state";
+    mark_replay_dirty();
+}
+
+void GridWorld::mark_replay_dirty() {
+    if (recorder != nullptr)
+        recorder->mark_dirty();
+}
+
+Environment *GridWorld::clone() {
+    if (domain != nullptr)  // a clone would be another rank
+        LOG(FATAL) << "clone is not supported in distributed mode";
+    GridWorld *ret = new GridWorld();
+
+    ret->config = config;
+    ret->executor = executor;
+    ret->policies = policies;
+    ret->models = models;
+
+    // ranges are owned by every environment
+    for (auto &item : agent_types) {
+        AgentType type = item.second;
+        type.view_range = type.view_range == nullptr ? nullptr : new Range(*type.view_range);
+        type.attack_range = type.attack_range == nullptr ? nullptr : new Range(*type.attack_range);
+        type.move_range = type.move_range == nullptr ? nullptr : new Range(*type.move_range);
+        ret->agent_types.insert(std::make_pair(item.first, type));
+    }
+    for (int i = 0; i < groups.size(); i++)
+        ret->groups.push_back(Group(ret->agent_types.find(groups[i].get_type().name)->second));
+
+    // the reward description is rebuilt from the raw parameters in reset
+    for (const AgentSymbol &symbol : agent_symbols)
+        ret->define_agent_symbol((int)ret->agent_symbols.size(), symbol.group, symbol.index);
+    for (const EventNode &node : event_nodes) {
+        EventNode copy;
+        copy.op = node.op;
+        copy.raw_parameter = node.raw_parameter;
+        ret->event_nodes.push_back(copy);
+    }
+    for (const RewardRule &rule : reward_rules) {
+        RewardRule copy;
+        copy.raw_parameter = rule.raw_parameter;
+        copy.values = rule.values;
+        copy.is_terminal = rule.is_terminal;
+        copy.auto_value = rule.auto_value;
+        ret->reward_rules.push_back(copy);
+    }
+
+    ret->reset();
+    std::vector<char> blob;
+    save_state(blob);
+    ret->load_state(blob.data(), blob.size());
+    return ret;
 }
 
 } // namespace magent
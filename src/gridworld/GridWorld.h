@@ -11,31 +11,78 @@
 #include <cmath>
 #include <cstdlib>
 #include <cstring>
+#include <memory>
 
 #include "../Environment.h"
+#include "../utility/ObjectPool.h"
+#include "../utility/Profiler.h"
+#include "../utility/StateBuffer.h"
+#include "../utility/ObsDtype.h"
+#include "../utility/ThreadPool.h"
 #include "grid_def.h"
 #include "Map.h"
 #include "Range.h"
 #include "AgentType.h"
 #include "RenderGenerator.h"
 #include "RewardEngine.h"
+#include "Policy.h"
+#include "InferenceBackend.h"
 
 namespace magent {
 namespace gridworld {
 
+struct Domain;
+class ReplayRecorder;
 
 // the statistical recorder
 struct StatRecorder {
     int both_attack;
+    int serial_action;   // moves and turns that fall into the serial boundary buffer
 
     void reset() {
         both_attack = 0;
+        serial_action = 0;
     }
 };
 
+// kinds of the event stream, bit (1 << kind) of the config event_mask enables a kind
+enum StepEventKind {
+    EVENT_ATTACK,   // src hits dst by damage (value), also for the hit which kills
+    EVENT_KILL,     // src kills dst
+    EVENT_EAT,      // src eats value of the food at (x, y)
+    EVENT_STARVE,   // src starves to death at (x, y)
+    EVENT_BLOCKED,  // the move of src to (x, y) is blocked by dst, or by a wall or the border (dst = -1)
+    EVENT_KIND_NUM,
+};
+
+// a record of get_info(-1, "events"), seven 4-byte fields
+struct StepEvent {
+    int32_t kind;
+    int32_t frame;     // frame of the step, see frame_skip
+    int32_t src, dst;  // agent ids, -1 for none
+    int32_t x, y;      // the target cell
+    float value;
+};
+
+// phases of the profiler, read (and reset) by get_info(-1, "profile")
+enum ProfilePhase {
+    PROF_ATTACK, PROF_STARVE, PROF_TURN_PARALLEL, PROF_TURN_BOUNDARY,
+    PROF_MOVE_PARALLEL, PROF_MOVE_BOUNDARY, PROF_CALC_REWARD,
+    PROF_GET_OBSERVATION, PROF_CLEAR_DEAD, PROF_RENDER, PROF_POLICY,
+    PROF_PHASE_NUM,
+};
+
+// categories of the memory accounting, read by get_info(-1, "memory") and capped by memory_limit
+enum MemoryCategory {
+    MEM_MAP, MEM_AGENT, MEM_GROUP_BUFFER, MEM_RANGE, MEM_REWARD, MEM_RENDER, MEM_STEP_BUFFER,
+    MEM_CATEGORY_NUM,
+};
+
 
 // the main engine
 class GridWorld: public Environment {
+    friend class Replayer;
+    friend class ReplayRecorder;
 public:
     GridWorld();
     ~GridWorld() override;
@@ -46,9 +93,20 @@ public:
 
     // run step
     void get_observation(GroupHandle group, float **linear_buffers) override;
+    void get_observation_subset(GroupHandle group, const int *indices, int n, float **linear_buffers) override;
+    // nonzero entries of views in COO (offsets per agent, (view_y, view_x, channel), value), returns the count
+    int get_observation_sparse(GroupHandle group, int *offsets, int *coords, float *values, int capacity,
+                               float *features);
+    // views and features of group written into buffers on the cuda device, in the layout of get_observation.
+    // views are float32 whatever obs_dtype, needs USE_CUDA in cmake
+    void get_observation_device(GroupHandle group, float *device_views, float *device_features);
     void set_action(GroupHandle group, const int *actions) override;
     void step(int *done) override;
     void get_reward(GroupHandle group, float *buffer) override;
+    void clear_dead() override;
+    void step_full(const int **actions, float ***obs, float **rewards, bool **alive, int **ids,
+                   int *nums, int *done) override;
+    void register_buffer(GroupHandle group, const char *name, void *buffer, int capacity) override;
 
     // info getter
     void get_info(GroupHandle group, const char *name, void *buffer) override;
@@ -56,9 +114,18 @@ public:
     // render
     void render() override;
 
+    // state snapshot
+    void save_state(std::vector<char> &blob) override;
+    void load_state(const char *blob, size_t size) override;
+    // a full copy through save_state, a clone steps right away and a step writes the slots and planes anyway
+    Environment *clone() override;
+
     // special run step
-    void clear_dead();
     void set_goal(GroupHandle group, const char *method, const int *linear_buffer);
+    // bind a scripted policy to group (nullptr to unbind), its actions are inferred at the beginning of step
+    void set_policy(GroupHandle group, std::shared_ptr<Policy> policy);
+    // bind a model to group (nullptr to unbind), its actions are inferred at the beginning of step
+    void set_model(GroupHandle group, std::shared_ptr<InferenceBackend> model);
 
     // agent
     void register_agent_type(const char *name, int n, const char **keys, float *values);
@@ -76,10 +143,76 @@ private:
     // reward description
     void init_reward_description();
     void calc_reward();
-    void calc_rule(std::vector<AgentSymbol *> &input_symbols, std::vector<AgentSymbol *> &infer_obj,
-                   RewardRule &rule, int now);
-    bool calc_event_node(EventNode *node, RewardRule &rule);
+    void calc_rule(RuleContext &ctx, int now);
+    bool calc_event_node(EventNode *node, RuleContext &ctx);
     void collect_related_symbol(EventNode &node);
+    void compile_rule(RewardRule &rule);
+    size_t get_reward_memory() const;
+
+    void compact_groups(float **rewards, bool **alive, int **ids);
+
+    // observation
+    // indices = nullptr for all the agents
+    void extract_observation(GroupHandle group, float **linear_buffers, utility::ObsDtype dtype,
+                             const int *indices = nullptr, int n_index = 0);
+    void build_minimap(const AgentType &type, int view_height, int view_width, float *minimap);
+    void copy_minimap(const Agent *agent, const std::vector<int> &channel_trans, const float *minimap,
+                      int view_height, int view_width, int n_channel, float *view);
+    void copy_minimap_sparse(const Agent *agent, const std::vector<int> &channel_trans, const float *minimap,
+                             int view_height, int view_width, std::vector<SparseViewEntry> &entries);
+    void fill_feature(Agent *agent, int n_action, float *feature);
+    void get_view2attack(const AgentType &type, int *buffer);
+
+    // kernels of the per-agent loops, specialized on the mode flags so the loops carry no dead branch.
+    // they are selected by select_kernels when the config changes and at reset
+    struct ObserveJob;
+    typedef void (GridWorld::*ObserveKernel)(ObserveJob &job);
+    typedef void (GridWorld::*MoveKernel)(std::vector<MoveAction> &move_buf, std::vector<StepEvent> &events);
+    template <bool MINIMAP, bool INCREMENTAL, bool CONVERT, bool POOLED>
+    void observe_kernel(ObserveJob &job);
+    template <bool ROTATE, bool ABSORB>
+    void move_kernel(std::vector<MoveAction> &move_buf, std::vector<StepEvent> &events);
+    template <bool MINIMAP, bool POOLED>
+    void fill_feature_kernel(Agent *agent, int n_action, float *feature);
+    template <bool MINIMAP, bool INCREMENTAL, bool POOLED>
+    void select_observe_kernels();
+    void select_kernels();
+
+    // policy. push_actions records the actions in the replay, queue_actions only buffers them
+    void push_actions(GroupHandle group, const int *actions);
+    void queue_actions(GroupHandle group, const int *actions);
+    void infer_policy_actions(GroupHandle group);
+    void infer_model_actions();
+    bool is_controlled(GroupHandle group) const;
+
+    // random placement in deterministic_mode
+    void add_random_deterministic(GroupHandle group, int n);
+    int next_agent_id() const;
+
+    void do_turns(std::vector<TurnAction> &turn_buf);
+    // event stream
+    bool want_event(StepEventKind kind) const { return (config.event_mask >> kind & 1) != 0; }
+    void begin_events(size_t n_buffer);
+    void flush_events();
+    // the frames of step after the actions are pushed
+    void run_frames(int *done);
+    // one frame of step, from the attacks to the game over check
+    void step_frame(int *done);
+    void mark_replay_dirty();
+
+    // distributed mode, in Domain.cc
+    void init_domain();
+    void sync_domain();
+    void release_ghosts(int side);
+    void send_halo(int side);
+    void recv_halo(int side);
+    void forward_ghost_damage();
+    void split_border_actions();
+    void run_border_chain();
+    void emigrate(std::vector<char> *messages);
+    void immigrate(std::vector<char> *messages);
+    void reduce_sum(std::vector<double> &values);
+    void render_distributed();
 
     // utility
     // to make channel layout in observation symmetric to every group
@@ -87,109 +220,214 @@ private:
             GroupHandle group, int base, int n_channel, int n_group);
     int group2channel(GroupHandle group);
     int get_feature_size(GroupHandle group);
-
-    // game config
-    int width, height;
-    bool food_mode;      // default = False
-    bool turn_mode;      // default = False
-    bool minimap_mode;   // default = False
-    bool goal_mode;      // default = False
-    bool large_map_mode; // default = False
-    bool mean_mode;      
-    int embedding_size;  // default = 0
+    // heap memory of every MemoryCategory, in bytes
+    void count_memory(std::vector<size_t> &bytes);
+    // raise an error if the memory is over memory_limit, after the operations that grow it
+    void check_memory_limit(const char *where);
+
+    // game config, written by set_config and copied by clone
+    struct Config {
+        int width = 0, height = 0;
+        bool food_mode = false;
+        bool turn_mode = false;
+        bool minimap_mode = false;
+        bool goal_mode = false;
+        bool mean_mode = false;
+        bool incremental_view_mode = false;
+        bool deterministic_mode = false;
+        bool tiled_map_mode = false;
+        int embedding_size = 0;
+        int tile_size = 0;       // 0 for auto, tile size of large_map_mode
+        int frame_skip = 1;      // frames a step repeats the actions for
+        int event_mask = 0;      // kinds of the event stream, none by default
+        int memory_limit = 0;    // in MiB, 0 for none
+        utility::ObsDtype obs_dtype = utility::OBS_FLOAT32;  // element type of exported views
+        std::vector<int> pooled_radii;  // radii of the pooled features, none by default
+    } config;
+    bool large_map_mode; // derived from the map size at reset
+
+    ObserveKernel observe_kernels[2];  // for float views and for converted views
+    MoveKernel move_kernel_fn;
+
+    // parallel loops run on a pool shared with the other games, nullptr for serial loops.
+    // chunks of GRAIN_AGENT cheap updates, GRAIN_VIEW views or policies
+    utility::ThreadPool *executor;
+    static const int GRAIN_AGENT = 512, GRAIN_VIEW = 16;
+
+    // strip of the map owned by this rank in distributed mode, nullptr for a single process
+    std::unique_ptr<Domain> domain;
 
     // game states : map, agent and group
     Map map;
     std::map<std::string, AgentType> agent_types;
     std::vector<Group> groups;
     std::default_random_engine random_engine;
+    // streams of the counter-based engine in deterministic_mode, keyed by (random_seed, stream, counter, agent)
+    enum RandomStream { RNG_ADD_AGENTS, RNG_ATTACK, RNG_POLICY, RNG_GOAL };
+    uint64_t random_seed;
+    uint32_t step_counter, call_counter;  // steps and random add_agents / set_goal calls since seeding
 
     // reward description
     std::vector<AgentSymbol> agent_symbols;
     std::vector<EventNode>   event_nodes;
     std::vector<RewardRule>  reward_rules;
+    std::vector<GroupHandle> event_groups;  // groups whose event agents are collected in calc_reward
+    std::vector<RuleContext> rule_contexts; // evaluations of a step, reused across steps
     bool reward_des_initialized;
 
+    // rewards of the earlier frames of a step per group, added back at the end of the step
+    std::vector<std::vector<Reward>> frame_rewards;
+
     // action buffer
     std::vector<AttackAction> attack_buffer;
-    // split the events to small regions and boundary for parallel
-    int NUM_SEP_BUFFER;
-    std::vector<MoveAction> *move_buffers, move_buffer_bound;
-    std::vector<TurnAction> *turn_buffers, turn_buffer_bound;
+    // attacks are bucketed by target into shards, resolved in parallel
+    std::vector<AttackTarget> attack_targets;
+    std::vector<int> attack_order, shard_begin, shard_dead_ct, shard_both_attack;
+    // runs of attacks on the same object, the runs of a shard are [shard_run_begin[s], shard_run_begin[s + 1]).
+    // run_of and attack_of are indexed by the agent table of the map
+    std::vector<AttackRun> attack_runs;
+    std::vector<int> shard_run_begin, shard_run_end, pending_runs, run_of, attack_of;
+    // split the events to 2D tiles and boundary for parallel.
+    // tiles are colored as a checkerboard (4 colors), tiles of the same color are processed in parallel
+    static const int DEFAULT_TILE_SIZE = 32;
+    int tile_cols, tile_rows, cur_tile_size;
+    std::vector<std::vector<MoveAction>> move_buffers;
+    std::vector<std::vector<TurnAction>> turn_buffers;
+    std::vector<int> color_tiles[4];
+    std::vector<MoveAction> move_buffer_bound;
+    std::vector<TurnAction> turn_buffer_bound;
+
+    // scripted policies of groups, immutable and shared with clones
+    std::vector<std::shared_ptr<Policy>> policies;
+    std::vector<int> policy_actions;
+    // models of groups, shared with clones. observations are double buffered,
+    // so the observation of a group is extracted while the previous group is in forward
+    std::vector<std::shared_ptr<InferenceBackend>> models;
+    std::vector<float> model_views[2], model_features[2];
+    std::vector<int> model_actions[2];
 
     // render
     RenderGenerator render_generator;
     int id_counter;
     bool first_render;
 
+    // event stream of the last step, kinds enabled by config.event_mask.
+    // a parallel phase appends to one buffer per chunk (or shard, tile), the buffers are joined in order
+    int event_frame;
+    std::vector<StepEvent> events;
+    std::vector<std::vector<StepEvent>> event_buffers;
+
+    // replay log of replay_file, nullptr if not recording
+    std::unique_ptr<ReplayRecorder> recorder;
+
+    // device copy of the map for get_observation_device, nullptr until the first call
+    std::unique_ptr<DeviceObserver> device_observer;
+
     // statistic recorder
     StatRecorder stat_recorder;
+    utility::Profiler profiler;
+    utility::Profiler rule_profiler;  // a phase for every reward rule, read (and reset) by get_info(-1, "rule_profile")
     int *counter_x, *counter_y;
 };
 
 
+// structure-of-arrays storage for the hot fields of agents in a group.
+// an Agent object is a stable handle (used by the agent table of Map) to a slot of this store
+struct AgentStore {
+    std::vector<int> ids;
+    std::vector<Position> poses;
+    std::vector<Direction> dirs;
+    std::vector<float> hps;
+    std::vector<unsigned char> deads;
+    std::vector<Reward> rewards;
+    std::vector<Action> last_actions;
+
+    int push() {
+        ids.push_back(0); poses.push_back(Position{0, 0}); dirs.push_back(NORTH);
+        hps.push_back(0); deads.push_back(0); rewards.push_back(0); last_actions.push_back(0);
+        return (int)ids.size() - 1;
+    }
+
+    void move(int from, int to) {
+        ids[to] = ids[from]; poses[to] = poses[from]; dirs[to] = dirs[from];
+        hps[to] = hps[from]; deads[to] = deads[from]; rewards[to] = rewards[from];
+        last_actions[to] = last_actions[from];
+    }
+
+    void resize(size_t n) {
+        ids.resize(n); poses.resize(n); dirs.resize(n); hps.resize(n);
+        deads.resize(n); rewards.resize(n); last_actions.resize(n);
+    }
+
+    void clear() { resize(0); }
+    size_t size() const { return ids.size(); }
+};
+
+
 class Agent {
 public:
-    Agent(AgentType &type, int id, GroupHandle group) : dead(false), absorbed(false), group(group),
-                                                        next_reward(0),
-                                                        type(type),
-                                                        last_op(OP_NULL), op_obj(nullptr), index(0) {
-        this->id = id;
-        dir = Direction(rand() % 4);
-        hp = type.hp;
-        last_action = static_cast<Action>(type.action_space.size()); // dangerous here !
-        next_reward = 0;
+    Agent(AgentType &type, AgentStore *store, int index, int id, GroupHandle group)
+            : op_obj(nullptr), type(type), store(store), last_op(OP_NULL), group(group), index(index),
+              absorbed(false), ghost(false) {
+        store->ids[index] = id;
+        store->deads[index] = false;
+        store->dirs[index] = NORTH;  // set by add_agents
+        store->hps[index] = type.hp;
+        store->last_actions[index] = static_cast<Action>(type.action_space.size()); // dangerous here !
+        store->rewards[index] = 0;
 
         init_reward();
     }
 
-    Position &get_pos()             { return pos; }
-    const Position &get_pos() const { return pos; }
-    void set_pos(Position pos) { this->pos = pos; }
+    Position &get_pos()             { return store->poses[index]; }
+    const Position &get_pos() const { return store->poses[index]; }
+    void set_pos(Position pos) { store->poses[index] = pos; }
 
-    Direction get_dir() const   { return dir; }
-    void set_dir(Direction dir) { this->dir = dir; }
+    Direction get_dir() const   { return store->dirs[index]; }
+    void set_dir(Direction dir) { store->dirs[index] = dir; }
 
     AgentType &get_type()             { return type; }
     const AgentType &get_type() const { return type; }
 
-    int get_id() const            { return id; }
-    void get_embedding(float *buf, int size) {
+    int get_id() const            { return store->ids[index]; }
+    void get_embedding(float *buf, int size) const {
         // embedding are binary form of id
-        if (embedding.empty()) {
-            int t = id;
-            for (int i = 0; i < size; i++, t >>= 1) {
-                embedding.push_back((float)(t & 1));
-            }
+        int t = get_id();
+        for (int i = 0; i < size; i++, t >>= 1) {
+            buf[i] = (float)(t & 1);
         }
-        memcpy(buf, &embedding[0], sizeof(float) * size);
     }
 
     void init_reward() {
-        last_reward = next_reward;
+        last_reward = store->rewards[index];
         last_op = OP_NULL;
-        next_reward = type.step_reward;
+        store->rewards[index] = type.step_reward;
         op_obj = nullptr;
-        be_involved = false;
     }
-    Reward get_reward()         { return next_reward; }
+    // between the frames of a step, the caller keeps the rewards of the earlier frames
+    void next_frame() {
+        last_op = OP_NULL;
+        store->rewards[index] = type.step_reward;
+        op_obj = nullptr;
+    }
+    Reward get_reward()         { return store->rewards[index]; }
     Reward get_last_reward()    { return last_reward; }
-    void add_reward(Reward add) { next_reward += add; }
-
-    void set_involved(bool value) { be_involved = value; }
-    bool get_involved() { return be_involved; }
+    void add_reward(Reward add) { store->rewards[index] += add; }
 
-    void set_action(Action act) { last_action = act; }
-    Action get_action()         { return last_action; }
+    void set_action(Action act) { store->last_actions[index] = act; }
+    Action get_action()         { return store->last_actions[index]; }
 
-    void add_hp(float add) { hp =  std::min(type.hp, hp + add); }
-    float get_hp() const   { return hp; }
-    void set_hp(float value) { hp = value; }
+    void add_hp(float add) { float &hp = store->hps[index]; hp = std::min(type.hp, hp + add); }
+    float get_hp() const   { return store->hps[index]; }
+    void set_hp(float value) { store->hps[index] = value; }
 
-    bool is_dead() const { return dead; }
-    void set_dead(bool value) { dead = value; }
+    bool is_dead() const { return store->deads[index] != 0; }
+    void set_dead(bool value) { store->deads[index] = value; }
     bool is_absorbed() const { return absorbed; }
     void set_absorbed(bool value) { absorbed = value; }
+    // a mirror of an agent owned by another rank, or an agent which leaves this rank (see Domain)
+    bool is_ghost() const { return ghost; }
+    void set_ghost(bool value) { ghost = value; }
 
     bool starve() {
         if (type.step_recover > 0) {
@@ -197,18 +435,20 @@ public:
         }
         else
             be_attack(-type.step_recover);
-        return dead;
+        return is_dead();
     }
 
     void be_attack(float damage) {
+        float &hp = store->hps[index];
         hp -= damage;
         if (hp < 0.0) {
-            dead = true;
-            next_reward = type.dead_penalty;
+            store->deads[index] = true;
+            store->rewards[index] = type.dead_penalty;
         }
     }
 
     GroupHandle get_group() const { return group; }
+    // index of this agent in its group, also the slot in AgentStore
     int get_index() const { return index; }
     void set_index(int i) { index = i; }
 
@@ -227,58 +467,242 @@ public:
         goal_radius = radius;
     }
 
-private:
-    int id;
-    bool dead;
-    bool absorbed;
-
-    Position pos;
-    Direction dir;
-    float hp;
+    // the fields out of AgentStore, except op_obj which only lives during a step
+    void save_state(utility::StateWriter &writer) const;
+    void load_state(utility::StateReader &reader);
 
-    EventOp last_op;
+private:
+    // ordered by size, so there is no padding between the fields
     void *op_obj;
-
-    Action last_action;
-    Reward next_reward, last_reward;
     AgentType &type;
+    AgentStore *store;
+
+    EventOp last_op;
+    Reward last_reward;
     GroupHandle group;
     int index;
-
-    bool be_involved;
-
-    std::vector<float> embedding;
     Position goal;
     int goal_radius;
+
+    bool absorbed;
+    bool ghost;
+};
+
+
+// persistent view buffer of a group, used by incremental_view_mode
+// a row is valid if it is extracted for the same agent at the same position and direction
+class ViewCache {
+public:
+    ViewCache() : view_size(0) {}
+
+    void resize(size_t n, size_t view_size) {
+        if (view_size != this->view_size) {
+            clear();
+            this->view_size = view_size;
+        }
+        views.resize(n * view_size);
+        ids.resize(n, -1);
+        poses.resize(n);
+        dirs.resize(n);
+        epochs.resize(n, -1);
+    }
+
+    bool is_valid(int i, const Agent *agent) const {
+        Position pos = agent->get_pos();
+        return ids[i] == agent->get_id() && dirs[i] == agent->get_dir()
+               && poses[i].x == pos.x && poses[i].y == pos.y;
+    }
+
+    // the view of row i is up to date at map epoch
+    void set_valid(int i, const Agent *agent, int epoch) {
+        ids[i] = agent->get_id();
+        poses[i] = agent->get_pos();
+        dirs[i] = agent->get_dir();
+        epochs[i] = epoch;
+    }
+    int get_epoch(int i) const { return epochs[i]; }
+
+    // move row `from` to row `to`, used when compacting dead agents
+    void move(int from, int to) {
+        if (from >= ids.size())
+            return;
+        memcpy(&views[to * view_size], &views[from * view_size], sizeof(float) * view_size);
+        ids[to] = ids[from];
+        poses[to] = poses[from];
+        dirs[to] = dirs[from];
+        epochs[to] = epochs[from];
+    }
+
+    void truncate(size_t n) {
+        resize(n, view_size);
+    }
+
+    void clear() {
+        views.clear(); ids.clear(); poses.clear(); dirs.clear(); epochs.clear();
+    }
+
+    size_t get_size() const { return ids.size(); }
+    float *get_view(int i) { return &views[i * view_size]; }
+
+    size_t get_memory() const {
+        return utility::vector_bytes(views) + utility::vector_bytes(ids) + utility::vector_bytes(poses)
+               + utility::vector_bytes(dirs) + utility::vector_bytes(epochs);
+    }
+
+private:
+    size_t view_size;
+    std::vector<float> views;
+    std::vector<int> ids;
+    std::vector<Position> poses;
+    std::vector<Direction> dirs;
+    std::vector<int> epochs;  // map epoch of the last check of the row
+};
+
+
+// running statistics of the agents in the list of a group : sums of positions, action counts and
+// histograms on coarse grids, for the center, mean_info and the minimaps without a scan of all agents.
+// an agent counts from add_agents to clear_dead, so agents killed in this step still count.
+// updates of positions are atomic, since moves in different tiles run in parallel
+class GroupStats {
+public:
+    GroupStats() : num(0), sum_x(0), sum_y(0) {}
+
+    // drop all the agents, n_action is the size of the action space
+    void clear(int n_action) {
+        num = 0;
+        sum_x = sum_y = 0;
+        action_counts.assign((size_t)n_action + 1, 0);  // the last one for agents without action
+        grids.clear();
+    }
+
+    void add(Position pos, Action action) { update(pos, action, 1); }
+    void remove(Position pos, Action action) { update(pos, action, -1); }
+
+    void move(Position from, Position to) {
+        __atomic_fetch_add(&sum_x, (long long)(to.x - from.x), __ATOMIC_RELAXED);
+        __atomic_fetch_add(&sum_y, (long long)(to.y - from.y), __ATOMIC_RELAXED);
+        for (Grid &grid : grids) {
+            int from_cell = grid.cell(from), to_cell = grid.cell(to);
+            if (from_cell != to_cell) {
+                __atomic_fetch_sub(&grid.counts[from_cell], 1, __ATOMIC_RELAXED);
+                __atomic_fetch_add(&grid.counts[to_cell], 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    void set_action(Action old_action, Action action) {
+        action_counts[clamp_action(old_action)]--;
+        action_counts[clamp_action(action)]++;
+    }
+
+    int get_num() const { return num; }
+    long long get_sum_x() const { return sum_x; }
+    long long get_sum_y() const { return sum_y; }
+    int get_action_count(Action action) const { return action_counts[action]; }
+
+    // counts of agents in the (rows, cols) cells of (scale_h, scale_w), built from agents at the first query
+    const int *get_grid(int rows, int cols, int scale_h, int scale_w, const std::vector<Agent*> &agents) {
+        for (Grid &grid : grids) {
+            if (grid.rows == rows && grid.cols == cols && grid.scale_h == scale_h && grid.scale_w == scale_w)
+                return grid.counts.data();
+        }
+        if (grids.size() >= MAX_GRIDS)
+            grids.erase(grids.begin());
+        grids.push_back(Grid{rows, cols, scale_h, scale_w, std::vector<int>((size_t)rows * cols, 0)});
+        Grid &grid = grids.back();
+        for (const Agent *agent : agents)
+            grid.counts[grid.cell(agent->get_pos())]++;
+        return grid.counts.data();
+    }
+
+    size_t get_memory() const {
+        size_t bytes = utility::vector_bytes(action_counts) + utility::vector_bytes(grids);
+        for (const Grid &grid : grids)
+            bytes += utility::vector_bytes(grid.counts);
+        return bytes;
+    }
+
+private:
+    struct Grid {
+        int rows, cols, scale_h, scale_w;
+        std::vector<int> counts;
+        int cell(Position pos) const { return (pos.y / scale_h) * cols + pos.x / scale_w; }
+    };
+
+    static const size_t MAX_GRIDS = 8;
+
+    int clamp_action(Action action) const {
+        const int none = (int)action_counts.size() - 1;
+        return action >= 0 && action < none ? (int)action : none;
+    }
+
+    void update(Position pos, Action action, int delta) {
+        num += delta;
+        sum_x += delta * pos.x;
+        sum_y += delta * pos.y;
+        action_counts[clamp_action(action)] += delta;
+        for (Grid &grid : grids)
+            grid.counts[grid.cell(pos)] += delta;
+    }
+
+    int num;
+    long long sum_x, sum_y;
+    std::vector<int> action_counts;
+    std::vector<Grid> grids;
 };
 
 
 class Group {
 public:
     Group(AgentType &type) : type(type), dead_ct(0), next_reward(0),
-                             center_x(0), center_y(0), recursive_base(0) {
+                             center_x(0), center_y(0), recursive_base(0), store(new AgentStore),
+                             agent_pool(new utility::ObjectPool<Agent>) {
+        stats.clear((int)type.action_space.size());
     }
 
-    void add_agent(Agent *agent) {
+    // allocate a slot in the store and append a new agent to the group
+    Agent *new_agent(int id, GroupHandle group) {
+        int index = store->push();
+        Agent *agent = agent_pool->alloc(type, store.get(), index, id, group);
         agents.push_back(agent);
+        return agent;
+    }
+    // remove the agent added by the last new_agent
+    void pop_agent() {
+        agent_pool->free(agents.back());
+        agents.pop_back();
+        store->resize(agents.size());
     }
+    // return the memory of an agent which has been removed from the agent list
+    void free_agent(Agent *agent) { agent_pool->free(agent); }
 
     int get_num()       { return (int)agents.size(); }
     int get_alive_num() { return get_num() - dead_ct; }
     size_t get_size()   { return agents.size(); }
 
     std::vector<Agent*> &get_agents() { return agents; }
+    AgentStore &get_store()           { return *store; }
     AgentType &get_type()             { return type; }
 
     void set_dead_ct(int ct) { dead_ct = ct; }
     int  get_dead_ct() const { return dead_ct; }
     void inc_dead_ct()       { dead_ct++; }
 
+    // agents are trivially destructible, so the pool is recycled without visiting them
     void clear() {
         agents.clear();
+        store->clear();
+        agent_pool->reset();
         dead_ct = 0;
+        view_cache.clear();
+        stats.clear((int)type.action_space.size());
     }
 
+    ViewCache &get_view_cache() { return view_cache; }
+    GroupStats &get_stats() { return stats; }
+    std::vector<float> &get_minimap_buffer() { return minimap_buffer; }
+    RegisteredBuffers &get_registered() { return registered; }
+
     void init_reward() { next_reward = 0; }
     Reward get_reward()         { return next_reward; }
     void add_reward(Reward add) { next_reward += add; }
@@ -289,18 +713,32 @@ public:
     }
     void set_recursive_base(int base) { recursive_base = base; }
 
+    // agents with an event object in this step, collected in Gridworld::calc_reward
+    std::vector<Agent*> &get_event_agents() { return event_agents; }
+
     void set_center(float cx, float cy) { center_x = cx; center_y = cy; }
     void get_center(float &cx,float &cy) { cx = center_x; cy = center_y; }
     void refresh_center() {
-        float sum_x = 0, sum_y = 0;
-        for (int i = 0; i < agents.size(); i++) {
-            sum_x += agents[i]->get_pos().x;
-            sum_y += agents[i]->get_pos().y;
-        }
-        center_x = sum_x / agents.size();
-        center_y = sum_y / agents.size();
+        center_x = (float)stats.get_sum_x() / agents.size();
+        center_y = (float)stats.get_sum_y() / agents.size();
+    }
+
+    // heap memory of the agents (store, pool and lists) and of the buffers (view cache, statistics, minimap)
+    size_t get_agent_memory() const {
+        const AgentStore &s = *store;
+        return utility::vector_bytes(s.ids) + utility::vector_bytes(s.poses) + utility::vector_bytes(s.dirs)
+               + utility::vector_bytes(s.hps) + utility::vector_bytes(s.deads) + utility::vector_bytes(s.rewards)
+               + utility::vector_bytes(s.last_actions) + agent_pool->get_capacity() * sizeof(Agent)
+               + utility::vector_bytes(agents) + utility::vector_bytes(event_agents);
+    }
+    size_t get_buffer_memory() const {
+        return view_cache.get_memory() + stats.get_memory() + utility::vector_bytes(minimap_buffer);
     }
 
+    // agents and group statistics, caches are invalidated by load_state
+    void save_state(utility::StateWriter &writer) const;
+    void load_state(utility::StateReader &reader, GroupHandle handle);
+
 private:
     AgentType &type;
     std::vector<Agent*> agents;
@@ -310,6 +748,14 @@ private:
     float center_x, center_y;
 
     int recursive_base;
+    std::vector<Agent*> event_agents;
+
+    std::unique_ptr<AgentStore> store;  // heap allocated, agents keep a pointer to it
+    std::unique_ptr<utility::ObjectPool<Agent>> agent_pool;
+    RegisteredBuffers registered;
+    ViewCache view_cache;
+    GroupStats stats;
+    std::vector<float> minimap_buffer;  // minimap of the observations, reused between calls
 };
 
 struct MoveAction {
@@ -327,6 +773,33 @@ struct AttackAction {
     int   action;
 };
 
+// resolved target of an attack, for sharded attack resolution
+struct AttackTarget {
+    const void *obj;     // occupier of the target slot at the beginning of the attack phase
+    PositionInteger pos;
+    int x, y;
+    int shard;           // -1 for attacking blank, -2 for dead attacker
+    uint32_t self;       // entry of the attacker in the agent table of the map
+    uint32_t victim;     // entry of the agent attacked, NO_OCCUPIER for food
+    int state;           // one of AttackState, read across shards
+    bool supplied;       // hp_supply is added to the attacker
+    GroupHandle dead_group;
+    Reward reward;
+    float hp_supply;
+};
+
+enum AttackState {
+    ATTACK_PENDING, ATTACK_SKIP,  // skip : the attacker is killed by an earlier attack
+    ATTACK_HIT, ATTACK_MISS       // miss : the attacker is alive but there is nothing to attack
+};
+
+// the attacks on one object, a range of attack_order in shuffled order
+struct AttackRun {
+    int begin, end;
+    int cursor;          // the first unresolved attack
+    int death;           // the attack that killed the object, INT_MAX for none
+};
+
 } // namespace magent
 } // namespace gridworld
 
@@ -0,0 +1,109 @@
+/**
+ * \file InferenceBackend.cc
+ * \brief built-in inference backends
+ */
+
+#include <vector>
+#include <algorithm>
+
+#ifdef MAGENT_USE_ONNXRUNTIME
+#include <onnxruntime_cxx_api.h>
+#endif
+
+#include "InferenceBackend.h"
+#include "../utility/utility.h"
+
+namespace magent {
+namespace gridworld {
+
+#ifdef MAGENT_USE_ONNXRUNTIME
+class OnnxBackend : public InferenceBackend {
+public:
+    explicit OnnxBackend(const std::string &path)
+            : env(ORT_LOGGING_LEVEL_WARNING, "magent"), session(nullptr) {
+        Ort::SessionOptions options;
+        options.SetGraphOptimizationLevel(GraphOptimizationLevel::ORT_ENABLE_ALL);
+        session = Ort::Session(env, path.c_str(), options);
+
+        Ort::AllocatorWithDefaultOptions allocator;
+        size_t n_input = session.GetInputCount();
+        if (n_input < 1 || n_input > 2 || session.GetOutputCount() < 1)
+            LOG(FATAL) << "the onnx model should have 1 or 2 inputs (view, feature) and an output : " << path;
+        for (size_t i = 0; i < n_input; i++)
+            input_names.push_back(session.GetInputNameAllocated(i, allocator).get());
+        output_name = session.GetOutputNameAllocated(0, allocator).get();
+    }
+
+    void forward(const InferenceBatch &batch, int *actions) override {
+        Ort::MemoryInfo memory_info = Ort::MemoryInfo::CreateCpu(OrtArenaAllocator, OrtMemTypeDefault);
+        const int64_t view_shape[4] = {batch.n, batch.view_height, batch.view_width, batch.n_channel};
+        const int64_t feature_shape[2] = {batch.n, batch.feature_size};
+
+        std::vector<Ort::Value> inputs;
+        inputs.push_back(Ort::Value::CreateTensor<float>(memory_info, const_cast<float *>(batch.view),
+                                                         (size_t)batch.n * batch.view_height * batch.view_width
+                                                         * batch.n_channel, view_shape, 4));
+        if (input_names.size() > 1)
+            inputs.push_back(Ort::Value::CreateTensor<float>(memory_info, const_cast<float *>(batch.feature),
+                                                             (size_t)batch.n * batch.feature_size, feature_shape, 2));
+
+        std::vector<const char *> names;
+        for (const std::string &name : input_names)
+            names.push_back(name.c_str());
+        const char *output = output_name.c_str();
+        std::vector<Ort::Value> outputs = session.Run(Ort::RunOptions{nullptr}, names.data(), inputs.data(),
+                                                      inputs.size(), &output, 1);
+
+        Ort::TensorTypeAndShapeInfo info = outputs[0].GetTensorTypeAndShapeInfo();
+        std::vector<int64_t> shape = info.GetShape();
+        switch (info.GetElementType()) {
+            case ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT: {  // logits
+                if (shape.size() != 2 || shape[0] != batch.n)
+                    LOG(FATAL) << "unexpected shape of the logits of the onnx model";
+                const float *logits = outputs[0].GetTensorData<float>();
+                const int64_t n_action = shape[1];
+                for (int i = 0; i < batch.n; i++) {
+                    const float *row = logits + i * n_action;
+                    actions[i] = (int)(std::max_element(row, row + n_action) - row);
+                }
+                break;
+            }
+            case ONNX_TENSOR_ELEMENT_DATA_TYPE_INT64: {
+                const int64_t *data = outputs[0].GetTensorData<int64_t>();
+                for (int i = 0; i < batch.n; i++)
+                    actions[i] = (int)data[i];
+                break;
+            }
+            case ONNX_TENSOR_ELEMENT_DATA_TYPE_INT32: {
+                const int32_t *data = outputs[0].GetTensorData<int32_t>();
+                for (int i = 0; i < batch.n; i++)
+                    actions[i] = data[i];
+                break;
+            }
+            default:
+                LOG(FATAL) << "unsupported output type of the onnx model";
+        }
+    }
+
+private:
+    Ort::Env env;
+    Ort::Session session;
+    std::vector<std::string> input_names;
+    std::string output_name;
+};
+#endif
+
+InferenceBackend *new_inference_backend(const std::string &name, const std::string &path) {
+    if (name == "onnx") {
+#ifdef MAGENT_USE_ONNXRUNTIME
+        return new OnnxBackend(path);
+#else
+        LOG(FATAL) << "onnx backend is not built in, turn on USE_ONNXRUNTIME in cmake";
+#endif
+    }
+    LOG(FATAL) << "invalid name of inference backend : " << name;
+    return nullptr;
+}
+
+} // namespace gridworld
+} // namespace magent
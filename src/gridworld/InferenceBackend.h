@@ -0,0 +1,45 @@
+/**
+ * \file InferenceBackend.h
+ * \brief batched model inference for groups whose actions are computed inside GridWorld::step
+ */
+
+#ifndef MAGENT_GRIDWORLD_INFERENCEBACKEND_H
+#define MAGENT_GRIDWORLD_INFERENCEBACKEND_H
+
+#include <string>
+
+namespace magent {
+namespace gridworld {
+
+// the observation of a group, in the layout of get_observation
+struct InferenceBatch {
+    const float *view;     // (n, view_height, view_width, n_channel)
+    const float *feature;  // (n, feature_size)
+    int n;
+    int view_height, view_width, n_channel;
+    int feature_size;
+    int n_action;
+};
+
+/**
+ * A model bound to a group. forward runs on a worker thread of the environment while the
+ * observation of the next bound group is extracted, one batch at a time for each environment.
+ * A backend shared by cloned environments can be called concurrently, so it must be reentrant then.
+ */
+class InferenceBackend {
+public:
+    virtual ~InferenceBackend() = default;
+
+    // write the action of every agent in the batch into actions
+    virtual void forward(const InferenceBatch &batch, int *actions) = 0;
+};
+
+// built-in backends : "onnx" (needs USE_ONNXRUNTIME in cmake), path is the model file.
+// the model takes "view" (and "feature" if it has two inputs), and outputs either
+// float logits (n, n_action) which are reduced by argmax, or integer actions (n)
+InferenceBackend *new_inference_backend(const std::string &name, const std::string &path);
+
+} // namespace gridworld
+} // namespace magent
+
+#endif //MAGENT_GRIDWORLD_INFERENCEBACKEND_H
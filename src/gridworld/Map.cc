@@ -4,7 +4,9 @@
  */
 
 #include <stdlib.h>
+#include <algorithm>
 #include <iostream>
+#include <unordered_map>
 #include <assert.h>
 #include "Map.h"
 #include "GridWorld.h"
@@ -16,56 +18,233 @@ inline void abs_to_rela(int c_x, int c_y, Direction dir, int abs_x, int abs_y, i
 inline void rela_to_abs(int c_x, int c_y, Direction dir, int rela_x, int rela_y, int &abs_x, int &abs_y);
 inline void save_to_real(const Agent *agent, int &real_x, int &real_y);
 inline void real_to_save(const Agent *agent, int real_x, int real_y, Direction new_dir, int &save_x, int &save_y);
-inline void get_size_for_dir(Agent *agent, int &width, int &height);
+inline void get_size_for_dir(const Agent *agent, int &width, int &height);
 
-#define MAP_INNER_Y_ADD w
-
-void Map::reset(int width, int height, bool food_mode) {
+void Map::reset(int width, int height, bool food_mode, int n_channel) {
     this->w = width;
-    this->h = height;
+    this->map_h = height;
+    this->row0 = std::max(stored_begin, 0);
+    this->h = (stored_end < 0 ? height : std::min(stored_end, height)) - row0;
+    if (h <= 0)
+        LOG(FATAL) << "invalid stored rows of the map : [" << stored_begin << ", " << stored_end << ")";
     this->food_mode = food_mode;
+    agent_table.clear();
+    free_table.clear();
+    free_valid = false;
+    crowded = false;
+
+    if (tiled) {
+        tiles_per_row = (w + MAP_TILE - 1) >> MAP_TILE_SHIFT;
+        n_cell = tiles_per_row * ((h + MAP_TILE - 1) >> MAP_TILE_SHIFT) * MAP_TILE * MAP_TILE;
+    } else {
+        tiles_per_row = 0;
+        n_cell = w * h;
+    }
 
     if (slots != nullptr)
         delete [] slots;
-    slots = new MapSlot[w * h];
+    slots = new MapSlot[n_cell];
 
     if (channel_ids != nullptr)
         delete [] channel_ids;
-    channel_ids = new int[w * h];
+    channel_ids = new int[n_cell];
+
+    memset(channel_ids, -1, sizeof(int) * n_cell);
+
+    delete [] food_plane;
+    food_plane = new Food[n_cell]();
+
+    n_plane = n_channel;
+    plane_words = (w + 63) / 64 + 1;
+    delete [] planes;
+    planes = new unsigned long long[(size_t)n_plane * h * plane_words]();
+    delete [] plane_used;
+    plane_used = new unsigned char[n_plane]();
+    delete [] hp_plane;
+    hp_plane = new float[(size_t)w * h]();
+
+    set_row_track(row_track);
+
+    if (tile_epoch != nullptr)
+        delete [] tile_epoch;
+    tile_epoch = nullptr;
+    if (dirty_track) {
+        tile_cols = ((w - 1) >> DIRTY_TILE_SHIFT) + 1;
+        tile_rows = ((h - 1) >> DIRTY_TILE_SHIFT) + 1;
+        tile_epoch = new int[tile_cols * tile_rows];
+        std::fill(tile_epoch, tile_epoch + tile_cols * tile_rows, dirty_epoch);
+    }
+
+    delete [] pool_count;
+    delete [] pool_hp;
+    pool_count = nullptr;
+    pool_hp = nullptr;
+    if (n_pool_group > 0) {
+        pool_count = new unsigned char[(size_t)n_pool_group * w * h]();
+        pool_hp = new float[(size_t)n_pool_group * w * h]();
+        count_sat.assign((size_t)n_pool_group * (h + 1) * (w + 1), 0);
+        hp_sat.assign((size_t)n_pool_group * (h + 1) * (w + 1), 0);
+    }
+    pool_dirty_row = h;
 
-    memset(channel_ids, -1, sizeof(int) * w * h);
+    wall_bits.clear();
+    if (h != map_h)
+        wall_bits.assign(((size_t)w * map_h + 63) / 64, 0);
 
     // init border
     for (int i = 0; i < w; i++) {
         add_wall(Position{i, 0});
-        add_wall(Position{i, h-1});
+        add_wall(Position{i, map_h-1});
     }
-    for (int i = 0; i < h; i++) {
+    for (int i = 0; i < map_h; i++) {
         add_wall(Position{0, i});
         add_wall(Position{w-1, i});
     }
 }
 
 Position Map::get_random_blank(std::default_random_engine &random_engine, int width, int height) {
-    int tries = 0;
-    while (true) {
-        int x = (int) random_engine() % (w - width);
-        int y = (int) random_engine() % (h - height);
+    return random_blank(random_engine, width, height);
+}
+
+Position Map::get_random_blank(utility::Philox &random_engine, int width, int height) {
+    return random_blank(random_engine, width, height);
+}
+
+Position Map::get_random_wall_cell(std::default_random_engine &random_engine) {
+    return random_wall_cell(random_engine);
+}
+
+Position Map::get_random_wall_cell(utility::Philox &random_engine) {
+    return random_wall_cell(random_engine);
+}
+
+// same as a blank 1 x 1 area if all the rows are stored. otherwise only the walls are known in every row,
+// so the draws do not depend on the agents of this rank
+template <typename RandomEngine>
+Position Map::random_wall_cell(RandomEngine &random_engine) {
+    if (wall_bits.empty())
+        return random_blank(random_engine, 1, 1);
+    for (size_t tries = 0; tries < (size_t)w * map_h; tries++) {
+        int x = (int)(random_engine() % (unsigned int)(w - 1));
+        int y = (int)(random_engine() % (unsigned int)(map_h - 1));
+        if (!is_wall_bit(x, y))
+            return Position{x, y};
+    }
+    LOG(FATAL) << "cannot find a blank position in a filled map";
+    return Position{0, 0};
+}
+
+template <typename RandomEngine>
+Position Map::random_blank(RandomEngine &random_engine, int width, int height) {
+    for (int tries = 0; tries < REJECT_TRIES; tries++) {
+        int x = (int)(random_engine() % (unsigned int)(w - width));
+        int y = row0 + (int)(random_engine() % (unsigned int)(h - height));
 
         if (is_blank_area(x, y, width, height)) {
+            __atomic_store_n(&crowded, false, __ATOMIC_RELAXED);
             return Position{x, y};
         }
+    }
+
+    // crowded map, the top-left cell is a free cell
+    __atomic_store_n(&crowded, true, __ATOMIC_RELAXED);
+    prepare_free_cells();
+    for (int tries = 0; tries < REJECT_TRIES && !free_cells.empty(); tries++) {
+        int cell = free_cells[random_engine() % (unsigned int)free_cells.size()];
+        if (is_blank_area(cell % w, row0 + cell / w, width, height))
+            return Position{cell % w, row0 + cell / w};
+    }
+
+    // few free cells can hold the area, draw among all the areas
+    std::vector<Position> areas;
+    find_blank_areas(nullptr, width, height, areas);
+    if (areas.empty())
+        LOG(FATAL) << "cannot find a blank position in a filled map";
+    return areas[random_engine() % (unsigned int)areas.size()];
+}
+
+// build the free cell index if it was dropped, placements of add_random_deterministic can race for it
+void Map::prepare_free_cells() {
+    if (__atomic_load_n(&free_valid, __ATOMIC_ACQUIRE))
+        return;
+    std::lock_guard<std::mutex> lock(free_mutex);
+    if (free_valid)
+        return;
+    free_cells.clear();
+    free_at.assign((size_t)w * h, -1);
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            if (is_blank(pos2int(x, row0 + y))) {
+                free_at[y * w + x] = (int)free_cells.size();
+                free_cells.push_back(y * w + x);
+            }
+        }
+    }
+    __atomic_store_n(&free_valid, true, __ATOMIC_RELEASE);
+}
 
-        if (tries++ > w * h) {
-            LOG(FATAL) << "cannot find a blank position in a filled map";
+// all the top-left cells of blank width x height areas in the stored rows, in row-major order
+void Map::find_blank_areas(utility::ThreadPool *pool, int width, int height, std::vector<Position> &areas) const {
+    // run[y * w + x] is the number of consecutive blank cells from (x, row0 + y) to the right
+    std::vector<int> run((size_t)w * h);
+    utility::parallel_range(pool, h, 16, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            int count = 0;
+            for (int x = w - 1; x >= 0; x--) {
+                count = is_blank(pos2int(x, row0 + y)) ? count + 1 : 0;
+                run[y * w + x] = count;
+            }
+        }
+    });
+
+    // an area fits at (x, y) if the runs of its height rows all reach its width, the bounds are those of is_blank_area
+    std::vector<std::vector<Position>> rows((size_t)std::max(h - height, 0));
+    utility::parallel_range(pool, (int)rows.size(), 16, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            for (int x = 0; x + width < w; x++) {
+                int j = 0;
+                while (j < height && run[(y + j) * w + x] >= width)
+                    j++;
+                if (j == height)
+                    rows[y].push_back(Position{x, row0 + y});
+            }
         }
+    });
+
+    areas.clear();
+    for (const std::vector<Position> &row : rows)
+        areas.insert(areas.end(), row.begin(), row.end());
+}
+
+int Map::get_random_blank_areas(std::default_random_engine &random_engine, utility::ThreadPool *pool,
+                                int width, int height, int n, std::vector<Position> &poses) {
+    std::vector<Position> areas;
+    find_blank_areas(pool, width, height, areas);
+
+    // partial shuffle, an area overlapping a chosen one is skipped
+    std::vector<unsigned char> taken((size_t)w * h, 0);
+    poses.clear();
+    for (size_t i = 0; i < areas.size() && (int)poses.size() < n; i++) {
+        std::swap(areas[i], areas[i + random_engine() % (areas.size() - i)]);
+        const Position pos = areas[i];
+        bool overlap = false;
+        for (int j = 0; j < height && !overlap; j++)
+            for (int k = 0; k < width && !overlap; k++)
+                overlap = taken[(pos.y - row0 + j) * w + pos.x + k] != 0;
+        if (overlap)
+            continue;
+        for (int j = 0; j < height; j++)
+            for (int k = 0; k < width; k++)
+                taken[(pos.y - row0 + j) * w + pos.x + k] = 1;
+        poses.push_back(pos);
     }
+    return (int)poses.size();
 }
 
 int Map::add_agent(Agent *agent, Position pos, int width, int height, int base_channel_id) {
     if (is_blank_area(pos.x, pos.y, width, height)) {
         // fill in map
-        fill_area(pos.x, pos.y, width, height, agent, OCC_AGENT, base_channel_id);
+        fill_area(pos.x, pos.y, width, height, alloc_table(agent), OCC_AGENT, base_channel_id);
         return 0;
     } else {
         return 1;
@@ -89,7 +268,7 @@ int Map::add_agent(Agent *agent, int base_channel_id) {
 
     if (is_blank_area(pos.x, pos.y, m_width, m_height)) {
         // fill in map
-        fill_area(pos.x, pos.y, m_width, m_height, agent, OCC_AGENT, base_channel_id);
+        fill_area(pos.x, pos.y, m_width, m_height, alloc_table(agent), OCC_AGENT, base_channel_id);
         return 0;
     } else {
         return 1;
@@ -98,127 +277,288 @@ int Map::add_agent(Agent *agent, int base_channel_id) {
 
 void Map::remove_agent(Agent *agent) {
     Position pos = agent->get_pos();
+    PositionInteger pos_int = pos2int(pos);
+    if (agent_at(pos_int) != agent)  // already removed
+        return;
+    const uint32_t entry = slots[pos_int].occupier;
     int width, height;
     get_size_for_dir(agent, width, height);
 
     // clear map
     clear_area(pos.x, pos.y, width, height);
+
+    std::lock_guard<std::mutex> lock(table_mutex);
+    free_table.push_back(entry);
 }
 
 int Map::add_wall(Position pos) {
+    if (!wall_bits.empty()) {
+        if (!in_board(pos.x, pos.y)) {  // a row not stored
+            size_t bit = (size_t)pos.y * w + pos.x;
+            wall_bits[bit >> 6] |= 1ULL << (bit & 63);
+            return 0;
+        }
+    }
     PositionInteger pos_int = pos2int(pos);
-    if (slots[pos_int].slot_type == BLANK && slots[pos_int].occupier != nullptr)
+    if (slots[pos_int].slot_type == BLANK && slots[pos_int].occupier != NO_OCCUPIER)
         return 1;
     slots[pos_int].slot_type = OBSTACLE;
     set_channel_id(pos_int, wall_channel_id);
+    update_free(pos.x, pos.y, pos_int);
+    if (!wall_bits.empty()) {
+        size_t bit = (size_t)pos.y * w + pos.x;
+        wall_bits[bit >> 6] |= 1ULL << (bit & 63);
+    }
     return 0;
 }
 
-void Map::average_pooling_group(float *group_buffer, int x0, int y0, int width, int height) {
-    for (int x = x0; x < x0 + width; x++) {
-        for (int y = y0; y < y0 + height; y++) {
+void Map::clear_foods(int row_begin, int row_end) {
+    for (int y = std::max(row_begin, row0); y < std::min(row_end, row0 + h); y++) {
+        for (int x = 0; x < w; x++) {
             PositionInteger pos_int = pos2int(x, y);
-            if (slots[pos_int].occupier != nullptr && slots[pos_int].occ_type == OCC_AGENT) {
-                Agent *agent = (Agent *)slots[pos_int].occupier;
+            if (slots[pos_int].occ_type == OCC_FOOD && slots[pos_int].occupier != NO_OCCUPIER)
+                remove_food(pos_int);
+        }
+    }
+}
+
+void Map::get_foods(int row_begin, int row_end, std::vector<FoodCell> &foods) const {
+    for (int y = std::max(row_begin, row0); y < std::min(row_end, row0 + h); y++) {
+        for (int x = 0; x < w; x++) {
+            const MapSlot &slot = slots[pos2int(x, y)];
+            if (slot.occ_type == OCC_FOOD && slot.occupier != NO_OCCUPIER)
+                foods.push_back(FoodCell{Position{x, y}, food_plane[slot.occupier]});
+        }
+    }
+}
+
+int Map::add_food(Position pos, Food amount) {
+    if (!in_board(pos.x, pos.y))
+        return 1;
+    PositionInteger pos_int = pos2int(pos);
+    if (!is_blank(pos_int))
+        return 1;
+    slots[pos_int].occ_type = OCC_FOOD;
+    slots[pos_int].occupier = (uint32_t)pos_int;
+    food_plane[pos_int] = amount;
+    set_channel_id(pos_int, food_channel_id);
+    update_free(pos.x, pos.y, pos_int);
+    return 0;
+}
+
+void Map::eat_food(Position pos, Food amount) {
+    if (!in_board(pos.x, pos.y))
+        return;
+    PositionInteger pos_int = pos2int(pos);
+    if (slots[pos_int].occ_type != OCC_FOOD || slots[pos_int].occupier == NO_OCCUPIER)
+        return;
+    Food &food = food_plane[slots[pos_int].occupier];
+    food -= std::min(amount, food);
+    if (food < 0.1)
+        remove_food(pos_int);
+}
+
+void Map::remove_food(PositionInteger pos_int) {
+    food_plane[slots[pos_int].occupier] = 0;
+    slots[pos_int].occupier = NO_OCCUPIER;
+    set_channel_id(pos_int, -1);
+    Position food_pos = int2pos(pos_int);
+    update_free(food_pos.x, food_pos.y, pos_int);
+}
+
+void Map::average_pooling_group(float *group_buffer, int x0, int y0, int width, int height) {
+    // row by row, consecutive cells of a row are adjacent in both layouts
+    for (int y = y0; y < y0 + height; y++) {
+        for (int x = x0; x < x0 + width; x++) {
+            Agent *agent = agent_at(pos2int(x, y));
+            if (agent != nullptr)
                 group_buffer[agent->get_group()]++;
+        }
+    }
+}
+
+// the eye and the view box clipped by the map, from the direction table of the agent type
+void Map::get_view_box(const Agent *agent, int &eye_x, int &eye_y,
+                       int &start_x, int &start_y, int &end_x, int &end_y) const {
+    const DirTable &table = agent->get_type().dir_tables[agent->get_dir()];
+    Position pos = agent->get_pos();
+
+    eye_x = pos.x + table.eye_dx;
+    eye_y = pos.y + table.eye_dy;
+    start_x = std::max(pos.x + table.view_x0, 0);
+    end_x   = std::min(pos.x + table.view_x1, w - 1);
+    start_y = std::max(pos.y + table.view_y0, row0);
+    end_y   = std::min(pos.y + table.view_y1, row0 + h - 1);
+}
+
+// offset to the eye in map -> coordinate in view, same as abs_to_rela
+template <Direction dir> inline void map_to_view(int dx, int dy, int &rela_x, int &rela_y);
+template <> inline void map_to_view<NORTH>(int dx, int dy, int &rela_x, int &rela_y) { rela_x = dx;  rela_y = dy;  }
+template <> inline void map_to_view<SOUTH>(int dx, int dy, int &rela_x, int &rela_y) { rela_x = -dx; rela_y = -dy; }
+template <> inline void map_to_view<WEST> (int dx, int dy, int &rela_x, int &rela_y) { rela_x = -dy; rela_y = dx;  }
+template <> inline void map_to_view<EAST> (int dx, int dy, int &rela_x, int &rela_y) { rela_x = dy;  rela_y = -dx; }
+
+// read n (1 <= n <= 64) bits starting from bit `offset` of a row of words
+inline unsigned long long get_bits(const unsigned long long *row, int offset, int n) {
+    int word = offset >> 6, shift = offset & 63;
+    unsigned long long bits = row[word] >> shift;
+    if (shift != 0)
+        bits |= row[word + 1] << (64 - shift);
+    return n == 64 ? bits : bits & ((1ULL << n) - 1);
+}
+
+// writers of extract_view_kernel, a dense (height, width, n_channel) view or a list of nonzero entries
+struct DenseViewWriter {
+    NDPointer<float, 3> buffer;
+    DenseViewWriter(float *linear_buffer, int height, int width, int n_channel)
+            : buffer(linear_buffer, {height, width, n_channel}) {}
+    void write(int view_y, int view_x, int channel, float value) { buffer.at(view_y, view_x, channel) = value; }
+};
+
+struct SparseViewWriter {
+    std::vector<SparseViewEntry> &entries;
+    explicit SparseViewWriter(std::vector<SparseViewEntry> &entries) : entries(entries) {}
+    void write(int view_y, int view_x, int channel, float value) {
+        entries.push_back(SparseViewEntry{view_y, view_x, channel, value});
+    }
+};
+
+// scan the view box row by row in map, 64 cells at a time.
+// occupancy bits of a channel are masked by the rotated range, only hit cells are written
+template <Direction dir, typename Writer>
+void Map::extract_view_kernel(Writer &writer, const int *channel_trans, const RangeMask &mask,
+                              int eye_x, int eye_y, int view_left_top_x, int view_left_top_y,
+                              int start_x, int start_y, int end_x, int end_y) const {
+    // clip by the bounding box of the mask
+    start_x = std::max(start_x, eye_x + mask.x0);
+    end_x   = std::min(end_x,   eye_x + mask.x0 + mask.cols - 1);
+    start_y = std::max(start_y, eye_y + mask.y0);
+    end_y   = std::min(end_y,   eye_y + mask.y0 + mask.rows - 1);
+
+    for (int y = start_y; y <= end_y; y++) {
+        const unsigned long long *mask_row = mask.row(y - eye_y - mask.y0);
+        const float *hp_row = hp_plane + (size_t)(y - row0) * w;
+        for (int c = 0; c < n_plane; c++) {
+            if (!plane_used[c])
+                continue;
+            const unsigned long long *plane_row = planes + ((size_t)c * h + y - row0) * plane_words;
+            const int channel_id = channel_trans[c];
+
+            for (int x = start_x; x <= end_x; x += 64) {
+                int n = std::min(64, end_x - x + 1);
+                unsigned long long hit = get_bits(plane_row, x, n) & get_bits(mask_row, x - eye_x - mask.x0, n);
+                while (hit) {
+                    int cell_x = x + __builtin_ctzll(hit);
+                    hit &= hit - 1;
+
+                    int rela_x, rela_y;
+                    map_to_view<dir>(cell_x - eye_x, y - eye_y, rela_x, rela_y);
+                    int view_x = rela_x - view_left_top_x, view_y = rela_y - view_left_top_y;
+
+                    writer.write(view_y, view_x, channel_id, 1);
+                    if (hp_row[cell_x] != 0) // is agent
+                        writer.write(view_y, view_x, channel_id + 1, hp_row[cell_x]);
+                }
             }
         }
     }
 }
 
-void Map::extract_view(const Agent *agent, float *linear_buffer, const int *channel_trans, const Range *range,
-                       int n_channel, int width, int height, int view_x_offset, int view_y_offset,
-                       int view_left_top_x, int view_left_top_y,
-                       int view_right_bottom_x, int view_right_bottom_y) const {
-    // convert coordinates between absolute map and relative view
+template <typename Writer>
+void Map::extract_view_dir(const Agent *agent, Writer &writer, const int *channel_trans) const {
+    const Range *range = agent->get_type().view_range;
     Direction dir = agent->get_dir();
-
-    int agent_x, agent_y;
     int eye_x, eye_y;
-    int x1, y1, x2, y2;
+    int start_x, start_y, end_x, end_y;
+    int view_left_top_x, view_left_top_y, view_right_bottom_x, view_right_bottom_y;
 
-    save_to_real(agent, agent_x, agent_y);
-    rela_to_abs(agent_x, agent_y, dir, view_x_offset, view_y_offset, eye_x, eye_y);
-    rela_to_abs(eye_x, eye_y, dir, view_left_top_x, view_left_top_y, x1, y1);
-    rela_to_abs(eye_x, eye_y, dir, view_right_bottom_x, view_right_bottom_y, x2, y2);
+    get_view_box(agent, eye_x, eye_y, start_x, start_y, end_x, end_y);
+    range->get_range_rela_offset(view_left_top_x, view_left_top_y, view_right_bottom_x, view_right_bottom_y);
 
-    // find the coordinate of start point and end point in map
-    int start_x, start_y, end_x, end_y;
-    start_x = std::max(std::min(x1, x2), 0);
-    end_x = std::min(std::max(x1, x2), w - 1);
-    start_y = std::max(std::min(y1, y2), 0);
-    end_y = std::min(std::max(y1, y2), h - 1);
-
-    NDPointer<float, 3> buffer(linear_buffer, {height, width, n_channel});
-
-    // build projection from map coordinate to view buffer coordinate
-    int view_x, view_y;
-    int view_rela_x, view_rela_y;
-    abs_to_rela(eye_x, eye_y, dir, start_x, start_y, view_rela_x, view_rela_y);
-    view_x = view_rela_x - view_left_top_x;
-    view_y = view_rela_y - view_left_top_y;
-
-    int *p_view_inner, *p_view_outer;
-    int d_view_inner, d_view_outer;
+    const RangeMask &mask = range->get_dir_mask(dir);
     switch (dir) {
         case NORTH:
-            p_view_inner = &view_y; p_view_outer = &view_x;
-            d_view_inner = 1; d_view_outer = 1;
+            extract_view_kernel<NORTH>(writer, channel_trans, mask, eye_x, eye_y,
+                                       view_left_top_x, view_left_top_y, start_x, start_y, end_x, end_y);
             break;
         case SOUTH:
-            p_view_inner = &view_y; p_view_outer = &view_x;
-            d_view_inner = -1; d_view_outer = -1;
+            extract_view_kernel<SOUTH>(writer, channel_trans, mask, eye_x, eye_y,
+                                       view_left_top_x, view_left_top_y, start_x, start_y, end_x, end_y);
             break;
         case EAST:
-            p_view_inner = &view_x; p_view_outer = &view_y;
-            d_view_inner = 1; d_view_outer = -1;
+            extract_view_kernel<EAST>(writer, channel_trans, mask, eye_x, eye_y,
+                                      view_left_top_x, view_left_top_y, start_x, start_y, end_x, end_y);
             break;
         case WEST:
-            p_view_inner = &view_x; p_view_outer = &view_y;
-            d_view_inner = -1; d_view_outer = 1;
+            extract_view_kernel<WEST>(writer, channel_trans, mask, eye_x, eye_y,
+                                      view_left_top_x, view_left_top_y, start_x, start_y, end_x, end_y);
             break;
         default:
             LOG(FATAL) << "invalid direction in Map::extract_view";
     }
+}
 
-    int start_inner = *p_view_inner;
+void Map::extract_view(const Agent *agent, float *linear_buffer, const int *channel_trans) const {
+    const AgentType &type = agent->get_type();
+    DenseViewWriter writer(linear_buffer, type.view_range->get_height(), type.view_range->get_width(),
+                           type.n_channel);
+    extract_view_dir(agent, writer, channel_trans);
+}
 
-    // scan the map
-    for (int x = start_x; x <= end_x; x++) {
-        PositionInteger pos_int = pos2int(x, start_y);
-        for (int y = start_y; y <= end_y; y++) {
-            int channel_id = channel_ids[pos_int];
+void Map::extract_view_sparse(const Agent *agent, std::vector<SparseViewEntry> &entries,
+                              const int *channel_trans) const {
+    SparseViewWriter writer(entries);
+    extract_view_dir(agent, writer, channel_trans);
+}
 
-            if (channel_id != -1 && range->is_in(view_y, view_x)) {
-                channel_id = channel_trans[channel_id];
-                buffer.at(view_y, view_x, channel_id) = 1;
-                if (slots[pos_int].occupier != nullptr && slots[pos_int].occ_type == OCC_AGENT) { // is agent
-                    Agent *p = ((Agent *) slots[pos_int].occupier);
-                    buffer.at(view_y, view_x, channel_id + 1) = p->get_hp() / p->get_type().hp; // normalize hp
-                }
-            }
+bool Map::is_view_dirty(const Agent *agent, int since_epoch) const {
+    int eye_x, eye_y;
+    int start_x, start_y, end_x, end_y;
 
-            *p_view_inner += d_view_inner;
-            pos_int += MAP_INNER_Y_ADD;
+    get_view_box(agent, eye_x, eye_y, start_x, start_y, end_x, end_y);
+
+    for (int ty = (start_y - row0) >> DIRTY_TILE_SHIFT; ty <= (end_y - row0) >> DIRTY_TILE_SHIFT; ty++) {
+        const int *row = tile_epoch + ty * tile_cols;
+        for (int tx = start_x >> DIRTY_TILE_SHIFT; tx <= end_x >> DIRTY_TILE_SHIFT; tx++) {
+            if (row[tx] > since_epoch)
+                return true;
         }
-        *p_view_inner = start_inner;
-        *p_view_outer += d_view_outer;
     }
+    return false;
+}
+
+void Map::update_hp(const Agent *agent) {
+    Position pos = agent->get_pos();
+    int width, height;
+    get_size_for_dir(agent, width, height);
+
+    float hp = agent->get_hp() / agent->get_type().hp;
+    for (int y = pos.y; y < pos.y + height; y++)
+        for (int x = pos.x; x < pos.x + width; x++)
+            hp_plane[(size_t)(y - row0) * w + x] = hp;
+    for (int y = pos.y; y < pos.y + height; y++)
+        mark_row(y);
+    if (pool_count != nullptr) {
+        for (int y = pos.y; y < pos.y + height; y++)
+            for (int x = pos.x; x < pos.x + width; x++)
+                set_pool_cell(x, y, agent, 1, hp);
+    }
+
+    if (!dirty_track)
+        return;
+    for (int ty = (pos.y - row0) >> DIRTY_TILE_SHIFT; ty <= (pos.y - row0 + height - 1) >> DIRTY_TILE_SHIFT; ty++)
+        for (int tx = pos.x >> DIRTY_TILE_SHIFT; tx <= (pos.x + width - 1) >> DIRTY_TILE_SHIFT; tx++)
+            tile_epoch[ty * tile_cols + tx] = dirty_epoch;
 }
 
 PositionInteger Map::get_attack_obj(const AttackAction &attack, int &obj_x, int &obj_y) const {
     const Agent *agent = attack.agent;
     const AgentType *type = &attack.agent->get_type();
-    Direction dir = agent->get_dir();
-
-    int att_x_offset = type->att_x_offset, att_y_offset = type->att_y_offset;
-    int agent_x, agent_y;
-    int rela_x, rela_y;
-
-    agent->get_type().attack_range->num2delta(attack.action, rela_x, rela_y);
+    const DirTable &table = type->dir_tables[agent->get_dir()];
+    Position pos = agent->get_pos();
 
-    save_to_real(agent, agent_x, agent_y);
-    rela_to_abs(agent_x, agent_y, dir, att_x_offset + rela_x, att_y_offset + rela_y, obj_x, obj_y);
+    obj_x = pos.x + table.attack_dx[attack.action];
+    obj_y = pos.y + table.attack_dy[attack.action];
 
     if (!in_board(obj_x, obj_y)) {
         return -1;
@@ -226,14 +566,14 @@ PositionInteger Map::get_attack_obj(const AttackAction &attack, int &obj_x, int
 
     PositionInteger pos_int = pos2int(obj_x, obj_y);
 
-    if (slots[pos_int].occupier == nullptr) {
+    if (slots[pos_int].occupier == NO_OCCUPIER) {
         return -1;
     }
 
     switch (slots[pos_int].occ_type) {
         case OCC_AGENT:
         {
-            Agent *obj = (Agent *) slots[pos_int].occupier;
+            Agent *obj = agent_table[slots[pos_int].occupier];
 
             if (!type->attack_in_group && agent->get_group() == obj->get_group()) { // same type
                 return -1;
@@ -251,36 +591,45 @@ PositionInteger Map::get_attack_obj(const AttackAction &attack, int &obj_x, int
     return -1;
 }
 
-// do attack for agent, return kill_reward and dead_group
-Reward Map::do_attack(Agent *agent, PositionInteger pos_int, GroupHandle &dead_group) {
+PositionInteger Map::get_attack_slot(const AttackAction &attack, int &obj_x, int &obj_y) const {
+    PositionInteger pos_int = get_attack_obj(attack, obj_x, obj_y);
+    if (pos_int == -1 && in_board(obj_x, obj_y) && slots[pos2int(obj_x, obj_y)].occupier != NO_OCCUPIER)
+        pos_int = pos2int(obj_x, obj_y);
+    return pos_int;
+}
+
+uint32_t Map::get_table_index(const Agent *agent) const {
+    return slots[pos2int(agent->get_pos())].occupier;
+}
+
+// do attack for agent, return kill_reward, dead_group and the hp supply for the attacker
+// the attacker is not modified except for its last op, so attacks on different objects can run in parallel
+Reward Map::do_attack(Agent *agent, PositionInteger pos_int, GroupHandle &dead_group, float &hp_supply) {
     // !! all the check should be done at Map::get_attack_obj
 
-    if (slots[pos_int].occupier == nullptr)  // dead
+    if (slots[pos_int].occupier == NO_OCCUPIER)  // dead
         return 0.0;
 
     switch(slots[pos_int].occ_type) {
         case OCC_AGENT:
         {
-            Agent *obj = ((Agent *)slots[pos_int].occupier);
+            Agent *obj = agent_table[slots[pos_int].occupier];
 
             obj->be_attack(agent->get_type().damage);
+            update_hp(obj);
             if (obj->is_dead()) {
                 agent->set_last_op(OP_KILL);
                 agent->set_op_obj(obj);
 
-                // remove dead people
+                // remove dead people, a ghost is counted by the rank that owns it
                 remove_agent(obj);
-                dead_group = obj->get_group();
-                agent->add_hp(obj->get_type().kill_supply);
-
-                // add food
-                if (food_mode) {
-                    slots[pos_int].occ_type = OCC_FOOD;
-                    Food *food = new Food;
-                    *food = obj->get_type().food_supply;
-                    slots[pos_int].occupier = food;
-                    set_channel_id(pos_int, food_channel_id);
-                }
+                if (!obj->is_ghost())
+                    dead_group = obj->get_group();
+                hp_supply = obj->get_type().kill_supply;
+
+                // add food, the owner of a ghost adds it when the forwarded damage kills the agent
+                if (food_mode && !obj->is_ghost())
+                    add_food(int2pos(pos_int), obj->get_type().food_supply);
                 return obj->get_type().kill_reward;
             } else {
                 agent->set_last_op(OP_ATTACK);
@@ -291,15 +640,12 @@ Reward Map::do_attack(Agent *agent, PositionInteger pos_int, GroupHandle &dead_g
         }
         case OCC_FOOD:  // deprecated ?
         {
-            Food *food = (Food *)slots[pos_int].occupier;
-            float add = std::min(agent->get_type().eat_ability, *food);
-            agent->add_hp(add);
-            *food -= add;
-            if (*food < 0.1) {
-                slots[pos_int].occupier = nullptr;
-                set_channel_id(pos_int, -1);
-                delete food;
-            }
+            Food &food = food_plane[slots[pos_int].occupier];
+            float add = std::min(agent->get_type().eat_ability, food);
+            hp_supply = add;
+            food -= add;
+            if (food < 0.1)
+                remove_food(pos_int);
             break;
         }
         default:
@@ -316,32 +662,32 @@ Reward Map::do_move(Agent *agent, const int delta[2]) {
     int width, height;
     get_size_for_dir(agent, width, height);
 
-    bool blank = is_blank_area(new_x, new_y, width, height, agent);
-    if (blank) {
-        PositionInteger old_pos_int = pos2int(pos);
+    PositionInteger old_pos_int = pos2int(pos);
+    const uint32_t self = slots[old_pos_int].occupier;
 
+    bool blank = is_blank_area(new_x, new_y, width, height, self);
+    if (blank) {
         // backup old
-        void *occupier = slots[old_pos_int].occupier;
         OccupyType occ_type = slots[old_pos_int].occ_type;
         int channel_id  = channel_ids[old_pos_int];
 
         clear_area(pos.x, pos.y, width, height);
-        fill_area(new_x, new_y, width, height, occupier, occ_type, channel_id);
+        fill_area(new_x, new_y, width, height, self, occ_type, channel_id);
 
         pos.x = new_x;
         pos.y = new_y;
     } else {
-        void *collide = get_collide(new_x, new_y, width, height, agent);
+        Agent *collide = get_collide(new_x, new_y, width, height, self);
         if  (collide != nullptr) {
-            /*Agent *obj = (Agent *)collide;
-            if (agent->get_group() != obj->get_group())
-                printf("%d %d\n", agent->get_group(), obj->get_group());*/
+            /*if (agent->get_group() != collide->get_group())
+                printf("%d %d\n", agent->get_group(), collide->get_group());*/
 
-            Agent *obj = (Agent *)collide;
+            Agent *obj = collide;
             if (obj->get_type().can_absorb) { // special condition
                 if (!obj->is_absorbed()) {
                     obj->set_absorbed(true);
                     obj->set_hp(obj->get_hp() * 2);
+                    update_hp(obj);
                     agent->set_dead(true);
                     remove_agent(agent);
                     agent->set_last_op(OP_COLLIDE);
@@ -387,9 +733,9 @@ Reward Map::do_turn(Agent *agent, int wise) {
 
     real_to_save(agent, new_x, new_y, new_dir, save_x, save_y);
 
-    if (is_blank_area(save_x, save_y, height, width, agent)) {
+    if (is_blank_area(save_x, save_y, height, width, slots[pos_int].occupier)) {
         // backup old
-        void *occupier = slots[pos_int].occupier;
+        uint32_t occupier = slots[pos_int].occupier;
         OccupyType occ_type = slots[pos_int].occ_type;
         int channel_id  = channel_ids[pos_int];
 
@@ -408,39 +754,42 @@ Reward Map::do_turn(Agent *agent, int wise) {
 int Map::get_align(Agent *agent) {
     Position pos = agent->get_pos();
     GroupHandle group = agent->get_group();
-    PositionInteger max_size = w * h;
+
+    // NOTE: only the rows are checked, since the map has walls in every column
+    auto same_group = [&](int x, int y) {
+        if (y < row0 || y >= row0 + h)  // a row not stored
+            return false;
+        Agent *other = agent_at(pos2int(x, y));
+        return other != nullptr && other->get_group() == group;
+    };
 
     // scan x axis
-    PositionInteger pos_int = pos2int(pos);
     int x_align = -1;
+    int x = pos.x;
     do {  // positive direction
         x_align++;
-        pos_int++;
-    } while (slots[pos_int].occupier != nullptr &&   // NOTE: do not check boundary, since the map has walls
-        ((Agent *)slots[pos_int].occupier)->get_group() == group);
+        x++;
+    } while (same_group(x, pos.y));
 
-    pos_int = pos2int(pos);
+    x = pos.x;
     do {  // negtive direction
         x_align++;
-        pos_int--;
-    } while (slots[pos_int].occupier != nullptr &&
-        ((Agent *)slots[pos_int].occupier)->get_group() == group);
+        x--;
+    } while (same_group(x, pos.y));
 
     // scan y axis
-    pos_int = pos2int(pos);
     int y_align = -1;
+    int y = pos.y;
     do {  // positive direction
         y_align++;
-        pos_int += MAP_INNER_Y_ADD;
-    } while (slots[pos_int].occupier != nullptr &&
-        ((Agent *)slots[pos_int].occupier)->get_group() == group);
+        y++;
+    } while (same_group(pos.x, y));
 
-    pos_int = pos2int(pos);
+    y = pos.y;
     do {  // negtive direction
         y_align++;
-        pos_int -= MAP_INNER_Y_ADD;
-    } while (slots[pos_int].occupier != nullptr &&
-        ((Agent *)slots[pos_int].occupier)->get_group() == group);
+        y--;
+    } while (same_group(pos.x, y));
 
     return std::max(x_align, y_align);
 }
@@ -451,63 +800,71 @@ int Map::get_align(Agent *agent) {
 
 // check if rectangle (x,y) - (x + width, y + height) is a blank area
 // the rectangle can only contains blank slots and itself
-inline bool Map::is_blank_area(int x, int y, int width, int height, void *self) {
-    if (x < 0 || y < 0 || x + width >= w || y + height >= h)
+inline bool Map::is_blank_area(int x, int y, int width, int height, uint32_t self) {
+    if (x < 0 || y < row0 || x + width >= w || y + height >= row0 + h)
         return false;
-    bool blank = true;
-    for (int i = 0; i < width && blank; i++) {
-        PositionInteger pos_int = pos2int(x + i, y);
-        for (int j = 0; j < height && blank; j++) {
-            if (slots[pos_int].slot_type != BLANK ||
-                (slots[pos_int].occupier != nullptr &&
-                    slots[pos_int].occupier != self)) {
-                blank = false;
-            }
-            pos_int += MAP_INNER_Y_ADD;
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            const MapSlot &slot = slots[pos2int(x + i, y + j)];
+            if (slot.slot_type != BLANK || (slot.occupier != NO_OCCUPIER
+                                             && (slot.occ_type != OCC_AGENT || slot.occupier != self)))
+                return false;
         }
     }
-    return blank;
+    return true;
 }
 
 // fill a rectangle (x, y) - (x + width, y + height) with specific occupier
-inline void Map::fill_area(int x, int y, int width, int height, void *occupier, OccupyType occ_type, int channel_id) {
-    for (int i = 0; i < width; i++) {
-        PositionInteger pos_int = pos2int(x + i, y);
-        for (int j = 0; j < height; j++) {
+inline void Map::fill_area(int x, int y, int width, int height, uint32_t occupier, OccupyType occ_type, int channel_id) {
+    float hp = 0;
+    const Agent *agent = nullptr;
+    if (occ_type == OCC_AGENT && occupier != NO_OCCUPIER) {
+        agent = agent_table[occupier];
+        hp = agent->get_hp() / agent->get_type().hp;
+    }
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            PositionInteger pos_int = pos2int(x + i, y + j);
             slots[pos_int].occupier = occupier;
             slots[pos_int].occ_type = occ_type;
+            hp_plane[(size_t)(y + j - row0) * w + x + i] = hp;
             set_channel_id(pos_int, channel_id);
-            pos_int += MAP_INNER_Y_ADD;
+            update_free(x + i, y + j, pos_int);
+            if (pool_count != nullptr && agent != nullptr)
+                set_pool_cell(x + i, y + j, agent, 1, hp);
         }
     }
 }
 
 // get original occupier in the rectangle who results in a collide with a move intention
-inline void * Map::get_collide(int x, int y, int width, int height, void *self) {
-    if (x < 0 || y < 0 || x + width >= w || y + height >= h)
+// the rectangle is scanned column by column, the first agent found is returned
+inline Agent * Map::get_collide(int x, int y, int width, int height, uint32_t self) {
+    if (x < 0 || y < row0 || x + width >= w || y + height >= row0 + h)
         return nullptr;
-    void *collide_obj = nullptr;
-    for (int i = 0; i < width && collide_obj == nullptr; i++) {
-        PositionInteger pos_int = pos2int(x + i, y);
-        for (int j = 0; j < height && collide_obj == nullptr; j++) {
-            if (slots[pos_int].occ_type == OCC_AGENT &&
-                slots[pos_int].occupier != self) {
-                collide_obj = slots[pos_int].occupier;
-            }
-            pos_int += MAP_INNER_Y_ADD;
+    for (int i = 0; i < width; i++) {
+        for (int j = 0; j < height; j++) {
+            const MapSlot &slot = slots[pos2int(x + i, y + j)];
+            if (slot.occ_type == OCC_AGENT && slot.occupier != NO_OCCUPIER && slot.occupier != self)
+                return agent_table[slot.occupier];
         }
     }
-    return collide_obj;
+    return nullptr;
 }
 
 // clear a rectangle
 inline void Map::clear_area(int x, int y, int width, int height) {
-    for (int i = 0; i < width; i++) {
-        PositionInteger pos_int = pos2int(x + i, y);
-        for (int j = 0; j < height; j++) {
-            slots[pos_int].occupier = nullptr;
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            PositionInteger pos_int = pos2int(x + i, y + j);
+            if (pool_count != nullptr) {
+                const Agent *agent = agent_at(pos_int);
+                if (agent != nullptr)
+                    set_pool_cell(x + i, y + j, agent, 0, 0);
+            }
+            slots[pos_int].occupier = NO_OCCUPIER;
+            hp_plane[(size_t)(y + j - row0) * w + x + i] = 0;
             set_channel_id(pos_int, -1);
-            pos_int += MAP_INNER_Y_ADD;
+            update_free(x + i, y + j, pos_int);
         }
     }
 }
@@ -594,7 +951,7 @@ inline void real_to_save(const Agent *agent, int real_x, int real_y, Direction n
     }
 }
 
-inline void get_size_for_dir(Agent *agent, int &width, int &height) {
+inline void get_size_for_dir(const Agent *agent, int &width, int &height) {
     Direction dir = agent->get_dir();
 
     if (dir == NORTH || dir == SOUTH) {
@@ -606,10 +963,141 @@ inline void get_size_for_dir(Agent *agent, int &width, int &height) {
     }
 }
 
+/**
+ * Pooled features
+ */
+inline void Map::set_pool_cell(int x, int y, const Agent *agent, unsigned char count, float hp) {
+    if (agent->get_group() >= n_pool_group)  // a group created after reset
+        return;
+    y -= row0;
+    size_t cell = ((size_t)agent->get_group() * h + y) * w + x;
+    pool_count[cell] = count;
+    pool_hp[cell] = hp;
+    int row = __atomic_load_n(&pool_dirty_row, __ATOMIC_RELAXED);
+    while (y < row && !__atomic_compare_exchange_n(&pool_dirty_row, &row, y, true,
+                                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+void Map::rebuild_pool_planes() {
+    if (pool_count == nullptr)
+        return;
+    memset(pool_count, 0, sizeof(unsigned char) * n_pool_group * w * h);
+    memset(pool_hp, 0, sizeof(float) * n_pool_group * w * h);
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            const Agent *agent = agent_at(pos2int(x, row0 + y));
+            if (agent != nullptr)
+                set_pool_cell(x, row0 + y, agent, 1, hp_plane[(size_t)y * w + x]);
+        }
+    }
+    pool_dirty_row = 0;
+}
+
+void Map::prepare_pooling() {
+    if (pool_count == nullptr || pool_dirty_row >= h)
+        return;
+
+    const size_t stride = (size_t)w + 1;
+    for (int g = 0; g < n_pool_group; g++) {
+        const unsigned char *count_plane = pool_count + (size_t)g * w * h;
+        const float *hp_plane_g = pool_hp + (size_t)g * w * h;
+        int *count_table = count_sat.data() + (size_t)g * (h + 1) * stride;
+        double *hp_table = hp_sat.data() + (size_t)g * (h + 1) * stride;
+
+        // row y + 1 of a table is row y of the table plus the prefix sums of row y of the plane
+        for (int y = pool_dirty_row; y < h; y++) {
+            const unsigned char *count_row = count_plane + (size_t)y * w;
+            const float *hp_row = hp_plane_g + (size_t)y * w;
+            const int *count_above = count_table + (size_t)y * stride;
+            const double *hp_above = hp_table + (size_t)y * stride;
+            int *count_out = count_table + (size_t)(y + 1) * stride;
+            double *hp_out = hp_table + (size_t)(y + 1) * stride;
+
+            int count_sum = 0;
+            double hp_sum = 0;
+            for (int x = 0; x < w; x++) {
+                count_sum += count_row[x];
+                hp_sum += hp_row[x];
+                count_out[x + 1] = count_above[x + 1] + count_sum;
+                hp_out[x + 1] = hp_above[x + 1] + hp_sum;
+            }
+        }
+    }
+    pool_dirty_row = h;
+}
+
+void Map::get_pooled(const Agent *agent, const std::vector<int> &radii, float *out) const {
+    const Position pos = agent->get_pos();
+    const GroupHandle self = agent->get_group();
+    const size_t stride = (size_t)w + 1;
+
+    for (int k = 0; k < radii.size(); k++) {
+        const int r = radii[k];
+        const int x0 = std::max(pos.x - r, 0), x1 = std::min(pos.x + r, w - 1) + 1;
+        const int y0 = std::max(pos.y - r, row0) - row0, y1 = std::min(pos.y + r, row0 + h - 1) + 1 - row0;
+        const float area = (float)(2 * r + 1) * (2 * r + 1);
+
+        for (int g = 0; g < n_pool_group; g++) {
+            const int *count_table = count_sat.data() + (size_t)g * (h + 1) * stride;
+            const double *hp_table = hp_sat.data() + (size_t)g * (h + 1) * stride;
+            int count = count_table[y1 * stride + x1] - count_table[y0 * stride + x1]
+                        - count_table[y1 * stride + x0] + count_table[y0 * stride + x0];
+            double hp = hp_table[y1 * stride + x1] - hp_table[y0 * stride + x1]
+                        - hp_table[y1 * stride + x0] + hp_table[y0 * stride + x0];
+
+            float *item = out + 2 * (k * n_pool_group + (g - self + n_pool_group) % n_pool_group);
+            item[0] = count / area;
+            item[1] = (float)hp / area;
+        }
+    }
+}
+
+void Map::sync_device(DeviceObserver &observer) {
+    std::vector<int> rows;
+    if (!observer.same_layout(w, h, n_plane, plane_words)) {
+        observer.resize_map(w, h, n_plane, plane_words);
+        std::fill(row_dirty.begin(), row_dirty.end(), 1);
+    }
+    for (int y = 0; y < h; y++) {
+        if (row_dirty[y]) {
+            rows.push_back(y);
+            row_dirty[y] = 0;
+        }
+    }
+    observer.upload_rows(rows, planes, hp_plane, plane_used);
+}
+
+size_t Map::get_memory() const {
+    size_t bytes = (size_t)n_cell * (sizeof(MapSlot) + sizeof(int) + sizeof(Food));
+    if (w > 0) {
+        bytes += (size_t)n_plane * h * plane_words * sizeof(unsigned long long) + n_plane;
+        bytes += (size_t)w * h * sizeof(float);
+        bytes += (size_t)n_pool_group * w * h * (sizeof(unsigned char) + sizeof(float));
+    }
+    if (tile_epoch != nullptr)
+        bytes += (size_t)tile_cols * tile_rows * sizeof(int);
+    bytes += utility::vector_bytes(count_sat) + utility::vector_bytes(hp_sat);
+    bytes += utility::vector_bytes(agent_table) + utility::vector_bytes(free_table);
+    bytes += utility::vector_bytes(free_cells) + utility::vector_bytes(free_at);
+    bytes += utility::vector_bytes(wall_bits) + utility::vector_bytes(row_dirty);
+    return bytes;
+}
+
 void Map::get_wall(std::vector<Position> &walls) const {
-    for (int i = 0; i < w * h; i++) {
-        if (slots[i].slot_type == OBSTACLE) {
-            walls.push_back(int2pos(i));
+    if (!wall_bits.empty()) {
+        for (int y = 0; y < map_h; y++) {
+            for (int x = 0; x < w; x++) {
+                if (is_wall_bit(x, y))
+                    walls.push_back(Position{x, y});
+            }
+        }
+        return;
+    }
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            if (slots[pos2int(x, y)].slot_type == OBSTACLE)
+                walls.push_back(Position{x, y});
         }
     }
 }
@@ -624,7 +1112,7 @@ void Map::render() {
     for (int x = 0; x < w; x++)
         printf("%2d ", x);  puts("");
 
-    for (int y = 0; y < h; y++) {
+    for (int y = row0; y < row0 + h; y++) {
         printf("%2d ", y);
         for (int x = 0; x < w; x++) {
             MapSlot s = slots[pos2int(x, y)];
@@ -632,12 +1120,12 @@ void Map::render() {
 
             switch (s.slot_type) {
                 case BLANK:
-                    if (s.occupier == nullptr) {
+                    if (s.occupier == NO_OCCUPIER) {
                         buf[0] = ' ';
                     } else {
                         switch (s.occ_type) {
                             case OCC_AGENT: {
-                                Agent &agent = *((Agent *)s.occupier);
+                                Agent &agent = *agent_table[s.occupier];
                                 switch (agent.get_dir()) {
                                     case EAST:  buf[0] = '>'; break;
                                     case WEST:  buf[0] = '<'; break;
@@ -673,5 +1161,124 @@ void Map::render() {
         printf("=");        puts("\n");
 }
 
+/**
+ * State snapshot
+ */
+namespace {
+// an occupied slot, group = -1 for food (index is then the position in the food table)
+struct SlotRecord {
+    int32_t pos;
+    int32_t group;
+    int32_t index;
+};
+} // namespace
+
+void Map::save_state(utility::StateWriter &writer) const {
+    writer.write<int32_t>(w);
+    writer.write<int32_t>(h);
+    writer.write<int32_t>(n_plane);
+
+    std::vector<unsigned char> types((size_t)w * h);
+    std::vector<int> channels((size_t)w * h);
+    std::vector<SlotRecord> records;
+    std::vector<Food> foods;
+    std::unordered_map<uint32_t, int> food_index;
+    for (int i = 0; i < w * h; i++) {
+        const PositionInteger pos_int = pos2int(i % w, row0 + i / w);
+        const MapSlot &slot = slots[pos_int];
+        types[i] = (unsigned char)slot.slot_type;
+        channels[i] = channel_ids[pos_int];
+        if (slot.occupier == NO_OCCUPIER)
+            continue;
+        if (slot.occ_type == OCC_AGENT) {
+            const Agent *agent = agent_table[slot.occupier];
+            records.push_back(SlotRecord{i, agent->get_group(), agent->get_index()});
+        } else {
+            // a food can cover several slots, store it once
+            auto iter = food_index.insert(std::make_pair(slot.occupier, (int)foods.size())).first;
+            if (iter->second == foods.size())
+                foods.push_back(food_plane[slot.occupier]);
+            records.push_back(SlotRecord{i, -1, iter->second});
+        }
+    }
+    writer.write_vector(types);
+    writer.write_vector(records);
+    writer.write_vector(foods);
+
+    // derived layers are copied as they are, so restoring does not replay set_channel_id
+    writer.write_array(channels.data(), channels.size());
+    writer.write_array(planes, (size_t)n_plane * h * plane_words);
+    writer.write_array(plane_used, (size_t)n_plane);
+    writer.write_array(hp_plane, (size_t)w * h);
+}
+
+void Map::load_state(utility::StateReader &reader, std::vector<Group> &groups) {
+    int width = reader.read<int32_t>(), height = reader.read<int32_t>(), n_channel = reader.read<int32_t>();
+    if (width != w || height != h || n_channel != n_plane)
+        LOG(FATAL) << "the map in the state does not match, reset the environment before load_state";
+
+    std::vector<unsigned char> types;
+    std::vector<SlotRecord> records;
+    std::vector<Food> foods;
+    reader.read_vector(types);
+    reader.read_vector(records);
+    reader.read_vector(foods);
+    if (types.size() != (size_t)w * h)
+        LOG(FATAL) << "broken map in the state";
+    free_valid = false;
+
+    for (int i = 0; i < n_cell; i++) {
+        slots[i] = MapSlot();
+        food_plane[i] = 0;
+    }
+    for (int i = 0; i < w * h; i++)
+        slots[pos2int(i % w, row0 + i / w)].slot_type = (SlotType)types[i];
+
+    // a food lives in the first cell it covers
+    std::vector<uint32_t> food_cells(foods.size(), NO_OCCUPIER);
+    std::unordered_map<const Agent *, uint32_t> agent_index;
+    agent_table.clear();
+    free_table.clear();
+    for (const SlotRecord &record : records) {
+        if (record.pos < 0 || record.pos >= w * h)
+            LOG(FATAL) << "broken map in the state";
+        const PositionInteger pos_int = pos2int(record.pos % w, row0 + record.pos / w);
+        MapSlot &slot = slots[pos_int];
+        if (record.group == -1) {
+            if (record.index < 0 || record.index >= foods.size())
+                LOG(FATAL) << "broken map in the state";
+            if (food_cells[record.index] == NO_OCCUPIER) {
+                food_cells[record.index] = (uint32_t)pos_int;
+                food_plane[pos_int] = foods[record.index];
+            }
+            slot.occ_type = OCC_FOOD;
+            slot.occupier = food_cells[record.index];
+        } else {
+            if (record.group < 0 || record.group >= groups.size()
+                || record.index < 0 || record.index >= groups[record.group].get_num())
+                LOG(FATAL) << "broken map in the state";
+            Agent *agent = groups[record.group].get_agents()[record.index];
+            auto iter = agent_index.insert(std::make_pair(agent, (uint32_t)agent_table.size())).first;
+            if (iter->second == agent_table.size())
+                agent_table.push_back(agent);
+            slot.occ_type = OCC_AGENT;
+            slot.occupier = iter->second;
+        }
+    }
+
+    std::vector<int> channels((size_t)w * h);
+    reader.read_array(channels.data(), channels.size());
+    for (int i = 0; i < w * h; i++)
+        channel_ids[pos2int(i % w, row0 + i / w)] = channels[i];
+    reader.read_array(planes, (size_t)n_plane * h * plane_words);
+    reader.read_array(plane_used, (size_t)n_plane);
+    reader.read_array(hp_plane, (size_t)w * h);
+
+    if (tile_epoch != nullptr)
+        std::fill(tile_epoch, tile_epoch + tile_cols * tile_rows, dirty_epoch);
+    std::fill(row_dirty.begin(), row_dirty.end(), 1);
+    rebuild_pool_planes();
+}
+
 } // namespace magent
 } // namespace gridworld
\ No newline at end of file
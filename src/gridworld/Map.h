@@ -6,80 +6,288 @@
 #ifndef MAGNET_GRIDWORLD_MAP_H
 #define MAGNET_GRIDWORLD_MAP_H
 
+#include <cstdint>
+#include <mutex>
 #include <vector>
 #include <random>
 #include "grid_def.h"
 #include "../Environment.h"
+#include "../utility/StateBuffer.h"
+#include "../utility/Philox.h"
+#include "../utility/ThreadPool.h"
 #include "Range.h"
+#include "DeviceObserver.h"
 
 namespace magent {
 namespace gridworld {
 
-typedef enum {BLANK, OBSTACLE} SlotType;
-typedef enum {OCC_AGENT, OCC_FOOD} OccupyType;
+typedef enum : uint8_t {BLANK, OBSTACLE} SlotType;
+typedef enum : uint8_t {OCC_AGENT, OCC_FOOD} OccupyType;
 
 typedef float Food;
 
+const uint32_t NO_OCCUPIER = 0xffffffffu;
+
+// a packed 8-byte slot. occupier is an index in the agent table of the map for OCC_AGENT,
+// or the cell of the food in the food plane for OCC_FOOD
 class MapSlot {
 public:
-    MapSlot() : slot_type(BLANK), occupier(nullptr) {}
+    MapSlot() : slot_type(BLANK), occ_type(OCC_AGENT), occupier(NO_OCCUPIER) {}
     SlotType slot_type;
     OccupyType occ_type;
-    void *occupier;
+    uint32_t occupier;
 };
+static_assert(sizeof(MapSlot) == 8, "MapSlot should be packed in 8 bytes");
+
 
+// a food left in a cell, mirrored to the neighbour ranks in distributed mode
+struct FoodCell {
+    Position pos;
+    Food amount;
+};
+
+// a nonzero entry of a view in sparse observation
+struct SparseViewEntry {
+    int view_y, view_x, channel;
+    float value;
+};
 
 class Map {
 public:
-    Map(): slots(nullptr), channel_ids(nullptr), w(-1), h(-1),
-        wall_channel_id(0), food_channel_id(1) {
+    Map(): slots(nullptr), channel_ids(nullptr), food_plane(nullptr), w(-1), h(-1), n_cell(0),
+        row0(0), map_h(-1), stored_begin(0), stored_end(-1),
+        tiled(false), tiles_per_row(0), wall_channel_id(0), food_channel_id(1),
+        n_plane(0), plane_words(0), planes(nullptr), plane_used(nullptr), hp_plane(nullptr),
+        dirty_track(false), dirty_epoch(0), tile_epoch(nullptr), row_track(false),
+        n_pool_group(0), pool_count(nullptr), pool_hp(nullptr), pool_dirty_row(0),
+        free_valid(false), crowded(false) {
     }
 
     ~Map() {
         delete [] slots;
         delete [] channel_ids;
+        delete [] food_plane;
+        delete [] planes;
+        delete [] plane_used;
+        delete [] hp_plane;
+        delete [] tile_epoch;
+        delete [] pool_count;
+        delete [] pool_hp;
     }
 
-    void reset(int width, int height, bool food_mode);
+    // tiled layout of slots and channel_ids, takes effect at the next reset
+    void set_tiled(bool value) { tiled = value; }
+    // only the rows [begin, end) of the map are stored, end = -1 for the last row. takes effect at the next reset.
+    // coordinates stay global, the other rows keep their walls in a bitmap and hold nothing else
+    void set_stored_rows(int begin, int end) { stored_begin = begin; stored_end = end; }
+    int get_row_begin() const { return row0; }
+    void reset(int width, int height, bool food_mode, int n_channel);
 
+    // a blank width x height area. rejection sampling is tried first, so placements on a sparse map do not change,
+    // then the top-left cell is drawn from the free cell index. can be called in parallel
     Position get_random_blank(std::default_random_engine &random_engine, int width=1, int height=1);
+    Position get_random_blank(utility::Philox &random_engine, int width=1, int height=1);
+    // a cell of the whole map without a wall, for random walls when only some rows are stored
+    Position get_random_wall_cell(std::default_random_engine &random_engine);
+    Position get_random_wall_cell(utility::Philox &random_engine);
+    // whether the last get_random_blank had to fall back to the free cell index
+    bool is_crowded() const { return __atomic_load_n(&crowded, __ATOMIC_RELAXED); }
+    // at most n disjoint blank width x height areas in random order, the candidates are scanned in parallel on pool.
+    // returns the number of areas found
+    int get_random_blank_areas(std::default_random_engine &random_engine, utility::ThreadPool *pool,
+                               int width, int height, int n, std::vector<Position> &poses);
+    // the parallel phases of a step do not maintain the free cell index, drop it before them
+    void drop_free_cells() { free_valid = false; }
 
 
     int add_agent(Agent *agent, Position pos, int width, int height, int base_channel_id);
     int add_agent(Agent *agent, int base_channel_id);
 
     int add_wall(Position pos);
+    // foods of the stored rows in [row_begin, row_end), cleared, listed or added in a blank stored cell
+    void clear_foods(int row_begin, int row_end);
+    void get_foods(int row_begin, int row_end, std::vector<FoodCell> &foods) const;
+    int add_food(Position pos, Food amount);
+    // the food eaten in a cell by an agent of another rank, nothing is done if there is no food
+    void eat_food(Position pos, Food amount);
+    // remove agent and recycle its entry in the agent table, nothing is done if it is already removed.
+    // it can be called in the parallel phases
     void remove_agent(Agent *agent);
 
     void average_pooling_group(float *group_buffer, int x0, int y0, int width, int height);
-    void extract_view(const Agent *agent, float *linear_buffer, const int *channel_trans, const Range *range,
-                      int n_channel, int width, int height, int view_x_offset, int view_y_offset,
-                      int view_left_top_x, int view_left_top_y,
-                      int view_right_bottom_x, int view_right_bottom_y) const;
+    // the view of agent (view_height, view_width, n_channel) of its type, the buffer should be zeroed
+    void extract_view(const Agent *agent, float *linear_buffer, const int *channel_trans) const;
+    // same as extract_view, but appends the nonzero entries instead of writing a dense view
+    void extract_view_sparse(const Agent *agent, std::vector<SparseViewEntry> &entries,
+                             const int *channel_trans) const;
 
     PositionInteger get_attack_obj(const AttackAction &attack, int &obj_x, int &obj_y) const;
-    Reward do_attack(Agent *agent, PositionInteger pos_int, GroupHandle &dead_group);
+    // the slot of get_attack_obj, or the occupied slot it rejects for attacking in group. -1 for a blank one
+    PositionInteger get_attack_slot(const AttackAction &attack, int &obj_x, int &obj_y) const;
+    Reward do_attack(Agent *agent, PositionInteger pos_int, GroupHandle &dead_group, float &hp_supply);
+    // a stable address of the object in a slot (Agent or Food), nullptr for none
+    const void *get_occupier(PositionInteger pos_int) const { return occupier_ptr(slots[pos_int]); }
+    // the agent in a slot, nullptr for none or food
+    Agent *get_agent(PositionInteger pos_int) const { return agent_at(pos_int); }
+    // the entry of an agent in the agent table, the agent should be in the map
+    uint32_t get_table_index(const Agent *agent) const;
+    size_t get_table_size() const { return agent_table.size(); }
 
     Reward do_move(Agent *agent, const int delta[2]);
     Reward do_turn(Agent *agent, int wise);
 
     int get_align(Agent *agent);
 
+    // refresh the hp plane (and dirty tiles) after the hp of an agent changes
+    void update_hp(const Agent *agent);
+
+    // dirty tracking for incremental observation, every change is stamped on its tile with the current epoch
+    void set_dirty_track(bool value) { dirty_track = value; }
+    int  next_dirty_epoch() { return dirty_epoch++; }
+    bool is_view_dirty(const Agent *agent, int since_epoch) const;
+
+    // rows of the planes changed since the last sync_device, tracked once a device observer is bound
+    void set_row_track(bool value) {
+        row_track = value;
+        row_dirty.assign(value && h > 0 ? (size_t)h : 0, 1);
+    }
+    // upload the changed rows to the device copy of observer, all of them if its layout is outdated
+    void sync_device(DeviceObserver &observer);
+
+    // pooled features of n_group groups, takes effect at the next reset, 0 to disable
+    void set_pooling(int n_group) { n_pool_group = n_group; }
+    // bring the summed-area tables up to date, call it serially before get_pooled
+    void prepare_pooling();
+    // for every radius r and every group g (ordered from the group of agent), the agent density
+    // and the sum of normalized hp in the (2r + 1) x (2r + 1) square around agent, divided by its area
+    void get_pooled(const Agent *agent, const std::vector<int> &radii, float *out) const;
+
     void render();
     void get_wall(std::vector<Position> &walls) const;
 
+    // heap memory of the slots, channel_ids, planes, agent table, indexes and dirty rows
+    size_t get_memory() const;
+
+    // occupiers are saved as (group, index) of agents, load_state rebuilds the agent table from them
+    // and must be called after the agents are restored. cells are saved in row-major order, whatever the layout,
+    // the channel layer, bitplanes and hp plane are copied as they are
+    void save_state(utility::StateWriter &writer) const;
+    void load_state(utility::StateReader &reader, std::vector<Group> &groups);
+
 private:
     MapSlot* slots;
     int *channel_ids;  // channel_id is supposed to be a member of MapSlot, extract it out from MapSlot for faster access of memory
-    int w, h;
+    Food *food_plane;  // food left in a cell. a food is created in the cell of the killed agent, so parallel attack shards never share one
+    int w, h;          // h is the number of stored rows
+    int n_cell;        // size of slots, channel_ids and food_plane, larger than w * h for the tiled layout
+    // the stored rows are [row0, row0 + h) of the map_h rows. every row-indexed array holds the stored rows only,
+    // walls of the whole map are kept in wall_bits (w * map_h bits) when some rows are not stored
+    int row0, map_h;
+    int stored_begin, stored_end;
+    std::vector<unsigned long long> wall_bits;
+    bool is_wall_bit(int x, int y) const {
+        size_t bit = (size_t)y * w + x;
+        return (wall_bits[bit >> 6] >> (bit & 63)) & 1;
+    }
     const int wall_channel_id, food_channel_id;
     bool food_mode;
 
+    // agents in the map, indexed by MapSlot::occupier. entries are allocated by add_agent (serially)
+    // and dropped at reset. remove_agent pushes the entry into free_table under table_mutex, its slots are
+    // cleared so nothing refers to it, and add_agent reuses it
+    std::vector<Agent *> agent_table;
+    std::vector<uint32_t> free_table;
+    std::mutex table_mutex;
+
+    uint32_t alloc_table(Agent *agent) {
+        if (free_table.empty()) {
+            agent_table.push_back(agent);
+            return (uint32_t)agent_table.size() - 1;
+        }
+        uint32_t index = free_table.back();
+        free_table.pop_back();
+        agent_table[index] = agent;
+        return index;
+    }
+
+    // tiled layout : slots and channel_ids are stored in MAP_TILE x MAP_TILE tiles, row-major inside a tile,
+    // so the rectangle of an agent or a pooled region stays in a few cache lines and pages on wide maps
+    static const int MAP_TILE_SHIFT = 4, MAP_TILE = 1 << MAP_TILE_SHIFT;
+    bool tiled;
+    int tiles_per_row;
+
+    // layered copy of channel_ids for extract_view, one occupancy bitplane per channel, row-major,
+    // plane_words 64-bit words per row (one more for unaligned reads). bits are updated atomically,
+    // since moves in different tiles can share a word
+    int n_plane, plane_words;
+    unsigned long long *planes;
+    unsigned char *plane_used;
+    float *hp_plane;     // normalized hp of the agent in a cell, 0 for other cells, row-major as the bitplanes
+
+    // dirty tiles, tile size is 1 << DIRTY_TILE_SHIFT
+    static const int DIRTY_TILE_SHIFT = 3;
+    bool dirty_track;
+    int dirty_epoch;
+    int *tile_epoch;
+    int tile_cols, tile_rows;
+
+    // rows changed since the last sync of the device copy, set from the parallel phases too
+    bool row_track;
+    std::vector<unsigned char> row_dirty;
+    void mark_row(int y) {
+        if (row_track)
+            __atomic_store_n(&row_dirty[y - row0], (unsigned char)1, __ATOMIC_RELAXED);
+    }
+
+    // pooling : occupancy and normalized hp of every group in (n_pool_group, h, w) planes, updated with
+    // the slots, and their summed-area tables (n_pool_group, h + 1, w + 1). tables are valid above
+    // pool_dirty_row, the first stored row changed since the last prepare_pooling
+    int n_pool_group;
+    unsigned char *pool_count;
+    float *pool_hp;
+    std::vector<int> count_sat;
+    std::vector<double> hp_sat;
+    int pool_dirty_row;
+
+    // free cell index : the blank cells ((y - row0) * w + x) in any order, and the index of every cell in it, -1 if not blank.
+    // it is built by the first placement that needs it, then kept up to date by the serial changes (swap-remove)
+    // until it is dropped
+    static const int REJECT_TRIES = 16;
+    std::vector<int> free_cells, free_at;
+    bool free_valid;
+    bool crowded;
+    std::mutex free_mutex;
+
+    bool is_blank(PositionInteger pos_int) const {
+        return slots[pos_int].slot_type == BLANK && slots[pos_int].occupier == NO_OCCUPIER;
+    }
+
+    void update_free(int x, int y, PositionInteger pos_int) {
+        if (!free_valid)
+            return;
+        int cell = (y - row0) * w + x, index = free_at[cell];
+        if (is_blank(pos_int)) {
+            if (index < 0) {
+                free_at[cell] = (int)free_cells.size();
+                free_cells.push_back(cell);
+            }
+        } else if (index >= 0) {
+            int last = free_cells.back();
+            free_cells[index] = last;
+            free_at[last] = index;
+            free_cells.pop_back();
+            free_at[cell] = -1;
+        }
+    }
+
+    void prepare_free_cells();
+    void find_blank_areas(utility::ThreadPool *pool, int width, int height, std::vector<Position> &areas) const;
+
     /**
      * Utility
      */
     bool in_board(int x, int y) const {
-        return x >= 0 && x < w && y >= 0 && y < h;
+        return x >= 0 && x < w && y >= row0 && y < row0 + h;
     }
 
     PositionInteger pos2int(Position pos) const {
@@ -88,25 +296,87 @@ private:
 
     PositionInteger pos2int(int x, int y) const {
         //return (PositionInteger)x * h + y;
+        y -= row0;
+        if (tiled) {
+            PositionInteger tile = (PositionInteger)(y >> MAP_TILE_SHIFT) * tiles_per_row + (x >> MAP_TILE_SHIFT);
+            return (tile << (2 * MAP_TILE_SHIFT)) | ((y & (MAP_TILE - 1)) << MAP_TILE_SHIFT) | (x & (MAP_TILE - 1));
+        }
         return (PositionInteger)y * w + x;
     }
 
     Position int2pos(PositionInteger pos) const {
         //return Position{(int)(pos / h), (int)(pos % h)};
-        return Position{(int)(pos % w), (int)(pos / w)};
+        if (tiled) {
+            PositionInteger tile = pos >> (2 * MAP_TILE_SHIFT);
+            int in_tile = (int)(pos & (MAP_TILE * MAP_TILE - 1));
+            return Position{(int)(tile % tiles_per_row) * MAP_TILE + (in_tile & (MAP_TILE - 1)),
+                            row0 + (int)(tile / tiles_per_row) * MAP_TILE + (in_tile >> MAP_TILE_SHIFT)};
+        }
+        return Position{(int)(pos % w), row0 + (int)(pos / w)};
+    }
+
+    void *occupier_ptr(const MapSlot &slot) const {
+        if (slot.occupier == NO_OCCUPIER)
+            return nullptr;
+        if (slot.occ_type == OCC_AGENT)
+            return agent_table[slot.occupier];
+        return food_plane + slot.occupier;
+    }
+
+    Agent *agent_at(PositionInteger pos_int) const {
+        const MapSlot &slot = slots[pos_int];
+        return slot.occupier != NO_OCCUPIER && slot.occ_type == OCC_AGENT ? agent_table[slot.occupier] : nullptr;
     }
 
     void set_channel_id(PositionInteger pos, int id) {
+        int old = channel_ids[pos];
         channel_ids[pos] = id;
+        if (old != id) {
+            Position p = int2pos(pos);
+            unsigned long long bit = 1ULL << (p.x & 63);
+            size_t word = (size_t)(p.y - row0) * plane_words + (p.x >> 6);
+            if (old != -1)
+                __atomic_fetch_and(&planes[(size_t)old * h * plane_words + word], ~bit, __ATOMIC_RELAXED);
+            if (id != -1) {
+                __atomic_fetch_or(&planes[(size_t)id * h * plane_words + word], bit, __ATOMIC_RELAXED);
+                plane_used[id] = 1;
+            }
+        }
+        if (dirty_track)
+            mark_dirty(int2pos(pos));
+        if (row_track)
+            mark_row(int2pos(pos).y);
     }
 
+    inline void set_pool_cell(int x, int y, const Agent *agent, unsigned char count, float hp);
+    void rebuild_pool_planes();
+
+    void mark_dirty(Position pos) {
+        tile_epoch[((pos.y - row0) >> DIRTY_TILE_SHIFT) * tile_cols + (pos.x >> DIRTY_TILE_SHIFT)] = dirty_epoch;
+    }
+
+    template <typename Writer>
+    void extract_view_dir(const Agent *agent, Writer &writer, const int *channel_trans) const;
+    template <Direction dir, typename Writer>
+    void extract_view_kernel(Writer &writer, const int *channel_trans, const RangeMask &mask,
+                             int eye_x, int eye_y, int view_left_top_x, int view_left_top_y,
+                             int start_x, int start_y, int end_x, int end_y) const;
+
+    void get_view_box(const Agent *agent, int &eye_x, int &eye_y,
+                      int &start_x, int &start_y, int &end_x, int &end_y) const;
+
     void dfs(std::default_random_engine &random_engine, int x, int y, int thick, int mode);
 
-    inline bool is_blank_area(int x, int y, int width, int height,  void *self = nullptr);
+    inline bool is_blank_area(int x, int y, int width, int height, uint32_t self = NO_OCCUPIER);
+    template <typename RandomEngine>
+    Position random_blank(RandomEngine &random_engine, int width, int height);
+    template <typename RandomEngine>
+    Position random_wall_cell(RandomEngine &random_engine);
+    void remove_food(PositionInteger pos_int);
     inline void clear_area(int x, int y, int width, int height);
     inline void fill_area(int x, int y, int width, int height,
-                          void *occupier, OccupyType occ_type, int channel_id);
-    inline void *get_collide(int x, int y, int width, int height, void *self);
+                          uint32_t occupier, OccupyType occ_type, int channel_id);
+    inline Agent *get_collide(int x, int y, int width, int height, uint32_t self);
 };
 
 } // namespace gridworld
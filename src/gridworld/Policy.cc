@@ -0,0 +1,234 @@
+/**
+ * \file Policy.cc
+ * \brief built-in scripted policies, ported from temp_c_booster.cc
+ */
+
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+
+#include "Policy.h"
+#include "GridWorld.h"
+
+namespace magent {
+namespace gridworld {
+
+// read a parameter by name, return default_value if it is not given
+static float get_param(int n, const char **keys, const float *values, const char *name, float default_value) {
+    for (int i = 0; i < n; i++) {
+        if (strequ(keys[i], name))
+            return values[i];
+    }
+    return default_value;
+}
+
+static void check_keys(int n, const char **keys, const std::vector<std::string> &known, const std::string &policy) {
+    for (int i = 0; i < n; i++) {
+        if (std::find(known.begin(), known.end(), keys[i]) == known.end())
+            LOG(FATAL) << "invalid parameter of policy " << policy << " : " << keys[i];
+    }
+}
+
+static void check_group(const PolicyContext &ctx, int group, const char *policy) {
+    if (group < 0 || group >= ctx.group_channels.size())
+        LOG(FATAL) << "invalid target group of policy " << policy << " : " << group;
+}
+
+/**
+ * runaway : move back if an agent of away_group is in the 3x3 cells at the bottom center of the view,
+ *           otherwise take action move_back + 1
+ */
+class RunawayPolicy : public Policy {
+public:
+    RunawayPolicy(int away_group, int move_back) : away_group(away_group), move_back(move_back) {}
+
+    void check(const PolicyContext &ctx) const override {
+        check_group(ctx, away_group, "runaway");
+    }
+
+    Action infer_action(const Agent &agent, const float *view, const PolicyContext &ctx,
+                        unsigned int *seed) const override {
+        const int height = ctx.view_height, width = ctx.view_width;
+        const int away_channel = ctx.group_channels[away_group];
+        for (int row = std::max(height - 3, 0); row <= height - 1; row++) {
+            for (int col = std::max(width / 2 - 1, 0); col <= std::min(width / 2 + 1, width - 1); col++) {
+                if (ctx.at(view, row, col, away_channel) > 0.5)
+                    return move_back;
+            }
+        }
+        return move_back + 1;
+    }
+
+private:
+    int away_group, move_back;
+};
+
+/**
+ * rush : attack the first target (or food) in attack range, move forward if a target is seen,
+ *        otherwise move randomly. agents with hp >= threshold always move randomly
+ */
+class RushPolicy : public Policy {
+public:
+    RushPolicy(int target_group, float threshold) : target_group(target_group), threshold(threshold) {}
+
+    void check(const PolicyContext &ctx) const override {
+        check_group(ctx, target_group, "rush");
+    }
+
+    Action infer_action(const Agent &agent, const float *view, const PolicyContext &ctx,
+                        unsigned int *seed) const override {
+        const int height = ctx.view_height, width = ctx.view_width;
+        const int enemy = ctx.group_channels[target_group];
+        if (agent.get_hp() >= threshold)
+            return (Action)(rand_r(seed) % ctx.attack_base);
+
+        bool found = false;
+        for (int row = 0; row < height; row++) {
+            for (int col = 0; col < width; col++) {
+                if (ctx.at(view, row, col, enemy) > 0.5
+                    || (ctx.food_channel >= 0 && ctx.at(view, row, col, ctx.food_channel) > 0.5)) {
+                    found = true;
+                    int attack = ctx.view2attack[row * width + col];
+                    if (attack != -1)
+                        return ctx.attack_base + attack;
+                }
+            }
+        }
+
+        if (found && (int)(ctx.at(view, height - 1, width / 2, ctx.wall_channel) + 0.5) != 1)
+            return 0;
+        return (Action)(rand_r(seed) % ctx.attack_base);
+    }
+
+private:
+    int target_group;
+    float threshold;
+};
+
+// move action towards a displacement (row, col) in the view, for the 13 moves of speed 2
+static int displacement_to_move(const std::pair<int, int> &disp, bool stride) {
+    int action = -1;
+    if (disp.first < 0) {
+        if (disp.second < 0) {
+            action = 1;
+        } else if (disp.second == 0) {
+            action = stride ? 0 : 2;
+        } else {
+            action = 3;
+        }
+    } else if (disp.first == 0) {
+        if (disp.second < 0) {
+            action = stride ? 4 : 5;
+        } else if (disp.second == 0) {
+            action = 6;
+        } else {
+            action = stride ? 8 : 7;
+        }
+    } else {
+        if (disp.second < 0) {
+            action = 9;
+        } else if (disp.second == 0) {
+            action = stride ? 12 : 10;
+        } else {
+            action = 11;
+        }
+    }
+    return action;
+}
+
+/**
+ * gather : attack a food (agent of target_group) in range, walk to a food in view,
+ *          or walk to a dense minimap cell of the target group. needs minimap_mode
+ */
+class GatherPolicy : public Policy {
+public:
+    explicit GatherPolicy(int target_group) : target_group(target_group) {}
+
+    void check(const PolicyContext &ctx) const override {
+        check_group(ctx, target_group, "gather");
+        if (!ctx.minimap_mode)
+            LOG(FATAL) << "policy gather needs minimap_mode";
+    }
+
+    Action infer_action(const Agent &agent, const float *view, const PolicyContext &ctx,
+                        unsigned int *seed) const override {
+        const int height = ctx.view_height, width = ctx.view_width;
+        const int food = ctx.group_channels[target_group];
+        const int self_minimap = ctx.group_channels[ctx.group] + 2, food_minimap = food + 2;
+
+        // find food
+        std::vector<int> att_vector;
+        std::vector<std::pair<int, int>> vector;
+        for (int row = 0; row < height; row++) {
+            for (int col = 0; col < width; col++) {
+                if (fabs(ctx.at(view, row, col, food) - 1.0) < 1e-10) {
+                    int attack = ctx.view2attack[row * width + col];
+                    if (attack != -1) {
+                        att_vector.push_back(attack + ctx.attack_base);
+                    } else {
+                        int d_row = row - height / 2, d_col = col - width / 2;
+                        if (d_row == d_col && abs(d_col) == 1) {
+                            if (rand_r(seed) & 1)
+                                d_row = 0;
+                            else
+                                d_col = 0;
+                        }
+                        vector.push_back(std::make_pair(d_row, d_col));
+                    }
+                }
+            }
+        }
+        if (!att_vector.empty())
+            return att_vector[rand_r(seed) % att_vector.size()];
+        if (!vector.empty())
+            return displacement_to_move(vector[0], false);
+
+        // use minimap to navigation
+        std::pair<int, int> mypos = std::make_pair(-1, -1);
+        std::vector<std::pair<float, std::pair<int, int>>> targets;
+        for (int row = 0; row < height; row++) {
+            for (int col = 0; col < width; col++) {
+                if (ctx.at(view, row, col, self_minimap) > 1.0)
+                    mypos = std::make_pair(row, col);
+            }
+        }
+        for (int row = 0; row < height; row++) {
+            for (int col = 0; col < width; col++) {
+                float density = ctx.at(view, row, col, food_minimap);
+                if (density > 0.0)
+                    targets.push_back(std::make_pair(density, std::make_pair(row - mypos.first, col - mypos.second)));
+            }
+        }
+        if (targets.empty())  // nothing left to gather
+            return (Action)(rand_r(seed) % ctx.attack_base);
+
+        std::sort(targets.rbegin(), targets.rend());
+        int action = displacement_to_move(targets[rand_r(seed) % targets.size()].second, true);
+        if (action == 6)
+            action = rand_r(seed) % ctx.attack_base;
+        return action;
+    }
+
+private:
+    int target_group;
+};
+
+Policy *new_policy(const std::string &name, int n, const char **keys, const float *values) {
+    if (name == "runaway") {
+        check_keys(n, keys, {"away_group", "move_back"}, name);
+        return new RunawayPolicy((int)get_param(n, keys, values, "away_group", -1),
+                                 (int)get_param(n, keys, values, "move_back", 4));
+    } else if (name == "rush") {
+        check_keys(n, keys, {"target_group", "threshold"}, name);
+        return new RushPolicy((int)get_param(n, keys, values, "target_group", -1),
+                              get_param(n, keys, values, "threshold", 100.0f));
+    } else if (name == "gather") {
+        check_keys(n, keys, {"target_group"}, name);
+        return new GatherPolicy((int)get_param(n, keys, values, "target_group", -1));
+    }
+    LOG(FATAL) << "invalid name of policy : " << name;
+    return nullptr;
+}
+
+} // namespace gridworld
+} // namespace magent
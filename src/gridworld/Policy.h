@@ -0,0 +1,56 @@
+/**
+ * \file Policy.h
+ * \brief scripted policies that are bound to a group and run inside GridWorld::step
+ */
+
+#ifndef MAGENT_GRIDWORLD_POLICY_H
+#define MAGENT_GRIDWORLD_POLICY_H
+
+#include <vector>
+#include <string>
+
+#include "grid_def.h"
+
+namespace magent {
+namespace gridworld {
+
+// what a policy can see besides the view of an agent, filled by GridWorld for the bound group
+struct PolicyContext {
+    GroupHandle group;
+    int view_height, view_width, n_channel;  // layout of the view, the same as get_observation
+    int wall_channel, food_channel;          // food_channel is -1 if food_mode is off
+    std::vector<int> group_channels;         // presence channel of every group, hp is +1, minimap is +2
+    bool minimap_mode;
+    int move_base, attack_base;
+    std::vector<int> view2attack;            // (view_height, view_width), attack action of a cell or -1
+
+    float at(const float *view, int row, int col, int channel) const {
+        return view[(row * view_width + col) * n_channel + channel];
+    }
+};
+
+/**
+ * A policy decides the action of one agent from its view, the view is extracted from the map
+ * in the layout of get_observation, without exporting the observation of the whole group.
+ * infer_action is called in parallel for the agents of a group, so it must not modify the policy.
+ * Random numbers must be drawn from seed (by rand_r), which is derived from the random engine of
+ * the environment, so a seeded run is reproducible.
+ */
+class Policy {
+public:
+    virtual ~Policy() = default;
+
+    // called once per step before infer_action, LOG(FATAL) if the policy cannot work with the group
+    virtual void check(const PolicyContext &ctx) const {}
+
+    virtual Action infer_action(const Agent &agent, const float *view, const PolicyContext &ctx,
+                                unsigned int *seed) const = 0;
+};
+
+// built-in policies : "runaway", "rush" and "gather", with parameters given by name
+Policy *new_policy(const std::string &name, int n, const char **keys, const float *values);
+
+} // namespace gridworld
+} // namespace magent
+
+#endif //MAGENT_GRIDWORLD_POLICY_H
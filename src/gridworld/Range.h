@@ -9,12 +9,25 @@
 #include <cstdio>
 #include <tgmath.h>
 #include <cstring>
+#include <vector>
+#include <algorithm>
+#include "grid_def.h"
 
 namespace magent {
 namespace gridworld {
 
 static const double PI = 3.1415926536;
 
+// a range rotated into the map frame for one direction,
+// bit c of row r is set if cell (eye_x + x0 + c, eye_y + y0 + r) is in the range
+struct RangeMask {
+    int x0, y0;
+    int rows, cols, n_word;  // one more word at the end of every row for unaligned reads
+    std::vector<unsigned long long> bits;
+
+    const unsigned long long *row(int r) const { return &bits[r * n_word]; }
+};
+
 class Range {
 public:
     Range() : width(-1), height(-1), count(0) {
@@ -22,14 +35,17 @@ public:
         dx = dy = nullptr;
     }
 
-    Range(const Range &other) :  width(other.width), height(other.height), count(other.count) {
+    Range(const Range &other) :  width(other.width), height(other.height), count(other.count),
+                                 x1(other.x1), y1(other.y1), x2(other.x2), y2(other.y2) {
         is_in_range = new bool[width * height];
         dx = new int[width * height];
         dy = new int[width * height];
 
         memcpy(is_in_range, other.is_in_range, sizeof(bool) * width * height);
-        memcpy(dx, other.dx, sizeof(bool) * width * height);
-        memcpy(dy, other.dy, sizeof(bool) * width * height);
+        memcpy(dx, other.dx, sizeof(int) * width * height);
+        memcpy(dy, other.dy, sizeof(int) * width * height);
+        for (int i = 0; i < DIR_NUM; i++)
+            dir_masks[i] = other.dir_masks[i];
     }
 
     ~Range() {
@@ -59,6 +75,16 @@ public:
     }
 
     int get_count() const { return count; }
+
+    // heap memory of the tables and the rotated masks
+    size_t get_memory() const {
+        size_t bytes = (sizeof(bool) + 2 * sizeof(int)) * (width > 0 ? (size_t)width * height : 0);
+        for (int i = 0; i < DIR_NUM; i++)
+            bytes += dir_masks[i].bits.capacity() * sizeof(unsigned long long);
+        return bytes;
+    }
+
+    const RangeMask &get_dir_mask(Direction dir) const { return dir_masks[dir]; }
     void num2delta(int n, int &dx, int &dy) const {
         // do not check boundary
         dx = this->dx[n];
@@ -91,12 +117,49 @@ public:
     }
 
 protected:
+    // build the rotated masks, called at the end of the constructors of derived ranges
+    void init_dir_masks() {
+        for (int d = 0; d < DIR_NUM; d++) {
+            RangeMask &mask = dir_masks[d];
+            int min_x = 0, min_y = 0, max_x = -1, max_y = -1;
+            bool first = true;
+            for (int i = 0; i < height; i++)
+                for (int j = 0; j < width; j++) {
+                    if (!is_in_range[i * width + j])
+                        continue;
+                    int map_dx, map_dy;
+                    rela_to_map((Direction)d, j + x1, i + y1, map_dx, map_dy);
+                    if (first) {
+                        min_x = max_x = map_dx; min_y = max_y = map_dy;
+                        first = false;
+                    }
+                    min_x = std::min(min_x, map_dx); max_x = std::max(max_x, map_dx);
+                    min_y = std::min(min_y, map_dy); max_y = std::max(max_y, map_dy);
+                }
+
+            mask.x0 = min_x; mask.y0 = min_y;
+            mask.cols = max_x - min_x + 1; mask.rows = max_y - min_y + 1;
+            mask.n_word = (mask.cols + 63) / 64 + 1;
+            mask.bits.assign((size_t)mask.rows * mask.n_word, 0);
+            for (int i = 0; i < height; i++)
+                for (int j = 0; j < width; j++) {
+                    if (!is_in_range[i * width + j])
+                        continue;
+                    int map_dx, map_dy;
+                    rela_to_map((Direction)d, j + x1, i + y1, map_dx, map_dy);
+                    int r = map_dy - min_y, c = map_dx - min_x;
+                    mask.bits[r * mask.n_word + (c >> 6)] |= 1ULL << (c & 63);
+                }
+        }
+    }
+
     int width, height;
     int count;
     int x1, y1, x2, y2;
     bool *is_in_range;
     int *dx;
     int *dy;
+    RangeMask dir_masks[DIR_NUM];
 };
 
 // sector range
@@ -140,6 +203,8 @@ public:
 
         x1 = -width / 2; y1 = -height;
         x2 = (width-1) / 2; y2 = -1;
+
+        init_dir_masks();
     }
 };
 
@@ -159,7 +224,7 @@ public:
         }
         height = width;
 
-        is_in_range = new bool[width * width];
+        is_in_range = new bool[width * width]();
         dx = new int[width * width];
         dy = new int[width * width];
 
@@ -186,6 +251,8 @@ public:
 
         x1 = y1 = -center;
         x2 = y2 = width - center - 1;
+
+        init_dir_masks();
     }
 };
 
@@ -6,6 +6,9 @@
 #include <ios>
 #include <fstream>
 #include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "RenderGenerator.h"
 #include "GridWorld.h"
@@ -13,10 +16,169 @@
 namespace magent {
 namespace gridworld {
 
+using utility::PackedAgent;
+using utility::PackedAttack;
+using utility::PackedPosition;
+
+RenderWriter::RenderWriter() : stop(false), busy(false), fout(nullptr), compress(false) {
+    thread = std::thread(&RenderWriter::run, this);
+}
+
+RenderWriter::~RenderWriter() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    cv_job.notify_all();
+    thread.join();
+    if (fout != nullptr)
+        fclose(fout);
+}
+
+void RenderWriter::open(const std::string &filename, bool compress, const char *magic) {
+    push(Job{filename, compress, magic, 0, std::vector<char>()});
+}
+
+void RenderWriter::write_block(uint32_t tag, std::vector<char> &&payload) {
+    push(Job{"", false, nullptr, tag, std::move(payload)});
+}
+
+void RenderWriter::push(Job &&job) {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv_done.wait(lock, [this] { return jobs.size() < MAX_QUEUED_JOB; });
+    jobs.push_back(std::move(job));
+    cv_job.notify_one();
+}
+
+void RenderWriter::flush() {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv_done.wait(lock, [this] { return jobs.empty() && !busy; });
+    if (fout != nullptr)
+        fflush(fout);
+}
+
+size_t RenderWriter::get_memory() {
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t bytes = busy ? 0 : compressed.capacity();  // the thread only resizes it while busy
+    for (const Job &job : jobs)
+        bytes += sizeof(Job) + job.payload.capacity();
+    return bytes;
+}
+
+void RenderWriter::run() {
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv_job.wait(lock, [this] { return stop || !jobs.empty(); });
+            if (jobs.empty())  // stop, all the jobs are done
+                return;
+            job = std::move(jobs.front());
+            jobs.pop_front();
+            busy = true;
+        }
+        cv_done.notify_all();
+
+        if (!job.filename.empty()) {
+            if (fout != nullptr)
+                fclose(fout);
+            fout = fopen(job.filename.c_str(), "wb");
+            if (fout == nullptr)
+                LOG(ERROR) << "cannot open render file " << job.filename;
+            compress = job.compress;
+            utility::RenderFileHeader header;
+            memcpy(header.magic, job.magic, sizeof(header.magic));
+            header.version = utility::RENDER_VERSION;
+            if (fout != nullptr)
+                fwrite(&header, sizeof(header), 1, fout);
+        } else if (fout != nullptr) {
+            utility::RenderBlockHeader header;
+            header.tag = job.tag;
+            header.raw_size = header.stored_size = (uint32_t)job.payload.size();
+            const char *data = job.payload.data();
+            if (compress && utility::compress_render_block(data, header.raw_size, compressed)) {
+                header.stored_size = (uint32_t)compressed.size();
+                data = compressed.data();
+            }
+            fwrite(&header, sizeof(header), 1, fout);
+            fwrite(data, 1, header.stored_size, fout);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            busy = false;
+        }
+        cv_done.notify_all();
+    }
+}
+
+RenderLiveRing::RenderLiveRing(const std::string &filename, const std::vector<Position> &walls,
+                               uint32_t n_slot, uint32_t slot_size) : addr(nullptr), size(0) {
+    utility::RenderLiveHeader header;
+    memcpy(header.magic, utility::RENDER_LIVE_MAGIC, sizeof(header.magic));
+    header.version = utility::RENDER_VERSION;
+    header.n_slot = n_slot;
+    header.slot_size = slot_size;
+    header.n_wall = (uint32_t)walls.size();
+    header.reserved = 0;
+    header.wall_offset = sizeof(header);
+    header.slot_offset = (header.wall_offset + walls.size() * sizeof(PackedPosition) + 7) / 8 * 8;
+    header.write_seq = header.dropped = 0;
+    size = header.slot_offset + (size_t)n_slot * (sizeof(utility::RenderLiveSlot) + slot_size);
+
+    // unlink first, so a reader of the previous ring keeps its own copy
+    unlink(filename.c_str());
+    int fd = ::open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || ftruncate(fd, (off_t)size) != 0) {
+        if (fd >= 0)
+            ::close(fd);
+        LOG(FATAL) << "cannot create live render file " << filename;
+    }
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED)
+        LOG(FATAL) << "cannot map live render file " << filename;
+    addr = (char *)p;
+
+    PackedPosition *wall_buf = (PackedPosition *)(addr + header.wall_offset);
+    for (int i = 0; i < walls.size(); i++)
+        wall_buf[i] = PackedPosition{(uint16_t)walls[i].x, (uint16_t)walls[i].y};
+    memcpy(addr, &header, sizeof(header));  // the magic is written last
+}
+
+RenderLiveRing::~RenderLiveRing() {
+    if (addr != nullptr)
+        munmap(addr, size);
+}
+
+void RenderLiveRing::publish(const std::vector<char> &payload) {
+    utility::RenderLiveHeader *header = (utility::RenderLiveHeader *)addr;
+    if (payload.size() > header->slot_size) {
+        __atomic_fetch_add(&header->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    uint64_t n = header->write_seq;  // only written by this thread
+    char *slot_addr = addr + header->slot_offset
+                      + (n % header->n_slot) * (sizeof(utility::RenderLiveSlot) + header->slot_size);
+    utility::RenderLiveSlot *slot = (utility::RenderLiveSlot *)slot_addr;
+
+    __atomic_store_n(&slot->seq, 2 * n + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->size = (uint32_t)payload.size();
+    memcpy(slot_addr + sizeof(utility::RenderLiveSlot), payload.data(), payload.size());
+    __atomic_store_n(&slot->seq, 2 * n + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->write_seq, n + 1, __ATOMIC_RELEASE);
+}
+
 RenderGenerator::RenderGenerator() {
     save_dir = "";
+    format = "text";
     file_ct = frame_ct = 0;
     frame_per_file = 10000;
+    key_frame_interval = 100;
+    live_slot_num = 8;
+    live_slot_size = 1 << 22;
 }
 
 void RenderGenerator::next_file() {
@@ -37,15 +199,46 @@ void RenderGenerator::set_render(const char *key, const char *value) {
         save_dir = std::string(value);
     else if (strequ(key, "frame_per_file"))
         sscanf(value, "%d", &frame_per_file);
+    else if (strequ(key, "key_frame_interval"))
+        sscanf(value, "%d", &key_frame_interval);
+    else if (strequ(key, "live_slot_num"))
+        sscanf(value, "%u", &live_slot_num);
+    else if (strequ(key, "live_slot_size"))
+        sscanf(value, "%u", &live_slot_size);
+    else if (strequ(key, "format")) {
+        if (!strequ(value, "text") && !strequ(value, "binary") && !strequ(value, "binary_lz4")
+            && !strequ(value, "live"))
+            LOG(FATAL) << "invalid render format in RenderGenerator::set_render : " << value;
+        if (strequ(value, "binary_lz4") && !utility::render_compress_available())
+            LOG(FATAL) << "lz4 is not built in, configure with -DUSE_LZ4=ON";
+        format = std::string(value);
+    }
+}
+
+void RenderGenerator::flush() {
+    if (writer != nullptr)
+        writer->flush();
+}
+
+size_t RenderGenerator::get_memory() {
+    size_t bytes = utility::vector_bytes(live_payload) + utility::vector_bytes(attack_events);
+    // a node of the hash map holds the pair and a link, the buckets are pointers
+    bytes += last_agents.size() * (sizeof(std::pair<const int, utility::PackedAgent>) + sizeof(void *))
+             + last_agents.bucket_count() * sizeof(void *);
+    if (writer != nullptr)
+        bytes += writer->get_memory();
+    if (live_ring != nullptr)
+        bytes += live_ring->get_size();
+    return bytes;
 }
 
 template <typename T>
 void print_json(std::ofstream &os, const char *key, T value, bool last=false) {
     os << "\"" << key << "\": " << value;
     if (last)
-        os << std::endl;
+        os << '\n';
     else
-        os << "," << std::endl;
+        os << ",\n";
 }
 
 std::string rgba_string(int r, int g, int b, float alpha) {
@@ -65,7 +258,7 @@ void RenderGenerator::gen_config(std::vector<Group> &group, int w, int h) {
         {64, 64, 64},
     };
 
-    f_config << "{" << std::endl;
+    f_config << "{\n";
     print_json(f_config, "width", w);
     print_json(f_config, "height", h);
     print_json(f_config, "static-file", "\"static.map\"");
@@ -76,10 +269,10 @@ void RenderGenerator::gen_config(std::vector<Group> &group, int w, int h) {
     print_json(f_config, "minimap-height", 250);
 
     // groups
-    f_config << "\"group\" : [" << std::endl;
+    f_config << "\"group\" : [\n";
     for (int i = 0; i < group.size(); i++) {
         AgentType &type = group[i].get_type();
-        f_config << "{" << std::endl;
+        f_config << "{\n";
 
         print_json(f_config, "height", type.length);
         print_json(f_config, "width", type.width);
@@ -96,12 +289,12 @@ void RenderGenerator::gen_config(std::vector<Group> &group, int w, int h) {
         print_json(f_config, "broadcast-radius", 1, true);
 
         if (i == group.size() - 1)
-            f_config << "}" << std::endl;
+            f_config << "}\n";
         else
-            f_config << "}," << std::endl;
+            f_config << "},\n";
     }
-    f_config << "]" << std::endl;
-    f_config << "}" << std::endl;
+    f_config << "]\n";
+    f_config << "}\n";
 }
 
 
@@ -110,6 +303,20 @@ void RenderGenerator::render_a_frame(std::vector<Group> &groups, const Map &map)
         return;
     }
 
+    if (format == "text")
+        render_text_frame(groups, map);
+    else if (format == "live")
+        render_live_frame(groups, map);
+    else
+        render_binary_frame(groups, map);
+
+    if (frame_ct++ > frame_per_file) {
+        frame_ct = 0;
+        file_ct++;
+    }
+}
+
+void RenderGenerator::render_text_frame(std::vector<Group> &groups, const Map &map) {
     std::string filename = save_dir + "/" + "video_" + std::to_string(file_ct) + ".txt";
     std::ofstream fout(filename.c_str(), frame_ct == 0 ? std::ios::out : std::ios::app);
 
@@ -119,9 +326,9 @@ void RenderGenerator::render_a_frame(std::vector<Group> &groups, const Map &map)
         map.get_wall(walls);
 
         // walls
-        fout << "W" << " " << walls.size() << std::endl;
+        fout << "W" << " " << walls.size() << '\n';
         for (int i = 0; i < walls.size(); i++) {
-            fout << walls[i].x << " " << walls[i].y << std::endl;
+            fout << walls[i].x << " " << walls[i].y << '\n';
         }
     }
 
@@ -142,7 +349,7 @@ void RenderGenerator::render_a_frame(std::vector<Group> &groups, const Map &map)
     int num_attacks = (int)attack_events.size();
 
     // frame info
-    fout << "F" << " " << num_agents << " " << num_attacks << " " << 0 << std::endl;
+    fout << "F" << " " << num_agents << " " << num_attacks << " " << 0 << '\n';
 
     // agent
     const int dir2angle[] = {0, 90, 180, 270};
@@ -164,7 +371,7 @@ void RenderGenerator::render_a_frame(std::vector<Group> &groups, const Map &map)
             hp = std::min(hp, 100);
             int dir = dir2angle[(int)agent.get_dir()];
 
-            fout << id << " " <<  hp << " " << dir << " " << pos.x << " " << pos.y << " " << i << std::endl;
+            fout << id << " " <<  hp << " " << dir << " " << pos.x << " " << pos.y << " " << i << '\n';
         }
     }
 
@@ -175,13 +382,103 @@ void RenderGenerator::render_a_frame(std::vector<Group> &groups, const Map &map)
         int x  = attack_events[i].x;
         int y  = attack_events[i].y;
 
-        fout << op << " " << id << " " << x << " " << y << std::endl;
+        fout << op << " " << id << " " << x << " " << y << '\n';
     }
+}
 
-    if (frame_ct++ > frame_per_file) {
-        frame_ct = 0;
-        file_ct++;
+template <typename T>
+static void append_record(std::vector<char> &buf, const T &record) {
+    const char *p = reinterpret_cast<const char *>(&record);
+    buf.insert(buf.end(), p, p + sizeof(T));
+}
+
+// pack agents (the same ones as the text format) and attacks into the payload of a frame block,
+// a delta frame is against the previous packed frame
+void RenderGenerator::pack_frame(std::vector<Group> &groups, bool key_frame, std::vector<char> &payload) {
+    std::unordered_map<int, PackedAgent> now_agents;
+    std::vector<PackedAgent> changed;
+    for (int i = 0; i < groups.size(); i++) {
+        const std::vector<Agent*> &agents = groups[i].get_agents();
+        bool can_absorb = groups[i].get_type().can_absorb;
+        for (int j = 0; j < agents.size(); j++) {
+            const Agent &agent = *agents[j];
+            if (can_absorb && !agent.is_absorbed())
+                continue;
+
+            Position pos = agent.get_pos();
+            int hp = std::max(0, int(100 * agent.get_hp() / agent.get_type().hp));
+            PackedAgent record{agent.get_id(), (uint16_t)pos.x, (uint16_t)pos.y, (uint8_t)std::min(hp, 100),
+                               (uint8_t)agent.get_dir(), (uint8_t)i, 0};
+            now_agents[record.id] = record;
+
+            if (key_frame) {
+                changed.push_back(record);
+            } else {
+                auto iter = last_agents.find(record.id);
+                if (iter == last_agents.end() || iter->second != record)
+                    changed.push_back(record);
+            }
+        }
+    }
+    std::vector<int32_t> removed;
+    if (!key_frame) {
+        for (auto iter = last_agents.begin(); iter != last_agents.end(); iter++) {
+            if (now_agents.find(iter->first) == now_agents.end())
+                removed.push_back(iter->first);
+        }
+    }
+    last_agents.swap(now_agents);
+
+    utility::RenderFrameHeader header{(uint32_t)last_agents.size(), (uint32_t)changed.size(),
+                                      (uint32_t)removed.size(), (uint32_t)attack_events.size()};
+    payload.clear();
+    payload.reserve(sizeof(header) + changed.size() * sizeof(PackedAgent)
+                    + removed.size() * sizeof(int32_t) + attack_events.size() * sizeof(PackedAttack));
+    append_record(payload, header);
+    for (int i = 0; i < changed.size(); i++)
+        append_record(payload, changed[i]);
+    for (int i = 0; i < removed.size(); i++)
+        append_record(payload, removed[i]);
+    for (int i = 0; i < attack_events.size(); i++)
+        append_record(payload, PackedAttack{attack_events[i].id, (uint16_t)attack_events[i].x,
+                                            (uint16_t)attack_events[i].y});
+}
+
+void RenderGenerator::render_binary_frame(std::vector<Group> &groups, const Map &map) {
+    if (writer == nullptr)
+        writer.reset(new RenderWriter());
+
+    if (frame_ct == 0) {
+        std::string filename = save_dir + "/" + "video_" + std::to_string(file_ct) + ".bin";
+        writer->open(filename, format == "binary_lz4");
+        last_agents.clear();
+
+        std::vector<Position> walls;
+        map.get_wall(walls);
+        std::vector<char> payload;
+        payload.reserve(sizeof(uint32_t) + walls.size() * sizeof(PackedPosition));
+        append_record(payload, (uint32_t)walls.size());
+        for (int i = 0; i < walls.size(); i++)
+            append_record(payload, PackedPosition{(uint16_t)walls[i].x, (uint16_t)walls[i].y});
+        writer->write_block(utility::RENDER_BLOCK_WALL, std::move(payload));
+    }
+
+    bool key_frame = key_frame_interval <= 1 || frame_ct % key_frame_interval == 0;
+    std::vector<char> payload;
+    pack_frame(groups, key_frame, payload);
+    writer->write_block(key_frame ? utility::RENDER_BLOCK_KEY_FRAME : utility::RENDER_BLOCK_DELTA_FRAME,
+                        std::move(payload));
+}
+
+void RenderGenerator::render_live_frame(std::vector<Group> &groups, const Map &map) {
+    if (live_ring == nullptr) {
+        std::vector<Position> walls;
+        map.get_wall(walls);
+        live_ring.reset(new RenderLiveRing(save_dir + "/" + "live.ring", walls, live_slot_num, live_slot_size));
     }
+
+    pack_frame(groups, true, live_payload);
+    live_ring->publish(live_payload);
 }
 
 } // namespace gridworld
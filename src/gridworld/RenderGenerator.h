@@ -8,9 +8,17 @@
 
 #include <vector>
 #include <string>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <memory>
+#include <cstdio>
 
 #include "grid_def.h"
 #include "Map.h"
+#include "../utility/RenderFormat.h"
 
 namespace magent {
 namespace gridworld {
@@ -20,6 +28,61 @@ struct RenderAttackEvent{
     int x, y;
 };
 
+// write blocks of binary render logs in a background thread, compression is also done there
+class RenderWriter {
+public:
+    RenderWriter();
+    ~RenderWriter();
+
+    // following blocks go to a new file, starting with a header of magic
+    void open(const std::string &filename, bool compress, const char *magic = utility::RENDER_MAGIC);
+    void write_block(uint32_t tag, std::vector<char> &&payload);
+    // block until all the queued blocks are written
+    void flush();
+    // heap memory of the queued blocks and the compression buffer
+    size_t get_memory();
+
+private:
+    struct Job {
+        std::string filename;  // not empty for an open job
+        bool compress;
+        const char *magic;
+        uint32_t tag;
+        std::vector<char> payload;
+    };
+
+    void push(Job &&job);
+    void run();
+
+    static const int MAX_QUEUED_JOB = 64;  // the engine waits if the writer falls too far behind
+
+    std::deque<Job> jobs;
+    std::mutex mutex;
+    std::condition_variable cv_job, cv_done;
+    bool stop, busy;
+    std::thread thread;
+
+    FILE *fout;
+    bool compress;
+    std::vector<char> compressed;
+};
+
+// the engine side of the live ring (see RenderFormat.h), a file in shared memory read by the render server
+class RenderLiveRing {
+public:
+    RenderLiveRing(const std::string &filename, const std::vector<Position> &walls, uint32_t n_slot, uint32_t slot_size);
+    ~RenderLiveRing();
+
+    // never blocks, a frame larger than a slot is dropped
+    void publish(const std::vector<char> &payload);
+
+    size_t get_size() const { return size; }
+
+private:
+    char *addr;
+    size_t size;
+};
+
 class RenderGenerator {
 public:
     RenderGenerator();
@@ -40,12 +103,32 @@ public:
         return save_dir;
     }
 
+    // wait for the background writer of the binary format
+    void flush();
+
+    // memory of the delta state, the payloads, the queue of the writer and the live ring
+    size_t get_memory();
+
 private:
+    void render_text_frame(std::vector<Group> &groups, const Map &map);
+    void render_binary_frame(std::vector<Group> &groups, const Map &map);
+    void render_live_frame(std::vector<Group> &groups, const Map &map);
+    void pack_frame(std::vector<Group> &groups, bool key_frame, std::vector<char> &payload);
+
     std::string save_dir;
+    std::string format;   // "text", "binary", "binary_lz4" or "live"
 
     int file_ct;
     int frame_ct;
     int frame_per_file;
+    int key_frame_interval;
+
+    std::unique_ptr<RenderWriter> writer;  // created at the first binary frame
+    std::unordered_map<int, utility::PackedAgent> last_agents;  // agents of the previous binary frame
+
+    std::unique_ptr<RenderLiveRing> live_ring;   // created at the first live frame
+    std::vector<char> live_payload;
+    unsigned int live_slot_num, live_slot_size;
 
     std::vector<RenderAttackEvent> attack_events;
 };
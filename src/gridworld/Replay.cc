@@ -0,0 +1,182 @@
+/**
+ * \file Replay.cc
+ * \brief compact replay logs of a GridWorld : snapshots and the actions of every step
+ */
+
+#include <cstdio>
+#include <sstream>
+
+#include "Replay.h"
+#include "GridWorld.h"
+
+namespace magent {
+namespace gridworld {
+
+// payload of RENDER_BLOCK_STEP, all integers are unsigned LEB128 varints :
+//   length, text of random_engine
+//   n_push, (group, n, action * n) * n_push    the actions pushed for the step, in order
+static void put_varint(std::vector<char> &out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back((char)((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.push_back((char)value);
+}
+
+static uint64_t get_varint(const std::vector<char> &in, size_t &offset) {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (offset >= in.size())
+            break;
+        unsigned char byte = (unsigned char)in[offset++];
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+            return value;
+    }
+    LOG(FATAL) << "broken step in the replay log";
+    return 0;
+}
+
+ReplayRecorder::ReplayRecorder(const std::string &filename, bool compress) : dirty(true), n_push(0) {
+    // the writer only logs the errors of its thread, check the file here
+    FILE *fout = fopen(filename.c_str(), "wb");
+    if (fout == nullptr)
+        LOG(FATAL) << "cannot open replay file " << filename;
+    fclose(fout);
+    writer.open(filename, compress, utility::REPLAY_MAGIC);
+}
+
+ReplayRecorder::~ReplayRecorder() {
+    writer.flush();
+}
+
+void ReplayRecorder::record_state(GridWorld &env) {
+    std::vector<char> state;
+    env.save_state(state);
+    writer.write_block(utility::RENDER_BLOCK_STATE, std::move(state));
+    dirty = false;
+}
+
+void ReplayRecorder::record_actions(GridWorld &env, GroupHandle group, const int *actions, int n) {
+    if (dirty)
+        record_state(env);
+    put_varint(pending, (uint64_t)group);
+    put_varint(pending, (uint64_t)n);
+    for (int i = 0; i < n; i++)
+        put_varint(pending, (uint64_t)(unsigned int)actions[i]);
+    n_push++;
+}
+
+void ReplayRecorder::record_step(GridWorld &env) {
+    if (dirty) {
+        // a snapshot is loaded at a step boundary, it cannot go between the actions and the step
+        if (n_push > 0)
+            LOG(FATAL) << "the game is changed between set_action and step, it cannot be recorded in the replay";
+        record_state(env);
+    }
+
+    std::ostringstream engine_state;
+    engine_state << env.random_engine;
+    const std::string text = engine_state.str();
+
+    std::vector<char> payload;
+    payload.reserve(text.size() + pending.size() + 16);
+    put_varint(payload, text.size());
+    payload.insert(payload.end(), text.begin(), text.end());
+    put_varint(payload, (uint64_t)n_push);
+    payload.insert(payload.end(), pending.begin(), pending.end());
+    writer.write_block(utility::RENDER_BLOCK_STEP, std::move(payload));
+
+    pending.clear();
+    n_push = 0;
+}
+
+void ReplayRecorder::record_clear() {
+    writer.write_block(utility::RENDER_BLOCK_CLEAR, std::vector<char>());
+}
+
+Replayer::Replayer(GridWorld &env, const std::string &filename) : env(env), offset(0) {
+    FILE *fin = fopen(filename.c_str(), "rb");
+    if (fin == nullptr)
+        LOG(FATAL) << "cannot open replay file " << filename;
+    char buf[1 << 16];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fin)) > 0)
+        data.insert(data.end(), buf, buf + n);
+    fclose(fin);
+
+    utility::RenderFileHeader header;
+    if (data.size() < sizeof(header))
+        LOG(FATAL) << "invalid replay file " << filename;
+    memcpy(&header, data.data(), sizeof(header));
+    if (memcmp(header.magic, utility::REPLAY_MAGIC, sizeof(header.magic)) != 0
+        || header.version != utility::RENDER_VERSION)
+        LOG(FATAL) << "invalid replay file " << filename;
+    offset = sizeof(header);
+}
+
+bool Replayer::read_block(uint32_t &tag, std::vector<char> &payload) {
+    utility::RenderBlockHeader header;
+    if (offset + sizeof(header) > data.size())
+        return false;
+    memcpy(&header, &data[offset], sizeof(header));
+    offset += sizeof(header);
+    if (offset + header.stored_size > data.size())
+        LOG(FATAL) << "truncated block in the replay log";
+
+    payload.resize(header.raw_size);
+    if (!utility::decompress_render_block(&data[offset], header.stored_size, payload.data(), header.raw_size))
+        LOG(FATAL) << "cannot decompress the replay log, it may need lz4 (configure with -DUSE_LZ4=ON)";
+    offset += header.stored_size;
+    tag = header.tag;
+    return true;
+}
+
+bool Replayer::next_step(int *done) {
+    uint32_t tag;
+    std::vector<char> payload;
+    while (read_block(tag, payload)) {
+        switch (tag) {
+            case utility::RENDER_BLOCK_STATE:
+                env.load_state(payload.data(), payload.size());
+                break;
+            case utility::RENDER_BLOCK_CLEAR:
+                env.clear_dead();
+                break;
+            case utility::RENDER_BLOCK_STEP:
+                apply_step(payload, done);
+                return true;
+            default:
+                LOG(FATAL) << "invalid block in the replay log : " << tag;
+        }
+    }
+    return false;
+}
+
+void Replayer::apply_step(const std::vector<char> &payload, int *done) {
+    size_t at = 0;
+    size_t length = get_varint(payload, at);
+    if (at + length > payload.size())
+        LOG(FATAL) << "broken step in the replay log";
+    std::istringstream engine_state(std::string(&payload[at], length));
+    at += length;
+
+    std::vector<int> actions;
+    uint64_t n_push = get_varint(payload, at);
+    for (uint64_t i = 0; i < n_push; i++) {
+        GroupHandle group = (GroupHandle)get_varint(payload, at);
+        int n = (int)get_varint(payload, at);
+        if (group < 0 || group >= (GroupHandle)env.groups.size() || n != env.groups[group].get_num())
+            LOG(FATAL) << "the replay log does not match the environment";
+        actions.resize((size_t)n);
+        for (int j = 0; j < n; j++)
+            actions[j] = (int)get_varint(payload, at);
+        env.queue_actions(group, actions.data());
+    }
+
+    engine_state >> env.random_engine;
+    env.run_frames(done);
+}
+
+} // namespace gridworld
+} // namespace magent
@@ -0,0 +1,71 @@
+/**
+ * \file Replay.h
+ * \brief compact replay logs of a GridWorld : snapshots and the actions of every step
+ */
+
+#ifndef MAGNET_GRIDWORLD_REPLAY_H
+#define MAGNET_GRIDWORLD_REPLAY_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "RenderGenerator.h"
+
+namespace magent {
+namespace gridworld {
+
+class GridWorld;
+
+/**
+ * The engine is deterministic given its state and the actions, so a log only keeps a snapshot after a change
+ * out of step (reset, add_agents, set_goal, load_state, seed), the actions pushed for every step
+ * (inferred ones included) and the clear_dead calls. The blocks are written in the background as render logs
+ */
+class ReplayRecorder {
+public:
+    ReplayRecorder(const std::string &filename, bool compress);
+    ~ReplayRecorder();
+
+    // the state changed out of step, a snapshot is written before the next actions
+    void mark_dirty() { dirty = true; }
+
+    void record_actions(GridWorld &env, GroupHandle group, const int *actions, int n);
+    // the end of the actions of a step, random_engine is the one the frames of the step start with
+    void record_step(GridWorld &env);
+    void record_clear();
+
+private:
+    void record_state(GridWorld &env);
+
+    RenderWriter writer;
+    bool dirty;
+    std::vector<char> pending;  // actions pushed since the last step
+    int n_push;
+};
+
+/**
+ * Re-simulate a log on env, which must be reset and configured as the recorded environment.
+ * Its policies and models are not used, the recorded actions are pushed instead
+ */
+class Replayer {
+public:
+    Replayer(GridWorld &env, const std::string &filename);
+
+    // apply the records up to the end of the next step, return false at the end of the log.
+    // done is the result of the step
+    bool next_step(int *done);
+
+private:
+    bool read_block(uint32_t &tag, std::vector<char> &payload);
+    void apply_step(const std::vector<char> &payload, int *done);
+
+    GridWorld &env;
+    std::vector<char> data;
+    size_t offset;
+};
+
+} // namespace gridworld
+} // namespace magent
+
+#endif //MAGNET_GRIDWORLD_REPLAY_H
@@ -4,6 +4,7 @@
  */
 
 #include "assert.h"
+#include <algorithm>
 
 #include "RewardEngine.h"
 #include "GridWorld.h"
@@ -11,14 +12,13 @@
 namespace magent {
 namespace gridworld {
 
-bool AgentSymbol::bind_with_check(void *entity) {
-    // bind agent symbol to entity with correctness check
+bool AgentSymbol::accept(void *entity) {
+    // check whether the entity can be bound to the symbol
     Agent *agent = (Agent *)entity;
     if (group != agent->get_group())
         return false;
     if (index != -1 && index != agent->get_index())
         return false;
-    this->entity = agent;
     return true;
 }
 
@@ -30,6 +30,7 @@ void GridWorld::define_agent_symbol(int no, int group, int index) {
     if (no >= agent_symbols.size()) {
         agent_symbols.resize((unsigned)no + 1);
     }
+    agent_symbols[no].no = no;
     agent_symbols[no].group = group;
     agent_symbols[no].index = index;
 }
@@ -186,7 +187,9 @@ void GridWorld::init_reward_description() {
 
         reward_rules[i].input_symbols = input_symbols;
         reward_rules[i].infer_obj     = infer_obj;
+        compile_rule(reward_rules[i]);
     }
+    rule_profiler = utility::Profiler((int)reward_rules.size());
 
     /**
      * semantic check
@@ -213,14 +216,110 @@ void GridWorld::init_reward_description() {
     }*/
 }
 
-bool GridWorld::calc_event_node(EventNode *node, RewardRule &rule) {
+size_t GridWorld::get_reward_memory() const {
+    // a node of std::set or std::map holds the value and three links and a color
+    const size_t tree_node = 4 * sizeof(void *);
+    size_t bytes = utility::vector_bytes(agent_symbols) + utility::vector_bytes(event_nodes)
+                   + utility::vector_bytes(reward_rules) + utility::vector_bytes(event_groups);
+    for (const EventNode &node : event_nodes) {
+        bytes += utility::vector_bytes(node.symbol_input) + utility::vector_bytes(node.node_input)
+                 + utility::vector_bytes(node.int_input) + utility::vector_bytes(node.raw_parameter);
+        bytes += node.related_symbols.size() * (tree_node + sizeof(AgentSymbol *));
+        bytes += node.infer_map.size() * (tree_node + 2 * sizeof(AgentSymbol *));
+    }
+    for (const RewardRule &rule : reward_rules) {
+        bytes += utility::vector_bytes(rule.input_symbols) + utility::vector_bytes(rule.infer_obj)
+                 + utility::vector_bytes(rule.receivers) + utility::vector_bytes(rule.values)
+                 + utility::vector_bytes(rule.raw_parameter) + rule.from_events.capacity() / 8
+                 + utility::vector_bytes(rule.prune_nodes);
+        for (const std::vector<EventNode*> &nodes : rule.prune_nodes)
+            bytes += utility::vector_bytes(nodes);
+    }
+    bytes += utility::vector_bytes(rule_contexts);
+    for (const RuleContext &ctx : rule_contexts) {
+        bytes += utility::vector_bytes(ctx.entities) + utility::vector_bytes(ctx.involved)
+                 + utility::vector_bytes(ctx.rewards) + ctx.scanned.capacity() / 8;
+    }
+    return bytes;
+}
+
+static void collect_conjuncts(EventNode *node, std::vector<EventNode*> &conjuncts) {
+    if (node->op == OP_AND) {
+        collect_conjuncts(node->node_input[0], conjuncts);
+        collect_conjuncts(node->node_input[1], conjuncts);
+    } else {
+        conjuncts.push_back(node);
+    }
+}
+
+static bool contain_op(const EventNode *node, EventOp op) {
+    if (node->op == op)
+        return true;
+    for (int i = 0; i < node->node_input.size(); i++) {
+        if (contain_op(node->node_input[i], op))
+            return true;
+    }
+    return false;
+}
+
+/**
+ * turn the permutation search of a rule into an event-driven plan, the rewards are the same as
+ * a full search
+ * 1. an `any` symbol that infers its object can only be bound to an agent with an event object
+ *    (last attack, kill or collide), so enumerate the event agents collected in calc_reward
+ *    instead of the whole group
+ * 2. every conjunct of the triggering event is checked as soon as all its symbols are bound
+ *    for the last time, and prunes the search when it fails
+ */
+void GridWorld::compile_rule(RewardRule &rule) {
+    std::vector<AgentSymbol*> &input_symbols = rule.input_symbols;
+    std::vector<AgentSymbol*> &infer_obj     = rule.infer_obj;
+    size_t n_level = input_symbols.size();
+
+    rule.from_events.assign(n_level, false);
+    for (int i = 0; i < n_level; i++) {
+        if (input_symbols[i]->is_any() && infer_obj[i] != nullptr) {
+            rule.from_events[i] = true;
+            GroupHandle group = input_symbols[i]->group;
+            if (std::find(event_groups.begin(), event_groups.end(), group) == event_groups.end())
+                event_groups.push_back(group);
+        }
+    }
+
+    // a symbol is fixed after the last level that binds it, `all` symbols need no binding
+    std::map<AgentSymbol*, int> bound_level;
+    for (int i = 0; i < n_level; i++) {
+        bound_level[input_symbols[i]] = i + 1;
+        if (infer_obj[i] != nullptr)
+            bound_level[infer_obj[i]] = i + 1;
+    }
+
+    std::vector<EventNode*> conjuncts;
+    collect_conjuncts(rule.on, conjuncts);
+    rule.prune_nodes.assign(n_level, std::vector<EventNode*>());
+    for (int i = 0; i < conjuncts.size(); i++) {
+        EventNode *node = conjuncts[i];
+        if (rule.auto_value && contain_op(node, OP_ALIGN))  // it assigns the reward value
+            continue;
+
+        int level = 0;
+        for (auto iter = node->related_symbols.begin(); iter != node->related_symbols.end(); iter++) {
+            if (!(*iter)->is_all())
+                level = std::max(level, bound_level[*iter]);
+        }
+        if (level < n_level)  // the last level is checked by the whole event
+            rule.prune_nodes[level].push_back(node);
+    }
+}
+
+bool GridWorld::calc_event_node(EventNode *node, RuleContext &ctx) {
     bool ret;
     switch (node->op) {
         case OP_ATTACK: case OP_KILL: case OP_COLLIDE: {
             Agent *sub, *obj;
             // object must be an agent, cannot be a group !
             assert(!node->symbol_input[1]->is_all());
-            obj = (Agent *)node->symbol_input[1]->entity;
+            obj = ctx.entity(node->symbol_input[1]);
             if (node->symbol_input[0]->is_all()) {
                 const std::vector<Agent*> &agents = groups[node->symbol_input[0]->group].get_agents();
                 ret = true;
@@ -233,7 +332,7 @@ bool GridWorld::calc_event_node(EventNode *node, RewardRule &rule) {
                     }
                 }
             } else {
-                sub = (Agent *)node->symbol_input[0]->entity;
+                sub = ctx.entity(node->symbol_input[0]);
                 ret = sub->get_last_op() == node->op && sub->get_op_obj() == obj;
             }
         }
@@ -242,16 +341,16 @@ bool GridWorld::calc_event_node(EventNode *node, RewardRule &rule) {
             // subject must be an agent, cannot be a group!
             assert(!node->symbol_input[0]->is_all());
 
-            Agent *sub = (Agent *)node->symbol_input[0]->entity;
+            Agent *sub = ctx.entity(node->symbol_input[0]);
 
             // int align = map.get_align(sub);
             Position pos = sub->get_pos();
-            assert(pos.x < width && pos.y < height);
+            assert(pos.x < config.width && pos.y < config.height);
             int align = counter_x[pos.x] + counter_y[pos.y];
 
-            if (rule.auto_value) {
-                assert(rule.values.size() == 1);
-                rule.values[0] = align - 1;
+            if (reward_rules[ctx.rule].auto_value) {
+                assert(reward_rules[ctx.rule].values.size() == 1);
+                ctx.auto_value = align - 1;
                 ret = true;
             } else {
                 ret = align > 1;
@@ -307,7 +406,7 @@ bool GridWorld::calc_event_node(EventNode *node, RewardRule &rule) {
                     }
                 }
             } else {
-                Agent *sub = (Agent *)node->symbol_input[0]->entity;
+                Agent *sub = ctx.entity(node->symbol_input[0]);
                 Position pos = sub->get_pos();
                 ret = (pos.x == int_input[0] && pos.y == int_input[1]);
             }
@@ -327,7 +426,7 @@ bool GridWorld::calc_event_node(EventNode *node, RewardRule &rule) {
                     }
                 }
             } else {
-                Agent *sub = (Agent *)node->symbol_input[0]->entity;
+                Agent *sub = ctx.entity(node->symbol_input[0]);
                 Position pos = sub->get_pos();
                 ret = ((pos.x > int_input[0] && pos.x < int_input[2]
                     && pos.y > int_input[1] && pos.y < int_input[3]));
@@ -345,22 +444,22 @@ bool GridWorld::calc_event_node(EventNode *node, RewardRule &rule) {
                     }
                 }
             } else {
-                Agent *sub = (Agent *)node->symbol_input[0]->entity;
+                Agent *sub = ctx.entity(node->symbol_input[0]);
                 ret = sub->is_dead();
             }
         }
             break;
 
         case OP_AND:
-            ret = calc_event_node(node->node_input[0], rule)
-                && calc_event_node(node->node_input[1], rule);
+            ret = calc_event_node(node->node_input[0], ctx)
+                && calc_event_node(node->node_input[1], ctx);
             break;
         case OP_OR:
-            ret = calc_event_node(node->node_input[0], rule)
-                || calc_event_node(node->node_input[1], rule);
+            ret = calc_event_node(node->node_input[0], ctx)
+                || calc_event_node(node->node_input[1], ctx);
             break;
         case OP_NOT:
-            ret = !calc_event_node(node->node_input[0], rule);
+            ret = !calc_event_node(node->node_input[0], ctx);
             break;
 
         default:
@@ -370,70 +469,89 @@ bool GridWorld::calc_event_node(EventNode *node, RewardRule &rule) {
     return ret;
 }
 
-void GridWorld::calc_rule(std::vector<AgentSymbol *> &input_symbols,
-                          std::vector<AgentSymbol *> &infer_obj,
-                          RewardRule &rule, int now) {
+/**
+ * depth first search of the permutations of the input symbols of ctx.rule, from level now.
+ * a symbol is bound in ctx.entities, the agents of `any` levels are recorded in ctx.involved to bind
+ * them only once in a permutation. the first `any` level only scans the candidates [ctx.begin, ctx.end)
+ */
+void GridWorld::calc_rule(RuleContext &ctx, int now) {
+    RewardRule &rule = reward_rules[ctx.rule];
+    const std::vector<AgentSymbol*> &input_symbols = rule.input_symbols;
+    const std::vector<AgentSymbol*> &infer_obj     = rule.infer_obj;
+
     if (now == input_symbols.size()) { // DFS last layer
-        if (calc_event_node(rule.on, rule)) { // if it is true, assign reward
-            rule.trigger = true;
+        ctx.n_leaf++;
+        if (calc_event_node(rule.on, ctx)) { // if it is true, assign reward
+            ctx.trigger = true;
             const std::vector<AgentSymbol*> &receivers = rule.receivers;
             for (int i = 0; i < receivers.size(); i++) {
                 AgentSymbol *sym = receivers[i];
+                float value = rule.auto_value ? ctx.auto_value : rule.values[i];
                 if (sym->is_all()) {
-                    groups[sym->group].add_reward(rule.values[i]);
+                    ctx.rewards.push_back(RuleContext::RewardRecord{nullptr, sym->group, value});
                 } else {
-                    Agent* agent = (Agent *)sym->entity;
-                    agent->add_reward(rule.values[i]);
+                    ctx.rewards.push_back(RuleContext::RewardRecord{ctx.entity(sym), sym->group, value});
                 }
             }
         }
     } else { // scan every possible permutation
+        const std::vector<EventNode*> &prune_nodes = rule.prune_nodes[now];
+        for (int i = 0; i < prune_nodes.size(); i++) {
+            if (!calc_event_node(prune_nodes[i], ctx))
+                return;
+        }
+
         AgentSymbol *sym = input_symbols[now];
         if (sym->is_any()) {
-            const std::vector<Agent*> &agents = groups[sym->group].get_agents();
-            int base = groups[sym->group].get_recursive_base() + 1;
-            base = 0;
-
-            for (int i = base; i < agents.size(); i++) {
-                groups[sym->group].set_recursive_base(i);
-                sym->entity = (void *)agents[i];
-
-                if (agents[i]->get_involved())
+            const std::vector<Agent*> &agents = rule.from_events[now] ? groups[sym->group].get_event_agents()
+                                                                      : groups[sym->group].get_agents();
+            int begin = now == 0 ? ctx.begin : 0;
+            int end   = now == 0 ? ctx.end : (int)agents.size();
+            if (!rule.from_events[now] && begin < end)
+                ctx.scanned[sym->group] = true;
+
+            for (int i = begin; i < end; i++) {
+                Agent *agent = agents[i];
+                if (std::find(ctx.involved.begin(), ctx.involved.end(), agent) != ctx.involved.end())
                     continue;
-                agents[i]->set_involved(true);
+                ctx.entities[sym->no] = agent;
+                ctx.involved.push_back(agent);
 
                 if (infer_obj[now] != nullptr) {   // can infer in this step
-                    void *entity = agents[i]->get_op_obj();
-                    if (entity != nullptr && infer_obj[now]->bind_with_check(entity)) {
-                        calc_rule(input_symbols, infer_obj, rule, now + 1);
+                    void *entity = agent->get_op_obj();
+                    if (entity != nullptr && infer_obj[now]->accept(entity)) {
+                        ctx.entities[infer_obj[now]->no] = entity;
+                        calc_rule(ctx, now + 1);
                     }
                 } else {
-                    calc_rule(input_symbols, infer_obj, rule, now + 1);
+                    calc_rule(ctx, now + 1);
                 }
-                agents[i]->set_involved(false);
+                ctx.involved.pop_back();
             }
         } else if (sym->is_all()) {
             if (infer_obj[now] != nullptr) {
                 Group &g = groups[sym->group];
                 if (g.get_agents().size() > 0)  {
                     void *entity = g.get_agents()[0]->get_op_obj(); // pick first agent to infer
-                    if (entity != nullptr && infer_obj[now]->bind_with_check(entity)) {
-                        calc_rule(input_symbols, infer_obj, rule, now + 1);
+                    if (entity != nullptr && infer_obj[now]->accept(entity)) {
+                        ctx.entities[infer_obj[now]->no] = entity;
+                        calc_rule(ctx, now + 1);
                     }
                 }
             } else {
-                calc_rule(input_symbols, infer_obj, rule, now + 1);
+                calc_rule(ctx, now + 1);
             }
         } else { // deterministic ID
             Group &g = groups[sym->group];
             if (sym->index < g.get_size()) {
                 Agent *agent = g.get_agents()[sym->index];
-                sym->entity = (void *)agent;
+                ctx.entities[sym->no] = agent;
 
                 if (infer_obj[now] != nullptr) {
                     if (agent->get_op_obj() != nullptr) {
-                        if (infer_obj[now]->bind_with_check(agent->get_op_obj())) {
-                            calc_rule(input_symbols, infer_obj, rule, now + 1);
+                        if (infer_obj[now]->accept(agent->get_op_obj())) {
+                            ctx.entities[infer_obj[now]->no] = agent->get_op_obj();
+                            calc_rule(ctx, now + 1);
                         }
                     }
                 }
@@ -442,7 +560,5 @@ void GridWorld::calc_rule(std::vector<AgentSymbol *> &input_symbols,
     }
 }
 
-
-
 } // namespace gridworld
 } // namespace magent
\ No newline at end of file
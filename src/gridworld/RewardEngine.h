@@ -16,9 +16,9 @@ namespace gridworld {
 
 class AgentSymbol {
 public:
+    int no;              // index in GridWorld::agent_symbols, binding slot in RuleContext
     int group;
     int index;           // -1 for any, -2 for all
-    void *entity;
 
     bool is_all() {
         return index == -2;
@@ -28,7 +28,8 @@ public:
         return index == -1;
     }
 
-    bool bind_with_check(void *entity);
+    // whether entity can be bound to this symbol
+    bool accept(void *entity);
 };
 
 class EventNode {
@@ -57,9 +58,39 @@ public:
 
     std::vector<int> raw_parameter; // serialized parameter from python end
 
+    // evaluation plan, compiled by GridWorld::compile_rule
+    std::vector<bool> from_events;                     // enumerate agents with an event object instead of the whole group
+    std::vector<std::vector<EventNode*>> prune_nodes;  // conjuncts of `on` which can be checked before entering a level
+
     bool trigger;
 };
 
+/**
+ * State of one evaluation of a rule, the rule description is read-only during the search,
+ * so rules and partitions of the first `any` level of a rule are evaluated in parallel.
+ * The rewards are buffered and applied in the order of the serial search, so the sums are reproducible
+ */
+struct RuleContext {
+    struct RewardRecord {
+        Agent *agent;  // nullptr for the reward of a group
+        int group;
+        float value;
+    };
+
+    int rule;
+    int begin, end;                  // candidates of the first level, if it is an `any` symbol
+    std::vector<void*>  entities;    // binding of every symbol, indexed by AgentSymbol::no
+    std::vector<Agent*> involved;    // agents bound to the `any` levels of this permutation
+    float auto_value;                // the value of an auto_value rule, assigned by OP_ALIGN
+    bool trigger;
+    std::vector<RewardRecord> rewards;
+    std::vector<bool> scanned;         // groups whose agents are scanned by an `any` level
+    long long n_leaf;                  // evaluated permutations
+    double time;                       // in seconds
+
+    Agent *entity(const AgentSymbol *sym) const { return (Agent *)entities[sym->no]; }
+};
+
 } // namespace gridworld
 } // namespace magent
 
@@ -14,6 +14,17 @@ namespace gridworld {
 
 typedef enum {EAST, SOUTH, WEST, NORTH, DIR_NUM} Direction;
 
+// rotate an offset in the frame of an agent facing dir to the map frame
+inline void rela_to_map(Direction dir, int rela_x, int rela_y, int &map_dx, int &map_dy) {
+    switch (dir) {
+        case NORTH: map_dx = rela_x;  map_dy = rela_y;  break;
+        case SOUTH: map_dx = -rela_x; map_dy = -rela_y; break;
+        case WEST:  map_dx = rela_y;  map_dy = -rela_x; break;
+        case EAST:  map_dx = -rela_y; map_dy = rela_x;  break;
+        default: map_dx = map_dy = 0;
+    }
+}
+
 typedef enum {
     OP_AND, OP_OR, OP_NOT,
     /***** split *****/
@@ -39,6 +50,8 @@ class Group;
 struct MoveAction;
 struct TurnAction;
 struct AttackAction;
+struct AttackTarget;
+struct AttackRun;
 
 // reward description
 class AgentSymbol;
@@ -47,6 +60,7 @@ class EventNode;
 
 using ::magent::environment::Environment;
 using ::magent::environment::GroupHandle;
+using ::magent::environment::RegisteredBuffers;
 using ::magent::utility::strequ;
 using ::magent::utility::NDPointer;
 
@@ -0,0 +1,222 @@
+#ifndef MAGNET_RENDER_BACKEND_BINARY_CPP_
+#define MAGNET_RENDER_BACKEND_BINARY_CPP_
+
+#include <algorithm>
+#include <cstdio>
+#include <type_traits>
+#include <vector>
+#include "binary.h"
+
+namespace magent {
+namespace render {
+
+// little-endian, whatever the host
+template<class T>
+static void put(std::string &result, T value) {
+    auto bits = static_cast<typename std::make_unsigned<T>::type>(value);
+    for (unsigned int i = 0; i < sizeof(T); i++) {
+        result.push_back(static_cast<char>((bits >> (8 * i)) & 0xFFu));
+    }
+}
+
+static uint16_t clamp16(int value) {
+    return static_cast<uint16_t>(std::min(std::max(value, 0), 0xFFFF));
+}
+
+const unsigned int Binary::MAX_BATCH;
+
+Binary::Binary() : obstaclesSent(false), colorsSent(false) {
+
+}
+
+Binary::AgentRecord Binary::pack(const render::AgentData &agent) {
+    AgentRecord record;
+    record.id = agent.id;
+    record.x = clamp16(agent.position.x);
+    record.y = clamp16(agent.position.y);
+    record.hp = clamp16(agent.hp);
+    record.direction = static_cast<uint8_t>(agent.direction / 90);
+    record.group = static_cast<uint8_t>(agent.groupID);
+    return record;
+}
+
+std::string Binary::encode(const render::AgentData &agent)const {
+    AgentRecord record = pack(agent);
+    std::string result;
+    put(result, record.id);
+    put(result, record.x);
+    put(result, record.y);
+    put(result, record.hp);
+    put(result, record.direction);
+    put(result, record.group);
+    return result;
+}
+
+std::string Binary::encode(const render::EventData &event)const {
+    std::string result;
+    put(result, static_cast<uint8_t>(event.type));
+    put(result, static_cast<int32_t>(event.agent->id));
+    put(result, clamp16(event.position.x));
+    put(result, clamp16(event.position.y));
+    return result;
+}
+
+std::string Binary::encode(const render::BreadData &bread)const {
+    std::string result;
+    put(result, clamp16(bread.position.x));
+    put(result, clamp16(bread.position.y));
+    put(result, clamp16(bread.hp));
+    return result;
+}
+
+std::string Binary::encode(const render::Config &config, unsigned int nFrame)const {
+    std::string result("i");
+    put(result, static_cast<uint32_t>(nFrame));
+    result.append(config.getFrontendJSON());
+    return result;
+}
+
+std::string Binary::encodeError(const std::string &message)const {
+    return 'e' + message;
+}
+
+Result Binary::decode(const std::string &data)const {
+    if (data.empty() || data[0] != 'b') {
+        return text.decode(data);
+    }
+    int first, count, xmin, xmax, ymin, ymax;
+    if (sscanf(data.substr(1).c_str(), "%d%d%d%d%d%d", &first, &count, &xmin, &ymin, &xmax, &ymax) != 6
+        || first < 0 || count <= 0) {
+        throw RenderException("invalid batch operation");
+    }
+    return {
+            Type::BATCH,
+            new render::BatchRequest{static_cast<unsigned int>(first), static_cast<unsigned int>(count),
+                                     render::Window(xmin, ymin, xmax, ymax)}
+    };
+}
+
+void Binary::encodeFrame(const render::Frame &frame, const render::Config &config,
+                         const render::Buffer &buffer, const render::Window &window, std::string &result)const {
+    std::vector<unsigned int> events, agents;
+    frame.queryVisible(config, window, events, agents);
+
+    put(result, static_cast<uint32_t>(events.size()));
+    for (unsigned int i : events) {
+        result.append(encode(frame.getEvent(i)));
+    }
+
+    // deltas against the agents of the last frame sent
+    std::unordered_map<int32_t, AgentRecord> shown;
+    std::vector<unsigned int> changed;
+    for (unsigned int i : agents) {
+        AgentRecord record = pack(frame.getAgent(i));
+        auto iter = sent.find(record.id);
+        if (iter == sent.end() || !(iter->second == record)) {
+            changed.push_back(i);
+        }
+        shown[record.id] = record;
+    }
+    std::vector<int32_t> removed;
+    for (const auto &item : sent) {
+        if (shown.find(item.first) == shown.end()) {
+            removed.push_back(item.first);
+        }
+    }
+    std::sort(removed.begin(), removed.end());
+    sent.swap(shown);
+
+    put(result, static_cast<uint32_t>(removed.size()));
+    for (int32_t id : removed) {
+        put(result, id);
+    }
+    put(result, static_cast<uint32_t>(changed.size()));
+    for (unsigned int i : changed) {
+        result.append(encode(frame.getAgent(i)));
+    }
+
+    std::string breads;
+    uint32_t nBreads = 0;
+    for (unsigned int i = 0, size = frame.getBreadsNumber(); i < size; i++) {
+        const render::BreadData &data = frame.getBread(i);
+        if (window.accept(data.position.x, data.position.y)) {
+            breads.append(encode(data));
+            nBreads++;
+        }
+    }
+    put(result, nBreads);
+    result.append(breads);
+
+    uint32_t nObstacles = obstaclesSent ? 0 : buffer.getObstaclesNumber();
+    put(result, nObstacles);
+    for (unsigned int i = 0; i < nObstacles; i++) {
+        const render::Coordinate &now = buffer.getObstacle(i);
+        put(result, clamp16(now.x));
+        put(result, clamp16(now.y));
+    }
+    obstaclesSent = true;
+
+    // minimap cells which changed since the last frame sent
+    std::vector<unsigned int> colors = frame.getMiniMAPColors(config);
+    if (sentColors.size() != colors.size()) {
+        sentColors.assign(colors.size(), 0);
+    }
+    std::string cells;
+    uint32_t nCells = 0;
+    for (unsigned int i = 0; i < colors.size(); i++) {
+        if (colors[i] != sentColors[i] || !colorsSent) {
+            put(cells, static_cast<uint32_t>(i));
+            put(cells, static_cast<uint32_t>(colors[i]));
+            nCells++;
+        }
+    }
+    sentColors.swap(colors);
+    colorsSent = true;
+    put(result, nCells);
+    result.append(cells);
+
+    const std::vector<unsigned int> &agentsCounter = frame.getAgentsCounter(config);
+    put(result, static_cast<uint32_t>(config.getStylesNumber()));
+    for (unsigned int i = 0; i < config.getStylesNumber(); i++) {
+        put(result, static_cast<uint32_t>(agentsCounter[i]));
+    }
+}
+
+std::string Binary::encode(const render::Frame &frame, const render::Config &config,
+                           const render::Buffer &buffer, const render::Window &window)const {
+    std::string result("f");
+    put(result, static_cast<uint32_t>(1));
+    encodeFrame(frame, config, buffer, window, result);
+    return result;
+}
+
+std::string Binary::encodeBatch(const render::Buffer &buffer, unsigned int first, unsigned int count,
+                                const render::Config &config, const render::Window &window)const {
+    if (first >= buffer.getFramesNumber()) {
+        throw RenderException("invalid frame in batch operation");
+    }
+    count = std::min(std::min(count, MAX_BATCH), buffer.getFramesNumber() - first);
+    std::string result("f");
+    put(result, static_cast<uint32_t>(first));
+    put(result, static_cast<uint32_t>(count));
+    for (unsigned int i = 0; i < count; i++) {
+        encodeFrame(buffer[first + i], config, buffer, window, result);
+    }
+    return result;
+}
+
+bool Binary::isBinary()const {
+    return true;
+}
+
+void Binary::reset() {
+    sent.clear();
+    obstaclesSent = false;
+    sentColors.clear();
+    colorsSent = false;
+}
+
+} // namespace render
+} // namespace magent
+
+#endif // MAGNET_RENDER_BACKEND_BINARY_CPP_
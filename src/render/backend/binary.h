@@ -0,0 +1,89 @@
+#ifndef MAGNET_RENDER_BACKEND_PROTOCOL_BINARY_H_
+#define MAGNET_RENDER_BACKEND_PROTOCOL_BINARY_H_
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "protocol.h"
+#include "text.h"
+#include "data.h"
+
+namespace magent {
+namespace render {
+
+/**
+ * Binary replies, little-endian, requests are the text ones plus batches "b<first> <count> <xmin> <ymin> <xmax> <ymax>".
+ *   'i' u32 nFrames, the frontend json
+ *   'e' the message
+ *   'f' u32 first frame of the request, u32 nFrames then for every frame, each list prefixed by its u32 length :
+ *       events (u8 type, i32 agent id, u16 x, u16 y), ids of the removed agents (i32),
+ *       new or changed agents (i32 id, u16 x, u16 y, u16 hp, u8 direction / 90, u8 group),
+ *       breads (u16 x, u16 y, u16 hp), obstacles (u16 x, u16 y), changed minimap cells (u32 index, u32 color),
+ *       agents of every group (u32)
+ * Agents and minimap cells are deltas against the last frame sent on the connection,
+ * obstacles are all sent in the first frame after a reset.
+ */
+class Binary : public Base<std::string> {
+private:
+    struct AgentRecord {
+        int32_t id;
+        uint16_t x, y, hp;
+        uint8_t direction, group;
+
+        bool operator ==(const AgentRecord &other)const {
+            return id == other.id && x == other.x && y == other.y && hp == other.hp
+                   && direction == other.direction && group == other.group;
+        }
+    };
+
+    static const unsigned int MAX_BATCH = 64;
+
+    // requests other than batches are parsed as text
+    render::Text text;
+
+    // the agents, obstacles and minimap the connection has
+    mutable std::unordered_map<int32_t, AgentRecord> sent;
+    mutable bool obstaclesSent;
+    mutable std::vector<unsigned int> sentColors;
+    mutable bool colorsSent;
+
+    static AgentRecord pack(const render::AgentData & /*agent*/);
+
+    void encodeFrame(const render::Frame & /*frame*/, const render::Config & /*config*/,
+                     const render::Buffer & /*buffer*/, const render::Window & /*window*/,
+                     std::string & /*result*/)const;
+
+    std::string encode(const render::AgentData & /*unused*/)const override;
+
+    std::string encode(const render::EventData & /*unused*/)const override;
+
+    std::string encode(const render::BreadData & /*unused*/)const override;
+
+public:
+    Binary();
+
+    std::string encode(const render::Config & /*unused*/, unsigned int /*unused*/)const override;
+
+    std::string encode(const render::Frame & /*unused*/,
+                       const render::Config & /*unused*/,
+                       const render::Buffer & /*unused*/,
+                       const render::Window & /*unused*/)const override;
+
+    std::string encodeBatch(const render::Buffer & /*unused*/, unsigned int /*unused*/, unsigned int /*unused*/,
+                            const render::Config & /*unused*/, const render::Window & /*unused*/)const override;
+
+    std::string encodeError(const std::string & /*unused*/)const override;
+
+    Result decode(const std::string & /*unused*/)const override;
+
+    bool isBinary()const override;
+
+    void reset() override;
+};
+
+} // namespace render
+} // namespace magent
+
+#endif //MAGNET_RENDER_BACKEND_PROTOCOL_BINARY_H_
@@ -1,6 +1,12 @@
 #include <cstring>
+#include <cctype>
 #include <fstream>
 #include <sstream>
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #ifdef __linux__
     #include <jsoncpp/json/json.h>
 #else
@@ -94,15 +100,18 @@ void Frame::load(std::istream & handle) {
 
     events = new render::EventData[nEvents];
     try{
-        for (unsigned int i = 0, j = 0; i < nEvents; i++) {
+        unsigned int j = 0;
+        for (unsigned int i = 0; i < nEvents; i++) {
             int id;
-            if (!(handle >> events[i].type >> id >> events[i].position.x >> events[i].position.y)) {
+            if (!(handle >> events[j].type >> id >> events[j].position.x >> events[j].position.y)) {
                 throw RenderException("cannot read the next event, map file may be broken");
             }
+            // an event of an agent which is not rendered is dropped
             if (map.find(id) != map.end()) {
-                events[i].agent = &agents[map[id]];
+                events[j++].agent = &agents[map[id]];
             }
         }
+        nEvents = j;
     } catch (const RenderException &e) {
         delete[](events);
         events = nullptr;
@@ -123,6 +132,210 @@ void Frame::load(std::istream & handle) {
         nBreads = 0;
         throw;
     }
+
+    buildIndex();
+}
+
+void Frame::load(const std::vector<utility::PackedAgent> &agents, const utility::PackedAttack *attacks,
+                 unsigned int nAttacks) {
+    if (this->agents != nullptr) {
+        delete[](this->agents);
+        this->agents = nullptr;
+    }
+
+    if (events != nullptr) {
+        delete[](events);
+        events = nullptr;
+    }
+
+    if (breads != nullptr) {
+        delete[](breads);
+        breads = nullptr;
+    }
+
+    nAgents = static_cast<unsigned int>(agents.size());
+    this->agents = new render::AgentData[nAgents];
+    std::unordered_map<int, int> map;
+    for (unsigned int i = 0; i < nAgents; i++) {
+        const utility::PackedAgent &agent = agents[i];
+        this->agents[i].id = agent.id;
+        this->agents[i].hp = agent.hp;
+        this->agents[i].direction = agent.dir * 90;
+        this->agents[i].position = Coordinate(agent.x, agent.y);
+        this->agents[i].groupID = agent.group;
+        map[agent.id] = i;
+    }
+
+    // an event of an agent which is not rendered is dropped
+    nEvents = 0;
+    events = new render::EventData[nAttacks];
+    for (unsigned int i = 0; i < nAttacks; i++) {
+        auto iter = map.find(attacks[i].id);
+        if (iter == map.end()) {
+            continue;
+        }
+        events[nEvents].type = 0;
+        events[nEvents].agent = &this->agents[iter->second];
+        events[nEvents].position = Coordinate(attacks[i].x, attacks[i].y);
+        nEvents++;
+    }
+
+    nBreads = 0;
+    breads = new render::BreadData[0];
+
+    buildIndex();
+}
+
+void Frame::buildIndex() {
+    miniMAP.clear();
+    agentsCounter.clear();
+
+    int maxX = 0, maxY = 0;
+    for (unsigned int i = 0; i < nAgents; i++) {
+        maxX = std::max(maxX, agents[i].position.x);
+        maxY = std::max(maxY, agents[i].position.y);
+    }
+    gridCols = maxX / GRID_CELL_SIZE + 1;
+    gridRows = maxY / GRID_CELL_SIZE + 1;
+
+    // counting sort of agents by cell
+    auto cellOf = [this](const render::AgentData &agent) {
+        return std::max(agent.position.y, 0) / GRID_CELL_SIZE * gridCols + std::max(agent.position.x, 0) / GRID_CELL_SIZE;
+    };
+    gridStart.assign(static_cast<size_t>(gridCols * gridRows + 1), 0);
+    for (unsigned int i = 0; i < nAgents; i++) {
+        gridStart[cellOf(agents[i]) + 1]++;
+    }
+    for (size_t i = 1; i < gridStart.size(); i++) {
+        gridStart[i] += gridStart[i - 1];
+    }
+    gridAgents.resize(nAgents);
+    std::vector<unsigned int> next(gridStart.begin(), gridStart.end() - 1);
+    for (unsigned int i = 0; i < nAgents; i++) {
+        gridAgents[next[cellOf(agents[i])]++] = i;
+    }
+}
+
+void Frame::queryAgents(int xmin, int ymin, int xmax, int ymax, std::vector<unsigned int> &result) const {
+    int col0 = std::max(xmin, 0) / GRID_CELL_SIZE, col1 = std::min(std::max(xmax, 0) / GRID_CELL_SIZE, gridCols - 1);
+    int row0 = std::max(ymin, 0) / GRID_CELL_SIZE, row1 = std::min(std::max(ymax, 0) / GRID_CELL_SIZE, gridRows - 1);
+    for (int row = row0; row <= row1; row++) {
+        for (int col = col0; col <= col1; col++) {
+            int cell = row * gridCols + col;
+            for (unsigned int i = gridStart[cell]; i < gridStart[cell + 1]; i++) {
+                const Coordinate &pos = agents[gridAgents[i]].position;
+                if (xmin <= pos.x && pos.x <= xmax && ymin <= pos.y && pos.y <= ymax) {
+                    result.push_back(gridAgents[i]);
+                }
+            }
+        }
+    }
+}
+
+const std::vector<unsigned int> &Frame::getMiniMAP(const render::Config &config) const {
+    if (miniMAP.empty()) {
+        unsigned int mapHeight = config.getHeight();
+        unsigned int mapWidth = config.getWidth();
+        unsigned int miniMAPHeight = config.getMiniMAPHeight();
+        unsigned int miniMAPWidth = config.getMiniMAPWidth();
+        unsigned int nStyles = config.getStylesNumber();
+
+        miniMAP.assign(miniMAPHeight * miniMAPWidth * nStyles, 0);
+        agentsCounter.assign(nStyles, 0);
+        for (unsigned int i = 0; i < nAgents; i++) {
+            const render::AgentData &data = agents[i];
+            agentsCounter[data.groupID]++;
+
+            auto miniPositionX = static_cast<unsigned int>(1.0 * data.position.x / mapWidth * miniMAPWidth);
+            auto miniPositionY = static_cast<unsigned int>(1.0 * data.position.y / mapHeight * miniMAPHeight);
+            miniMAP[(miniPositionY * miniMAPWidth + miniPositionX) * nStyles + data.groupID]++;
+        }
+    }
+    return miniMAP;
+}
+
+const std::vector<unsigned int> &Frame::getAgentsCounter(const render::Config &config) const {
+    getMiniMAP(config);
+    return agentsCounter;
+}
+
+void Frame::queryVisible(const render::Config &config, const render::Window &window,
+                         std::vector<unsigned int> &visibleEvents, std::vector<unsigned int> &visibleAgents) const {
+    std::unordered_map<int, bool> hasEvent;
+    visibleEvents.clear();
+    for (unsigned int i = 0; i < nEvents; i++) {
+        const render::EventData &data = events[i];
+        const render::Style &style = config.getStyle(data.agent->groupID);
+        unsigned int width = style.width;
+        unsigned int height = style.height;
+        if (data.agent->direction % 180 != 0) std::swap(width, height);
+        if (window.accept(data.position.x, data.position.y)
+            || window.accept(data.agent->position.x, data.agent->position.y, width, height)) {
+            hasEvent[data.agent->id] = true;
+            visibleEvents.push_back(i);
+        }
+    }
+
+    // candidates from the spatial index of the frame. an agent is accepted if its anchor is in the window,
+    // or at most its size before the window. agents with events are always accepted
+    const unsigned int & nStyles = config.getStylesNumber();
+    int maxSize = 0;
+    for (unsigned int i = 0; i < nStyles; i++) {
+        maxSize = std::max(maxSize, static_cast<int>(std::max(config.getStyle(i).width, config.getStyle(i).height)));
+    }
+    std::vector<unsigned int> candidates;
+    queryAgents(window.wmin.x - maxSize, window.wmin.y - maxSize, window.wmax.x, window.wmax.y, candidates);
+    for (unsigned int i = 0; i < nEvents; i++) {
+        const render::AgentData *agent = events[i].agent;
+        if (hasEvent[agent->id]) {
+            candidates.push_back(static_cast<unsigned int>(agent - agents));
+        }
+    }
+    std::sort(candidates.begin(), candidates.end());
+    candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+    visibleAgents.clear();
+    for (unsigned int i = 0; i < candidates.size(); i++) {
+        const render::AgentData &data = agents[candidates[i]];
+        const render::Style &style = config.getStyle(data.groupID);
+        unsigned int width = style.width;
+        unsigned int height = style.height;
+        if (data.direction % 180 != 0) std::swap(width, height);
+        if (hasEvent[data.id] || window.accept(data.position.x, data.position.y, width, height)) {
+            visibleAgents.push_back(candidates[i]);
+        }
+    }
+}
+
+std::vector<unsigned int> Frame::getMiniMAPColors(const render::Config &config) const {
+    unsigned int nCells = config.getMiniMAPHeight() * config.getMiniMAPWidth();
+    unsigned int nStyles = config.getStylesNumber();
+    const std::vector<unsigned int> &minimap = getMiniMAP(config);
+    std::vector<unsigned int> colors(nCells);
+    for (unsigned int i = 0; i < nCells; i++) {
+        double red = 0, blue = 0, green = 0;
+        unsigned int sum = 0;
+        const unsigned int *cell = &minimap[i * nStyles];
+        for (unsigned int j = 0; j < nStyles; j++) {
+            sum += cell[j];
+        }
+        for (unsigned int j = 0; j < nStyles; j++) {
+            red += 1.0 * config.getStyle(j).red * cell[j] / sum;
+            blue += 1.0 * config.getStyle(j).blue * cell[j] / sum;
+            green += 1.0 * config.getStyle(j).green * cell[j] / sum;
+        }
+        unsigned int value = 0;
+        if (sum == 0u) {
+            value = (0xFFu << 24) | (0xFFu << 16) | (0xFFu << 8) | (0xFFu << 0);
+        } else {
+            value |= static_cast<unsigned int>(red) << 24;
+            value |= static_cast<unsigned int>(blue) << 16;
+            value |= static_cast<unsigned int>(green) << 8;
+            value |= static_cast<unsigned int>(0xFFu) << 0;
+        }
+        colors[i] = value;
+    }
+    return colors;
 }
 
 Frame::~Frame() {
@@ -142,7 +355,8 @@ Frame::~Frame() {
     }
 }
 
-Frame::Frame() : nEvents(0), nAgents(0), nBreads(0), agents(nullptr), events(nullptr), breads(nullptr) {
+Frame::Frame() : nEvents(0), nAgents(0), nBreads(0), agents(nullptr), events(nullptr), breads(nullptr),
+                 gridCols(0), gridRows(0) {
 
 }
 
@@ -161,33 +375,67 @@ void Frame::releaseMemory() {
 }
 
 Buffer::~Buffer() {
-    maxSize = 0;
-    if (frames != nullptr) {
-        delete[](frames);
-        frames = nullptr;
+    unmap();
+}
+
+void Buffer::unmap() {
+    for (auto &item : cache) {
+        delete item.second;
+    }
+    cache.clear();
+    cacheIndex.clear();
+    agentsFrame = -1;
+
+    if (data != nullptr) {
+        munmap(const_cast<char *>(data), dataSize);
+        data = nullptr;
+        dataSize = 0;
     }
     if (obstacles != nullptr) {
         delete[](obstacles);
         obstacles = nullptr;
     }
+    nObstacles = nFrames = 0;
+    frameOffsets.clear();
+    keyFrames.clear();
 }
 
 const Frame &Buffer::operator [](unsigned int id)const {
-    return frames[id];
-}
+    if (id >= nFrames) {
+        throw RenderException("frame id out of range");
+    }
+    if (live) {
+        return decodeLive();
+    }
 
-void Buffer::resize(unsigned int size) {
-    auto memory = new Frame[size];
-    memcpy(static_cast<void *>(memory), static_cast<void *>(frames), sizeof(*frames) * std::min(maxSize, size));
-    for (unsigned int i = 0; i < maxSize; i++) {
-        frames[i].releaseMemory();
+    auto iter = cacheIndex.find(id);
+    if (iter != cacheIndex.end()) {
+        cache.splice(cache.begin(), cache, iter->second);
+        return *iter->second->second;
     }
-    delete[](frames);
-    frames = memory;
-    maxSize = size;
+
+    Frame *frame;
+    if (cache.size() >= maxSize) {  // reuse the least recently used one
+        frame = cache.back().second;
+        cacheIndex.erase(cache.back().first);
+        cache.pop_back();
+    } else {
+        frame = new Frame();
+    }
+    try {
+        decode(id, *frame);
+    } catch (const RenderException &e) {
+        delete frame;
+        throw;
+    }
+    cache.emplace_front(id, frame);
+    cacheIndex[id] = cache.begin();
+    return *frame;
 }
 
-Buffer::Buffer(unsigned int maxSize) : maxSize(maxSize), frames(new Frame [maxSize]), nObstacles(0), obstacles(nullptr) {
+Buffer::Buffer(unsigned int maxSize)
+        : nFrames(0), maxSize(std::max(maxSize, 1u)), nObstacles(0), obstacles(nullptr),
+          data(nullptr), dataSize(0), binary(false), live(false), agentsFrame(-1) {
 
 }
 
@@ -195,10 +443,61 @@ const unsigned int & Buffer::getFramesNumber()const {
     return nFrames;
 }
 
-void Buffer::load(std::istream &handle) {
-    if (!handle) {
-        throw RenderException("invalid handle of the map data file");
+void Buffer::load(const std::string &path) {
+    unmap();
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw RenderException("cannot open the map data file " + path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        ::close(fd);
+        throw RenderException("invalid map data file " + path);
+    }
+    // shared, so the frames published to a live ring after loading are visible
+    void *addr = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        throw RenderException("cannot map the map data file " + path);
+    }
+    data = static_cast<const char *>(addr);
+    dataSize = static_cast<size_t>(st.st_size);
+
+    binary = dataSize >= sizeof(utility::RenderFileHeader)
+             && memcmp(data, utility::RENDER_MAGIC, sizeof(utility::RENDER_MAGIC)) == 0;
+    live = dataSize >= sizeof(utility::RenderLiveHeader)
+           && memcmp(data, utility::RENDER_LIVE_MAGIC, sizeof(utility::RENDER_LIVE_MAGIC)) == 0;
+    try {
+        if (live) {
+            indexLive();
+        } else if (binary) {
+            indexBinary();
+        } else {
+            indexText();
+        }
+    } catch (const RenderException &e) {
+        unmap();
+        throw;
     }
+}
+
+namespace {
+
+// an istream over a piece of the memory mapping
+class MemoryBuf : public std::streambuf {
+public:
+    MemoryBuf(const char *begin, const char *end) {
+        char *p = const_cast<char *>(begin);
+        setg(p, p, const_cast<char *>(end));
+    }
+};
+
+} // namespace
+
+void Buffer::indexText() {
+    MemoryBuf buf(data, data + dataSize);
+    std::istream handle(&buf);
 
     std::string tmp;
     if (!(handle >> tmp >> nObstacles)) {
@@ -209,36 +508,248 @@ void Buffer::load(std::istream &handle) {
         throw RenderException("invalid tag of walls");
     }
 
-    if (obstacles != nullptr) {
-        delete[](obstacles);
-        obstacles = nullptr;
+    obstacles = new Coordinate[nObstacles];
+    for (unsigned int i = 0; i < nObstacles; i++) {
+        if (!(handle >> obstacles[i].x >> obstacles[i].y)) {
+            throw RenderException("cannot read the information of the next obstacle in the data file");
+        }
     }
-    try {
-        obstacles = new Coordinate[nObstacles];
-        for (unsigned int i = 0; i < nObstacles; i++) {
-            if (!(handle >> obstacles[i].x >> obstacles[i].y)) {
-                throw RenderException("cannot read the information of the next obstacle in the data file");
+
+    // every line starting with "F" is the head of a frame
+    const char *end = data + dataSize;
+    const char *line = data;
+    while (line < end) {
+        if (*line == 'F') {
+            frameOffsets.push_back(static_cast<size_t>(line + 1 - data));
+        } else if (*line != 'W' && !isdigit(*line) && *line != '-' && !isspace(*line)) {
+            throw RenderException("invalid frame flag, the map file may be broken");
+        }
+        line = static_cast<const char *>(memchr(line, '\n', static_cast<size_t>(end - line)));
+        if (line == nullptr) {
+            break;
+        }
+        line++;
+    }
+    nFrames = static_cast<unsigned int>(frameOffsets.size());
+}
+
+void Buffer::indexBinary() {
+    utility::RenderFileHeader header;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, utility::RENDER_MAGIC, sizeof(header.magic)) != 0) {
+        throw RenderException("invalid magic number of the binary data file");
+    }
+    if (header.version != utility::RENDER_VERSION) {
+        throw RenderException("unsupported version of the binary data file");
+    }
+
+    // only the block headers are read, except for the walls.
+    // a truncated block at the end (the file is still being written) is ignored
+    size_t offset = sizeof(header);
+    int keyFrame = -1;
+    utility::RenderBlockHeader block;
+    while (offset + sizeof(block) <= dataSize) {
+        memcpy(&block, data + offset, sizeof(block));
+        if (offset + sizeof(block) + block.stored_size > dataSize) {
+            break;
+        }
+
+        switch (block.tag) {
+            case utility::RENDER_BLOCK_WALL: {
+                std::vector<char> raw;
+                const char *payload = readBlock(offset, block, raw);
+                loadObstacles(payload, block.raw_size);
+                break;
             }
+            case utility::RENDER_BLOCK_KEY_FRAME:
+                keyFrame = static_cast<int>(frameOffsets.size());
+                frameOffsets.push_back(offset);
+                keyFrames.push_back(static_cast<unsigned int>(keyFrame));
+                break;
+            case utility::RENDER_BLOCK_DELTA_FRAME:
+                if (keyFrame < 0) {
+                    throw RenderException("delta frame before any key frame, the map file may be broken");
+                }
+                frameOffsets.push_back(offset);
+                keyFrames.push_back(static_cast<unsigned int>(keyFrame));
+                break;
+            default:
+                throw RenderException("invalid block tag, the map file may be broken");
         }
-    } catch (const RenderException &e) {
+        offset += sizeof(block) + block.stored_size;
+    }
+    nFrames = static_cast<unsigned int>(frameOffsets.size());
+}
+
+void Buffer::indexLive() {
+    utility::RenderLiveHeader header;
+    memcpy(&header, data, sizeof(header));
+    if (header.version != utility::RENDER_VERSION) {
+        throw RenderException("unsupported version of the live render file");
+    }
+    if (header.n_slot == 0 || header.wall_offset + header.n_wall * sizeof(utility::PackedPosition) > dataSize
+        || header.slot_offset + header.n_slot * (sizeof(utility::RenderLiveSlot) + header.slot_size) > dataSize) {
+        throw RenderException("broken header of the live render file");
+    }
+
+    nObstacles = header.n_wall;
+    obstacles = new Coordinate[nObstacles];
+    auto positions = reinterpret_cast<const utility::PackedPosition *>(data + header.wall_offset);
+    for (unsigned int i = 0; i < nObstacles; i++) {
+        obstacles[i] = Coordinate(positions[i].x, positions[i].y);
+    }
+
+    // the ring has no end, the frontend can pick any frame
+    nFrames = 0x7fffffff;
+}
+
+const Frame &Buffer::decodeLive()const {
+    auto header = reinterpret_cast<const utility::RenderLiveHeader *>(data);
+    for (int retry = 0; retry < 16; retry++) {
+        uint64_t n = __atomic_load_n(&header->write_seq, __ATOMIC_ACQUIRE);
+        if (n == 0) {  // nothing is published yet
+            liveFrame.load(std::vector<utility::PackedAgent>(), nullptr, 0);
+            return liveFrame;
+        }
+        n--;
+
+        const char *slotAddr = data + header->slot_offset
+                               + (n % header->n_slot) * (sizeof(utility::RenderLiveSlot) + header->slot_size);
+        auto slot = reinterpret_cast<const utility::RenderLiveSlot *>(slotAddr);
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq != 2 * n + 2) {  // overwritten by a newer frame
+            continue;
+        }
+        uint32_t size = slot->size;
+        if (size > header->slot_size) {
+            continue;
+        }
+        liveRaw.resize(size);
+        memcpy(liveRaw.data(), slotAddr + sizeof(utility::RenderLiveSlot), size);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) {
+            continue;
+        }
+
+        utility::RenderBlockHeader block = {utility::RENDER_BLOCK_KEY_FRAME, size, size};
+        const utility::PackedAttack *attacks;
+        unsigned int nAttacks;
+        applyBinaryFrame(liveRaw.data(), block, &attacks, &nAttacks);
+        liveFrame.load(agents, attacks, nAttacks);
+        return liveFrame;
+    }
+    return liveFrame;  // the engine is too fast to catch, show the previous frame again
+}
+
+void Buffer::loadObstacles(const char *payload, unsigned int size) {
+    uint32_t n;
+    if (size < sizeof(n)) {
+        throw RenderException("broken block of walls in the data file");
+    }
+    memcpy(&n, payload, sizeof(n));
+    if (size != sizeof(n) + n * sizeof(utility::PackedPosition)) {
+        throw RenderException("broken block of walls in the data file");
+    }
+
+    if (obstacles != nullptr) {
         delete[](obstacles);
         obstacles = nullptr;
-        throw;
     }
+    nObstacles = n;
+    obstacles = new Coordinate[nObstacles];
+    auto positions = reinterpret_cast<const utility::PackedPosition *>(payload + sizeof(n));
+    for (unsigned int i = 0; i < nObstacles; i++) {
+        obstacles[i] = Coordinate(positions[i].x, positions[i].y);
+    }
+}
+
+const char *Buffer::readBlock(size_t offset, utility::RenderBlockHeader &block, std::vector<char> &raw)const {
+    memcpy(&block, data + offset, sizeof(block));
+    const char *stored = data + offset + sizeof(block);
+    if (block.stored_size == block.raw_size) {  // not compressed, read from the mapping directly
+        return stored;
+    }
+    raw.resize(block.raw_size);
+    if (!utility::decompress_render_block(stored, block.stored_size, raw.data(), block.raw_size)) {
+        throw RenderException("cannot decompress a block of the data file, the file may be broken or lz4 is not built in");
+    }
+    return raw.data();
+}
 
-    nFrames = 0;
-    while (!handle.eof()) {
-        if (nFrames == maxSize) {
-            resize(maxSize * 2);
+void Buffer::applyBinaryFrame(const char *payload, const utility::RenderBlockHeader &block,
+                              const utility::PackedAttack **attacks, unsigned int *nAttacks)const {
+    utility::RenderFrameHeader frame;
+    if (block.raw_size < sizeof(frame)) {
+        throw RenderException("broken frame in the data file");
+    }
+    memcpy(&frame, payload, sizeof(frame));
+    if (block.raw_size != sizeof(frame) + frame.n_changed * sizeof(utility::PackedAgent)
+                          + frame.n_removed * sizeof(int32_t) + frame.n_attack * sizeof(utility::PackedAttack)) {
+        throw RenderException("broken frame in the data file");
+    }
+    auto changed = reinterpret_cast<const utility::PackedAgent *>(payload + sizeof(frame));
+    auto removed = reinterpret_cast<const int32_t *>(changed + frame.n_changed);
+    *attacks = reinterpret_cast<const utility::PackedAttack *>(removed + frame.n_removed);
+    *nAttacks = frame.n_attack;
+
+    if (block.tag == utility::RENDER_BLOCK_KEY_FRAME) {
+        agents.clear();
+        agentIndex.clear();
+    }
+    for (unsigned int i = 0; i < frame.n_removed; i++) {
+        auto iter = agentIndex.find(removed[i]);
+        if (iter == agentIndex.end()) {
+            throw RenderException("remove an unknown agent, the map file may be broken");
         }
-        if (!(handle >> tmp)) {
-            break;
+        unsigned int pos = iter->second;
+        agentIndex.erase(iter);
+        if (pos != agents.size() - 1) {
+            agents[pos] = agents.back();
+            agentIndex[agents[pos].id] = pos;
         }
-        if (tmp != "F") {
-            throw RenderException("invalid frame flag, the map file may be broken");
+        agents.pop_back();
+    }
+    for (unsigned int i = 0; i < frame.n_changed; i++) {
+        auto iter = agentIndex.find(changed[i].id);
+        if (iter == agentIndex.end()) {
+            agentIndex[changed[i].id] = static_cast<unsigned int>(agents.size());
+            agents.push_back(changed[i]);
+        } else {
+            agents[iter->second] = changed[i];
+        }
+    }
+    if (agents.size() != frame.n_agent) {
+        throw RenderException("wrong number of agents after applying a delta frame, the map file may be broken");
+    }
+}
+
+void Buffer::decode(unsigned int id, Frame &frame)const {
+    if (!binary) {
+        MemoryBuf buf(data + frameOffsets[id], data + dataSize);
+        std::istream handle(&buf);
+        frame.load(handle);
+        return;
+    }
+
+    // continue from the last decoded frame if it is on the way, otherwise start from the key frame
+    unsigned int start = keyFrames[id];
+    if (agentsFrame >= static_cast<int>(start) && agentsFrame < static_cast<int>(id)) {
+        start = static_cast<unsigned int>(agentsFrame + 1);
+    }
+    agentsFrame = -1;  // broken if an exception is thrown
+
+    std::vector<char> raw;
+    for (unsigned int i = start; i <= id; i++) {
+        utility::RenderBlockHeader block;
+        const char *payload = readBlock(frameOffsets[i], block, raw);
+        const utility::PackedAttack *attacks;
+        unsigned int nAttacks;
+        applyBinaryFrame(payload, block, &attacks, &nAttacks);
+        if (i == id) {
+            frame.load(agents, attacks, nAttacks);
         }
-        frames[nFrames++].load(handle);
     }
+    agentsFrame = static_cast<int>(id);
 }
 
 const unsigned int &Buffer::getObstaclesNumber() const {
@@ -6,6 +6,9 @@
 #include <vector>
 #include <string>
 #include <istream>
+#include <unordered_map>
+#include <list>
+#include "../../utility/RenderFormat.h"
 
 namespace magent {
 namespace render {
@@ -44,6 +47,8 @@ struct Window {
     bool accept(int, int, int, int)const;
 };
 
+class Config;
+
 class Frame : public render::Unique {
 private:
     unsigned int nAgents, nEvents, nBreads;
@@ -51,11 +56,25 @@ private:
     render::EventData * events;
     render::BreadData * breads;
 
+    // uniform grid of agent positions, agents of a cell are gridAgents[gridStart[c], gridStart[c + 1])
+    static const int GRID_CELL_SIZE = 16;
+    int gridCols, gridRows;
+    std::vector<unsigned int> gridStart, gridAgents;
+
+    // agents of every group in every minimap cell and in total, computed at the first request
+    mutable std::vector<unsigned int> miniMAP, agentsCounter;
+
+    void buildIndex();
+
 public:
     explicit Frame();
 
     void load(std::istream & /*handle*/);
 
+    // load from the decoded state of a binary log
+    void load(const std::vector<utility::PackedAgent> & /*agents*/,
+              const utility::PackedAttack * /*attacks*/, unsigned int /*nAttacks*/);
+
     const unsigned int & getAgentsNumber() const;
 
     const unsigned int & getEventsNumber() const;
@@ -68,6 +87,23 @@ public:
 
     const render::BreadData & getBread(unsigned int id) const;
 
+    // append the indexes of agents whose position is in [xmin, xmax] x [ymin, ymax], in any order
+    void queryAgents(int xmin, int ymin, int xmax, int ymax, std::vector<unsigned int> & /*result*/) const;
+
+    // (miniMAPHeight * miniMAPWidth, nStyles) counters of the minimap
+    const std::vector<unsigned int> & getMiniMAP(const render::Config & /*config*/) const;
+
+    // number of agents in every group
+    const std::vector<unsigned int> & getAgentsCounter(const render::Config & /*config*/) const;
+
+    // indexes of the events and agents shown in the window : events at a cell in it or of an agent overlapping it,
+    // then agents overlapping it or with a shown event, in increasing order
+    void queryVisible(const render::Config & /*config*/, const render::Window & /*window*/,
+                      std::vector<unsigned int> & /*events*/, std::vector<unsigned int> & /*agents*/) const;
+
+    // RGBA color of every minimap cell, the styles of its agents blended, white for an empty cell
+    std::vector<unsigned int> getMiniMAPColors(const render::Config & /*config*/) const;
+
     ~Frame() override;
 
     void releaseMemory();
@@ -77,18 +113,64 @@ struct Style {
     unsigned int height, width, red, blue, green;
 };
 
+/**
+ * The data file is mapped into memory and indexed by frame offsets when loaded,
+ * frames are decoded on demand and the recently decoded ones are kept in an LRU cache.
+ */
 class Buffer : public render::Unique {
 private:
     unsigned int nFrames, maxSize, nObstacles;
-    Frame * frames;
     Coordinate * obstacles;
 
-    void resize(unsigned int size);
+    // memory mapping of the data file
+    const char * data;
+    size_t dataSize;
+    bool binary, live;
+
+    // text: offset after the "F" tag of every frame
+    // binary: offset of the block of every frame, and the key frame it depends on
+    std::vector<size_t> frameOffsets;
+    std::vector<unsigned int> keyFrames;
+
+    // LRU of decoded frames, the front is the most recently used
+    mutable std::list<std::pair<unsigned int, Frame *>> cache;
+    mutable std::unordered_map<unsigned int, std::list<std::pair<unsigned int, Frame *>>::iterator> cacheIndex;
+
+    // agents of the last decoded binary frame, so scrubbing forward only applies one delta
+    mutable std::vector<utility::PackedAgent> agents;
+    mutable std::unordered_map<int, unsigned int> agentIndex;
+    mutable int agentsFrame;
+
+    void unmap();
+
+    void indexText();
+
+    void indexBinary();
+
+    void indexLive();
+
+    void loadObstacles(const char * /*payload*/, unsigned int /*size*/);
+
+    // read the block at offset, return the decoded payload
+    const char *readBlock(size_t /*offset*/, utility::RenderBlockHeader & /*block*/, std::vector<char> & /*raw*/)const;
+
+    void decode(unsigned int /*id*/, Frame & /*frame*/)const;
+
+    // live: copy the newest published frame out of the ring and decode it into liveFrame
+    const Frame & decodeLive()const;
+    mutable Frame liveFrame;
+    mutable std::vector<char> liveRaw;
+
+    void applyBinaryFrame(const char * /*payload*/, const utility::RenderBlockHeader & /*block*/,
+                          const utility::PackedAttack ** /*attacks*/, unsigned int * /*nAttacks*/)const;
 
 public:
+    // maxSize is the number of decoded frames kept in memory
     explicit Buffer(unsigned int maxSize = 1000);
 
-    void load(std::istream & /*handle*/);
+    // the text format, the binary format or the live ring of RenderGenerator, detected by the magic number.
+    // every frame id of a live ring returns the newest frame written by the engine
+    void load(const std::string & /*path*/);
 
     const Frame & operator [](unsigned int /*id*/)const;
 
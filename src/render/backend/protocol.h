@@ -12,11 +12,18 @@ namespace render {
 
 enum Type {
     LOAD,
-    PICK
+    PICK,
+    BATCH
 };
 
 typedef const std::pair<const Type, const void * const> Result;
 
+// count frames from first, seen through the same window
+struct BatchRequest {
+    unsigned int first, count;
+    render::Window window;
+};
+
 template<class T>
 class Base : public render::Unique {
 private:
@@ -37,6 +44,21 @@ public:
 
     virtual const std::pair<const Type, const void * const> decode(const T &)const = 0;
 
+    // several consecutive frames in one message, for the protocols which support it
+    virtual T encodeBatch(const render::Buffer &, unsigned int, unsigned int,
+                          const render::Config &, const render::Window &)const {
+        throw RenderException("batch is not supported by the protocol");
+    }
+
+    // whether the messages are sent as binary websocket frames
+    virtual bool isBinary()const {
+        return false;
+    }
+
+    // forget what was sent on the connection, at a new connection or a new file
+    virtual void reset() {
+    }
+
 };
 
 } // namespace render
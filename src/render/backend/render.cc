@@ -1,12 +1,17 @@
 #include "server.h"
 #include "websocket.h"
 #include "text.h"
+#include "binary.h"
 
 int main(int argc, char *argv[]) {
     magent::render::RenderConfig config;
     magent::render::parse(argc, argv, config);
     magent::render::Logger::verbose = !config.quiet;
-    magent::render::TextServer<magent::render::WebSocket, magent::render::Text> server(config, 256);
-
-    server.run();
+    if (config.binary) {
+        magent::render::TextServer<magent::render::WebSocket, magent::render::Binary> server(config, 256);
+        server.run();
+    } else {
+        magent::render::TextServer<magent::render::WebSocket, magent::render::Text> server(config, 256);
+        server.run();
+    }
 }
@@ -33,6 +33,10 @@ private:
                     );
                     delete(static_cast<const std::pair<std::string, std::string> * const>(data.second));
                     break;
+                case magent::render::BATCH:
+                    pick(*static_cast<const render::BatchRequest * const>(data.second));
+                    delete(static_cast<const render::BatchRequest * const>(data.second));
+                    break;
                 case magent::render::PICK:
                     const std::pair<const int, const render::Window> &coordinate =
                             *static_cast<const std::pair<const int, const render::Window> * const>(data.second);
@@ -52,12 +56,16 @@ protected:
         S::reply(protocol.encode(buffer[frame], config, buffer, window));
     }
 
+    void pick(const render::BatchRequest & request) {
+        S::reply(protocol.encodeBatch(buffer, request.first, request.count, config, request.window));
+    }
+
     void load(const std::string & conf_path, const std::string & data_path) {
+        protocol.reset();
         std::ifstream handleConf(conf_path);
         try {
             config.load(handleConf);
-            std::ifstream handleData(config.getDataPath() + '/' + data_path);
-            buffer.load(handleData);
+            buffer.load(config.getDataPath() + '/' + data_path);
             reply(buffer.getFramesNumber());
         } catch (const magent::render::RenderException &e) {
             render::Logger::STDERR.log(e.what());
@@ -91,7 +99,7 @@ protected:
     }
 
     void open() override {
-
+        protocol.reset();
     }
 
     void close() override {
@@ -105,7 +113,7 @@ protected:
 public:
     explicit TextServer(const RenderConfig &config, unsigned int maxBufferSize)
             : buffer(maxBufferSize), config(), S(config.port) {
-
+        S::binary = protocol.isBinary();
     }
 
     void run() override {
@@ -13,9 +13,10 @@ template <class T>
 class ISocket : public render::Unique {
 protected:
     const T args;
+    bool binary;  // replies are sent as binary messages
 
 public:
-    explicit ISocket(const T &args) : args(args) {
+    explicit ISocket(const T &args) : args(args), binary(false) {
     }
 
     virtual void reply(const std::string &) = 0;
@@ -1,6 +1,7 @@
 #ifndef MAGNET_RENDER_BACKEND_TEXT_CPP_
 #define MAGNET_RENDER_BACKEND_TEXT_CPP_
 
+#include <algorithm>
 #include <cmath>
 #include <cstring>
 #include <unordered_map>
@@ -69,51 +70,18 @@ std::string Text::encode(const magent::render::Frame &frame,
                          const magent::render::Buffer &buffer,
                          const magent::render::Window &window)const {
     std::string result("f");
-    std::unordered_map<int, bool> hasEvent;
-    for (unsigned int i = 0, size = frame.getEventsNumber(), first = 1; i < size; i++) {
-        const render::EventData &data = frame.getEvent(i);
-        const render::Style &style = config.getStyle(data.agent->groupID);
-        unsigned int width = style.width;
-        unsigned int height = style.height;
-        if (data.agent->direction % 180 != 0) std::swap(width, height);
-        if (window.accept(data.position.x, data.position.y)
-            || window.accept(data.agent->position.x, data.agent->position.y, width, height)) {
-            hasEvent[data.agent->id] = true;
-            if (first == 0u) result.append("|");
-            result.append(encode(data));
-            first = 0;
-        }
-    }
-    result.append(";");
+    std::vector<unsigned int> events, agents;
+    frame.queryVisible(config, window, events, agents);
 
-    unsigned int mapHeight = config.getHeight();
-    unsigned int mapWidth = config.getWidth();
-    unsigned int miniMAPHeight = config.getMiniMAPHeight();
-    unsigned int miniMAPWidth = config.getMiniMAPWidth();
-    const unsigned int & nStyles = config.getStylesNumber();
-    auto minimap = new unsigned int*[miniMAPHeight * miniMAPWidth];
-    auto agentsCounter = new unsigned int[nStyles];
-    for (unsigned int i = 0; i < miniMAPHeight * miniMAPWidth; i++) {
-        minimap[i] = new unsigned int[nStyles];
-        std::fill(minimap[i], minimap[i] + nStyles, 0);
+    for (unsigned int i = 0; i < events.size(); i++) {
+        if (i != 0u) result.append("|");
+        result.append(encode(frame.getEvent(events[i])));
     }
-    memset(agentsCounter, 0, sizeof(*agentsCounter) * nStyles);
-    for (unsigned int i = 0, size = frame.getAgentsNumber(), first = 1; i < size; i++) {
-        const magent::render::AgentData & data = frame.getAgent(i);
-        const render::Style &style = config.getStyle(data.groupID);
-        unsigned int width = style.width;
-        unsigned int height = style.height;
-        if (data.direction % 180 != 0) std::swap(width, height);
-        if (hasEvent[data.id] || window.accept(data.position.x, data.position.y, width, height)) {
-            if (first == 0) result.append("|");
-            result.append(encode(data));
-            first = 0;
-        }
-        agentsCounter[data.groupID]++;
+    result.append(";");
 
-        auto miniPositionX = static_cast<unsigned int>(1.0 * data.position.x / mapWidth * miniMAPWidth);
-        auto miniPositionY = static_cast<unsigned int>(1.0 * data.position.y / mapHeight * miniMAPHeight);
-        minimap[miniPositionY * miniMAPWidth + miniPositionX][data.groupID]++;
+    for (unsigned int i = 0; i < agents.size(); i++) {
+        if (i != 0u) result.append("|");
+        result.append(encode(frame.getAgent(agents[i])));
     }
     result.append(";");
 
@@ -139,36 +107,15 @@ std::string Text::encode(const magent::render::Frame &frame,
     }
     result.append(";");
 
-    for (unsigned int i = 0, first = 1; i < miniMAPHeight * miniMAPWidth; i++) {
-        if (first == 0u) result.append(" ");
-        double red = 0, blue = 0, green = 0;
-        unsigned int sum = 0;
-        for (unsigned int j = 0; j < nStyles; j++) {
-            sum += minimap[i][j];
-        }
-        for (unsigned int j = 0; j < nStyles; j++) {
-            red += 1.0 * config.getStyle(j).red * minimap[i][j] / sum;
-            blue += 1.0 * config.getStyle(j).blue * minimap[i][j] / sum;
-            green += 1.0 * config.getStyle(j).green * minimap[i][j] / sum;
-        }
-        unsigned int value = 0;
-        if (sum == 0u) {
-            value = (0xFFu << 24) | (0xFFu << 16) | (0xFFu << 8) | (0xFFu << 0);
-        } else {
-            value |= static_cast<unsigned int>(red) << 24;
-            value |= static_cast<unsigned int>(blue) << 16;
-            value |= static_cast<unsigned int>(green) << 8;
-            value |= static_cast<unsigned int>(0xFFu) << 0;
-        }
-
-        result.append(std::to_string(value));
-        first = 0;
-        delete[](minimap[i]);
+    std::vector<unsigned int> colors = frame.getMiniMAPColors(config);
+    for (unsigned int i = 0; i < colors.size(); i++) {
+        if (i != 0u) result.append(" ");
+        result.append(std::to_string(colors[i]));
     }
-    delete[](minimap);
 
     result.append(";");
-    for (unsigned int i = 0, first = 1; i < nStyles; i++) {
+    const std::vector<unsigned int> &agentsCounter = frame.getAgentsCounter(config);
+    for (unsigned int i = 0, first = 1; i < config.getStylesNumber(); i++) {
         if (first == 0u) result.append(" ");
         result.append(std::to_string(agentsCounter[i]));
         first = 0;
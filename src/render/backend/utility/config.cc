@@ -10,6 +10,7 @@ const char MATRIX_ARGP_DOCUMENT[] = "render: The backend server of magnet platfo
 const argp_option MATRIX_ARGP_OPTIONS[] ={
         {"port"                 , 'P', "PORT" , 0, "Specify the port to be used by the server(the default port is 9030)."                                , 1},
         {"quiet"                , 'Q', nullptr, 0, "Quiet mode will be used and almost all warning, diagnostic and exception message will be suppressed.", 2},
+        {"binary"               , 'B', nullptr, 0, "Reply with the binary protocol, agents are sent as deltas and frames can be batched."               , 3},
         {nullptr}
 };
 
@@ -36,6 +37,10 @@ error_t __parser(int key, char *arg, struct argp_state *state) {
             config.quiet = true;
             break;
         }
+        case 'B': {
+            config.binary = true;
+            break;
+        }
         default:
             return ARGP_ERR_UNKNOWN;
     }
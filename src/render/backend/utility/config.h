@@ -11,6 +11,7 @@ namespace render {
 struct RenderConfig {
     uint16_t port = 9030;
     bool quiet = false;
+    bool binary = false;
 };
 
 void parse(int argc, char *argv[], RenderConfig &config);
@@ -62,7 +62,8 @@ WebSocket::WebSocket(uint16_t port)  : ISocket(port), connection_hdl(nullptr) {
 
 void WebSocket::reply(const std::string &message) {
     websocketpp::lib::error_code errcode;
-    ws.send(*connection_hdl, message, websocketpp::frame::opcode::text, errcode);
+    ws.send(*connection_hdl, message,
+            binary ? websocketpp::frame::opcode::binary : websocketpp::frame::opcode::text, errcode);
 }
 
 void WebSocket::run() {
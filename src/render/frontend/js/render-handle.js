@@ -26,6 +26,14 @@ var _mapStyles = undefined;
 var _mapSpeed = undefined;
 var _mapForcedPause = undefined;
 
+// binary protocol : agents, obstacles and minimap the backend has sent, and the prefetched frames
+var _binaryMode = false;
+var _binaryAgents = undefined;
+var _binaryObstacles = undefined;
+var _binaryMiniMAP = undefined;
+var _mapPrefetch = [];
+var _mapRequests = [];  // batches requested and not answered yet, in the order they were sent
+
 var _isBrowserSizeChanged = undefined;
 var _isWindowChanged = undefined;
 var _isGridSizeChanged = undefined;
@@ -36,6 +44,167 @@ function _onresize() {
     _isWindowChanged = true;
 }
 
+function _windowString() {
+    return Math.floor(_offsetX).toString() + ' ' + Math.floor(_offsetY).toString() + ' '
+        + Math.ceil(_offsetX + window.innerWidth / gridSize).toString() + ' '
+        + Math.ceil(_offsetY + window.innerHeight / gridSize).toString();
+}
+
+function _requestFrame() {
+    var frameWindow = _windowString();
+    if (!_binaryMode) {
+        _socket.send('p' + _mapCurrentImage.toString() + ' ' + frameWindow);
+        return;
+    }
+    // frames are prefetched in batches, the rest of a batch is dropped when the window moves or the user seeks
+    if (_mapPrefetch.length > 0 && _mapPrefetch[0].frame === _mapCurrentImage && _mapPrefetch[0].window === frameWindow) {
+        var prefetched = _mapPrefetch.shift().data;
+        setTimeout(function () {
+            _showFrame(prefetched);
+        }, 0);
+        return;
+    }
+    _mapPrefetch = [];
+    _mapRequests.push({frame: _mapCurrentImage, window: frameWindow});
+    _socket.send('b' + _mapCurrentImage.toString() + ' ' + FRAME_BATCH.toString() + ' ' + frameWindow);
+}
+
+function _showFrame(data) {
+    _mapStatus = 'PLAY';
+    _mapLastData = _mapData;
+    _mapData = data;
+}
+
+// the record of an agent in the frame data, its position moved to the anchor of its direction
+function _addAgent(agents, id, x, y, group, dir, hp) {
+    if (!_mapStyles['group'].hasOwnProperty(group)) {
+        $.jGrowl('group ' + group.toString() + ' is not found in the configuration file', {
+            position: 'bottom-right'
+        });
+        _mapStatus = 'STOP';
+        return false;
+    }
+    if (dir === 90) {
+        x = x + _mapStyles['group'][group]['height'] - 1;
+        y = y + _mapStyles['group'][group]['width'] - 1;
+    } else if (dir === 180) {
+        y = y + _mapStyles['group'][group]['height'] - 1;
+    } else if (dir === 0) {
+        x = x + _mapStyles['group'][group]['width'] - 1;
+    }
+    agents[id] = [x, y, group, dir, hp];
+    return true;
+}
+
+// decode a binary reply, the layout is described in backend/binary.h. returns the equivalent text message for
+// 'i' and 'e', null for frames which are shown or prefetched here
+function _decodeBinary(buffer) {
+    var view = new DataView(buffer);
+    var op = String.fromCharCode(view.getUint8(0));
+    var offset = 1;
+    var readText = function () {
+        var bytes = new Uint8Array(buffer, offset);
+        return decodeURIComponent(escape(String.fromCharCode.apply(null, bytes)));
+    };
+    if (op === 'i') {
+        _binaryMode = true;
+        _binaryAgents = {};
+        _binaryObstacles = [];
+        _binaryMiniMAP = [];
+        _mapPrefetch = [];
+        _mapRequests = [];
+        var nFrames = view.getUint32(offset, true);
+        offset += 4;
+        return 'i' + nFrames.toString() + '|' + readText();
+    }
+    if (op !== 'f') {
+        return op + readText();
+    }
+
+    // replies come in the order of the requests, a reply is only shown and prefetched if no batch was
+    // requested after it. the frames of an outdated reply are still decoded, since they carry deltas
+    var first = view.getUint32(offset, true);
+    offset += 4;
+    var requested = undefined;
+    while (_mapRequests.length > 0 && requested === undefined) {
+        var request = _mapRequests.shift();
+        if (request.frame === first) {
+            requested = request;
+        }
+    }
+    var latest = requested !== undefined && _mapRequests.length === 0;
+
+    var frames = [];
+    var count = view.getUint32(offset, true);
+    offset += 4;
+    for (var it = 0; it < count; it++) {
+        var data = [[], {}, [], _binaryObstacles, [], []];
+        var n, i;
+
+        n = view.getUint32(offset, true);
+        offset += 4;
+        for (i = 0; i < n; i++, offset += 9) {
+            data[0].push([view.getUint8(offset), view.getInt32(offset + 1, true),
+                view.getUint16(offset + 5, true), view.getUint16(offset + 7, true)]);
+        }
+
+        n = view.getUint32(offset, true);
+        offset += 4;
+        for (i = 0; i < n; i++, offset += 4) {
+            delete _binaryAgents[view.getInt32(offset, true)];
+        }
+        n = view.getUint32(offset, true);
+        offset += 4;
+        for (i = 0; i < n; i++, offset += 12) {
+            _binaryAgents[view.getInt32(offset, true)] = [
+                view.getUint16(offset + 4, true), view.getUint16(offset + 6, true),
+                view.getUint8(offset + 11), view.getUint8(offset + 10) * 90, view.getUint16(offset + 8, true)
+            ];
+        }
+        for (var id in _binaryAgents) {
+            var agent = _binaryAgents[id];
+            if (!_addAgent(data[1], id, agent[0], agent[1], agent[2], agent[3], agent[4])) break;
+        }
+
+        n = view.getUint32(offset, true);
+        offset += 4;
+        for (i = 0; i < n; i++, offset += 6) {
+            data[2].push([view.getUint16(offset, true), view.getUint16(offset + 2, true),
+                view.getUint16(offset + 4, true)]);
+        }
+
+        n = view.getUint32(offset, true);
+        offset += 4;
+        for (i = 0; i < n; i++, offset += 4) {
+            _binaryObstacles.push([view.getUint16(offset, true), view.getUint16(offset + 2, true)]);
+        }
+
+        n = view.getUint32(offset, true);
+        offset += 4;
+        for (i = 0; i < n; i++, offset += 8) {
+            _binaryMiniMAP[view.getUint32(offset, true)] = view.getUint32(offset + 4, true);
+        }
+        data[4] = _binaryMiniMAP.slice();
+
+        n = view.getUint32(offset, true);
+        offset += 4;
+        for (i = 0; i < n; i++, offset += 4) {
+            data[5].push(view.getUint32(offset, true));
+        }
+        frames.push(data);
+    }
+
+    if (latest) {
+        for (var k = 1; k < frames.length; k++) {
+            _mapPrefetch.push({frame: first + k, window: requested.window, data: frames[k]});
+        }
+        if (frames.length > 0) {
+            _showFrame(frames[0]);
+        }
+    }
+    return null;
+}
+
 function _drawGrid() {
     /*_gridCTX.clearRect(0, 0, _gridCTX.canvas.width, _gridCTX.canvas.height);
     %_gridCTX.beginPath();
@@ -202,6 +371,7 @@ function run() {
 
     var _connect = function () {
         _socket = new WebSocket(SOCKET_HOST);
+        _socket.binaryType = 'arraybuffer';
         _socket.onopen = function () {
             console.log('successfully connected to the backend server');
             $("#magnet-file-modal").modal('show');
@@ -224,6 +394,10 @@ function run() {
         };
         _socket.onmessage = function (data) {
             data = data.data;
+            if (data instanceof ArrayBuffer) {
+                data = _decodeBinary(data);
+                if (data === null) return;
+            }
             var op = data[0];
             data = data.substr(1);
             switch (op) {
@@ -266,10 +440,7 @@ function run() {
                             _mapData = undefined;
                             _mapAnimateTick = 0;
                             _mapCurrentImage = parseInt($('#magnet-settings-progress').val());
-                            _socket.send('p' + _mapCurrentImage.toString() + ' '
-                                + Math.floor(_offsetX).toString() + ' ' + Math.floor(_offsetY).toString() + ' '
-                                + Math.ceil(_offsetX + window.innerWidth / gridSize).toString() + ' '
-                                + Math.ceil(_offsetY + window.innerHeight / gridSize).toString());
+                            _requestFrame();
                             _mapStatus = 'PAUSE';
                         })
                         .bind('slide', function () {
@@ -278,10 +449,7 @@ function run() {
                             _mapAnimateTick = 0;
                             _mapCurrentImage = parseInt($('#magnet-settings-progress').val());
 
-                            _socket.send('p' + _mapCurrentImage.toString() + ' '
-                                + Math.floor(_offsetX).toString() + ' ' + Math.floor(_offsetY).toString() + ' '
-                                + Math.ceil(_offsetX + window.innerWidth / gridSize).toString() + ' '
-                                + Math.ceil(_offsetY + window.innerHeight / gridSize).toString());
+                            _requestFrame();
                             _mapStatus = 'PAUSE';
                         });
                     $('#magnet-settings-speed')
@@ -296,10 +464,7 @@ function run() {
 
                     _animate();
 
-                    _socket.send('p' + _mapCurrentImage.toString() + ' '
-                        + Math.floor(_offsetX).toString() + ' ' + Math.floor(_offsetY).toString() + ' '
-                        + Math.ceil(_offsetX + window.innerWidth / gridSize).toString() + ' '
-                        + Math.ceil(_offsetY + window.innerHeight / gridSize).toString());
+                    _requestFrame();
                     break;
                 case 'f':
                     _mapStatus = 'PLAY';
@@ -330,22 +495,7 @@ function run() {
                         var group = parseInt(data[1][itAgents][3]);
                         var dir = parseInt(data[1][itAgents][4]);
                         var hp = parseInt(data[1][itAgents][5]);
-                        if (!_mapStyles['group'].hasOwnProperty(group)) {
-                            $.jGrowl('group ' + group.toString() + ' is not found in the configuration file', {
-                                position: 'bottom-right'
-                            });
-                            _mapStatus = 'STOP';
-                            break;
-                        }
-                        if (dir === 90) {
-                            x = x + _mapStyles['group'][group]['height'] - 1;
-                            y = y + _mapStyles['group'][group]['width'] - 1;
-                        } else if (dir === 180) {
-                            y = y + _mapStyles['group'][group]['height'] - 1;
-                        } else if (dir === 0) {
-                            x = x + _mapStyles['group'][group]['width'] - 1;
-                        }
-                        _mapData[1][data[1][itAgents][0]] = [x, y, group, dir, hp]
+                        if (!_addAgent(_mapData[1], data[1][itAgents][0], x, y, group, dir, hp)) break;
                     }
 
                     data[2] = data[2].split('|');
@@ -678,17 +828,11 @@ function _animate() {
             _mapAnimateTick = 0;
             if (_mapCurrentImage >= _mapTotalImage) {
                 _mapCurrentImage = _mapTotalImage - 1;
-                _socket.send('p' + _mapCurrentImage.toString() + ' '
-                    + Math.floor(_offsetX).toString() + ' ' + Math.floor(_offsetY).toString() + ' '
-                    + Math.ceil(_offsetX + window.innerWidth / gridSize).toString() + ' '
-                    + Math.ceil(_offsetY + window.innerHeight / gridSize).toString());
+                _requestFrame();
                 _mapStatus = 'WAITING';
             } else {
                 $('#magnet-settings-progress').val(_mapCurrentImage);
-                _socket.send('p' + _mapCurrentImage.toString() + ' '
-                    + Math.floor(_offsetX).toString() + ' ' + Math.floor(_offsetY).toString() + ' '
-                    + Math.ceil(_offsetX + window.innerWidth / gridSize).toString() + ' '
-                    + Math.ceil(_offsetY + window.innerHeight / gridSize).toString());
+                _requestFrame();
                 _mapStatus = 'WAITING';
             }
         }
@@ -1,5 +1,6 @@
 var SOCKET_HOST = 'ws://localhost:9030';
 var SOCKET_RECONNECT_PERIOD = 2000;
+var FRAME_BATCH = 16;  // frames prefetched by a request of the binary protocol
 
 var STATUS_SPACING = 15;
 var STATUS_PADDING_TOP = 15;
@@ -4,7 +4,9 @@
  */
 
 #include "Environment.h"
+#include "EnvPool.h"
 #include "gridworld/GridWorld.h"
+#include "gridworld/Replay.h"
 #include "discrete_snake/DiscreteSnake.h"
 #include "utility/utility.h"
 #include "runtime_api.h"
@@ -27,6 +29,14 @@ int env_new_game(EnvHandle *game, const char *name) {
 
 int env_delete_game(EnvHandle game) {
     LOG(TRACE) << "env delete game.  ";
+    if (game->step_pending()) {  // the step must not outlive the game
+        int done;
+        try {
+            game->wait_step(&done);
+        } catch (std::exception &e) {
+            LOG(WARNING) << "asynchronous step failed before delete : " << e.what();
+        }
+    }
     delete game;
     return 0;
 }
@@ -50,6 +60,12 @@ int env_get_observation(EnvHandle game, GroupHandle group, float **buffer) {
     return 0;
 }
 
+int env_get_observation_subset(EnvHandle game, GroupHandle group, const int *indices, int n, float **buffer) {
+    LOG(TRACE) << "env get observation subset.  ";
+    game->get_observation_subset(group, indices, n, buffer);
+    return 0;
+}
+
 int env_set_action(EnvHandle game, GroupHandle group, const int *actions) {
     LOG(TRACE) << "env set action.  ";
     game->set_action(group, actions);
@@ -68,6 +84,31 @@ int env_get_reward(EnvHandle game, GroupHandle group, float *buffer) {
     return 0;
 }
 
+int env_step_async(EnvHandle game, int clear_dead) {
+    LOG(TRACE) << "env step async.  ";
+    game->step_async(clear_dead != 0);
+    return 0;
+}
+
+int env_wait(EnvHandle game, int *done) {
+    LOG(TRACE) << "env wait.  ";
+    game->wait_step(done);
+    return 0;
+}
+
+int env_step_full(EnvHandle game, const int **actions, float ***obs, float **rewards, bool **alive, int **ids,
+                  int *nums, int *done) {
+    LOG(TRACE) << "env step full.  ";
+    game->step_full(actions, obs, rewards, alive, ids, nums, done);
+    return 0;
+}
+
+int env_register_buffer(EnvHandle game, GroupHandle group, const char *name, void *buffer, int capacity) {
+    LOG(TRACE) << "env register buffer " << name << ".  ";
+    game->register_buffer(group, name, buffer, capacity);
+    return 0;
+}
+
 // info getter
 int env_get_info(EnvHandle game, GroupHandle group, const char *name, void *buffer) {
     LOG(TRACE) << "env get info " << name << ".  ";
@@ -75,6 +116,32 @@ int env_get_info(EnvHandle game, GroupHandle group, const char *name, void *buff
     return 0;
 }
 
+// state snapshot
+int env_save_state(EnvHandle game, char *buffer, long long *size) {
+    LOG(TRACE) << "env save state.  ";
+    // the state is saved once per call and freed on return, a caller keeping a large enough buffer saves once
+    std::vector<char> blob;
+    if (buffer != nullptr)
+        blob.reserve((size_t)std::max(*size, 0LL));
+    game->save_state(blob);
+    if (buffer != nullptr && *size >= (long long)blob.size())
+        memcpy(buffer, blob.data(), blob.size());
+    *size = (long long)blob.size();
+    return 0;
+}
+
+int env_load_state(EnvHandle game, const char *buffer, long long size) {
+    LOG(TRACE) << "env load state.  ";
+    game->load_state(buffer, (size_t)size);
+    return 0;
+}
+
+int env_clone_game(EnvHandle game, EnvHandle *clone) {
+    LOG(TRACE) << "env clone game.  ";
+    *clone = game->clone();
+    return 0;
+}
+
 // render
 int env_render(EnvHandle game) {
     LOG(TRACE) << "env render.  ";
@@ -89,6 +156,65 @@ int env_render_next_file(EnvHandle game) {
     return 0;
 }
 
+/**
+ *  Environment Pool
+ */
+int env_pool_new(EnvPoolHandle *pool, EnvHandle *games, int n, int n_threads) {
+    LOG(TRACE) << "env pool new.  ";
+    *pool = new ::magent::environment::EnvPool(games, n, n_threads);
+    return 0;
+}
+
+int env_pool_delete(EnvPoolHandle pool) {
+    LOG(TRACE) << "env pool delete.  ";
+    delete pool;
+    return 0;
+}
+
+// run step
+int env_pool_reset_all(EnvPoolHandle pool) {
+    LOG(TRACE) << "env pool reset all.  ";
+    pool->reset_all();
+    return 0;
+}
+
+int env_pool_get_observation_all(EnvPoolHandle pool, GroupHandle group, float **buffer) {
+    LOG(TRACE) << "env pool get observation all.  ";
+    pool->get_observation_all(group, buffer);
+    return 0;
+}
+
+int env_pool_set_action_all(EnvPoolHandle pool, GroupHandle group, const int *actions) {
+    LOG(TRACE) << "env pool set action all.  ";
+    pool->set_action_all(group, actions);
+    return 0;
+}
+
+int env_pool_step_all(EnvPoolHandle pool, int *done) {
+    LOG(TRACE) << "env pool step all.  ";
+    pool->step_all(done);
+    return 0;
+}
+
+int env_pool_get_reward_all(EnvPoolHandle pool, GroupHandle group, float *buffer) {
+    LOG(TRACE) << "env pool get reward all.  ";
+    pool->get_reward_all(group, buffer);
+    return 0;
+}
+
+int env_pool_clear_dead_all(EnvPoolHandle pool) {
+    LOG(TRACE) << "env pool clear dead all.  ";
+    pool->clear_dead_all();
+    return 0;
+}
+
+// info getter
+int env_pool_get_num_all(EnvPoolHandle pool, GroupHandle group, int *buffer) {
+    LOG(TRACE) << "env pool get num all.  ";
+    pool->get_num_all(group, buffer);
+    return 0;
+}
+
 /**
  *  GridWorld special
  */
@@ -120,12 +246,58 @@ int gridworld_clear_dead(EnvHandle game) {
     return 0;
 }
 
+int gridworld_get_observation_sparse(EnvHandle game, GroupHandle group, int *offsets, int *coords, float *values,
+                                     int capacity, float *features, int *nnz) {
+    LOG(TRACE) << "gridworld get observation sparse.  ";
+    *nnz = ((::magent::gridworld::GridWorld *)game)->get_observation_sparse(group, offsets, coords, values,
+                                                                          capacity, features);
+    return 0;
+}
+
+int gridworld_get_observation_device(EnvHandle game, GroupHandle group, float *view, float *feature) {
+    LOG(TRACE) << "gridworld get observation device.  ";
+    ((::magent::gridworld::GridWorld *)game)->get_observation_device(group, view, feature);
+    return 0;
+}
+
 int gridworld_set_goal(EnvHandle game, GroupHandle group, const char *method, const int *linear_buffer) {
     LOG(TRACE) << "gridworld clear dead.  ";
     ((::magent::gridworld::GridWorld *)game)->set_goal(group, method, linear_buffer);
     return 0;
 }
 
+int gridworld_replay(EnvHandle game, const char *path, int render, int *n_step) {
+    LOG(TRACE) << "gridworld replay.  ";
+    ::magent::gridworld::GridWorld *env = (::magent::gridworld::GridWorld *)game;
+    ::magent::gridworld::Replayer replayer(*env, path);
+    int done, ct = 0;
+    while (replayer.next_step(&done)) {
+        if (render)
+            env->render();
+        ct++;
+    }
+    *n_step = ct;
+    return 0;
+}
+
+int gridworld_set_policy(EnvHandle game, GroupHandle group, const char *name, int n, const char **keys, float *values) {
+    LOG(TRACE) << "gridworld set policy.  ";
+    std::shared_ptr<::magent::gridworld::Policy> policy;
+    if (name != nullptr)
+        policy.reset(::magent::gridworld::new_policy(name, n, keys, values));
+    ((::magent::gridworld::GridWorld *)game)->set_policy(group, policy);
+    return 0;
+}
+
+int gridworld_set_model(EnvHandle game, GroupHandle group, const char *backend, const char *path) {
+    LOG(TRACE) << "gridworld set model.  ";
+    std::shared_ptr<::magent::gridworld::InferenceBackend> model;
+    if (backend != nullptr)
+        model.reset(::magent::gridworld::new_inference_backend(backend, path));
+    ((::magent::gridworld::GridWorld *)game)->set_model(group, model);
+    return 0;
+}
+
 // reward description
 int gridworld_define_agent_symbol(EnvHandle game, int no, int group, int index) {
     LOG(TRACE) << "gridworld define agent symbol";
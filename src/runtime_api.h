@@ -7,11 +7,13 @@
 #define MAGENT_RUNTIME_API_H
 
 #include "Environment.h"
+#include "EnvPool.h"
 
 extern "C" {
 
 using ::magent::environment::EnvHandle;
 using ::magent::environment::GroupHandle;
+using ::magent::environment::EnvPoolHandle;
 
 /**
  *  General Environment
@@ -24,17 +26,60 @@ int env_config_game(EnvHandle game, const char *name, void *p_value);
 // run step
 int env_reset(EnvHandle game);
 int env_get_observation(EnvHandle game, GroupHandle group, float **buffer);
+// observations of the agents indices[0..n) of group only, into the first n rows of the buffers
+int env_get_observation_subset(EnvHandle game, GroupHandle group, const int *indices, int n, float **buffer);
 int env_set_action(EnvHandle game, GroupHandle group, const int *actions);
 int env_step(EnvHandle game, int *done);
 int env_get_reward(EnvHandle game, GroupHandle group, float *buffer);
 
+// persistent output buffers, name = "view", "feature" or "reward".
+// after registration, pass NULL to env_get_observation / env_get_reward to use them
+int env_register_buffer(EnvHandle game, GroupHandle group, const char *name, void *buffer, int capacity);
+
+// asynchronous step, env_step (and clear_dead if clear_dead != 0) runs on a background thread and
+// writes rewards and observations into the registered buffers. Other calls to the game must wait until env_wait,
+// calls to other games can be made meanwhile (e.g. to run the policy of another game)
+int env_step_async(EnvHandle game, int clear_dead);
+int env_wait(EnvHandle game, int *done);
+
+// fused step : set actions, step, get rewards and alive, clear dead, get ids, numbers and observations
+// of all the groups in one call. every argument is an array indexed by group, NULL arrays or entries are skipped.
+// rewards and alive are of the agents before clear dead (as env_get_reward), the others are after it
+int env_step_full(EnvHandle game, const int **actions, float ***obs, float **rewards, bool **alive, int **ids,
+                  int *nums, int *done);
+
 // info getter
 int env_get_info(EnvHandle game, GroupHandle group, const char *name, void *buffer);
 
+// state snapshot. *size is the capacity of buffer on input and the size of the state on output,
+// nothing is copied if the capacity is not enough. a call saves the state once, so pass a buffer
+// large enough (e.g. the size of the last state with some room) instead of querying the size first
+int env_save_state(EnvHandle game, char *buffer, long long *size);
+int env_load_state(EnvHandle game, const char *buffer, long long size);
+int env_clone_game(EnvHandle game, EnvHandle *clone);
+
 // render
 int env_render(EnvHandle game);
 int env_render_next_file(EnvHandle game);
 
+/**
+ *  Environment Pool
+ */
+// pool
+int env_pool_new(EnvPoolHandle *pool, EnvHandle *games, int n, int n_threads);
+int env_pool_delete(EnvPoolHandle pool);
+
+// run step, buffers are concatenated in the order of games
+int env_pool_reset_all(EnvPoolHandle pool);
+int env_pool_get_observation_all(EnvPoolHandle pool, GroupHandle group, float **buffer);
+int env_pool_set_action_all(EnvPoolHandle pool, GroupHandle group, const int *actions);
+int env_pool_step_all(EnvPoolHandle pool, int *done);
+int env_pool_get_reward_all(EnvPoolHandle pool, GroupHandle group, float *buffer);
+int env_pool_clear_dead_all(EnvPoolHandle pool);
+
+// info getter
+int env_pool_get_num_all(EnvPoolHandle pool, GroupHandle group, int *buffer);
+
 /**
  *  GridWorld special
  */
@@ -46,7 +91,22 @@ int gridworld_add_agents(EnvHandle game, GroupHandle group, int n, const char *m
 
 // run step
 int gridworld_clear_dead(EnvHandle game);
+// sparse observation : offsets (n + 1), coords (capacity, 3) as (view_y, view_x, channel), values (capacity),
+// features as env_get_observation. *nnz is the number of entries. if nnz > capacity only the first capacity
+// entries are written, offsets and features are complete, retry with a capacity of at least nnz
+int gridworld_get_observation_sparse(EnvHandle game, GroupHandle group, int *offsets, int *coords, float *values,
+                                     int capacity, float *features, int *nnz);
+// views and features of group written into buffers on the cuda device, needs a build with USE_CUDA
+int gridworld_get_observation_device(EnvHandle game, GroupHandle group, float *view, float *feature);
 int gridworld_set_goal(EnvHandle game, GroupHandle group, const char *method, const int *linear_buffer);
+// re-simulate a replay log (config replay_file) on game, which is reset and configured as the recorded game.
+// the steps are rendered if render != 0, *n_step is the number of steps
+int gridworld_replay(EnvHandle game, const char *path, int render, int *n_step);
+// bind a built-in policy ("runaway", "rush" or "gather") to group, its actions are inferred in env_step.
+// name = NULL to unbind
+int gridworld_set_policy(EnvHandle game, GroupHandle group, const char *name, int n, const char **keys, float *values);
+// bind a model to group, backend = "onnx" and path is the model file. backend = NULL to unbind
+int gridworld_set_model(EnvHandle game, GroupHandle group, const char *backend, const char *path);
 
 // reward description
 int gridworld_define_agent_symbol(EnvHandle game, int no, int group, int index);
@@ -8,6 +8,7 @@
 #include <cmath>
 #include <vector>
 #include "utility/utility.h"
+#include "runtime_api.h"
 
 using magent::utility::NDPointer;
 
@@ -0,0 +1,80 @@
+/**
+ * \file ObjectPool.h
+ * \brief a block allocator for objects that are created and destroyed every episode
+ */
+
+#ifndef MAGENT_UTILITY_OBJECTPOOL_H
+#define MAGENT_UTILITY_OBJECTPOOL_H
+
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace magent {
+namespace utility {
+
+/**
+ * Objects are placed in fixed-size blocks that are never returned to the heap until the pool
+ * is destroyed. Freed slots are reused by later allocations, and reset() recycles all the
+ * blocks in O(1). Not thread-safe.
+ */
+template <typename T>
+class ObjectPool {
+public:
+    explicit ObjectPool(size_t block_size = 1024) : block_size(block_size), block_pt(0), slot_pt(0) {
+    }
+
+    ~ObjectPool() {
+        for (auto block : blocks)
+            ::operator delete(block);
+    }
+
+    ObjectPool(const ObjectPool &) = delete;
+    ObjectPool &operator=(const ObjectPool &) = delete;
+
+    template <typename... Args>
+    T *alloc(Args&&... args) {
+        void *mem;
+        if (!free_list.empty()) {
+            mem = free_list.back();
+            free_list.pop_back();
+        } else {
+            if (slot_pt == block_size) {
+                block_pt++;
+                slot_pt = 0;
+            }
+            if (block_pt == blocks.size())
+                blocks.push_back(static_cast<T *>(::operator new(sizeof(T) * block_size)));
+            mem = blocks[block_pt] + slot_pt++;
+        }
+        return new (mem) T(std::forward<Args>(args)...);
+    }
+
+    void free(T *obj) {
+        obj->~T();
+        free_list.push_back(obj);
+    }
+
+    /**
+     * \brief recycle all the slots, objects still alive are dropped without running their destructors,
+     *        so T should be trivially destructible or be freed by the caller before
+     */
+    void reset() {
+        block_pt = slot_pt = 0;
+        free_list.clear();
+    }
+
+    size_t get_capacity() const { return blocks.size() * block_size; }
+
+private:
+    size_t block_size;
+    std::vector<T *> blocks;
+    std::vector<T *> free_list;
+    size_t block_pt, slot_pt;
+};
+
+} // namespace utility
+} // namespace magent
+
+#endif //MAGENT_UTILITY_OBJECTPOOL_H
@@ -0,0 +1,101 @@
+/**
+ * \file ObsDtype.h
+ * \brief element types of exported views : float32, float16 or uint8
+ */
+
+#ifndef MAGENT_UTILITY_OBSDTYPE_H
+#define MAGENT_UTILITY_OBSDTYPE_H
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include "utility.h"
+
+namespace magent {
+namespace utility {
+
+/**
+ * Views are extracted as float and converted when they are written to the buffers of the caller.
+ * float16 is IEEE half precision (round to nearest even). uint8 stores round(v * OBS_UINT8_SCALE),
+ * so [0, 2] is representable : occupancy, hp and minimap (density + 1 at the cell of the agent).
+ * Features are always float32.
+ */
+enum ObsDtype { OBS_FLOAT32 = 0, OBS_FLOAT16 = 1, OBS_UINT8 = 2 };
+
+const float OBS_UINT8_SCALE = 127.0f;
+
+inline ObsDtype parse_obs_dtype(const char *name) {
+    if (strequ(name, "float32"))
+        return OBS_FLOAT32;
+    else if (strequ(name, "float16"))
+        return OBS_FLOAT16;
+    else if (strequ(name, "uint8"))
+        return OBS_UINT8;
+    LOG(FATAL) << "invalid observation dtype : " << name;
+    return OBS_FLOAT32;
+}
+
+inline size_t obs_dtype_size(ObsDtype dtype) {
+    switch (dtype) {
+        case OBS_FLOAT16: return sizeof(uint16_t);
+        case OBS_UINT8:   return sizeof(uint8_t);
+        default:          return sizeof(float);
+    }
+}
+
+inline uint16_t float_to_half(float value) {
+    uint32_t x;
+    memcpy(&x, &value, sizeof(x));
+    const uint32_t sign = (x >> 16) & 0x8000;
+    const uint32_t abs = x & 0x7fffffff;
+
+    if (abs >= 0x7f800000)  // inf or nan
+        return (uint16_t)(sign | 0x7c00 | (abs > 0x7f800000 ? 0x200 : 0));
+    if (abs >= 0x477ff000)  // overflow after rounding
+        return (uint16_t)(sign | 0x7c00);
+    if (abs < 0x38800000) {  // subnormal or zero in half
+        if (abs < 0x33000000)
+            return (uint16_t)sign;
+        const uint32_t shift = 126 - (abs >> 23);
+        const uint32_t mantissa = (abs & 0x7fffff) | 0x800000;
+        uint32_t half = mantissa >> shift;
+        const uint32_t rest = mantissa & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1)))
+            half++;
+        return (uint16_t)(sign | half);
+    }
+    // normal, rebias the exponent and round the 13 dropped bits to nearest even
+    uint32_t half = (abs - 0x38000000) >> 13;
+    const uint32_t rest = abs & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+        half++;
+    return (uint16_t)(sign | half);
+}
+
+// convert n floats into dst, which holds elements of dtype
+inline void convert_obs(const float *src, void *dst, size_t n, ObsDtype dtype) {
+    switch (dtype) {
+        case OBS_FLOAT32:
+            memcpy(dst, src, sizeof(float) * n);
+            break;
+        case OBS_FLOAT16: {
+            uint16_t *out = (uint16_t *)dst;
+            for (size_t i = 0; i < n; i++)
+                out[i] = float_to_half(src[i]);
+            break;
+        }
+        case OBS_UINT8: {
+            uint8_t *out = (uint8_t *)dst;
+            for (size_t i = 0; i < n; i++) {
+                float q = std::round(src[i] * OBS_UINT8_SCALE);
+                out[i] = (uint8_t)(q < 0 ? 0 : (q > 255 ? 255 : q));
+            }
+            break;
+        }
+    }
+}
+
+} // namespace utility
+} // namespace magent
+
+#endif //MAGENT_UTILITY_OBSDTYPE_H
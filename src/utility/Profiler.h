@@ -0,0 +1,72 @@
+/**
+ * \file Profiler.h
+ * \brief accumulated wall time and counters of the phases of an environment
+ */
+
+#ifndef MAGENT_UTILITY_PROFILER_H
+#define MAGENT_UTILITY_PROFILER_H
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+namespace magent {
+namespace utility {
+
+/**
+ * Phases are indexed by an enum of the environment. For every phase the profiler accumulates
+ * the elapsed time, the number of calls and the number of processed items (agents, actions ...).
+ * A record only costs two reads of the steady clock.
+ * Usage:
+ *     auto start = profiler.now();
+ *     ... // phase A
+ *     start = profiler.record(PHASE_A, start, n_item);
+ *     ... // phase B
+ *     profiler.record(PHASE_B, start);
+ */
+class Profiler {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    explicit Profiler(int n_phase) : times(n_phase, 0.0), calls(n_phase, 0), items(n_phase, 0) {
+    }
+
+    Clock::time_point now() const { return Clock::now(); }
+
+    // add the time since start to phase, return the current time as the start of the next phase
+    Clock::time_point record(int phase, Clock::time_point start, long long n_item = 0) {
+        Clock::time_point end = Clock::now();
+        times[phase] += std::chrono::duration<double>(end - start).count();
+        calls[phase]++;
+        items[phase] += n_item;
+        return end;
+    }
+
+    // add time measured elsewhere (in seconds) to phase, a call if new_call
+    void add(int phase, double time, long long n_item = 0, bool new_call = true) {
+        times[phase] += time;
+        calls[phase] += new_call;
+        items[phase] += n_item;
+    }
+
+    void reset() {
+        std::fill(times.begin(), times.end(), 0.0);
+        std::fill(calls.begin(), calls.end(), 0);
+        std::fill(items.begin(), items.end(), 0);
+    }
+
+    int get_phase_num() const { return (int)times.size(); }
+    double get_time(int phase) const   { return times[phase]; }  // in seconds
+    long long get_calls(int phase) const { return calls[phase]; }
+    long long get_items(int phase) const { return items[phase]; }
+
+private:
+    std::vector<double> times;
+    std::vector<long long> calls;
+    std::vector<long long> items;
+};
+
+} // namespace utility
+} // namespace magent
+
+#endif //MAGENT_UTILITY_PROFILER_H
@@ -0,0 +1,153 @@
+/**
+ * \file RenderFormat.h
+ * \brief binary format of render logs, shared by the engine and the render backend
+ */
+
+#ifndef MAGENT_UTILITY_RENDERFORMAT_H
+#define MAGENT_UTILITY_RENDERFORMAT_H
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#ifdef MAGENT_USE_LZ4
+#include <lz4.h>
+#endif
+
+namespace magent {
+namespace utility {
+
+/**
+ * A binary log is a RenderFileHeader followed by blocks, every block is a RenderBlockHeader and its payload.
+ * The payload is lz4 compressed when stored_size != raw_size. All the fields are in host byte order.
+ *
+ * payload of RENDER_BLOCK_WALL : uint32 n, PackedPosition * n
+ * payload of a frame block     : RenderFrameHeader, PackedAgent * n_changed, int32 (removed id) * n_removed,
+ *                                PackedAttack * n_attack
+ * A key frame lists all the agents, a delta frame only lists the agents that are new or changed since
+ * the previous frame, and the ids of the agents that are gone.
+ */
+const char RENDER_MAGIC[4] = {'M', 'A', 'G', 'B'};
+const uint32_t RENDER_VERSION = 1;
+
+enum RenderBlockTag : uint32_t {
+    RENDER_BLOCK_WALL = 'W', RENDER_BLOCK_KEY_FRAME = 'K', RENDER_BLOCK_DELTA_FRAME = 'D',
+};
+
+/**
+ * A replay log (replay_file of GridWorld) has the same layout with REPLAY_MAGIC, its blocks are
+ * RENDER_BLOCK_STATE : a state of GridWorld::save_state, before the actions of the next step
+ * RENDER_BLOCK_STEP  : varint-encoded step, see Replay.cc
+ * RENDER_BLOCK_CLEAR : empty, a clear_dead
+ */
+const char REPLAY_MAGIC[4] = {'M', 'A', 'G', 'R'};
+
+enum ReplayBlockTag : uint32_t {
+    RENDER_BLOCK_STATE = 'S', RENDER_BLOCK_STEP = 'A', RENDER_BLOCK_CLEAR = 'C',
+};
+
+struct RenderFileHeader {
+    char magic[4];
+    uint32_t version;
+};
+
+struct RenderBlockHeader {
+    uint32_t tag;
+    uint32_t raw_size;
+    uint32_t stored_size;
+};
+
+struct RenderFrameHeader {
+    uint32_t n_agent;  // number of agents in this frame after applying the delta
+    uint32_t n_changed, n_removed, n_attack;
+};
+
+struct PackedPosition {
+    uint16_t x, y;
+};
+
+struct PackedAgent {
+    int32_t id;
+    uint16_t x, y;
+    uint8_t hp;        // in percent
+    uint8_t dir;       // angle / 90
+    uint8_t group;
+    uint8_t reserved;
+
+    bool operator ==(const PackedAgent &other) const {
+        return memcmp(this, &other, sizeof(PackedAgent)) == 0;
+    }
+    bool operator !=(const PackedAgent &other) const { return !(*this == other); }
+};
+
+struct PackedAttack {
+    int32_t id;
+    uint16_t x, y;
+};
+
+static_assert(sizeof(PackedAgent) == 12 && sizeof(PackedAttack) == 8, "unexpected padding in render records");
+
+/**
+ * Live ring (render_format = "live"): a file mapped by the engine and the render server.
+ * RenderLiveHeader, the walls (PackedPosition * n_wall), then n_slot slots of RenderLiveSlot + slot_size bytes.
+ * Frame n (from 0) is written to slot n % n_slot as the payload of a key frame, guarded by a seqlock:
+ * slot.seq is 2n + 1 while it is being written and 2n + 2 after. write_seq is the number of published frames.
+ * The engine never waits for readers, a reader takes the newest frame and retries if it is overwritten.
+ */
+const char RENDER_LIVE_MAGIC[4] = {'M', 'A', 'G', 'L'};
+
+struct RenderLiveHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t n_slot, slot_size;
+    uint64_t wall_offset, slot_offset;
+    uint32_t n_wall, reserved;
+    uint64_t write_seq;
+    uint64_t dropped;   // frames larger than a slot
+};
+
+struct RenderLiveSlot {
+    uint64_t seq;
+    uint32_t size;
+    uint32_t reserved;
+};
+
+inline bool render_compress_available() {
+#ifdef MAGENT_USE_LZ4
+    return true;
+#else
+    return false;
+#endif
+}
+
+// compress a payload into out, return false (and leave out undefined) if it is not worth it
+inline bool compress_render_block(const char *raw, uint32_t raw_size, std::vector<char> &out) {
+#ifdef MAGENT_USE_LZ4
+    out.resize((size_t)LZ4_compressBound((int)raw_size));
+    int size = LZ4_compress_default(raw, out.data(), (int)raw_size, (int)out.size());
+    if (size <= 0 || (uint32_t)size >= raw_size)
+        return false;
+    out.resize((size_t)size);
+    return true;
+#else
+    return false;
+#endif
+}
+
+// return false if the block is broken or compression is not built in
+inline bool decompress_render_block(const char *stored, uint32_t stored_size, char *raw, uint32_t raw_size) {
+    if (stored_size == raw_size) {
+        memcpy(raw, stored, raw_size);
+        return true;
+    }
+#ifdef MAGENT_USE_LZ4
+    return LZ4_decompress_safe(stored, raw, (int)stored_size, (int)raw_size) == (int)raw_size;
+#else
+    return false;
+#endif
+}
+
+} // namespace utility
+} // namespace magent
+
+#endif //MAGENT_UTILITY_RENDERFORMAT_H
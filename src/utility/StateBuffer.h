@@ -0,0 +1,102 @@
+/**
+ * \file StateBuffer.h
+ * \brief sequential writer and reader of the binary state of an environment
+ */
+
+#ifndef MAGENT_UTILITY_STATEBUFFER_H
+#define MAGENT_UTILITY_STATEBUFFER_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "utility.h"
+
+namespace magent {
+namespace utility {
+
+/**
+ * Values are stored as raw bytes in host byte order, so a state can only be loaded
+ * by the same build on the same kind of machine. Only trivially copyable types are allowed.
+ */
+class StateWriter {
+public:
+    explicit StateWriter(std::vector<char> &out) : out(out) {}
+
+    template <typename T>
+    void write(const T &value) { write_array(&value, 1); }
+
+    template <typename T>
+    void write_array(const T *data, size_t n) {
+        size_t old = out.size();
+        out.resize(old + sizeof(T) * n);
+        if (n > 0)
+            memcpy(&out[old], data, sizeof(T) * n);
+    }
+
+    template <typename T>
+    void write_vector(const std::vector<T> &values) {
+        write<uint64_t>(values.size());
+        write_array(values.data(), values.size());
+    }
+
+    void write_string(const std::string &str) {
+        write<uint64_t>(str.size());
+        write_array(str.data(), str.size());
+    }
+
+private:
+    std::vector<char> &out;
+};
+
+class StateReader {
+public:
+    StateReader(const char *data, size_t size) : data(data), size(size), offset(0) {}
+
+    template <typename T>
+    T read() {
+        T value;
+        read_array(&value, 1);
+        return value;
+    }
+
+    template <typename T>
+    void read_array(T *buf, size_t n) {
+        check(n, sizeof(T));
+        if (n > 0)
+            memcpy(buf, data + offset, sizeof(T) * n);
+        offset += sizeof(T) * n;
+    }
+
+    template <typename T>
+    void read_vector(std::vector<T> &values) {
+        size_t n = (size_t)read<uint64_t>();
+        check(n, sizeof(T));
+        values.resize(n);
+        read_array(values.data(), n);
+    }
+
+    std::string read_string() {
+        size_t n = (size_t)read<uint64_t>();
+        check(n, 1);
+        std::string str(data + offset, n);
+        offset += n;
+        return str;
+    }
+
+    bool at_end() const { return offset == size; }
+
+private:
+    void check(size_t n, size_t elem_size) const {
+        if (n > (size - offset) / elem_size)
+            LOG(FATAL) << "truncated state buffer";
+    }
+
+    const char *data;
+    size_t size, offset;
+};
+
+} // namespace utility
+} // namespace magent
+
+#endif //MAGENT_UTILITY_STATEBUFFER_H
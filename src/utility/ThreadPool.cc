@@ -0,0 +1,150 @@
+/**
+ * \file ThreadPool.cc
+ * \brief a fixed-size pool of worker threads, for coarse-grained jobs and for the parallel loops of the engine
+ */
+
+#include <algorithm>
+#include <map>
+#include <omp.h>
+#include "ThreadPool.h"
+
+namespace magent {
+namespace utility {
+
+// set on the workers of every pool and on a caller while it runs chunks, nested loops run serially
+static thread_local bool in_parallel = false;
+
+ThreadPool::ThreadPool(int n_threads) : stop(false) {
+    if (n_threads <= 0)
+        n_threads = std::max(1, (int)std::thread::hardware_concurrency());
+
+    for (int i = 0; i < n_threads; i++)
+        workers.emplace_back(&ThreadPool::worker_loop, this);
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    cv_task.notify_all();
+    for (auto &worker : workers)
+        worker.join();
+}
+
+void ThreadPool::parallel_for(int n, const std::function<void(int)> &func) {
+    if (n <= 0)
+        return;
+
+    std::function<void(int, int)> range = [&func](int begin, int end) {
+        for (int i = begin; i < end; i++)
+            func(i);
+    };
+    Job job(&range, n, 1);
+    submit_and_wait(job, false);
+}
+
+void ThreadPool::parallel_range(int n, int grain, const std::function<void(int, int)> &func) {
+    if (n <= 0)
+        return;
+    grain = std::max(grain, 1);
+
+    if (n <= grain || in_parallel || workers.empty()) {  // the same chunks, in order
+        for (int begin = 0; begin < n; begin += grain)
+            func(begin, std::min(n, begin + grain));
+        return;
+    }
+
+    Job job(&func, n, grain);
+    submit_and_wait(job, true);
+}
+
+void ThreadPool::submit_and_wait(Job &job, bool caller_helps) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(&job);
+    }
+    cv_task.notify_all();
+
+    int finished = 0;
+    if (caller_helps) {
+        in_parallel = true;
+        finished = run_chunks(job);
+        in_parallel = false;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    auto it = std::find(jobs.begin(), jobs.end(), &job);
+    if (it != jobs.end() && job.next >= job.n_chunk)
+        jobs.erase(it);
+    job.finished += finished;
+    cv_done.wait(lock, [&job] { return job.finished == job.n_chunk && job.users == 0; });
+
+    if (job.error != nullptr)
+        std::rethrow_exception(job.error);
+}
+
+// claim chunks of job until there is none left, return the number of chunks done
+int ThreadPool::run_chunks(Job &job) {
+    int done = 0;
+    int k;
+    while ((k = job.next++) < job.n_chunk) {
+        int begin = k * job.grain, end = std::min(job.n, begin + job.grain);
+        try {
+            (*job.func)(begin, end);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (job.error == nullptr)
+                job.error = std::current_exception();
+        }
+        done++;
+    }
+    return done;
+}
+
+void ThreadPool::worker_loop() {
+    // parallelism comes from the pool, keep the nested OpenMP regions serial
+    omp_set_num_threads(1);
+    in_parallel = true;
+
+    while (true) {
+        Job *job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv_task.wait(lock, [this] { return stop || !jobs.empty(); });
+            if (stop)
+                return;
+            job = jobs.front();
+            job->users++;
+        }
+
+        int finished = run_chunks(*job);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!jobs.empty() && jobs.front() == job)  // all chunks are claimed
+            jobs.pop_front();
+        job->finished += finished;
+        job->users--;
+        if (job->finished == job->n_chunk && job->users == 0)
+            cv_done.notify_all();
+    }
+}
+
+ThreadPool *ThreadPool::shared(int n_threads) {
+    if (n_threads <= 0)
+        n_threads = omp_get_max_threads();
+    if (n_threads <= 1)
+        return nullptr;
+
+    // pools are never destroyed, so their workers do not outlive the static destructors
+    static std::mutex registry_mutex;
+    static std::map<int, ThreadPool *> *registry = new std::map<int, ThreadPool *>();
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    ThreadPool *&pool = (*registry)[n_threads];
+    if (pool == nullptr)
+        pool = new ThreadPool(n_threads - 1);
+    return pool;
+}
+
+} // namespace utility
+} // namespace magent
@@ -0,0 +1,91 @@
+/**
+ * \file ThreadPool.h
+ * \brief a fixed-size pool of worker threads, for coarse-grained jobs and for the parallel loops of the engine
+ */
+
+#ifndef MAGENT_UTILITY_THREADPOOL_H
+#define MAGENT_UTILITY_THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace magent {
+namespace utility {
+
+/**
+ * Loops are split into chunks of `grain` items, idle workers claim the chunks of the oldest loop
+ * in the queue one at a time, so several callers (e.g. environments stepped in different threads)
+ * share the same bounded set of workers.
+ * A loop called inside another loop, or from a worker of any pool, runs serially on the calling thread.
+ * Workers run with a single OpenMP thread, so the jobs themselves do not oversubscribe the cores
+ */
+class ThreadPool {
+public:
+    // n_threads <= 0 means hardware concurrency
+    explicit ThreadPool(int n_threads = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    // run func(0), ..., func(n-1) on the workers only.
+    // block until all the jobs are finished, rethrow the first exception raised by a job
+    void parallel_for(int n, const std::function<void(int)> &func);
+
+    // run func(begin, end) on the chunks [k * grain, min(n, (k + 1) * grain)), the caller works on them too.
+    // the chunks do not depend on the number of threads, so results merged by chunk are reproducible.
+    // a loop of at most grain items runs serially. exceptions are rethrown as in parallel_for
+    void parallel_range(int n, int grain, const std::function<void(int, int)> &func);
+
+    int get_num_threads() const { return (int)workers.size(); }
+
+    // the pool of n_threads threads (caller included) shared by the whole process, n_threads <= 0 for
+    // the default number of OpenMP threads. nullptr for a single thread, parallel loops then run serially
+    static ThreadPool *shared(int n_threads);
+
+private:
+    struct Job {
+        const std::function<void(int, int)> *func;
+        int n, grain, n_chunk;
+        std::atomic<int> next;
+        int finished;  // chunks done, guarded by mutex
+        int users;     // workers holding the job, guarded by mutex
+        std::exception_ptr error;
+
+        Job(const std::function<void(int, int)> *func, int n, int grain)
+                : func(func), n(n), grain(grain), n_chunk((n + grain - 1) / grain), next(0),
+                  finished(0), users(0) {}
+    };
+
+    void worker_loop();
+    void submit_and_wait(Job &job, bool caller_helps);
+    int run_chunks(Job &job);
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable cv_task, cv_done;
+    std::deque<Job *> jobs;
+    bool stop;
+};
+
+// parallel_range on pool, or serially on the same chunks if pool is nullptr
+inline void parallel_range(ThreadPool *pool, int n, int grain, const std::function<void(int, int)> &func) {
+    if (pool != nullptr) {
+        pool->parallel_range(n, grain, func);
+        return;
+    }
+    grain = grain < 1 ? 1 : grain;
+    for (int begin = 0; begin < n; begin += grain)
+        func(begin, begin + grain < n ? begin + grain : n);
+}
+
+} // namespace utility
+} // namespace magent
+
+#endif //MAGENT_UTILITY_THREADPOOL_H
@@ -0,0 +1,166 @@
+/**
+ * \file Transport.cc
+ * \brief built-in transports
+ */
+
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <list>
+#include <map>
+#include <mutex>
+#include <tuple>
+
+#ifdef MAGENT_USE_MPI
+#include <mpi.h>
+#endif
+
+#include "Transport.h"
+#include "utility.h"
+
+namespace magent {
+namespace utility {
+
+// mailboxes of the ranks of a local session, keyed by (src, dst, tag)
+struct LocalHub {
+    int size;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::map<std::tuple<int, int, int>, std::deque<std::vector<char>>> mailboxes;
+};
+
+class LocalTransport : public Transport {
+public:
+    LocalTransport(std::shared_ptr<LocalHub> hub, int rank) : hub(hub), rank(rank) {}
+
+    int get_rank() const override { return rank; }
+    int get_size() const override { return hub->size; }
+
+    void send(int dst, int tag, const std::vector<char> &message) override {
+        {
+            std::lock_guard<std::mutex> lock(hub->mutex);
+            hub->mailboxes[std::make_tuple(rank, dst, tag)].push_back(message);
+        }
+        hub->cv.notify_all();
+    }
+
+    void recv(int src, int tag, std::vector<char> &message) override {
+        std::unique_lock<std::mutex> lock(hub->mutex);
+        std::deque<std::vector<char>> &box = hub->mailboxes[std::make_tuple(src, rank, tag)];
+        hub->cv.wait(lock, [&box] { return !box.empty(); });
+        message.swap(box.front());
+        box.pop_front();
+    }
+
+private:
+    std::shared_ptr<LocalHub> hub;
+    int rank;
+};
+
+// the hub of a session lives as long as one of its ranks
+static std::shared_ptr<Transport> join_local(const std::string &name, int rank, int size) {
+    static std::mutex registry_mutex;
+    static std::map<std::string, std::weak_ptr<LocalHub>> registry;
+
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    std::shared_ptr<LocalHub> hub = registry[name].lock();
+    if (hub == nullptr) {
+        hub = std::make_shared<LocalHub>();
+        hub->size = size;
+        registry[name] = hub;
+    } else if (hub->size != size) {
+        LOG(FATAL) << "ranks of the local transport " << name << " disagree on the size : "
+                   << hub->size << " and " << size;
+    }
+    return std::make_shared<LocalTransport>(hub, rank);
+}
+
+#ifdef MAGENT_USE_MPI
+// sends are buffered until they complete, so two ranks can send to each other before they recv
+class MpiTransport : public Transport {
+public:
+    MpiTransport() {
+        int initialized;
+        MPI_Initialized(&initialized);
+        if (!initialized) {
+            MPI_Init(nullptr, nullptr);
+            atexit(finalize);
+        }
+        MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+        MPI_Comm_size(MPI_COMM_WORLD, &size);
+    }
+
+    ~MpiTransport() override {
+        for (Pending &pending : pendings)
+            MPI_Wait(&pending.request, MPI_STATUS_IGNORE);
+    }
+
+    int get_rank() const override { return rank; }
+    int get_size() const override { return size; }
+
+    void send(int dst, int tag, const std::vector<char> &message) override {
+        pendings.emplace_back();
+        Pending &pending = pendings.back();
+        pending.buffer = message;
+        MPI_Isend(pending.buffer.data(), (int)pending.buffer.size(), MPI_CHAR, dst, tag,
+                  MPI_COMM_WORLD, &pending.request);
+
+        // drop the completed sends
+        for (auto iter = pendings.begin(); iter != pendings.end(); ) {
+            int done;
+            MPI_Test(&iter->request, &done, MPI_STATUS_IGNORE);
+            iter = done ? pendings.erase(iter) : ++iter;
+        }
+    }
+
+    void recv(int src, int tag, std::vector<char> &message) override {
+        MPI_Status status;
+        int count;
+        MPI_Probe(src, tag, MPI_COMM_WORLD, &status);
+        MPI_Get_count(&status, MPI_CHAR, &count);
+        message.resize((size_t)count);
+        MPI_Recv(message.data(), count, MPI_CHAR, src, tag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    }
+
+private:
+    struct Pending {
+        std::vector<char> buffer;
+        MPI_Request request;
+    };
+
+    static void finalize() {
+        int finalized;
+        MPI_Finalized(&finalized);
+        if (!finalized)
+            MPI_Finalize();
+    }
+
+    int rank, size;
+    std::list<Pending> pendings;
+};
+#endif
+
+std::shared_ptr<Transport> new_transport(const std::string &spec) {
+    if (spec.compare(0, 6, "local:") == 0) {
+        size_t rank_at = spec.find(':', 6), size_at = rank_at == std::string::npos
+                                                      ? std::string::npos : spec.find(':', rank_at + 1);
+        if (rank_at == std::string::npos || size_at == std::string::npos)
+            LOG(FATAL) << "invalid local transport, should be local:<name>:<rank>:<size> : " << spec;
+        int rank = atoi(spec.c_str() + rank_at + 1), size = atoi(spec.c_str() + size_at + 1);
+        if (size <= 0 || rank < 0 || rank >= size)
+            LOG(FATAL) << "invalid rank or size of the local transport : " << spec;
+        return join_local(spec.substr(6, rank_at - 6), rank, size);
+    } else if (spec == "mpi") {
+#ifdef MAGENT_USE_MPI
+        return std::make_shared<MpiTransport>();
+#else
+        LOG(FATAL) << "the mpi transport needs USE_MPI in cmake";
+#endif
+    } else {
+        LOG(FATAL) << "unknown transport : " << spec;
+    }
+    return nullptr;
+}
+
+} // namespace utility
+} // namespace magent
@@ -0,0 +1,40 @@
+/**
+ * \file Transport.h
+ * \brief point-to-point messages between the ranks of a distributed game
+ */
+
+#ifndef MAGENT_UTILITY_TRANSPORT_H
+#define MAGENT_UTILITY_TRANSPORT_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace magent {
+namespace utility {
+
+/**
+ * Messages are byte buffers. A send never waits for the matching recv, a recv blocks until the message
+ * arrives. Messages of the same (source, tag) arrive in the order they are sent.
+ * A transport is used by one thread at a time.
+ */
+class Transport {
+public:
+    virtual ~Transport() = default;
+
+    virtual int get_rank() const = 0;
+    virtual int get_size() const = 0;
+
+    virtual void send(int dst, int tag, const std::vector<char> &message) = 0;
+    virtual void recv(int src, int tag, std::vector<char> &message) = 0;
+};
+
+// built-in transports :
+//   "local:<name>:<rank>:<size>" ranks in the same process (e.g. one thread per rank), joined by name
+//   "mpi"                        ranks of MPI_COMM_WORLD (needs USE_MPI in cmake)
+std::shared_ptr<Transport> new_transport(const std::string &spec);
+
+} // namespace utility
+} // namespace magent
+
+#endif //MAGENT_UTILITY_TRANSPORT_H
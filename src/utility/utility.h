@@ -9,6 +9,7 @@
 #include <array>
 #include <iostream>
 #include <sstream>
+#include <vector>
 
 namespace magent {
 namespace utility {
@@ -16,6 +17,12 @@ namespace utility {
 // return true if the two strings are the same
 bool strequ(const char *a, const char *b);
 
+// heap memory held by a vector, for memory accounting
+template <typename T>
+size_t vector_bytes(const std::vector<T> &v) {
+    return v.capacity() * sizeof(T);
+}
+
 /**
  * a class for transforming linear pointer to multi dimensional pointer
  * e.g.  NDPointer<int, 3> multi(linear, {n, m, k}) means transforming "int *linear" to "int (*multi)[m][k]"